@@ -0,0 +1,154 @@
+// Secondary ray throughput with and without RaySorter reordering.
+//
+// Usage: RaySortBench [spheresPerAxis] [imageSide] [repeats]
+//
+// A box with a grid of spheres is hit by imageSide^2 camera rays; every hit
+// spawns a random (diffuse) bounce ray. Those incoherent secondary rays are
+// then traced in generation order and in sorted order.
+
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+#include "omp.h"
+#include "util.h"
+#include "shape.h"
+#include "material.h"
+#include "camera.h"
+#include "ray_queue.h"
+#include "ray_sort.h"
+
+using namespace Tracer;
+
+
+// Cosine-distributed direction around the unit normal n
+static Vector sampleHemisphere(const Vector& n, Rng& rng)
+{
+    float u1 = rng.nextFloat();
+    float u2 = rng.nextFloat();
+    float r = std::sqrt(u1);
+    float phi = 2.0f * float(M_PI) * u2;
+    Vector t = std::fabs(n.m_x) > 0.5f ? Vector(0.0f, 1.0f, 0.0f) : Vector(1.0f, 0.0f, 0.0f);
+    Vector b = cross(n, t).normalized();
+    t = cross(b, n);
+    return (t * (r * std::cos(phi)) + b * (r * std::sin(phi)) + n * std::sqrt(1.0f - u1)).normalized();
+}
+
+
+// Intersects every ray of the queue; returns the number of hits so the
+// work cannot be optimized away
+static size_t traceQueue(ShapeSet& scene, const RayQueue& rays)
+{
+    size_t hits = 0;
+    #pragma omp parallel for reduction(+:hits) schedule(static, 256)
+    for (size_t i = 0; i < rays.m_count; ++i)
+    {
+        Intersection isect(rays.ray(i));
+        if (scene.intersect(isect))
+        {
+            ++hits;
+        }
+    }
+    return hits;
+}
+
+
+int main(int argc, char **argv)
+{
+    int spheresPerAxis = argc > 1 ? std::atoi(argv[1]) : 12;
+    size_t side = argc > 2 ? (size_t)std::atoi(argv[2]) : 512;
+    int repeats = argc > 3 ? std::atoi(argv[3]) : 3;
+
+    MaterialTable materials;
+    unsigned int wallId = materials.addMaterial(LambertMaterial(Color(0.5f, 0.5f, 0.5f)));
+    unsigned int ballId = materials.addMaterial(PhongMaterial(Color(0.0f, 0.0f, 0.5f), 20, 0.5f, 5.0f, 0.5f));
+
+    ShapeSet scene;
+    std::vector<Shape*> owned;
+    owned.push_back(new Plane(Point(0.0f, -2.0f, 0.0f), Vector(0.0f, 1.0f, 0.0f), materials.get(wallId)));
+    owned.push_back(new Plane(Point(0.0f, 12.0f, 0.0f), Vector(0.0f, -1.0f, 0.0f), materials.get(wallId)));
+    owned.push_back(new Plane(Point(7.0f, 0.0f, 0.0f), Vector(-1.0f, 0.0f, 0.0f), materials.get(wallId)));
+    owned.push_back(new Plane(Point(-7.0f, 0.0f, 0.0f), Vector(1.0f, 0.0f, 0.0f), materials.get(wallId)));
+    owned.push_back(new Plane(Point(0.0f, 0.0f, -5.0f), Vector(0.0f, 0.0f, 1.0f), materials.get(wallId)));
+    float spacing = 12.0f / float(spheresPerAxis);
+    for (int i = 0; i < spheresPerAxis; ++i)
+    {
+        for (int j = 0; j < spheresPerAxis; ++j)
+        {
+            for (int k = 0; k < 4; ++k)
+            {
+                Point center(-6.0f + (i + 0.5f) * spacing,
+                             -2.0f + (j + 0.5f) * spacing,
+                             -4.0f + k * 2.0f);
+                owned.push_back(new Sphere(center, 0.3f * spacing, materials.get(ballId)));
+            }
+        }
+    }
+    for (size_t i = 0; i < owned.size(); ++i)
+    {
+        scene.addShape(owned[i]);
+    }
+
+    // Secondary rays: one diffuse bounce per camera hit
+    Camera camera;
+    MemoryArena arena;
+    RayQueue rays;
+    rays.allocate(arena, side * side);
+    size_t count = 0;
+    Rng rng;
+    for (size_t y = 0; y < side; ++y)
+    {
+        for (size_t x = 0; x < side; ++x)
+        {
+            float xu, yu;
+            Camera::screenPosition(x, y, rng.nextFloat(), rng.nextFloat(), side, side, xu, yu);
+            Intersection isect(camera.makeRay(xu, yu));
+            if (!scene.intersect(isect))
+            {
+                continue;
+            }
+            Vector n = isect.m_normal;
+            if (dot(n, isect.m_ray.m_direction) > 0.0f)
+            {
+                n *= -1.0f;
+            }
+            rays.set(count, Ray(isect.position(), sampleHemisphere(n, rng)),
+                     Color(1.0f, 1.0f, 1.0f), (unsigned int)count);
+            ++count;
+        }
+    }
+    rays.m_count = count;
+
+    std::cout << "shapes: " << owned.size() << ", secondary rays: " << count
+              << ", threads: " << omp_get_max_threads() << std::endl;
+
+    RayQueue sorted = rays;
+    RaySorter sorter;
+    sorter.reserve(arena, count);
+    double sortTime = omp_get_wtime();
+    sorter.sort(sorted);
+    sortTime = omp_get_wtime() - sortTime;
+
+    double bestUnsorted = 1e30, bestSorted = 1e30;
+    size_t hitsUnsorted = 0, hitsSorted = 0;
+    for (int r = 0; r < repeats; ++r)
+    {
+        double t0 = omp_get_wtime();
+        hitsUnsorted = traceQueue(scene, rays);
+        double t1 = omp_get_wtime();
+        hitsSorted = traceQueue(scene, sorted);
+        double t2 = omp_get_wtime();
+        bestUnsorted = std::min(bestUnsorted, t1 - t0);
+        bestSorted = std::min(bestSorted, t2 - t1);
+    }
+
+    std::cout << "unsorted: " << count / bestUnsorted * 1e-6 << " Mrays/s (" << hitsUnsorted << " hits)" << std::endl;
+    std::cout << "sorted:   " << count / bestSorted * 1e-6 << " Mrays/s (" << hitsSorted << " hits)" << std::endl;
+    std::cout << "sorted incl. sort: " << count / (bestSorted + sortTime) * 1e-6 << " Mrays/s"
+              << " (sort " << sortTime * 1e3 << " ms)" << std::endl;
+
+    for (size_t i = 0; i < owned.size(); ++i)
+    {
+        delete owned[i];
+    }
+    return 0;
+}
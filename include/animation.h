@@ -0,0 +1,253 @@
+#ifndef __ANIMATION_H__
+#define __ANIMATION_H__
+
+#include <string>
+#include <vector>
+#include "util.h"
+#include "ray.h"
+#include "shape.h"
+#include "camera.h"
+#include "transform.h"
+#include "instance.h"
+
+namespace Tracer
+{
+
+struct TransformKey
+{
+    float m_time;
+    Vector m_translation;
+    // Euler angles in degrees, applied x then y then z
+    Vector m_rotation;
+    float m_scale;
+
+    TransformKey(float time = 0.0f,
+                 const Vector& translation = Vector(),
+                 const Vector& rotation = Vector(),
+                 float scale = 1.0f)
+        : m_time(time), m_translation(translation), m_rotation(rotation), m_scale(scale)
+    {
+
+    }
+
+    Transform toTransform() const
+    {
+        return Transform::translate(m_translation) *
+               Transform::rotate(2, m_rotation.m_z) *
+               Transform::rotate(1, m_rotation.m_y) *
+               Transform::rotate(0, m_rotation.m_x) *
+               Transform::scale(Vector(m_scale));
+    }
+};
+
+
+// Keyframed translation, rotation and uniform scale, interpolated linearly
+// and held constant outside the first and last key
+class AnimatedTransform
+{
+public:
+    // Keys may be added in any order
+    void addKey(const TransformKey& key)
+    {
+        std::vector<TransformKey>::iterator pos = m_keys.begin();
+        while (pos != m_keys.end() && pos->m_time <= key.m_time)
+        {
+            ++pos;
+        }
+        m_keys.insert(pos, key);
+    }
+
+    bool animated() const { return m_keys.size() > 1; }
+
+    Transform evaluate(float time) const
+    {
+        if (m_keys.empty())
+        {
+            return Transform();
+        }
+        if (time <= m_keys.front().m_time)
+        {
+            return m_keys.front().toTransform();
+        }
+        if (time >= m_keys.back().m_time)
+        {
+            return m_keys.back().toTransform();
+        }
+        size_t i = 1;
+        while (m_keys[i].m_time < time)
+        {
+            ++i;
+        }
+        const TransformKey& k0 = m_keys[i - 1];
+        const TransformKey& k1 = m_keys[i];
+        float span = k1.m_time - k0.m_time;
+        float u = span > 0.0f ? (time - k0.m_time) / span : 1.0f;
+        TransformKey key(time,
+                         k0.m_translation + u * (k1.m_translation - k0.m_translation),
+                         k0.m_rotation + u * (k1.m_rotation - k0.m_rotation),
+                         k0.m_scale + u * (k1.m_scale - k0.m_scale));
+        return key.toTransform();
+    }
+
+protected:
+    std::vector<TransformKey> m_keys;
+};
+
+
+//
+// Hierarchy of animated transforms. Each node's world transform is its
+// parent's world transform times its own animated local one; shapes hang
+// off nodes through Instances, which update() keeps in sync. An instance
+// may sit at a fixed offset from its node.
+//
+class SceneGraph
+{
+public:
+    void clear()
+    {
+        m_nodes.clear();
+    }
+
+    // Parents must be added before their children; returns the node index
+    int addNode(const std::string& name, int parent = -1)
+    {
+        Node node;
+        node.m_name = name;
+        node.m_parent = parent;
+        m_nodes.push_back(node);
+        return int(m_nodes.size()) - 1;
+    }
+
+    // Index of the named node, -1 if there is none
+    int find(const std::string& name) const
+    {
+        for (size_t i = 0; i < m_nodes.size(); ++i)
+        {
+            if (m_nodes[i].m_name == name)
+            {
+                return int(i);
+            }
+        }
+        return -1;
+    }
+
+    AnimatedTransform& animation(int node) { return m_nodes[node].m_animation; }
+
+    void attach(int node, Instance* pInstance, const Transform& local = Transform())
+    {
+        Attachment a;
+        a.m_pInstance = pInstance;
+        a.m_local = local;
+        m_nodes[node].m_attached.push_back(a);
+    }
+
+    size_t size() const { return m_nodes.size(); }
+
+    // Evaluates every node at time and moves the attached shapes; returns
+    // true if any of them moved (always on the first call)
+    bool update(float time)
+    {
+        bool moved = false;
+        for (size_t i = 0; i < m_nodes.size(); ++i)
+        {
+            Node& node = m_nodes[i];
+            Transform world = node.m_animation.evaluate(time);
+            if (node.m_parent >= 0)
+            {
+                world = m_nodes[node.m_parent].m_world * world;
+            }
+            if (world != node.m_world || !node.m_valid)
+            {
+                node.m_world = world;
+                node.m_valid = true;
+                for (size_t s = 0; s < node.m_attached.size(); ++s)
+                {
+                    const Attachment& a = node.m_attached[s];
+                    a.m_pInstance->setTransform(world * a.m_local);
+                    moved = true;
+                }
+            }
+        }
+        return moved;
+    }
+
+protected:
+    struct Attachment
+    {
+        Instance* m_pInstance;
+        Transform m_local;
+    };
+
+    struct Node
+    {
+        std::string m_name;
+        int m_parent;
+        AnimatedTransform m_animation;
+        Transform m_world;
+        bool m_valid;
+        std::vector<Attachment> m_attached;
+
+        Node() : m_parent(-1), m_valid(false) { }
+    };
+
+    std::vector<Node> m_nodes;
+};
+
+
+// Keyframed camera; every field is interpolated linearly
+class CameraTrack
+{
+public:
+    void clear() { m_times.clear(); m_cameras.clear(); }
+
+    void addKey(float time, const Camera& camera)
+    {
+        size_t i = 0;
+        while (i < m_times.size() && m_times[i] <= time)
+        {
+            ++i;
+        }
+        m_times.insert(m_times.begin() + i, time);
+        m_cameras.insert(m_cameras.begin() + i, camera);
+    }
+
+    bool empty() const { return m_times.empty(); }
+
+    // Camera at time, or fallback if there are no keys
+    Camera evaluate(float time, const Camera& fallback) const
+    {
+        if (m_times.empty())
+        {
+            return fallback;
+        }
+        if (time <= m_times.front())
+        {
+            return m_cameras.front();
+        }
+        if (time >= m_times.back())
+        {
+            return m_cameras.back();
+        }
+        size_t i = 1;
+        while (m_times[i] < time)
+        {
+            ++i;
+        }
+        const Camera& c0 = m_cameras[i - 1];
+        const Camera& c1 = m_cameras[i];
+        float span = m_times[i] - m_times[i - 1];
+        float u = span > 0.0f ? (time - m_times[i - 1]) / span : 1.0f;
+        return Camera(c0.m_fieldOfView + u * (c1.m_fieldOfView - c0.m_fieldOfView),
+                      c0.m_origin + u * (c1.m_origin - c0.m_origin),
+                      c0.m_target + u * (c1.m_target - c0.m_target),
+                      c0.m_up + u * (c1.m_up - c0.m_up));
+    }
+
+protected:
+    std::vector<float> m_times;
+    std::vector<Camera> m_cameras;
+};
+
+}//namespace Tracer
+
+#endif
@@ -0,0 +1,304 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <assert.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <new>
+#include <utility>
+#include <vector>
+#include "omp.h"
+#include "util.h"
+
+namespace Tracer
+{
+
+//
+// Memory arenas.
+//
+// MemoryArena is a bump allocator for transient data: allocation is a
+// pointer increment, nothing is freed individually, and reset() makes all
+// of it available again. After a reset the arena keeps a single chunk big
+// enough for everything it handed out before, so a renderer that allocates
+// the same queues every pass settles on one contiguous block and stops
+// touching the heap.
+//
+// ObjectPool<T> holds long-lived objects of one type, such as the shapes of
+// a scene, in large blocks. Objects never move once created, so pointers
+// to them stay valid, and each one has a stable index in creation order.
+//
+// FrameArenas is one MemoryArena per OpenMP thread, for per-thread scratch
+// inside parallel loops. The arenas are not shared, so there must be one
+// for every thread of the team: whoever resets them for a parallel region
+// first ensure()s as many as the region will run threads.
+//
+
+// Everything handed out is aligned to at least a cache line
+const size_t kArenaAlignment = 64;
+const size_t kArenaChunkSize = 256 * 1024;
+// Chunks from this size up are aligned to, and advised as, huge pages
+const size_t kArenaHugePageSize = 2 * 1024 * 1024;
+
+
+inline void* allocateAligned(size_t size, size_t alignment)
+{
+    void* p = NULL;
+    if (posix_memalign(&p, alignment, size) != 0)
+    {
+        throw std::bad_alloc();
+    }
+#ifdef MADV_HUGEPAGE
+    if (size >= kArenaHugePageSize)
+    {
+        madvise(p, size, MADV_HUGEPAGE);
+    }
+#endif
+    return p;
+}
+
+
+class MemoryArena
+{
+public:
+    MemoryArena(size_t chunkSize = kArenaChunkSize)
+        : m_chunkSize(chunkSize), m_offset(0), m_used(0), m_peak(0)
+    {
+
+    }
+
+    ~MemoryArena() { release(); }
+
+    // size bytes aligned to alignment (a power of two, at most a page)
+    void* allocate(size_t size, size_t alignment = kArenaAlignment)
+    {
+        if (alignment < kArenaAlignment)
+        {
+            alignment = kArenaAlignment;
+        }
+        size_t offset = (m_offset + alignment - 1) & ~(alignment - 1);
+        if (m_chunks.empty() || offset + size > m_chunks.back().m_size)
+        {
+            addChunk(size);
+            offset = 0;
+        }
+        m_offset = offset + size;
+        m_used += size;
+        if (m_used > m_peak)
+        {
+            m_peak = m_used;
+        }
+        return m_chunks.back().m_pData + offset;
+    }
+
+    // Uninitialized array of n Ts; T must not need construction
+    template <class T>
+    T* allocArray(size_t n)
+    {
+        return n ? static_cast<T*>(allocate(n * sizeof(T))) : NULL;
+    }
+
+    // Makes everything allocated so far available again; pointers into the
+    // arena must not be used afterwards
+    void reset()
+    {
+        if (m_chunks.size() > 1)
+        {
+            // Replace the chunks by one that holds the high-water mark
+            size_t total = 0;
+            for (size_t i = 0; i < m_chunks.size(); ++i)
+            {
+                total += m_chunks[i].m_size;
+            }
+            release();
+            addChunk(total);
+        }
+        m_offset = 0;
+        m_used = 0;
+    }
+
+    // Returns all memory to the system
+    void release()
+    {
+        for (size_t i = 0; i < m_chunks.size(); ++i)
+        {
+            free(m_chunks[i].m_pData);
+        }
+        m_chunks.clear();
+        m_offset = 0;
+        m_used = 0;
+    }
+
+    size_t bytesUsed() const { return m_used; }
+    size_t peakBytes() const { return m_peak; }
+
+protected:
+    struct Chunk
+    {
+        char* m_pData;
+        size_t m_size;
+    };
+
+    void addChunk(size_t minSize)
+    {
+        Chunk chunk;
+        chunk.m_size = std::max(minSize, m_chunkSize);
+        size_t alignment = kArenaAlignment;
+        if (chunk.m_size >= kArenaHugePageSize)
+        {
+            chunk.m_size = (chunk.m_size + kArenaHugePageSize - 1) & ~(kArenaHugePageSize - 1);
+            alignment = kArenaHugePageSize;
+        }
+        chunk.m_pData = static_cast<char*>(allocateAligned(chunk.m_size, alignment));
+        m_chunks.push_back(chunk);
+    }
+
+    std::vector<Chunk> m_chunks;
+    size_t m_chunkSize;
+    // Offset of the first free byte in the last chunk
+    size_t m_offset;
+    size_t m_used;
+    size_t m_peak;
+
+private:
+    MemoryArena(const MemoryArena&);
+    MemoryArena& operator =(const MemoryArena&);
+};
+
+
+template <class T>
+class ObjectPool
+{
+public:
+    // Objects per block; a power of two so indexing is a shift and a mask
+    static const size_t kBlockShift = sizeof(T) <= 256 ? 10 : 6;
+    static const size_t kBlockSize = size_t(1) << kBlockShift;
+
+    ObjectPool() : m_size(0) { }
+
+    ~ObjectPool() { clear(); }
+
+    // Constructs a T from args at the next index
+    template <class... Args>
+    T* create(Args&&... args)
+    {
+        if ((m_size >> kBlockShift) == m_blocks.size())
+        {
+            size_t alignment = std::max(kArenaAlignment, size_t(__alignof__(T)));
+            m_blocks.push_back(static_cast<T*>(allocateAligned(kBlockSize * sizeof(T), alignment)));
+        }
+        T* p = slot(m_size);
+        new (p) T(std::forward<Args>(args)...);
+        ++m_size;
+        return p;
+    }
+
+    T& operator [](size_t i) { return *slot(i); }
+    const T& operator [](size_t i) const { return *slot(i); }
+
+    size_t size() const { return m_size; }
+
+    // Destroys every object, last created first
+    void clear()
+    {
+        while (m_size > 0)
+        {
+            slot(--m_size)->~T();
+        }
+        for (size_t i = 0; i < m_blocks.size(); ++i)
+        {
+            free(m_blocks[i]);
+        }
+        m_blocks.clear();
+    }
+
+protected:
+    T* slot(size_t i) const { return m_blocks[i >> kBlockShift] + (i & (kBlockSize - 1)); }
+
+    std::vector<T*> m_blocks;
+    size_t m_size;
+
+private:
+    ObjectPool(const ObjectPool&);
+    ObjectPool& operator =(const ObjectPool&);
+};
+
+
+class FrameArenas
+{
+public:
+    FrameArenas() : m_pSlots(NULL), m_size(0)
+    {
+        ensure(size_t(std::max(omp_get_max_threads(), 1)));
+    }
+
+    ~FrameArenas()
+    {
+        destroy();
+    }
+
+    // Makes sure there is an arena for each of numThreads threads, dropping
+    // the arenas (and whatever they hold) if there are fewer. Not to be
+    // called while any arena is in use.
+    void ensure(size_t numThreads)
+    {
+        if (numThreads <= m_size)
+        {
+            return;
+        }
+        destroy();
+        m_pSlots = static_cast<Slot*>(allocateAligned(numThreads * sizeof(Slot), kArenaAlignment));
+        for (; m_size < numThreads; ++m_size)
+        {
+            new (&m_pSlots[m_size]) Slot();
+        }
+    }
+
+    // Arena of the calling OpenMP thread, which must have one
+    MemoryArena& local()
+    {
+        size_t thread = size_t(omp_get_thread_num());
+        assert(thread < m_size);
+        return m_pSlots[thread].m_arena;
+    }
+
+    size_t size() const { return m_size; }
+
+    void reset()
+    {
+        for (size_t i = 0; i < m_size; ++i)
+        {
+            m_pSlots[i].m_arena.reset();
+        }
+    }
+
+protected:
+    // Padded to a cache line so the bookkeeping of neighbouring threads'
+    // arenas is never shared
+    struct Slot
+    {
+        MemoryArena m_arena;
+        char m_padding[kArenaAlignment - sizeof(MemoryArena) % kArenaAlignment];
+    };
+
+    void destroy()
+    {
+        for (size_t i = 0; i < m_size; ++i)
+        {
+            m_pSlots[i].~Slot();
+        }
+        free(m_pSlots);
+        m_pSlots = NULL;
+        m_size = 0;
+    }
+
+    Slot* m_pSlots;
+    size_t m_size;
+
+private:
+    FrameArenas(const FrameArenas&);
+    FrameArenas& operator =(const FrameArenas&);
+};
+
+}//namespace Tracer
+
+#endif
@@ -0,0 +1,1063 @@
+#ifndef __BINARY_SCENE_H__
+#define __BINARY_SCENE_H__
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "util.h"
+#include "ray.h"
+#include "shape.h"
+#include "material.h"
+#include "light_source.h"
+#include "environment.h"
+#include "texture.h"
+#include "camera.h"
+#include "transform.h"
+#include "bvh.h"
+#include "instance.h"
+#include "scene.h"
+
+namespace Tracer
+{
+
+//
+// Binary scene file, laid out to be mmap()ed and rendered in place.
+//
+// A header is followed by flat arrays of plain records: the material table,
+// planes, lights, the environment (if any) and its texels, the bounded
+// primitives, the nodes of every BVH and the paths of the textures.
+// Each BVH (one per prototype, plus the root) owns a contiguous range of
+// nodes and of primitives in leaf order. A leaf refers to its primitives by
+// absolute index and an interior node to its second child by absolute node
+// index, as in Bvh; an instance primitive names the root node of its
+// prototype and holds its world-to-object matrix.
+//
+// Loading turns only the materials, planes, lights and the environment
+// back into objects; textures are opened through the TextureCache as the
+// text scene would.
+// Primitives and nodes are used straight from the mapping, so startup does
+// not grow with the scene, and processes rendering the same file share its
+// pages through the page cache. Loading checks the header, the section
+// bounds and every index the traversal follows (see checkBinaryTrees()),
+// so a stale or corrupt file is rejected rather than read out of bounds;
+// the floats are trusted to come from writeBinaryScene().
+//
+// Records hold floats and unsigned ints in the writer's byte order, and
+// the header's byte order tag rejects files from the other endianness.
+//
+
+const char kBinarySceneMagic[8] = { 'T', 'R', 'S', 'C', 'E', 'N', 'E', '\0' };
+const unsigned int kBinarySceneVersion = 4;
+const unsigned int kBinarySceneByteOrder = 0x01020304;
+// Sections start on this boundary
+const size_t kBinarySceneAlignment = 16;
+// FlatMaterial::m_texture of an untextured material
+const unsigned int kNoTexture = ~0u;
+// Deepest nesting of prototypes in prototypes a binary scene may hold;
+// traversal recurses once per level
+const unsigned int kMaxPrototypeNesting = 64;
+
+
+enum FlatPrimitiveType
+{
+    kFlatSphere,
+    kFlatRectangle,
+    kFlatInstance
+};
+
+
+// m_texture is the offset of the texture's NUL-terminated path in the
+// string section, or kNoTexture
+struct FlatMaterial
+{
+    unsigned int m_type;
+    float m_color[3];
+    float m_kAmbient;
+    float m_rReflect;
+    float m_rRefract;
+    float m_kDiffuse;
+    float m_kSpecular;
+    float m_exponent;
+    float m_ior;
+    unsigned int m_texture;
+    float m_uvScale;
+};
+
+
+struct FlatPlane
+{
+    float m_position[3];
+    float m_normal[3];
+    unsigned int m_material;
+};
+
+
+enum FlatLightType
+{
+    kFlatRectangleLight,
+    kFlatPointLight,
+    kFlatSpotLight,
+    kFlatSphereLight,
+    kFlatDiskLight
+};
+
+
+// m_type is a FlatLightType. m_position is a rectangle's corner, a sphere's
+// or disk's center, or the point light's position. m_side1 holds a spot
+// light's or disk's direction; m_side2 holds the spot light's angle and
+// falloff, or the sphere's or disk's radius, in its first elements.
+struct FlatLight
+{
+    unsigned int m_type;
+    float m_position[3];
+    float m_side1[3];
+    float m_side2[3];
+    float m_power;
+    unsigned int m_material;
+};
+
+
+// m_type is an EnvironmentType. The sky fields are used by skies only; an
+// image's m_width x m_height texels sit in the texel section.
+struct FlatEnvironment
+{
+    unsigned int m_type;
+    unsigned int m_width;
+    unsigned int m_height;
+    float m_power;
+    float m_rotation;
+    float m_color[3];
+    float m_zenith[3];
+    float m_horizon[3];
+    float m_ground[3];
+    float m_sunDirection[3];
+    float m_sun[3];
+    float m_sunAngle;
+};
+
+
+struct FlatTexel
+{
+    float m_color[3];
+};
+
+
+// Sphere: center and radius. Rectangle: corner and both sides. Instance:
+// the world-to-object matrix, row by row. m_index is the material, or the
+// prototype's root node for an instance.
+struct FlatPrimitive
+{
+    unsigned int m_type;
+    unsigned int m_index;
+    float m_data[12];
+};
+
+
+struct FlatNode
+{
+    float m_min[3];
+    float m_max[3];
+    unsigned int m_index;
+    unsigned short m_count;
+    unsigned short m_axis;
+};
+
+
+struct FlatSection
+{
+    unsigned long long m_offset;
+    unsigned long long m_count;
+};
+
+
+struct BinarySceneHeader
+{
+    char m_magic[8];
+    unsigned int m_version;
+    unsigned int m_byteOrder;
+    // Content hash of the scene description the file was written from
+    unsigned long long m_sourceHash;
+    // Field of view, origin, target and up vector
+    float m_camera[10];
+    unsigned int m_rootNode;
+    unsigned int m_reserved;
+    FlatSection m_materials;
+    FlatSection m_planes;
+    FlatSection m_lights;
+    FlatSection m_environments;
+    FlatSection m_texels;
+    FlatSection m_primitives;
+    FlatSection m_nodes;
+    FlatSection m_strings;
+};
+
+
+inline void flattenVector(const Vector& v, float* out)
+{
+    out[0] = v.m_x;
+    out[1] = v.m_y;
+    out[2] = v.m_z;
+}
+
+
+inline Vector unflattenVector(const float* v)
+{
+    return Vector(v[0], v[1], v[2]);
+}
+
+
+inline void flattenColor(const Color& c, float* out)
+{
+    out[0] = c.m_r;
+    out[1] = c.m_g;
+    out[2] = c.m_b;
+}
+
+
+inline Color unflattenColor(const float* c)
+{
+    return Color(c[0], c[1], c[2]);
+}
+
+
+//
+// Converts a built Scene into the flat records and writes them out.
+//
+class BinarySceneWriter
+{
+public:
+    bool write(const Scene& scene, const std::string& path, std::string& error)
+    {
+        if (scene.animated())
+        {
+            error = "animated scenes cannot be written as binary scenes";
+            return false;
+        }
+
+        BinarySceneHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.m_magic, kBinarySceneMagic, sizeof(header.m_magic));
+        header.m_version = kBinarySceneVersion;
+        header.m_byteOrder = kBinarySceneByteOrder;
+        header.m_sourceHash = scene.m_hash;
+        const Camera& camera = scene.m_camera;
+        header.m_camera[0] = camera.m_fieldOfView;
+        flattenVector(camera.m_origin, header.m_camera + 1);
+        flattenVector(camera.m_target, header.m_camera + 4);
+        flattenVector(camera.m_up, header.m_camera + 7);
+
+        for (size_t i = 0; i < scene.m_materials.size(); ++i)
+        {
+            const Material& m = scene.m_materials[i];
+            FlatMaterial f;
+            f.m_type = m.m_type;
+            f.m_color[0] = m.m_color.m_r;
+            f.m_color[1] = m.m_color.m_g;
+            f.m_color[2] = m.m_color.m_b;
+            f.m_kAmbient = m.m_kAmbient;
+            f.m_rReflect = m.m_rReflect;
+            f.m_rRefract = m.m_rRefract;
+            f.m_kDiffuse = m.m_kDiffuse;
+            f.m_kSpecular = m.m_kSpecular;
+            f.m_exponent = m.m_exponent;
+            f.m_ior = m.m_ior;
+            f.m_texture = kNoTexture;
+            f.m_uvScale = m.m_uvScale;
+            if (m.m_pTexture)
+            {
+                const std::string& texturePath = m.m_pTexture->path();
+                f.m_texture = (unsigned int)m_strings.size();
+                m_strings.insert(m_strings.end(), texturePath.begin(), texturePath.end());
+                m_strings.push_back('\0');
+            }
+            m_materials.push_back(f);
+        }
+
+        for (std::vector<Light*>::const_iterator iter = scene.m_lights.begin();
+             iter != scene.m_lights.end();
+             ++iter)
+        {
+            if ((*iter)->getShapeType() == "EnvironmentLight")
+            {
+                flattenEnvironment(*static_cast<const EnvironmentLight*>(*iter));
+                continue;
+            }
+            if (!flattenLight(**iter))
+            {
+                error = "unsupported light type '" + (*iter)->getShapeType() + "'";
+                return false;
+            }
+        }
+
+        // Planes stay objects; every other bounded shape but the lights
+        // goes under a root BVH of its own
+        std::vector<Shape*> bounded;
+        const std::vector<Shape*>& shapes = scene.topLevelShapes();
+        for (size_t i = 0; i < shapes.size(); ++i)
+        {
+            Shape* pShape = shapes[i];
+            std::string type = pShape->getShapeType();
+            if (type == "Plane")
+            {
+                const Plane* pPlane = static_cast<const Plane*>(pShape);
+                FlatPlane f;
+                flattenVector(pPlane->position(), f.m_position);
+                flattenVector(pPlane->normal(), f.m_normal);
+                f.m_material = pPlane->material()->m_id;
+                m_planes.push_back(f);
+            }
+            else if (type.find("Light") == std::string::npos)
+            {
+                bounded.push_back(pShape);
+            }
+        }
+        Bvh root;
+        root.build(bounded);
+        unsigned int nesting;
+        if (root.numNodes() && !flattenBvh(root, header.m_rootNode, nesting, error))
+        {
+            return false;
+        }
+
+        return writeFile(header, path, error);
+    }
+
+protected:
+    bool flattenLight(const Light& light)
+    {
+        const std::string& type = light.getShapeType();
+        FlatLight f;
+        std::memset(&f, 0, sizeof(f));
+        f.m_power = light.power();
+        if (type == "RectangleLight")
+        {
+            const RectangleLight& l = static_cast<const RectangleLight&>(light);
+            f.m_type = kFlatRectangleLight;
+            flattenVector(l.position(), f.m_position);
+            flattenVector(l.side1(), f.m_side1);
+            flattenVector(l.side2(), f.m_side2);
+            f.m_material = l.material()->m_id;
+        }
+        else if (type == "PointLight")
+        {
+            const PointLight& l = static_cast<const PointLight&>(light);
+            f.m_type = kFlatPointLight;
+            flattenVector(l.position(), f.m_position);
+            f.m_material = l.material()->m_id;
+        }
+        else if (type == "SpotLight")
+        {
+            const SpotLight& l = static_cast<const SpotLight&>(light);
+            f.m_type = kFlatSpotLight;
+            flattenVector(l.position(), f.m_position);
+            flattenVector(l.direction(), f.m_side1);
+            f.m_side2[0] = l.angle();
+            f.m_side2[1] = l.falloff();
+            f.m_material = l.material()->m_id;
+        }
+        else if (type == "SphereLight")
+        {
+            const SphereLight& l = static_cast<const SphereLight&>(light);
+            f.m_type = kFlatSphereLight;
+            flattenVector(l.center(), f.m_position);
+            f.m_side2[0] = l.radius();
+            f.m_material = l.material()->m_id;
+        }
+        else if (type == "DiskLight")
+        {
+            const DiskLight& l = static_cast<const DiskLight&>(light);
+            f.m_type = kFlatDiskLight;
+            flattenVector(l.center(), f.m_position);
+            flattenVector(l.normal(), f.m_side1);
+            f.m_side2[0] = l.radius();
+            f.m_material = l.material()->m_id;
+        }
+        else
+        {
+            return false;
+        }
+        m_lights.push_back(f);
+        return true;
+    }
+
+    void flattenEnvironment(const EnvironmentLight& environment)
+    {
+        FlatEnvironment f;
+        std::memset(&f, 0, sizeof(f));
+        const SkyModel& sky = environment.sky();
+        f.m_type = environment.type();
+        f.m_width = (unsigned int)environment.width();
+        f.m_height = (unsigned int)environment.height();
+        f.m_power = environment.power();
+        f.m_rotation = environment.rotation();
+        flattenColor(environment.color(), f.m_color);
+        flattenColor(sky.m_zenith, f.m_zenith);
+        flattenColor(sky.m_horizon, f.m_horizon);
+        flattenColor(sky.m_ground, f.m_ground);
+        flattenVector(sky.m_sunDirection, f.m_sunDirection);
+        flattenColor(sky.m_sun, f.m_sun);
+        f.m_sunAngle = sky.m_sunAngle;
+        m_environments.push_back(f);
+
+        const std::vector<Color>& texels = environment.texels();
+        for (size_t i = 0; i < texels.size(); ++i)
+        {
+            FlatTexel t;
+            flattenColor(texels[i], t.m_color);
+            m_texels.push_back(t);
+        }
+    }
+
+    // Appends the nodes and primitives of bvh, after those of every
+    // prototype it instances, and returns its root node and how deep its
+    // prototypes nest (1 for none)
+    bool flattenBvh(const Bvh& bvh, unsigned int& rootNode, unsigned int& nesting, std::string& error)
+    {
+        const std::vector<Shape*>& shapes = bvh.shapes();
+        nesting = 1;
+        for (size_t i = 0; i < shapes.size(); ++i)
+        {
+            if (shapes[i]->getShapeType() != "Instance")
+            {
+                continue;
+            }
+            const Shape* pPrototype = static_cast<const Instance*>(shapes[i])->prototype();
+            std::map<const Shape*, unsigned int>::const_iterator written = m_nesting.find(pPrototype);
+            if (written != m_nesting.end())
+            {
+                nesting = std::max(nesting, written->second + 1);
+                continue;
+            }
+            if (pPrototype->getShapeType() != "Bvh")
+            {
+                error = "instances of single shapes cannot be written";
+                return false;
+            }
+            unsigned int node, prototypeNesting;
+            if (!flattenBvh(*static_cast<const Bvh*>(pPrototype), node, prototypeNesting, error))
+            {
+                return false;
+            }
+            m_prototypes[pPrototype] = node;
+            m_nesting[pPrototype] = prototypeNesting;
+            nesting = std::max(nesting, prototypeNesting + 1);
+        }
+        if (nesting > kMaxPrototypeNesting)
+        {
+            error = "prototypes nest too deeply to be written";
+            return false;
+        }
+
+        unsigned int primitiveBase = (unsigned int)m_primitives.size();
+        for (size_t i = 0; i < shapes.size(); ++i)
+        {
+            const Shape* pShape = shapes[i];
+            std::string type = pShape->getShapeType();
+            FlatPrimitive f;
+            std::memset(&f, 0, sizeof(f));
+            if (type == "Sphere")
+            {
+                const Sphere* pSphere = static_cast<const Sphere*>(pShape);
+                f.m_type = kFlatSphere;
+                f.m_index = pSphere->material()->m_id;
+                flattenVector(pSphere->position(), f.m_data);
+                f.m_data[3] = pSphere->radius();
+            }
+            else if (type == "Rectangle")
+            {
+                const Rectangle* pRectangle = pShape->asRectangle();
+                f.m_type = kFlatRectangle;
+                f.m_index = pRectangle->material()->m_id;
+                flattenVector(pRectangle->position(), f.m_data);
+                flattenVector(pRectangle->side1(), f.m_data + 3);
+                flattenVector(pRectangle->side2(), f.m_data + 6);
+            }
+            else if (type == "Instance")
+            {
+                const Instance* pInstance = static_cast<const Instance*>(pShape);
+                f.m_type = kFlatInstance;
+                f.m_index = m_prototypes[pInstance->prototype()];
+                std::memcpy(f.m_data, pInstance->worldToObject().m, sizeof(f.m_data));
+            }
+            else
+            {
+                error = "unsupported shape type '" + type + "'";
+                return false;
+            }
+            m_primitives.push_back(f);
+        }
+
+        unsigned int nodeBase = (unsigned int)m_nodes.size();
+        const std::vector<BvhNode>& nodes = bvh.nodes();
+        for (size_t n = 0; n < nodes.size(); ++n)
+        {
+            const BvhNode& node = nodes[n];
+            FlatNode f;
+            flattenVector(node.m_box.m_min, f.m_min);
+            flattenVector(node.m_box.m_max, f.m_max);
+            f.m_index = node.m_index + (node.m_count ? primitiveBase : nodeBase);
+            f.m_count = node.m_count;
+            f.m_axis = node.m_axis;
+            m_nodes.push_back(f);
+        }
+        rootNode = nodeBase;
+        return true;
+    }
+
+    template <class Record>
+    static void placeSection(const std::vector<Record>& records, FlatSection& section, size_t& offset)
+    {
+        offset = (offset + kBinarySceneAlignment - 1) / kBinarySceneAlignment * kBinarySceneAlignment;
+        section.m_offset = offset;
+        section.m_count = records.size();
+        offset += records.size() * sizeof(Record);
+    }
+
+    template <class Record>
+    static bool writeSection(std::ofstream& out, const std::vector<Record>& records, const FlatSection& section)
+    {
+        static const char zeros[kBinarySceneAlignment] = { 0 };
+        out.write(zeros, std::streamsize(section.m_offset - (unsigned long long)out.tellp()));
+        if (!records.empty())
+        {
+            out.write(reinterpret_cast<const char*>(&records[0]), std::streamsize(records.size() * sizeof(Record)));
+        }
+        return bool(out);
+    }
+
+    // Writes to a temporary file renamed into place, so concurrent jobs
+    // never map a half-written scene
+    bool writeFile(BinarySceneHeader& header, const std::string& path, std::string& error)
+    {
+        size_t offset = sizeof(header);
+        placeSection(m_materials, header.m_materials, offset);
+        placeSection(m_planes, header.m_planes, offset);
+        placeSection(m_lights, header.m_lights, offset);
+        placeSection(m_environments, header.m_environments, offset);
+        placeSection(m_texels, header.m_texels, offset);
+        placeSection(m_primitives, header.m_primitives, offset);
+        placeSection(m_nodes, header.m_nodes, offset);
+        placeSection(m_strings, header.m_strings, offset);
+
+        std::string temporary = path + ".tmp";
+        std::ofstream out(temporary.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        bool ok = out &&
+                  writeSection(out, m_materials, header.m_materials) &&
+                  writeSection(out, m_planes, header.m_planes) &&
+                  writeSection(out, m_lights, header.m_lights) &&
+                  writeSection(out, m_environments, header.m_environments) &&
+                  writeSection(out, m_texels, header.m_texels) &&
+                  writeSection(out, m_primitives, header.m_primitives) &&
+                  writeSection(out, m_nodes, header.m_nodes) &&
+                  writeSection(out, m_strings, header.m_strings);
+        out.close();
+        if (!ok || !out || std::rename(temporary.c_str(), path.c_str()) != 0)
+        {
+            std::remove(temporary.c_str());
+            error = "cannot write binary scene '" + path + "'";
+            return false;
+        }
+        return true;
+    }
+
+    std::vector<FlatMaterial> m_materials;
+    std::vector<FlatPlane> m_planes;
+    std::vector<FlatLight> m_lights;
+    std::vector<FlatEnvironment> m_environments;
+    std::vector<FlatTexel> m_texels;
+    std::vector<FlatPrimitive> m_primitives;
+    std::vector<FlatNode> m_nodes;
+    std::vector<char> m_strings;
+    // Root node of every prototype written so far, and how deep the
+    // prototypes in it nest
+    std::map<const Shape*, unsigned int> m_prototypes;
+    std::map<const Shape*, unsigned int> m_nesting;
+};
+
+
+inline bool writeBinaryScene(const Scene& scene, const std::string& path, std::string& error)
+{
+    BinarySceneWriter writer;
+    return writer.write(scene, path, error);
+}
+
+
+//
+// The bounded part of a binary scene, intersected straight from the
+// mapped records. Owns the mapping; materials are looked up by id in the
+// scene's table, which must outlive it.
+//
+class MappedScene : public Shape
+{
+public:
+    MappedScene(void* pMapping, size_t size, const MaterialTable& materials)
+        : m_pMapping(pMapping),
+          m_size(size),
+          m_materials(materials)
+    {
+        m_shapeType = "MappedScene";
+        const BinarySceneHeader* pHeader = static_cast<const BinarySceneHeader*>(pMapping);
+        const char* base = static_cast<const char*>(pMapping);
+        m_pPrimitives = reinterpret_cast<const FlatPrimitive*>(base + pHeader->m_primitives.m_offset);
+        m_pNodes = reinterpret_cast<const FlatNode*>(base + pHeader->m_nodes.m_offset);
+        m_rootNode = pHeader->m_rootNode;
+    }
+
+    virtual ~MappedScene()
+    {
+        munmap(m_pMapping, m_size);
+    }
+
+    virtual bool intersect(Intersection& intersection)
+    {
+        return intersectBvh(m_rootNode, intersection);
+    }
+
+    virtual bool bounds(BoundingBox& box) const
+    {
+        const FlatNode& root = m_pNodes[m_rootNode];
+        box = BoundingBox(unflattenVector(root.m_min), unflattenVector(root.m_max));
+        return true;
+    }
+
+protected:
+    // Same traversal as Bvh::intersect
+    bool intersectBvh(unsigned int root, Intersection& intersection)
+    {
+        const Ray& ray = intersection.m_ray;
+        Vector invDirection(1.0f / ray.m_direction.m_x,
+                            1.0f / ray.m_direction.m_y,
+                            1.0f / ray.m_direction.m_z);
+        bool negative[3] = { invDirection.m_x < 0.0f,
+                             invDirection.m_y < 0.0f,
+                             invDirection.m_z < 0.0f };
+
+        unsigned int stack[kBvhStackSize];
+        unsigned int top = 0;
+        unsigned int n = root;
+        bool intersectedAny = false;
+        for (;;)
+        {
+            const FlatNode& node = m_pNodes[n];
+            BoundingBox box(unflattenVector(node.m_min), unflattenVector(node.m_max));
+            if (box.intersect(ray.m_origin, invDirection, 0.0f, intersection.m_t))
+            {
+                if (node.m_count)
+                {
+                    for (unsigned int i = node.m_index; i < node.m_index + node.m_count; ++i)
+                    {
+                        if (intersectPrimitive(m_pPrimitives[i], intersection))
+                        {
+                            intersectedAny = true;
+                        }
+                    }
+                }
+                else
+                {
+                    if (negative[node.m_axis])
+                    {
+                        stack[top++] = n + 1;
+                        n = node.m_index;
+                    }
+                    else
+                    {
+                        stack[top++] = node.m_index;
+                        n = n + 1;
+                    }
+                    continue;
+                }
+            }
+            if (top == 0)
+            {
+                break;
+            }
+            n = stack[--top];
+        }
+        return intersectedAny;
+    }
+
+    bool intersectPrimitive(const FlatPrimitive& primitive, Intersection& intersection)
+    {
+        const float* d = primitive.m_data;
+        switch (primitive.m_type)
+        {
+            case kFlatSphere:
+                if (!Sphere::intersectSphere(Point(d[0], d[1], d[2]), d[3], intersection))
+                {
+                    return false;
+                }
+                break;
+            case kFlatRectangle:
+                if (!Rectangle::intersectRectangle(Point(d[0], d[1], d[2]),
+                                                   Vector(d[3], d[4], d[5]),
+                                                   Vector(d[6], d[7], d[8]),
+                                                   intersection))
+                {
+                    return false;
+                }
+                break;
+            case kFlatInstance:
+            {
+                // As Instance::intersect, recursing into the prototype
+                Transform toObject;
+                std::memcpy(toObject.m, d, sizeof(toObject.m));
+                Ray worldRay = intersection.m_ray;
+                intersection.m_ray = Ray(toObject.transformPoint(worldRay.m_origin),
+                                         toObject.transformVector(worldRay.m_direction),
+                                         worldRay.m_tMax);
+                bool intersected = intersectBvh(primitive.m_index, intersection);
+                if (intersected)
+                {
+                    intersection.m_normal = toObject.transformTransposed(intersection.m_normal).normalized();
+                    intersection.m_uvDensity *= intersection.m_ray.m_direction.length() / worldRay.m_direction.length();
+                }
+                intersection.m_ray = worldRay;
+                return intersected;
+            }
+            default:
+                return false;
+        }
+        intersection.m_pShape = this;
+        intersection.m_pMaterial = m_materials.get(primitive.m_index);
+        if (primitive.m_type == kFlatSphere && intersection.m_pMaterial->m_pTexture)
+        {
+            Sphere::surfaceUV(d[3], intersection);
+        }
+        return true;
+    }
+
+    void* m_pMapping;
+    size_t m_size;
+    const MaterialTable& m_materials;
+    const FlatPrimitive* m_pPrimitives;
+    const FlatNode* m_pNodes;
+    unsigned int m_rootNode;
+};
+
+
+// Whether path starts with the binary scene magic
+inline bool isBinarySceneFile(const std::string& path)
+{
+    char magic[sizeof(kBinarySceneMagic)];
+    std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+    return in.read(magic, sizeof(magic)) && std::memcmp(magic, kBinarySceneMagic, sizeof(magic)) == 0;
+}
+
+
+// Source hash recorded in a binary scene's header
+inline bool readBinarySceneHash(const std::string& path, unsigned long long& hash)
+{
+    BinarySceneHeader header;
+    std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+    if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)))
+    {
+        return false;
+    }
+    hash = header.m_sourceHash;
+    return true;
+}
+
+
+inline bool checkSection(const FlatSection& section, size_t recordSize, size_t fileSize)
+{
+    return section.m_offset % sizeof(float) == 0 &&
+           section.m_offset <= fileSize &&
+           section.m_count <= (fileSize - section.m_offset) / recordSize;
+}
+
+
+// Whether the nodes and primitives hold trees as writeBinaryScene() lays
+// them out, so that MappedScene's traversal stays within the sections and
+// ends: a tree's nodes are a run of their own, after the trees of the
+// prototypes it instances, with children after their parents; leaves
+// refer to existing primitives, primitives to existing materials or to
+// the root of an earlier tree, and no tree is deeper than the traversal
+// stack or nests prototypes more than kMaxPrototypeNesting deep
+inline bool checkBinaryTrees(const BinarySceneHeader& header, const char* base, size_t numMaterials)
+{
+    const FlatNode* pNodes = reinterpret_cast<const FlatNode*>(base + header.m_nodes.m_offset);
+    const FlatPrimitive* pPrimitives = reinterpret_cast<const FlatPrimitive*>(base + header.m_primitives.m_offset);
+    size_t numNodes = header.m_nodes.m_count;
+    size_t numPrimitives = header.m_primitives.m_count;
+    if (numNodes == 0)
+    {
+        return true;
+    }
+
+    // Root of the tree, depth within it, and (for roots) prototype nesting
+    // of every node; children are reached from their parent first
+    const unsigned int kNoRoot = ~0u;
+    std::vector<unsigned int> root(numNodes, kNoRoot), depth(numNodes, 0), nesting(numNodes, 1);
+    for (size_t n = 0; n < numNodes; ++n)
+    {
+        const FlatNode& node = pNodes[n];
+        if (root[n] == kNoRoot)
+        {
+            root[n] = (unsigned int)n;
+        }
+        if (depth[n] >= kBvhStackSize || (n > 0 && root[n] < root[n - 1]))
+        {
+            return false;
+        }
+        unsigned int r = root[n];
+        if (node.m_count == 0)
+        {
+            size_t children[2] = { n + 1, node.m_index };
+            if (node.m_axis > 2 || node.m_index <= n + 1 || node.m_index >= numNodes)
+            {
+                return false;
+            }
+            for (size_t c = 0; c < 2; ++c)
+            {
+                if (root[children[c]] != kNoRoot && root[children[c]] != r)
+                {
+                    return false;
+                }
+                root[children[c]] = r;
+                depth[children[c]] = std::max(depth[children[c]], depth[n] + 1);
+            }
+            continue;
+        }
+        if (size_t(node.m_index) + node.m_count > numPrimitives)
+        {
+            return false;
+        }
+        for (size_t i = node.m_index; i < size_t(node.m_index) + node.m_count; ++i)
+        {
+            const FlatPrimitive& primitive = pPrimitives[i];
+            if (primitive.m_type == kFlatInstance)
+            {
+                unsigned int prototype = primitive.m_index;
+                if (prototype >= r || root[prototype] != prototype)
+                {
+                    return false;
+                }
+                nesting[r] = std::max(nesting[r], nesting[prototype] + 1);
+                if (nesting[r] > kMaxPrototypeNesting)
+                {
+                    return false;
+                }
+            }
+            else if (primitive.m_type > kFlatInstance || primitive.m_index >= numMaterials)
+            {
+                return false;
+            }
+        }
+    }
+    return header.m_rootNode < numNodes && root[header.m_rootNode] == header.m_rootNode;
+}
+
+
+// Maps a file written by writeBinaryScene() and builds scene around it
+inline bool loadBinaryScene(const std::string& path, Scene& scene, std::string& error)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        error = "cannot open binary scene '" + path + "'";
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(BinarySceneHeader))
+    {
+        close(fd);
+        error = path + ": not a binary scene";
+        return false;
+    }
+    size_t size = size_t(st.st_size);
+    void* pMapping = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (pMapping == MAP_FAILED)
+    {
+        error = "cannot map binary scene '" + path + "'";
+        return false;
+    }
+
+    const BinarySceneHeader& header = *static_cast<const BinarySceneHeader*>(pMapping);
+    const char* base = static_cast<const char*>(pMapping);
+    bool valid = std::memcmp(header.m_magic, kBinarySceneMagic, sizeof(header.m_magic)) == 0 &&
+                 header.m_byteOrder == kBinarySceneByteOrder &&
+                 checkSection(header.m_materials, sizeof(FlatMaterial), size) &&
+                 checkSection(header.m_planes, sizeof(FlatPlane), size) &&
+                 checkSection(header.m_lights, sizeof(FlatLight), size) &&
+                 checkSection(header.m_environments, sizeof(FlatEnvironment), size) &&
+                 checkSection(header.m_texels, sizeof(FlatTexel), size) &&
+                 checkSection(header.m_primitives, sizeof(FlatPrimitive), size) &&
+                 checkSection(header.m_nodes, sizeof(FlatNode), size) &&
+                 checkSection(header.m_strings, sizeof(char), size) &&
+                 (header.m_nodes.m_count == 0 || header.m_rootNode < header.m_nodes.m_count);
+    if (!valid || header.m_version != kBinarySceneVersion)
+    {
+        munmap(pMapping, size);
+        error = path + (valid ? ": unsupported binary scene version" : ": corrupt binary scene");
+        return false;
+    }
+
+    scene.clear();
+    const FlatMaterial* pMaterials = reinterpret_cast<const FlatMaterial*>(base + header.m_materials.m_offset);
+    size_t numMaterials = header.m_materials.m_count;
+    for (size_t i = 0; i < numMaterials; ++i)
+    {
+        const FlatMaterial& f = pMaterials[i];
+        Material m;
+        m.m_type = f.m_type < kNumBsdfTypes ? BsdfType(f.m_type) : kBsdfLambert;
+        m.m_color = Color(f.m_color[0], f.m_color[1], f.m_color[2]);
+        m.m_kAmbient = f.m_kAmbient;
+        m.m_rReflect = f.m_rReflect;
+        m.m_rRefract = f.m_rRefract;
+        m.m_kDiffuse = f.m_kDiffuse;
+        m.m_kSpecular = f.m_kSpecular;
+        m.m_exponent = f.m_exponent;
+        m.m_ior = f.m_ior;
+        m.m_pow = PowKernel(f.m_exponent);
+        m.m_uvScale = f.m_uvScale;
+        if (f.m_texture != kNoTexture)
+        {
+            const char* strings = base + header.m_strings.m_offset;
+            const char* end = f.m_texture < header.m_strings.m_count
+                              ? static_cast<const char*>(std::memchr(strings + f.m_texture, '\0',
+                                                                     header.m_strings.m_count - f.m_texture))
+                              : NULL;
+            std::string textureError;
+            if (!end || !(m.m_pTexture = TextureCache::global().load(std::string(strings + f.m_texture, end),
+                                                                     textureError)))
+            {
+                munmap(pMapping, size);
+                scene.clear();
+                error = path + ": " + (end ? textureError : "corrupt binary scene");
+                return false;
+            }
+        }
+        scene.m_materials.addMaterial(m);
+    }
+
+    const float* c = header.m_camera;
+    scene.m_camera = Camera(c[0], unflattenVector(c + 1), unflattenVector(c + 4), unflattenVector(c + 7));
+
+    const FlatPlane* pPlanes = reinterpret_cast<const FlatPlane*>(base + header.m_planes.m_offset);
+    const FlatLight* pLights = reinterpret_cast<const FlatLight*>(base + header.m_lights.m_offset);
+    const FlatEnvironment* pEnvironments =
+        reinterpret_cast<const FlatEnvironment*>(base + header.m_environments.m_offset);
+    const FlatTexel* pTexels = reinterpret_cast<const FlatTexel*>(base + header.m_texels.m_offset);
+    bool materialsValid = true;
+    for (size_t i = 0; i < header.m_planes.m_count; ++i)
+    {
+        materialsValid = materialsValid && pPlanes[i].m_material < numMaterials;
+    }
+    for (size_t i = 0; i < header.m_lights.m_count; ++i)
+    {
+        materialsValid = materialsValid && pLights[i].m_material < numMaterials &&
+                         pLights[i].m_type <= kFlatDiskLight;
+    }
+    for (size_t i = 0; i < header.m_environments.m_count; ++i)
+    {
+        const FlatEnvironment& f = pEnvironments[i];
+        materialsValid = materialsValid && i == 0 && f.m_type <= kEnvironmentImage &&
+                         (f.m_type != kEnvironmentImage ||
+                          (f.m_width && f.m_height &&
+                           (unsigned long long)f.m_width * f.m_height == header.m_texels.m_count));
+    }
+    if (!materialsValid || !checkBinaryTrees(header, base, numMaterials))
+    {
+        munmap(pMapping, size);
+        scene.clear();
+        error = path + ": corrupt binary scene";
+        return false;
+    }
+
+    for (size_t i = 0; i < header.m_planes.m_count; ++i)
+    {
+        const FlatPlane& f = pPlanes[i];
+        scene.addShape(scene.create<Plane>(unflattenVector(f.m_position), unflattenVector(f.m_normal),
+                                           scene.m_materials.get(f.m_material)));
+    }
+    for (size_t i = 0; i < header.m_lights.m_count; ++i)
+    {
+        const FlatLight& f = pLights[i];
+        const Material* pMaterial = scene.m_materials.get(f.m_material);
+        Light* pLight;
+        switch (f.m_type)
+        {
+        case kFlatPointLight:
+            pLight = scene.create<PointLight>(unflattenVector(f.m_position), pMaterial, f.m_power);
+            break;
+        case kFlatSpotLight:
+            pLight = scene.create<SpotLight>(unflattenVector(f.m_position), unflattenVector(f.m_side1),
+                                             f.m_side2[0], f.m_side2[1], pMaterial, f.m_power);
+            break;
+        case kFlatSphereLight:
+            pLight = scene.create<SphereLight>(unflattenVector(f.m_position), f.m_side2[0],
+                                               pMaterial, f.m_power);
+            break;
+        case kFlatDiskLight:
+            pLight = scene.create<DiskLight>(unflattenVector(f.m_position), unflattenVector(f.m_side1),
+                                             f.m_side2[0], pMaterial, f.m_power);
+            break;
+        default:
+            pLight = scene.create<RectangleLight>(unflattenVector(f.m_position), unflattenVector(f.m_side1),
+                                                  unflattenVector(f.m_side2), pMaterial, f.m_power);
+            break;
+        }
+        scene.addLight(pLight);
+    }
+    if (header.m_environments.m_count)
+    {
+        const FlatEnvironment& f = pEnvironments[0];
+        Light* pEnvironment;
+        if (f.m_type == kEnvironmentImage)
+        {
+            std::vector<Color> texels(header.m_texels.m_count);
+            for (size_t i = 0; i < texels.size(); ++i)
+            {
+                texels[i] = unflattenColor(pTexels[i].m_color);
+            }
+            pEnvironment = new EnvironmentLight(texels, f.m_width, f.m_height, f.m_power, f.m_rotation);
+        }
+        else if (f.m_type == kEnvironmentSky)
+        {
+            SkyModel sky;
+            sky.m_zenith = unflattenColor(f.m_zenith);
+            sky.m_horizon = unflattenColor(f.m_horizon);
+            sky.m_ground = unflattenColor(f.m_ground);
+            sky.m_sunDirection = unflattenVector(f.m_sunDirection);
+            sky.m_sun = unflattenColor(f.m_sun);
+            sky.m_sunAngle = f.m_sunAngle;
+            pEnvironment = new EnvironmentLight(sky, f.m_power);
+        }
+        else
+        {
+            pEnvironment = new EnvironmentLight(unflattenColor(f.m_color), f.m_power);
+        }
+        scene.adoptShape(pEnvironment);
+        scene.addEnvironment(pEnvironment);
+    }
+    unsigned long long sourceHash = header.m_sourceHash;
+    if (header.m_nodes.m_count)
+    {
+        MappedScene* pMapped = new MappedScene(pMapping, size, scene.m_materials);
+        scene.adoptShape(pMapped);
+        scene.addShape(pMapped);
+    }
+    else
+    {
+        munmap(pMapping, size);
+    }
+    scene.finalize();
+    scene.m_hash = sourceHash;
+    // Only the source's hash is kept, so any change to it counts as one
+    // to the geometry
+    scene.m_geometryHash = sourceHash;
+    return true;
+}
+
+}//namespace Tracer
+
+#endif
@@ -0,0 +1,343 @@
+#ifndef __BVH_H__
+#define __BVH_H__
+
+#include <algorithm>
+#include <vector>
+#include "util.h"
+#include "ray.h"
+#include "shape.h"
+
+namespace Tracer
+{
+
+//
+// Bounding volume hierarchy over a set of bounded shapes.
+//
+// Nodes are kept flat in depth-first order: an interior node's first child
+// directly follows it and m_index is the second child; a leaf covers
+// m_count shapes starting at m_index. The tree is built with the binned
+// surface area heuristic. When shapes move, refit() only recomputes the
+// boxes bottom-up, keeping the topology; once that has made the tree much
+// worse than a fresh build it rebuilds instead.
+//
+
+const unsigned int kBvhMaxLeafSize = 4;
+const unsigned int kBvhNumBins = 12;
+const unsigned int kBvhStackSize = 64;
+// Rebuild when refitting has grown the SAH cost by this factor
+const float kBvhRebuildRatio = 1.5f;
+
+
+struct BvhNode
+{
+    BoundingBox m_box;
+    unsigned int m_index;
+    // Shapes in a leaf, 0 for interior nodes
+    unsigned short m_count;
+    // Split axis of an interior node
+    unsigned short m_axis;
+};
+
+
+class Bvh : public Shape
+{
+public:
+    Bvh() : m_builtCost(0.0f)
+    {
+        m_shapeType = "Bvh";
+    }
+
+    virtual ~Bvh() { }
+
+    // Shapes with empty bounds (an empty prototype, say) can never be hit
+    // and are left out
+    void build(const std::vector<Shape*>& shapes)
+    {
+        m_shapes.clear();
+        m_boxes.clear();
+        for (size_t i = 0; i < shapes.size(); ++i)
+        {
+            BoundingBox box;
+            shapes[i]->bounds(box);
+            if (!box.empty())
+            {
+                m_shapes.push_back(shapes[i]);
+                m_boxes.push_back(box);
+            }
+        }
+        rebuild();
+    }
+
+    // Recomputes the bounds after shapes have moved; returns true if the
+    // tree had to be rebuilt instead
+    bool refit()
+    {
+        for (size_t i = 0; i < m_shapes.size(); ++i)
+        {
+            m_shapes[i]->bounds(m_boxes[i]);
+        }
+        // Children follow their parent, so a reverse sweep sees them first
+        for (size_t n = m_nodes.size(); n-- > 0;)
+        {
+            BvhNode& node = m_nodes[n];
+            node.m_box = BoundingBox();
+            if (node.m_count)
+            {
+                for (unsigned int i = node.m_index; i < node.m_index + node.m_count; ++i)
+                {
+                    node.m_box.expand(m_boxes[i]);
+                }
+            }
+            else
+            {
+                node.m_box.expand(m_nodes[n + 1].m_box);
+                node.m_box.expand(m_nodes[node.m_index].m_box);
+            }
+        }
+        if (cost() > kBvhRebuildRatio * m_builtCost)
+        {
+            rebuild();
+            return true;
+        }
+        return false;
+    }
+
+    virtual bool intersect(Intersection& intersection)
+    {
+        if (m_nodes.empty())
+        {
+            return false;
+        }
+        const Ray& ray = intersection.m_ray;
+        Vector invDirection(1.0f / ray.m_direction.m_x,
+                            1.0f / ray.m_direction.m_y,
+                            1.0f / ray.m_direction.m_z);
+        bool negative[3] = { invDirection.m_x < 0.0f,
+                             invDirection.m_y < 0.0f,
+                             invDirection.m_z < 0.0f };
+
+        unsigned int stack[kBvhStackSize];
+        unsigned int top = 0;
+        unsigned int n = 0;
+        bool intersectedAny = false;
+        for (;;)
+        {
+            const BvhNode& node = m_nodes[n];
+            if (node.m_box.intersect(ray.m_origin, invDirection, 0.0f, intersection.m_t))
+            {
+                if (node.m_count)
+                {
+                    for (unsigned int i = node.m_index; i < node.m_index + node.m_count; ++i)
+                    {
+                        if (m_shapes[i]->intersect(intersection))
+                        {
+                            intersectedAny = true;
+                        }
+                    }
+                }
+                else
+                {
+                    // Visit the near child first
+                    if (negative[node.m_axis])
+                    {
+                        stack[top++] = n + 1;
+                        n = node.m_index;
+                    }
+                    else
+                    {
+                        stack[top++] = node.m_index;
+                        n = n + 1;
+                    }
+                    continue;
+                }
+            }
+            if (top == 0)
+            {
+                break;
+            }
+            n = stack[--top];
+        }
+        return intersectedAny;
+    }
+
+    virtual bool bounds(BoundingBox& box) const
+    {
+        box = m_nodes.empty() ? BoundingBox() : m_nodes[0].m_box;
+        return true;
+    }
+
+    // SAH cost of the current tree, relative to the root's area
+    float cost() const
+    {
+        if (m_nodes.empty())
+        {
+            return 0.0f;
+        }
+        float rootArea = std::max(m_nodes[0].m_box.surfaceArea(), 1e-12f);
+        float sum = 0.0f;
+        for (size_t n = 0; n < m_nodes.size(); ++n)
+        {
+            const BvhNode& node = m_nodes[n];
+            sum += node.m_box.surfaceArea() / rootArea * (node.m_count ? float(node.m_count) : 1.0f);
+        }
+        return sum;
+    }
+
+    size_t numNodes() const { return m_nodes.size(); }
+    size_t numShapes() const { return m_shapes.size(); }
+
+    // Nodes in depth-first order and the shapes in leaf order, for
+    // flattening the tree
+    const std::vector<BvhNode>& nodes() const { return m_nodes; }
+    const std::vector<Shape*>& shapes() const { return m_shapes; }
+
+protected:
+    void rebuild()
+    {
+        m_nodes.clear();
+        if (!m_shapes.empty())
+        {
+            m_nodes.reserve(2 * m_shapes.size());
+            buildRange(0, (unsigned int)m_shapes.size());
+        }
+        m_builtCost = cost();
+    }
+
+    // Appends the subtree over shapes [begin, end) and returns its index;
+    // depth is capped so traversal never overflows its stack
+    unsigned int buildRange(unsigned int begin, unsigned int end, unsigned int depth = 0)
+    {
+        unsigned int index = (unsigned int)m_nodes.size();
+        m_nodes.push_back(BvhNode());
+        BoundingBox box, centroids;
+        for (unsigned int i = begin; i < end; ++i)
+        {
+            box.expand(m_boxes[i]);
+            centroids.expand(m_boxes[i].center());
+        }
+        m_nodes[index].m_box = box;
+
+        unsigned int count = end - begin;
+        unsigned int axis = 0;
+        unsigned int mid = begin;
+        if (count > kBvhMaxLeafSize && depth + 1 < kBvhStackSize &&
+            findSplit(begin, end, box, centroids, axis, mid))
+        {
+            buildRange(begin, mid, depth + 1);
+            unsigned int second = buildRange(mid, end, depth + 1);
+            m_nodes[index].m_index = second;
+            m_nodes[index].m_count = 0;
+            m_nodes[index].m_axis = (unsigned short)axis;
+        }
+        else
+        {
+            m_nodes[index].m_index = begin;
+            m_nodes[index].m_count = (unsigned short)count;
+            m_nodes[index].m_axis = 0;
+        }
+        return index;
+    }
+
+    static float axisValue(const Point& p, unsigned int axis)
+    {
+        return axis == 0 ? p.m_x : (axis == 1 ? p.m_y : p.m_z);
+    }
+
+    // Binned SAH split along the widest centroid axis; partitions the range
+    // and returns false if a leaf is cheaper
+    bool findSplit(unsigned int begin, unsigned int end,
+                   const BoundingBox& box, const BoundingBox& centroids,
+                   unsigned int& axis, unsigned int& mid)
+    {
+        Vector extent = centroids.m_max - centroids.m_min;
+        axis = (extent.m_x > extent.m_y && extent.m_x > extent.m_z) ? 0 : (extent.m_y > extent.m_z ? 1 : 2);
+        float lo = axisValue(centroids.m_min, axis);
+        float width = axisValue(extent, axis);
+        unsigned int count = end - begin;
+
+        if (width <= 0.0f)
+        {
+            // All centroids coincide; split in the middle so leaves stay small
+            if (count <= 255)
+            {
+                return false;
+            }
+            mid = begin + count / 2;
+            return true;
+        }
+
+        BoundingBox bins[kBvhNumBins];
+        unsigned int binCounts[kBvhNumBins] = { 0 };
+        float scale = float(kBvhNumBins) / width;
+        for (unsigned int i = begin; i < end; ++i)
+        {
+            unsigned int b = std::min((unsigned int)((axisValue(m_boxes[i].center(), axis) - lo) * scale),
+                                      kBvhNumBins - 1);
+            bins[b].expand(m_boxes[i]);
+            ++binCounts[b];
+        }
+
+        // Sweep from the right to get the cost of every split plane
+        float rightArea[kBvhNumBins];
+        unsigned int rightCount[kBvhNumBins];
+        BoundingBox right;
+        unsigned int rightN = 0;
+        for (unsigned int b = kBvhNumBins - 1; b > 0; --b)
+        {
+            right.expand(bins[b]);
+            rightN += binCounts[b];
+            rightArea[b] = right.surfaceArea();
+            rightCount[b] = rightN;
+        }
+        BoundingBox left;
+        unsigned int leftN = 0;
+        float bestCost = kRayTMax;
+        unsigned int bestBin = 0;
+        for (unsigned int b = 1; b < kBvhNumBins; ++b)
+        {
+            left.expand(bins[b - 1]);
+            leftN += binCounts[b - 1];
+            float c = left.surfaceArea() * leftN + rightArea[b] * rightCount[b];
+            if (leftN && rightCount[b] && c < bestCost)
+            {
+                bestCost = c;
+                bestBin = b;
+            }
+        }
+
+        float leafCost = box.surfaceArea() * count;
+        if (bestBin == 0 || (bestCost + box.surfaceArea() >= leafCost && count <= 255))
+        {
+            return false;
+        }
+
+        // Partition the shapes (and their boxes) around the chosen plane
+        unsigned int i = begin, j = end;
+        while (i < j)
+        {
+            unsigned int b = std::min((unsigned int)((axisValue(m_boxes[i].center(), axis) - lo) * scale),
+                                      kBvhNumBins - 1);
+            if (b < bestBin)
+            {
+                ++i;
+            }
+            else
+            {
+                --j;
+                std::swap(m_shapes[i], m_shapes[j]);
+                std::swap(m_boxes[i], m_boxes[j]);
+            }
+        }
+        mid = i;
+        return true;
+    }
+
+    std::vector<BvhNode> m_nodes;
+    std::vector<Shape*> m_shapes;
+    std::vector<BoundingBox> m_boxes;
+    float m_builtCost;
+};
+
+}//namespace Tracer
+
+#endif
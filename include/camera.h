@@ -0,0 +1,106 @@
+#ifndef __CAMERA_H__
+#define __CAMERA_H__
+
+#include "util.h"
+#include "ray.h"
+
+namespace Tracer
+{
+
+// Set up a camera ray given the look-at spec, FOV, and screen position to aim at.
+inline Ray makeCameraRay(float fieldOfViewInDegrees,
+                         const Point& origin,
+                         const Vector& target,
+                         const Vector& targetUpDirection,
+                         float xScreenPos0To1,
+                         float yScreenPos0To1)
+{
+    Vector forward = (target - origin).normalized();
+    Vector right = cross(forward, targetUpDirection).normalized();
+    Vector up = cross(right, forward).normalized();
+
+    // Convert to radians, as that is what the math calls expect
+    float fovScale = std::tan(fieldOfViewInDegrees * M_PI / 360.0f)*2;
+
+    Ray ray;
+
+    // Set up ray info
+    ray.m_origin = origin;
+    ray.m_direction = forward +
+                      right * ((xScreenPos0To1 - 0.5f) * fovScale) +
+                      up * ((yScreenPos0To1 - 0.5f) * fovScale);
+    ray.m_direction.normalize();
+
+    return ray;
+}
+
+
+// Look-at pinhole camera
+struct Camera
+{
+    float m_fieldOfView;
+    Point m_origin;
+    Point m_target;
+    Vector m_up;
+
+    Camera(float fieldOfViewInDegrees = 60.0f,
+           const Point& origin = Point(0.0f, 5.0f, 15.0f),
+           const Point& target = Point(0.0f, 5.0f, 0.0f),
+           const Vector& up = Vector(0.0f, 1.0f, 0.0f))
+        : m_fieldOfView(fieldOfViewInDegrees),
+          m_origin(origin),
+          m_target(target),
+          m_up(up)
+    {
+
+    }
+
+    Ray makeRay(float xScreenPos0To1, float yScreenPos0To1) const
+    {
+        return makeCameraRay(m_fieldOfView, m_origin, m_target, m_up,
+                             xScreenPos0To1, yScreenPos0To1);
+    }
+
+    // Angle between the rays through neighbouring pixels of a width x
+    // height image, near the center (the larger of the two axes' steps)
+    float pixelSpread(size_t width, size_t height) const
+    {
+        float fovScale = std::tan(m_fieldOfView * M_PI / 360.0f) * 2;
+        return fovScale / float(std::max(std::min(width, height), size_t(2)) - 1);
+    }
+
+    // Screen position makeRay() would aim at point through; false if the
+    // point is not in front of the camera
+    bool project(const Point& point, float& xScreenPos0To1, float& yScreenPos0To1) const
+    {
+        Vector forward = (m_target - m_origin).normalized();
+        Vector right = cross(forward, m_up).normalized();
+        Vector up = cross(right, forward).normalized();
+        float fovScale = std::tan(m_fieldOfView * M_PI / 360.0f) * 2;
+
+        Vector offset = point - m_origin;
+        float depth = dot(offset, forward);
+        if (!(depth > 0.0f))
+        {
+            return false;
+        }
+        xScreenPos0To1 = dot(offset, right) / (depth * fovScale) + 0.5f;
+        yScreenPos0To1 = dot(offset, up) / (depth * fovScale) + 0.5f;
+        return true;
+    }
+
+    // Screen position of a sample (x + dx, y + dy) in a width x height image;
+    // the first and last pixel centres span the screen, so both are at
+    // least 2 (RenderSettings refuses less)
+    static void screenPosition(size_t x, size_t y, float dx, float dy,
+                               size_t width, size_t height,
+                               float& xu, float& yu)
+    {
+        yu = 1.0f - (y + dy) / float(height - 1);
+        xu = (x + dx) / float(width - 1);
+    }
+};
+
+}//namespace Tracer
+
+#endif
@@ -0,0 +1,370 @@
+#ifndef __DENOISE_H__
+#define __DENOISE_H__
+
+#include <cmath>
+#include <string>
+#include <vector>
+#include "omp.h"
+#include "util.h"
+#include "ray.h"
+#include "shape.h"
+#include "material.h"
+#include "camera.h"
+#include "integrator.h"
+#include "image_io.h"
+
+namespace Tracer
+{
+
+//
+// Feature-guided denoising.
+//
+// A cheap feature pass traces a few primary rays per pixel and records the
+// albedo (Material::m_color), shading normal and depth of what they see,
+// following mirrors and glass to the first surface that is not a perfect
+// specular, as the light paths themselves do. The denoiser then divides
+// the albedo out of the image, smooths what is left (mostly lighting)
+// with an edge-avoiding a-trous wavelet filter whose weights fall off with
+// differences in normal, albedo and depth, and multiplies the albedo back
+// in. Each a-trous iteration doubles the filter's reach, so
+// kDenoiseIterations passes of a 5x5 kernel cover a 125 pixel footprint
+// without crossing geometric or texture edges.
+//
+// Luminance differences are judged against the local noise level, as in
+// spatiotemporal variance-guided filtering: the variance of each pixel is
+// first estimated from its neighbourhood on the same surface, then
+// filtered along with the image, so noise is smoothed away while lighting
+// features stronger than the noise (shadow edges, highlights) survive.
+//
+
+const size_t kFeatureSamples = 4;
+// Mirror and glass surfaces followed before the features are taken
+const size_t kFeatureMaxSpecular = 4;
+const size_t kDenoiseIterations = 5;
+const size_t kDenoiseTileSize = 32;
+// Tolerances of the edge-stopping functions; luminance in standard
+// deviations of the noise
+const float kDenoiseSigmaLuminance = 4.0f;
+const float kDenoiseSigmaNormal = 0.3f;
+const float kDenoiseSigmaAlbedo = 0.1f;
+// Relative to the pixel's depth
+const float kDenoiseSigmaDepth = 0.05f;
+
+
+// Per-pixel features, averaged over the feature samples; depth is 0 where
+// every sample missed
+struct FeatureBuffers
+{
+    size_t m_width, m_height;
+    std::vector<Color> m_albedo;
+    std::vector<Vector> m_normal;
+    std::vector<float> m_depth;
+
+    FeatureBuffers() : m_width(0), m_height(0) { }
+
+    void reset(size_t width, size_t height)
+    {
+        m_width = width;
+        m_height = height;
+        m_albedo.assign(width * height, Color());
+        m_normal.assign(width * height, Vector());
+        m_depth.assign(width * height, 0.0f);
+    }
+};
+
+
+// Albedo, normal and depth along ray, following perfect specular surfaces;
+// returns false on a miss. pixelSpread filters textures as traceRay does.
+inline bool traceFeatures(Ray ray, ShapeSet& masterSet, float pixelSpread,
+                          Color& albedo, Vector& normal, float& depth)
+{
+    Color tint(1.0f, 1.0f, 1.0f);
+    float coneWidth = 0.0f;
+    for (size_t nBounce = 0; ; ++nBounce)
+    {
+        Intersection intersection(ray);
+        if (!masterSet.intersect(intersection))
+        {
+            return false;
+        }
+        coneWidth += pixelSpread * intersection.m_t;
+        if (nBounce == 0)
+        {
+            depth = intersection.m_t;
+        }
+        const Material& material = *intersection.m_pMaterial;
+        normal = intersection.m_normal;
+        float cosI = -dot(ray.m_direction, normal);
+        bool entering = cosI > 0.0f;
+        if (!entering)
+        {
+            normal *= -1.0f;
+        }
+        bool specular = material.m_type == kBsdfMirror || material.m_type == kBsdfDielectric;
+        if (!specular || nBounce >= kFeatureMaxSpecular)
+        {
+            albedo = tint * material.m_color * surfaceTexture(intersection, coneWidth);
+            return true;
+        }
+
+        tint *= material.m_color;
+        Vector refracted;
+        float eta = entering ? 1.0f / material.m_ior : material.m_ior;
+        if (material.m_type == kBsdfDielectric && refract(ray.m_direction, normal, eta, refracted))
+        {
+            ray = Ray(intersection.position(), refracted);
+        }
+        else
+        {
+            ray = Ray(intersection.position(), reflect(ray.m_direction, normal));
+        }
+    }
+}
+
+
+// Feature pass over the whole image, kFeatureSamples stratified samples
+// per pixel
+inline void renderFeatures(ShapeSet& masterSet,
+                           const Camera& camera,
+                           size_t width,
+                           size_t height,
+                           unsigned int seed,
+                           FeatureBuffers& features)
+{
+    features.reset(width, height);
+    const size_t strata = (size_t)std::sqrt(float(kFeatureSamples));
+    const float pixelSpread = camera.pixelSpread(width, height);
+
+    #pragma omp parallel for schedule(dynamic, 4)
+    for (size_t y = 0; y < height; ++y)
+    {
+        for (size_t x = 0; x < width; ++x)
+        {
+            size_t pixel = y * width + x;
+            Rng rng = Rng::forStream(seed ^ 0x5bd1e995u, (unsigned int)pixel);
+            Color albedo;
+            Vector normal;
+            float depth = 0.0f;
+            size_t hits = 0;
+            for (size_t s = 0; s < strata * strata; ++s)
+            {
+                float dx = (float(s % strata) + rng.nextFloat()) / float(strata);
+                float dy = (float(s / strata) + rng.nextFloat()) / float(strata);
+                float xu, yu;
+                Camera::screenPosition(x, y, dx, dy, width, height, xu, yu);
+                Color a;
+                Vector n;
+                float d = 0.0f;
+                if (traceFeatures(camera.makeRay(xu, yu), masterSet, pixelSpread, a, n, d))
+                {
+                    albedo += a;
+                    normal += n;
+                    depth += d;
+                    ++hits;
+                }
+            }
+            if (hits)
+            {
+                features.m_albedo[pixel] = albedo / float(hits);
+                features.m_normal[pixel] = normal.length2() > 0.0f ? normal.normalized() : Vector();
+                features.m_depth[pixel] = depth / float(hits);
+            }
+        }
+    }
+}
+
+
+// Weight of pixel q's features seen from pixel p, leaving out luminance;
+// 0 between a hit and a miss
+inline float featureWeight(const FeatureBuffers& features, size_t p, size_t q)
+{
+    float dp = features.m_depth[p];
+    float dq = features.m_depth[q];
+    if ((dp > 0.0f) != (dq > 0.0f))
+    {
+        return 0.0f;
+    }
+    Vector dn = features.m_normal[p] - features.m_normal[q];
+    Color da = features.m_albedo[p] - features.m_albedo[q];
+    float e = dn.length2() / (kDenoiseSigmaNormal * kDenoiseSigmaNormal) +
+              (da.m_r * da.m_r + da.m_g * da.m_g + da.m_b * da.m_b) /
+              (kDenoiseSigmaAlbedo * kDenoiseSigmaAlbedo) +
+              (dp > 0.0f ? std::fabs(dp - dq) / (kDenoiseSigmaDepth * dp) : 0.0f);
+    return std::exp(-e);
+}
+
+
+// Edge-avoiding a-trous filter of image (row-major, features' size),
+// guided by features; runs tile by tile in parallel
+inline void denoiseImage(std::vector<Color>& image, const FeatureBuffers& features)
+{
+    const size_t width = features.m_width;
+    const size_t height = features.m_height;
+    const size_t numPixels = width * height;
+    const float kernel[3] = { 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+    const float kAlbedoFloor = 0.01f;
+    size_t tilesX = (width + kDenoiseTileSize - 1) / kDenoiseTileSize;
+    size_t tilesY = (height + kDenoiseTileSize - 1) / kDenoiseTileSize;
+
+    // Work on lighting alone: divide out the albedo where there is one
+    std::vector<Color> current(numPixels), next(numPixels);
+    #pragma omp parallel for
+    for (size_t i = 0; i < numPixels; ++i)
+    {
+        const Color& a = features.m_albedo[i];
+        current[i] = features.m_depth[i] > 0.0f
+                     ? image[i] / Color(std::max(a.m_r, kAlbedoFloor),
+                                        std::max(a.m_g, kAlbedoFloor),
+                                        std::max(a.m_b, kAlbedoFloor))
+                     : image[i];
+    }
+
+    // Luminance variance over each pixel's 5x5 neighbourhood, weighted by
+    // feature similarity so edges between surfaces do not count as noise
+    std::vector<float> variance(numPixels), nextVariance(numPixels);
+    #pragma omp parallel for schedule(dynamic, 4)
+    for (size_t y = 0; y < height; ++y)
+    {
+        for (size_t x = 0; x < width; ++x)
+        {
+            size_t p = y * width + x;
+            float sum = 0.0f, sum2 = 0.0f, weightSum = 0.0f;
+            for (int qy = std::max(int(y) - 2, 0); qy <= std::min(int(y) + 2, int(height) - 1); ++qy)
+            {
+                for (int qx = std::max(int(x) - 2, 0); qx <= std::min(int(x) + 2, int(width) - 1); ++qx)
+                {
+                    size_t q = size_t(qy) * width + size_t(qx);
+                    float w = featureWeight(features, p, q);
+                    float l = luminance(current[q]);
+                    sum += w * l;
+                    sum2 += w * l * l;
+                    weightSum += w;
+                }
+            }
+            float mean = sum / weightSum;
+            variance[p] = std::max(sum2 / weightSum - mean * mean, 0.0f);
+        }
+    }
+
+    for (size_t iteration = 0; iteration < kDenoiseIterations; ++iteration)
+    {
+        const int step = 1 << iteration;
+
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (size_t tile = 0; tile < tilesX * tilesY; ++tile)
+        {
+            size_t x0 = (tile % tilesX) * kDenoiseTileSize;
+            size_t y0 = (tile / tilesX) * kDenoiseTileSize;
+            size_t x1 = std::min(x0 + kDenoiseTileSize, width);
+            size_t y1 = std::min(y0 + kDenoiseTileSize, height);
+            for (size_t y = y0; y < y1; ++y)
+            {
+                for (size_t x = x0; x < x1; ++x)
+                {
+                    size_t p = y * width + x;
+
+                    // The variance is blurred a little before use, it is
+                    // itself a noisy estimate
+                    float blurred = 0.0f, blurWeight = 0.0f;
+                    for (int qy = std::max(int(y) - 1, 0); qy <= std::min(int(y) + 1, int(height) - 1); ++qy)
+                    {
+                        for (int qx = std::max(int(x) - 1, 0); qx <= std::min(int(x) + 1, int(width) - 1); ++qx)
+                        {
+                            float w = (qx == int(x) ? 2.0f : 1.0f) * (qy == int(y) ? 2.0f : 1.0f);
+                            blurred += w * variance[size_t(qy) * width + size_t(qx)];
+                            blurWeight += w;
+                        }
+                    }
+                    float invSigma = 1.0f / (kDenoiseSigmaLuminance * std::sqrt(blurred / blurWeight) + 1e-4f);
+                    float lp = luminance(current[p]);
+
+                    Color sum;
+                    float sumVariance = 0.0f;
+                    float weightSum = 0.0f;
+                    for (int j = -2; j <= 2; ++j)
+                    {
+                        int qy = int(y) + j * step;
+                        if (qy < 0 || qy >= int(height))
+                        {
+                            continue;
+                        }
+                        for (int i = -2; i <= 2; ++i)
+                        {
+                            int qx = int(x) + i * step;
+                            if (qx < 0 || qx >= int(width))
+                            {
+                                continue;
+                            }
+                            size_t q = size_t(qy) * width + size_t(qx);
+                            const Color& cq = current[q];
+                            float w = kernel[std::abs(i)] * kernel[std::abs(j)] *
+                                      featureWeight(features, p, q) *
+                                      std::exp(-std::fabs(lp - luminance(cq)) * invSigma);
+                            sum += w * cq;
+                            sumVariance += w * w * variance[q];
+                            weightSum += w;
+                        }
+                    }
+                    next[p] = sum / weightSum;
+                    nextVariance[p] = sumVariance / (weightSum * weightSum);
+                }
+            }
+        }
+        std::swap(current, next);
+        std::swap(variance, nextVariance);
+    }
+
+    // Put the albedo back
+    #pragma omp parallel for
+    for (size_t i = 0; i < numPixels; ++i)
+    {
+        const Color& a = features.m_albedo[i];
+        image[i] = features.m_depth[i] > 0.0f
+                   ? current[i] * Color(std::max(a.m_r, kAlbedoFloor),
+                                        std::max(a.m_g, kAlbedoFloor),
+                                        std::max(a.m_b, kAlbedoFloor))
+                   : current[i];
+    }
+}
+
+
+// Path of the aux image called name that goes with imagePath:
+// "out.png", "albedo" -> "out_albedo.png"
+inline std::string featureFile(const std::string& imagePath, const std::string& name)
+{
+    std::string::size_type dot = imagePath.find_last_of('.');
+    std::string::size_type slash = imagePath.find_last_of('/');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+    {
+        dot = imagePath.size();
+    }
+    return imagePath.substr(0, dot) + "_" + name + imagePath.substr(dot);
+}
+
+
+// Writes the albedo, the normals (mapped from -1..1 to 0..1) and the depth
+// (near is bright, scaled to the farthest hit) next to imagePath
+inline bool writeFeatureImages(const FeatureBuffers& features, const std::string& imagePath)
+{
+    size_t n = features.m_albedo.size();
+    std::vector<Color> normal(n), depth(n);
+    float maxDepth = 0.0f;
+    for (size_t i = 0; i < n; ++i)
+    {
+        maxDepth = std::max(maxDepth, features.m_depth[i]);
+    }
+    for (size_t i = 0; i < n; ++i)
+    {
+        const Vector& v = features.m_normal[i];
+        normal[i] = Color(0.5f + 0.5f * v.m_x, 0.5f + 0.5f * v.m_y, 0.5f + 0.5f * v.m_z);
+        float d = features.m_depth[i];
+        depth[i] = Color(d > 0.0f ? 1.0f - d / (maxDepth * 1.0001f) : 0.0f);
+    }
+    return writeImage(featureFile(imagePath, "albedo"), features.m_albedo, features.m_width, features.m_height) &&
+           writeImage(featureFile(imagePath, "normal"), normal, features.m_width, features.m_height) &&
+           writeImage(featureFile(imagePath, "depth"), depth, features.m_width, features.m_height);
+}
+
+}//namespace Tracer
+
+#endif
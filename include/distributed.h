@@ -0,0 +1,629 @@
+#ifndef __DISTRIBUTED_H__
+#define __DISTRIBUTED_H__
+
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "util.h"
+#include "shape.h"
+#include "light_source.h"
+#include "camera.h"
+#include "film.h"
+#include "integrator.h"
+#include "settings.h"
+#include "progressive.h"
+
+namespace Tracer
+{
+
+//
+// Distributed rendering over TCP.
+//
+// A coordinator splits the frame into jobs, either tiles with every sample
+// or sample ranges of the whole frame, and hands them out to worker
+// processes on demand (two in flight per worker). Workers splat their
+// job's samples through the pixel filter and send back the weighted sums
+// and weights of the job's pixels plus the filter's border around them,
+// which the coordinator merges into one Film. Tile jobs are the film's own
+// tiles, so their results land in the film the same way the in-process
+// renderer's tiles do.
+//
+// Every pixel sample seeds its own Rng from (seed, sample index, pixel), so
+// the image does not depend on how the work was split or who rendered it.
+//
+// Workers are either forked locally (--workers) or separate processes,
+// possibly on other machines, started with --connect HOST:PORT and the
+// same scene and settings. All message fields are in host byte order, so
+// every process has to run on the same architecture. The coordinator waits
+// for the workers up to --worker-timeout seconds, and less once every
+// forked worker has either connected or exited, then starts with those
+// that connected.
+//
+
+const unsigned int kProtocolMagic = 0x52545243;   // "RTRC"
+const unsigned int kProtocolVersion = 3;
+const size_t kJobsInFlightPerWorker = 2;
+
+enum MessageType
+{
+    kMessageJob = 1,
+    kMessageQuit = 2
+};
+
+
+// One unit of work: pixels [x0, x1) x [y0, y1), samples [s0, s1)
+struct RenderJob
+{
+    unsigned int m_id;
+    unsigned int m_x0, m_y0, m_x1, m_y1;
+    unsigned int m_sampleBegin, m_sampleEnd;
+
+    size_t numPixels() const { return size_t(m_x1 - m_x0) * size_t(m_y1 - m_y0); }
+};
+
+
+inline bool writeAll(int fd, const void* data, size_t size)
+{
+    const char* p = static_cast<const char*>(data);
+    while (size > 0)
+    {
+        ssize_t n = ::write(fd, p, size);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return false;
+        }
+        p += n;
+        size -= size_t(n);
+    }
+    return true;
+}
+
+
+inline bool readAll(int fd, void* data, size_t size)
+{
+    char* p = static_cast<char*>(data);
+    while (size > 0)
+    {
+        ssize_t n = ::read(fd, p, size);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return false;
+        }
+        p += n;
+        size -= size_t(n);
+    }
+    return true;
+}
+
+
+// Splits "host:port"; returns false if there is no port
+inline bool splitAddress(const std::string& address, std::string& host, std::string& port)
+{
+    std::string::size_type colon = address.rfind(':');
+    if (colon == std::string::npos || colon + 1 == address.size())
+    {
+        return false;
+    }
+    host = address.substr(0, colon);
+    port = address.substr(colon + 1);
+    return true;
+}
+
+
+inline int connectTo(const std::string& address)
+{
+    std::string host, port;
+    if (!splitAddress(address, host, port))
+    {
+        return -1;
+    }
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* result = NULL;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0)
+    {
+        return -1;
+    }
+    int fd = -1;
+    for (addrinfo* ai = result; ai; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+        {
+            continue;
+        }
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+        {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+    if (fd >= 0)
+    {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+
+// Listening socket on "host:port" (port 0 picks a free one); the port
+// actually bound is returned in boundPort
+inline int listenOn(const std::string& address, int backlog, unsigned short& boundPort)
+{
+    std::string host, port;
+    if (!splitAddress(address, host, port))
+    {
+        return -1;
+    }
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo* result = NULL;
+    if (getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &result) != 0)
+    {
+        return -1;
+    }
+    int fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    int one = 1;
+    if (fd < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+        bind(fd, result->ai_addr, result->ai_addrlen) != 0 ||
+        listen(fd, backlog) != 0)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        freeaddrinfo(result);
+        return -1;
+    }
+    freeaddrinfo(result);
+
+    sockaddr_in bound;
+    socklen_t len = sizeof(bound);
+    getsockname(fd, reinterpret_cast<sockaddr*>(&bound), &len);
+    boundPort = ntohs(bound.sin_port);
+    return fd;
+}
+
+
+// Padded size of a job's result under filter, in pixels
+inline size_t jobBufferSize(const RenderJob& job, const Filter& filter)
+{
+    size_t border = 2 * filter.padding();
+    return (job.m_x1 - job.m_x0 + border) * (job.m_y1 - job.m_y0 + border);
+}
+
+
+// Renders the pixel samples of a job, with one Rng per pixel sample, and
+// splats them into buffer (set to the job's pixels and border, from arena).
+// A row's splats reach padding rows up and down, so the rows are split
+// into rounds 2 * padding + 1 apart that never write the same pixel.
+// pIrradiance is the worker's irradiance cache, if the settings ask for
+// one; it lives as long as the worker, so later jobs reuse its records.
+inline void renderJob(const RenderJob& job,
+                      ShapeSet& masterSet,
+                      const std::vector<Light*>& lights,
+                      const Camera& camera,
+                      const RenderSettings& settings,
+                      const Filter& filter,
+                      MemoryArena& arena,
+                      FilmTile& buffer,
+                      IrradianceCache* pIrradiance = NULL)
+{
+    const size_t width = settings.m_width;
+    const size_t height = settings.m_height;
+    const size_t jobHeight = job.m_y1 - job.m_y0;
+    const size_t rowStep = 2 * filter.padding() + 1;
+    const float pixelSpread = camera.pixelSpread(width, height);
+    arena.reset();
+    buffer.reserve(arena, jobBufferSize(job, filter));
+    buffer.setRect(filter, job.m_x0, job.m_y0, job.m_x1, job.m_y1);
+
+    for (size_t round = 0; round < rowStep; ++round)
+    {
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (size_t row = round; row < jobHeight; row += rowStep)
+        {
+            size_t y = job.m_y0 + row;
+            for (size_t x = job.m_x0; x < job.m_x1; ++x)
+            {
+                unsigned int pixel = (unsigned int)(y * width + x);
+                for (unsigned int s_i = job.m_sampleBegin; s_i < job.m_sampleEnd; ++s_i)
+                {
+                    Rng rng = Rng::forStream(settings.m_seed ^ hashUInt32(s_i), pixel);
+                    float dy = rng.nextFloat();
+                    float dx = rng.nextFloat();
+                    float yu = 1.0f - (y + dy) / float(height - 1);
+                    float xu = (x + dx) / float(width - 1);
+                    Color pixelColor = traceRay(camera.makeRay(xu, yu), masterSet, lights, rng,
+                                                settings.m_maxBounce, settings.m_numLightSamples,
+                                                pixelSpread, float(settings.m_shadowCullThreshold), NULL,
+                                                pIrradiance, settings.m_numIrradianceRays);
+                    pixelColor.clamp();
+                    buffer.addSample(x, y, dx, dy, pixelColor);
+                }
+            }
+        }
+    }
+}
+
+
+// Worker side: serve jobs on fd until told to quit or the connection
+// drops. Returns the process exit code.
+inline int runWorker(int fd,
+                     ShapeSet& masterSet,
+                     const std::vector<Light*>& lights,
+                     const Camera& camera,
+                     const RenderSettings& settings)
+{
+    unsigned int hello[2] = { kProtocolMagic, kProtocolVersion };
+    if (!writeAll(fd, hello, sizeof(hello)))
+    {
+        return 1;
+    }
+
+    Filter filter = makeFilter(settings);
+    MemoryArena arena;
+    FilmTile buffer;
+    IrradianceCache irradiance(float(settings.m_irradianceAccuracy));
+    IrradianceCache* pIrradiance = settings.m_irradianceAccuracy > 0.0 ? &irradiance : NULL;
+    for (;;)
+    {
+        unsigned int type;
+        RenderJob job;
+        if (!readAll(fd, &type, sizeof(type)))
+        {
+            return 1;
+        }
+        if (type == kMessageQuit)
+        {
+            return 0;
+        }
+        if (type != kMessageJob || !readAll(fd, &job, sizeof(job)))
+        {
+            return 1;
+        }
+        renderJob(job, masterSet, lights, camera, settings, filter, arena, buffer, pIrradiance);
+        if (!writeAll(fd, &job.m_id, sizeof(job.m_id)) ||
+            !writeAll(fd, buffer.m_sum, buffer.size() * sizeof(Color)) ||
+            !writeAll(fd, buffer.m_weight, buffer.size() * sizeof(float)))
+        {
+            return 1;
+        }
+    }
+}
+
+
+class Coordinator
+{
+public:
+    Coordinator(ShapeSet& masterSet,
+                const std::vector<Light*>& lights,
+                const Camera& camera,
+                const RenderSettings& settings)
+        : m_masterSet(masterSet),
+          m_lights(lights),
+          m_camera(camera),
+          m_settings(settings)
+    {
+
+    }
+
+    // Renders the whole frame with the configured workers into film (sized,
+    // with the settings' tile size and filter).
+    // Must be called before any OpenMP parallel region has run in this
+    // process, since local workers are forked.
+    bool render(Film& film)
+    {
+        signal(SIGPIPE, SIG_IGN);
+        makeJobs();
+
+        size_t numWorkers = m_settings.m_numWorkers + m_settings.m_numRemoteWorkers;
+        unsigned short port = 0;
+        int listenFd = listenOn(m_settings.m_listenAddress, (int)numWorkers, port);
+        if (listenFd < 0)
+        {
+            std::cerr << "cannot listen on " << m_settings.m_listenAddress << ": "
+                      << std::strerror(errno) << std::endl;
+            return false;
+        }
+        if (m_settings.m_numRemoteWorkers > 0 || m_settings.m_verbose)
+        {
+            std::cerr << "coordinator listening on port " << port << std::endl;
+        }
+
+        // Local workers share the scene through fork's copy of memory
+        std::vector<pid_t> children;
+        for (size_t i = 0; i < m_settings.m_numWorkers; ++i)
+        {
+            pid_t pid = fork();
+            if (pid == 0)
+            {
+                close(listenFd);
+                std::string host, unused;
+                splitAddress(m_settings.m_listenAddress, host, unused);
+                std::ostringstream address;
+                address << (host.empty() || host == "0.0.0.0" ? "127.0.0.1" : host) << ":" << port;
+                int fd = connectTo(address.str());
+                _exit(fd < 0 ? 1 : runWorker(fd, m_masterSet, m_lights, m_camera, m_settings));
+            }
+            if (pid > 0)
+            {
+                children.push_back(pid);
+            }
+        }
+
+        acceptWorkers(listenFd, numWorkers, children);
+        close(listenFd);
+
+        bool ok = !m_workers.empty();
+        if (!ok)
+        {
+            std::cerr << "no worker connected" << std::endl;
+        }
+        else if (m_workers.size() < numWorkers)
+        {
+            std::cerr << "starting with " << m_workers.size() << " of " << numWorkers
+                      << " workers" << std::endl;
+        }
+        ok = ok && dispatch(film);
+
+        for (size_t i = 0; i < m_workers.size(); ++i)
+        {
+            if (m_workers[i].m_fd >= 0)
+            {
+                unsigned int quit = kMessageQuit;
+                writeAll(m_workers[i].m_fd, &quit, sizeof(quit));
+                close(m_workers[i].m_fd);
+            }
+        }
+        for (size_t i = 0; i < children.size(); ++i)
+        {
+            waitpid(children[i], NULL, 0);
+        }
+        return ok;
+    }
+
+protected:
+    struct Worker
+    {
+        int m_fd;
+        std::deque<RenderJob> m_inFlight;
+
+        explicit Worker(int fd) : m_fd(fd) { }
+    };
+
+    // Accepts connections on listenFd until numWorkers have been made,
+    // the worker timeout passes or no more can come: a forked worker that
+    // exits before then (reaped here and taken off children) is not
+    // waited for. Workers that fail the handshake are dropped.
+    void acceptWorkers(int listenFd, size_t numWorkers, std::vector<pid_t>& children)
+    {
+        const double deadline = omp_get_wtime() + m_settings.m_workerTimeout;
+        size_t numConnections = 0, numLost = 0;
+        while (numConnections + numLost < numWorkers)
+        {
+            for (size_t i = 0; i < children.size();)
+            {
+                if (waitpid(children[i], NULL, WNOHANG) == children[i])
+                {
+                    children.erase(children.begin() + i);
+                    ++numLost;
+                }
+                else
+                {
+                    ++i;
+                }
+            }
+            double remaining = deadline - omp_get_wtime();
+            if (numConnections + numLost >= numWorkers || remaining <= 0.0)
+            {
+                break;
+            }
+
+            // Wake up now and then to reap the children
+            pollfd listening = { listenFd, POLLIN, 0 };
+            int ready = poll(&listening, 1, (int)std::min(remaining * 1000.0 + 1.0, 100.0));
+            if (ready < 0 && errno != EINTR)
+            {
+                break;
+            }
+            if (ready <= 0)
+            {
+                continue;
+            }
+            int fd = accept(listenFd, NULL, NULL);
+            if (fd < 0)
+            {
+                continue;
+            }
+            ++numConnections;
+            unsigned int hello[2];
+            if (!readAll(fd, hello, sizeof(hello)) ||
+                hello[0] != kProtocolMagic || hello[1] != kProtocolVersion)
+            {
+                std::cerr << "worker handshake failed" << std::endl;
+                close(fd);
+                continue;
+            }
+            m_workers.push_back(Worker(fd));
+        }
+    }
+
+    void makeJobs()
+    {
+        const size_t width = m_settings.m_width;
+        const size_t height = m_settings.m_height;
+        const size_t spp = m_settings.m_numPixelSamples;
+        m_pending.clear();
+
+        if (m_settings.m_partition == "samples")
+        {
+            // Whole-frame jobs over sample ranges, a few per worker
+            size_t numWorkers = std::max<size_t>(1, m_settings.m_numWorkers + m_settings.m_numRemoteWorkers);
+            size_t chunk = std::max<size_t>(1, spp / (numWorkers * 4));
+            for (size_t s0 = 0; s0 < spp; s0 += chunk)
+            {
+                RenderJob job = { (unsigned int)m_pending.size(),
+                                  0, 0, (unsigned int)width, (unsigned int)height,
+                                  (unsigned int)s0, (unsigned int)std::min(s0 + chunk, spp) };
+                m_pending.push_back(job);
+            }
+        }
+        else
+        {
+            const size_t tileSize = m_settings.m_tileSize;
+            for (size_t y0 = 0; y0 < height; y0 += tileSize)
+            {
+                for (size_t x0 = 0; x0 < width; x0 += tileSize)
+                {
+                    RenderJob job = { (unsigned int)m_pending.size(),
+                                      (unsigned int)x0, (unsigned int)y0,
+                                      (unsigned int)std::min(x0 + tileSize, width),
+                                      (unsigned int)std::min(y0 + tileSize, height),
+                                      0, (unsigned int)spp };
+                    m_pending.push_back(job);
+                }
+            }
+        }
+    }
+
+    bool sendJob(Worker& worker)
+    {
+        RenderJob job = m_pending.front();
+        unsigned int type = kMessageJob;
+        if (!writeAll(worker.m_fd, &type, sizeof(type)) ||
+            !writeAll(worker.m_fd, &job, sizeof(job)))
+        {
+            return false;
+        }
+        m_pending.pop_front();
+        worker.m_inFlight.push_back(job);
+        return true;
+    }
+
+    // A worker went away: give its jobs to the others
+    void dropWorker(Worker& worker)
+    {
+        std::cerr << "lost a worker, requeueing " << worker.m_inFlight.size() << " job(s)" << std::endl;
+        close(worker.m_fd);
+        worker.m_fd = -1;
+        m_pending.insert(m_pending.begin(), worker.m_inFlight.begin(), worker.m_inFlight.end());
+        worker.m_inFlight.clear();
+    }
+
+    bool dispatch(Film& film)
+    {
+        size_t remaining = m_pending.size();
+        MemoryArena arena;
+        FilmTile buffer;
+        std::vector<pollfd> fds;
+        std::vector<size_t> fdWorker;
+
+        while (remaining > 0)
+        {
+            // Keep every live worker busy
+            fds.clear();
+            fdWorker.clear();
+            for (size_t i = 0; i < m_workers.size(); ++i)
+            {
+                Worker& worker = m_workers[i];
+                while (worker.m_fd >= 0 && !m_pending.empty() &&
+                       worker.m_inFlight.size() < kJobsInFlightPerWorker)
+                {
+                    if (!sendJob(worker))
+                    {
+                        dropWorker(worker);
+                    }
+                }
+                if (worker.m_fd >= 0 && !worker.m_inFlight.empty())
+                {
+                    pollfd p = { worker.m_fd, POLLIN, 0 };
+                    fds.push_back(p);
+                    fdWorker.push_back(i);
+                }
+            }
+            if (fds.empty())
+            {
+                std::cerr << "no workers left with " << remaining << " job(s) to go" << std::endl;
+                return false;
+            }
+
+            if (poll(&fds[0], fds.size(), -1) < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return false;
+            }
+
+            for (size_t k = 0; k < fds.size(); ++k)
+            {
+                if (!(fds[k].revents & (POLLIN | POLLHUP | POLLERR)))
+                {
+                    continue;
+                }
+                Worker& worker = m_workers[fdWorker[k]];
+                RenderJob job = worker.m_inFlight.front();
+                unsigned int id;
+                arena.reset();
+                buffer.reserve(arena, jobBufferSize(job, film.filter()));
+                buffer.setRect(film.filter(), job.m_x0, job.m_y0, job.m_x1, job.m_y1,
+                               film.tileAt(job.m_x0, job.m_y0, job.m_x1, job.m_y1));
+                if (!readAll(worker.m_fd, &id, sizeof(id)) || id != job.m_id ||
+                    !readAll(worker.m_fd, buffer.m_sum, buffer.size() * sizeof(Color)) ||
+                    !readAll(worker.m_fd, buffer.m_weight, buffer.size() * sizeof(float)))
+                {
+                    dropWorker(worker);
+                    continue;
+                }
+                worker.m_inFlight.pop_front();
+                film.mergeTile(buffer);
+                --remaining;
+            }
+        }
+        return true;
+    }
+
+    ShapeSet& m_masterSet;
+    const std::vector<Light*>& m_lights;
+    Camera m_camera;
+    const RenderSettings& m_settings;
+    std::deque<RenderJob> m_pending;
+    std::vector<Worker> m_workers;
+};
+
+}//namespace Tracer
+
+#endif
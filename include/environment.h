@@ -0,0 +1,357 @@
+#ifndef __ENVIRONMENT_H__
+#define __ENVIRONMENT_H__
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+#include "util.h"
+#include "shape.h"
+#include "light_source.h"
+
+namespace Tracer
+{
+
+//
+// Environment lighting: radiance arriving from infinitely far away, as a
+// constant color, an analytic sky or a lat-long (equirectangular) image.
+//
+// Rays that leave the scene pick it up through Light::radiance(). For
+// direct lighting the environment is a Light like any other: samplePoint()
+// picks a direction, importance sampled from a piecewise-constant 2D
+// distribution over the lat-long square proportional to luminance times
+// sin(theta), and returns a point far away in that direction, so the
+// shadow ray is an ordinary one. sampledPower() turns the sample into the
+// power Material::getColor() expects, L / (pi * pdf), so a uniform white
+// environment lights an upward-facing surface like a unit light overhead.
+//
+// Lat-long coordinates: u runs around the y axis with u = 0.5 looking
+// down -z (the default camera's view), v from the zenith (0) to the
+// nadir (1).
+//
+
+enum EnvironmentType
+{
+    kEnvironmentConstant,
+    kEnvironmentSky,
+    kEnvironmentImage
+};
+
+// Grid the analytic environments are tabulated on for sampling, and the
+// samples per cell along each axis
+const size_t kEnvironmentTableWidth = 512;
+const size_t kEnvironmentTableHeight = 256;
+const size_t kEnvironmentSupersampling = 4;
+// Every cell keeps at least this fraction of the mean density, so a cell
+// the table underestimates (a sliver of sun) can still be sampled
+const float kEnvironmentPdfFloor = 0.01f;
+// Distance of the points samplePoint() returns
+const float kEnvironmentDistance = 1.0e6f;
+
+
+//
+// Piecewise-constant density over [0, 1)^2 on a width x height grid,
+// sampled by inverting the CDF of the rows (the marginal) and then the
+// CDF within the chosen row (the conditional).
+//
+class Distribution2D
+{
+public:
+    Distribution2D() : m_width(0), m_height(0), m_mean(0.0f) { }
+
+    // func: row-major, non-negative, not all zero
+    void build(const std::vector<float>& func, size_t width, size_t height)
+    {
+        m_width = width;
+        m_height = height;
+        m_func = func;
+        m_conditionalCdf.assign(height * (width + 1), 0.0f);
+        m_marginalCdf.assign(height + 1, 0.0f);
+
+        for (size_t y = 0; y < height; ++y)
+        {
+            float* cdf = &m_conditionalCdf[y * (width + 1)];
+            for (size_t x = 0; x < width; ++x)
+            {
+                cdf[x + 1] = cdf[x] + m_func[y * width + x];
+            }
+            float rowSum = cdf[width];
+            m_marginalCdf[y + 1] = m_marginalCdf[y] + rowSum;
+            for (size_t x = 1; x <= width; ++x)
+            {
+                cdf[x] = rowSum > 0.0f ? cdf[x] / rowSum : float(x) / float(width);
+            }
+        }
+        float total = m_marginalCdf[height];
+        m_mean = total / float(width * height);
+        for (size_t y = 1; y <= height; ++y)
+        {
+            m_marginalCdf[y] /= total;
+        }
+    }
+
+    // Point (u, v) for the uniform numbers (u1, u2), and its density
+    void sample(float u1, float u2, float& u, float& v, float& pdf) const
+    {
+        float dy;
+        size_t y = invert(&m_marginalCdf[0], m_height, u1, dy);
+        float dx;
+        size_t x = invert(&m_conditionalCdf[y * (m_width + 1)], m_width, u2, dx);
+        u = (float(x) + dx) / float(m_width);
+        v = (float(y) + dy) / float(m_height);
+        pdf = m_func[y * m_width + x] / m_mean;
+    }
+
+    float pdf(float u, float v) const
+    {
+        size_t x = std::min(size_t(std::max(u, 0.0f) * float(m_width)), m_width - 1);
+        size_t y = std::min(size_t(std::max(v, 0.0f) * float(m_height)), m_height - 1);
+        return m_func[y * m_width + x] / m_mean;
+    }
+
+protected:
+    // Cell of a CDF (count + 1 entries from 0 to 1) holding xi, and where
+    // in it xi falls
+    static size_t invert(const float* cdf, size_t count, float xi, float& offset)
+    {
+        size_t i = size_t(std::upper_bound(cdf, cdf + count + 1, xi) - cdf);
+        i = std::min(std::max(i, size_t(1)), count) - 1;
+        // Skip empty cells the search may land on
+        while (i + 1 < count && cdf[i + 1] <= cdf[i])
+        {
+            ++i;
+        }
+        float width = cdf[i + 1] - cdf[i];
+        offset = width > 0.0f ? std::min((xi - cdf[i]) / width, 0.99999994f) : 0.5f;
+        return i;
+    }
+
+    size_t m_width, m_height;
+    std::vector<float> m_func;
+    std::vector<float> m_conditionalCdf;
+    std::vector<float> m_marginalCdf;
+    float m_mean;
+};
+
+
+//
+// Analytic sky: a gradient from the horizon to the zenith over the upper
+// hemisphere, flat ground below, and an optional sun disk.
+//
+struct SkyModel
+{
+    Color m_zenith;
+    Color m_horizon;
+    Color m_ground;
+    // Unit vector towards the sun
+    Vector m_sunDirection;
+    // Radiance of the disk; black for no sun
+    Color m_sun;
+    // Angular radius in degrees
+    float m_sunAngle;
+
+    SkyModel()
+        : m_zenith(0.25f, 0.45f, 0.9f),
+          m_horizon(0.8f, 0.85f, 0.9f),
+          m_ground(0.3f, 0.28f, 0.25f),
+          m_sunDirection(0.0f, 1.0f, 0.0f),
+          m_sun(),
+          m_sunAngle(1.0f)
+    {
+
+    }
+
+    Color evaluate(const Vector& direction) const
+    {
+        Color sky;
+        if (direction.m_y < 0.0f)
+        {
+            sky = m_ground;
+        }
+        else
+        {
+            float t = std::sqrt(direction.m_y);
+            sky = (1.0f - t) * m_horizon + t * m_zenith;
+        }
+        if (dot(direction, m_sunDirection) >= std::cos(m_sunAngle * float(M_PI) / 180.0f))
+        {
+            sky += m_sun;
+        }
+        return sky;
+    }
+};
+
+
+class EnvironmentLight : public Light
+{
+public:
+    EnvironmentLight(const Color& color, float power)
+        : Light(color, power), m_type(kEnvironmentConstant), m_width(0), m_height(0)
+    {
+        init(0.0f);
+    }
+
+    EnvironmentLight(const SkyModel& sky, float power)
+        : Light(Color(1.0f, 1.0f, 1.0f), power), m_type(kEnvironmentSky), m_sky(sky),
+          m_width(0), m_height(0)
+    {
+        init(0.0f);
+    }
+
+    // texels: row-major lat-long image of linear radiance; rotation turns
+    // it about the y axis, in degrees
+    EnvironmentLight(const std::vector<Color>& texels, size_t width, size_t height,
+                     float power, float rotation = 0.0f)
+        : Light(Color(1.0f, 1.0f, 1.0f), power), m_type(kEnvironmentImage),
+          m_texels(texels), m_width(width), m_height(height)
+    {
+        init(rotation);
+    }
+
+    virtual ~EnvironmentLight() { }
+
+    // Never hit: rays that miss everything see it through radiance()
+    virtual bool intersect(Intersection&) { return false; }
+
+    virtual bool samplePoint(Rng& rng,
+                             const Point& position,
+                             Point& lightPosition,
+                             Vector& lightNormal)
+    {
+        float u, v, pdf;
+        m_distribution.sample(rng.nextFloat(), rng.nextFloat(), u, v, pdf);
+        Vector direction = toDirection(u, v);
+        lightPosition = position + direction * kEnvironmentDistance;
+        lightNormal = direction * -1.0f;
+        return true;
+    }
+
+    virtual Color sampledPower(const Point& position, const Point& lightPosition) const
+    {
+        Vector direction = (lightPosition - position).normalized();
+        float p = pdf(direction);
+        return p > 0.0f ? radiance(direction) / (float(M_PI) * p) : Color();
+    }
+
+    virtual float sampleDensity(const Point& position, const Point& lightPosition) const
+    {
+        return pdf((lightPosition - position).normalized());
+    }
+
+    virtual Color radiance(const Vector& direction) const
+    {
+        switch (m_type)
+        {
+        case kEnvironmentSky:
+            return m_sky.evaluate(direction) * m_power;
+        case kEnvironmentImage:
+        {
+            float u, v;
+            toLatLong(direction, u, v);
+            size_t x = std::min(size_t(u * float(m_width)), m_width - 1);
+            size_t y = std::min(size_t(v * float(m_height)), m_height - 1);
+            return m_texels[y * m_width + x] * m_power;
+        }
+        default:
+            return m_color * m_power;
+        }
+    }
+
+    // Density of samplePoint()'s directions, per unit solid angle
+    float pdf(const Vector& direction) const
+    {
+        float u, v;
+        toLatLong(direction, u, v);
+        float sinTheta = std::sin(v * float(M_PI));
+        return sinTheta > 0.0f
+               ? m_distribution.pdf(u, v) / (2.0f * float(M_PI) * float(M_PI) * sinTheta)
+               : 0.0f;
+    }
+
+    EnvironmentType type() const { return m_type; }
+    const Color& color() const { return m_color; }
+    const SkyModel& sky() const { return m_sky; }
+    const std::vector<Color>& texels() const { return m_texels; }
+    size_t width() const { return m_width; }
+    size_t height() const { return m_height; }
+    float rotation() const { return m_rotation; }
+
+protected:
+    void init(float rotation)
+    {
+        m_shapeType = "EnvironmentLight";
+        m_rotation = rotation;
+        m_rotationU = rotation / 360.0f;
+
+        // Images are sampled by their own texels, analytic environments by
+        // a supersampled table
+        bool image = m_type == kEnvironmentImage;
+        size_t width = image ? m_width : kEnvironmentTableWidth;
+        size_t height = image ? m_height : kEnvironmentTableHeight;
+        size_t n = image ? 1 : kEnvironmentSupersampling;
+        std::vector<float> func(width * height);
+        double sum = 0.0;
+        for (size_t y = 0; y < height; ++y)
+        {
+            float sinTheta = std::sin((float(y) + 0.5f) / float(height) * float(M_PI));
+            for (size_t x = 0; x < width; ++x)
+            {
+                float value = 0.0f;
+                if (image)
+                {
+                    value = luminance(m_texels[y * width + x]);
+                }
+                else
+                {
+                    for (size_t j = 0; j < n; ++j)
+                    {
+                        for (size_t i = 0; i < n; ++i)
+                        {
+                            Vector d = toDirection((float(x) + (float(i) + 0.5f) / float(n)) / float(width),
+                                                   (float(y) + (float(j) + 0.5f) / float(n)) / float(height));
+                            value += luminance(radiance(d));
+                        }
+                    }
+                    value /= float(n * n);
+                }
+                func[y * width + x] = std::max(value, 0.0f) * sinTheta;
+                sum += func[y * width + x];
+            }
+        }
+        float floor = sum > 0.0 ? kEnvironmentPdfFloor * float(sum / double(width * height)) : 1.0f;
+        for (size_t i = 0; i < func.size(); ++i)
+        {
+            func[i] = std::max(func[i], floor);
+        }
+        m_distribution.build(func, width, height);
+    }
+
+    Vector toDirection(float u, float v) const
+    {
+        float phi = 2.0f * float(M_PI) * (u + m_rotationU - 0.5f);
+        float theta = float(M_PI) * v;
+        float sinTheta = std::sin(theta);
+        return Vector(sinTheta * std::sin(phi), std::cos(theta), -sinTheta * std::cos(phi));
+    }
+
+    void toLatLong(const Vector& direction, float& u, float& v) const
+    {
+        float phi = std::atan2(direction.m_x, -direction.m_z);
+        u = phi / (2.0f * float(M_PI)) + 0.5f - m_rotationU;
+        u -= std::floor(u);
+        v = std::acos(std::max(-1.0f, std::min(1.0f, direction.m_y))) / float(M_PI);
+    }
+
+    EnvironmentType m_type;
+    SkyModel m_sky;
+    std::vector<Color> m_texels;
+    size_t m_width, m_height;
+    // Degrees, and as a fraction of a turn in u
+    float m_rotation;
+    float m_rotationU;
+    Distribution2D m_distribution;
+};
+
+}//namespace Tracer
+
+#endif
@@ -0,0 +1,424 @@
+#ifndef __FILM_H__
+#define __FILM_H__
+
+#include <cmath>
+#include <string>
+#include <vector>
+#include "util.h"
+#include "arena.h"
+#include "numa.h"
+#include "settings.h"
+
+namespace Tracer
+{
+
+//
+// Film: reconstruction of the image from its samples.
+//
+// A sample at offset (dx, dy) in [0, 1)^2 within pixel (x, y) is splatted
+// into every pixel whose centre lies within the filter's radius, weighted
+// by the (separable) filter, and a pixel resolves to its weighted sum
+// divided by its summed weights. The box filter of radius 0.5 puts each sample in the
+// pixel it fell in with weight 1, which is the plain per-pixel mean.
+//
+// Splats reach up to padding() pixels past the pixel they fell in, so a
+// tile's samples land in a border around the tile too. Renderers splat
+// into a FilmTile, a tile-local buffer with that border (usually from the
+// thread's frame arena), and merge it into the film when the tile is done.
+// The film stores every tile with its own border, so merging a tile only
+// ever touches that tile's storage: tiles can be merged concurrently with
+// no atomics and no cache lines shared between threads, and resolve()
+// gathers each pixel from its tile and the borders of the neighbours that
+// overlap it.
+//
+
+enum FilterType
+{
+    kFilterBox,
+    kFilterTent,
+    kFilterGaussian,
+    kFilterMitchell
+};
+
+// Entries of a filter's table over [0, radius]
+const size_t kFilterTableSize = 64;
+const float kMaxFilterRadius = 4.0f;
+// Most pixels a footprint can cover along one axis
+const size_t kMaxFilterFootprint = 2 * size_t(kMaxFilterRadius) + 2;
+// FilmTile::m_tile of a buffer that is not one of the film's tiles
+const size_t kNoTile = size_t(-1);
+
+
+class Filter
+{
+public:
+    // A radius of 0 picks the filter's default
+    Filter(FilterType type = kFilterBox, float radius = 0.0f)
+        : m_type(type)
+    {
+        const float defaults[] = { 0.5f, 1.0f, 1.5f, 2.0f };
+        m_radius = radius > 0.0f ? std::min(radius, kMaxFilterRadius) : defaults[type];
+        m_invRadius = 1.0f / m_radius;
+        m_padding = size_t(std::ceil(m_radius + 0.5f)) - 1;
+
+        // Sampled at the middle of each table entry's interval
+        for (size_t i = 0; i < kFilterTableSize; ++i)
+        {
+            m_table[i] = profile((float(i) + 0.5f) / float(kFilterTableSize));
+        }
+    }
+
+    static bool parseType(const std::string& name, FilterType& type)
+    {
+        if      (name == "box")      type = kFilterBox;
+        else if (name == "tent")     type = kFilterTent;
+        else if (name == "gaussian") type = kFilterGaussian;
+        else if (name == "mitchell") type = kFilterMitchell;
+        else                         return false;
+        return true;
+    }
+
+    FilterType type() const { return m_type; }
+    float radius() const { return m_radius; }
+
+    // Pixels a splat can reach past the pixel its sample fell in
+    size_t padding() const { return m_padding; }
+
+    // Filter value at offset d (at most the radius) along one axis, by
+    // table lookup
+    float evaluate(float d) const
+    {
+        size_t i = size_t(std::fabs(d) * m_invRadius * float(kFilterTableSize));
+        return m_table[std::min(i, kFilterTableSize - 1)];
+    }
+
+    // Pixels along one axis covered by a sample at offset in [0, 1) within
+    // its pixel: the first one, relative to the sample's pixel, and the
+    // filter weight of each of the returned number of pixels from it, in
+    // weights (kMaxFilterFootprint entries). Working relative to the pixel
+    // keeps large image coordinates from rounding samples into the next one.
+    size_t footprint(float offset, int& first, float* weights) const
+    {
+        // Offsets are taken to pixel centres; a centre at exactly
+        // -radius is left out so a box splat covers a single pixel
+        float center = offset - 0.5f;
+        first = int(std::floor(center - m_radius)) + 1;
+        int last = int(std::floor(center + m_radius));
+        size_t count = 0;
+        for (int q = first; q <= last; ++q)
+        {
+            weights[count++] = evaluate(float(q) - center);
+        }
+        return count;
+    }
+
+protected:
+    // Filter value at |d| = x * radius, x in [0, 1]
+    float profile(float x) const
+    {
+        switch (m_type)
+        {
+        case kFilterTent:
+            return 1.0f - x;
+        case kFilterGaussian:
+        {
+            // Shifted to reach 0 at the radius
+            const float alpha = 2.0f;
+            float r2 = m_radius * m_radius;
+            return std::exp(-alpha * x * x * r2) - std::exp(-alpha * r2);
+        }
+        case kFilterMitchell:
+        {
+            // Mitchell-Netravali with B = C = 1/3, over [0, 2]
+            const float B = 1.0f / 3.0f, C = 1.0f / 3.0f;
+            float t = 2.0f * x;
+            if (t > 1.0f)
+            {
+                return ((-B - 6.0f * C) * t * t * t + (6.0f * B + 30.0f * C) * t * t +
+                        (-12.0f * B - 48.0f * C) * t + (8.0f * B + 24.0f * C)) / 6.0f;
+            }
+            return ((12.0f - 9.0f * B - 6.0f * C) * t * t * t +
+                    (-18.0f + 12.0f * B + 6.0f * C) * t * t + (6.0f - 2.0f * B)) / 6.0f;
+        }
+        default:
+            return 1.0f;
+        }
+    }
+
+    FilterType m_type;
+    float m_radius;
+    float m_invRadius;
+    size_t m_padding;
+    float m_table[kFilterTableSize];
+};
+
+
+// The filter picked by settings (validated when they were parsed)
+inline Filter makeFilter(const RenderSettings& settings)
+{
+    FilterType type = kFilterBox;
+    Filter::parseType(settings.m_filter, type);
+    return Filter(type, float(settings.m_filterRadius));
+}
+
+
+//
+// Weighted sums and weights of the pixels of a rectangle plus the filter's
+// border, row-major; the storage comes from an arena and is reused for
+// every rectangle that fits in it.
+//
+struct FilmTile
+{
+    // Index of the film tile this buffer holds, or kNoTile
+    size_t m_tile;
+    // Padded rectangle; the origin may be outside the image
+    int m_x0, m_y0;
+    size_t m_width, m_height;
+    Color* m_sum;
+    float* m_weight;
+    size_t m_capacity;
+    const Filter* m_pFilter;
+
+    FilmTile() : m_tile(kNoTile), m_x0(0), m_y0(0), m_width(0), m_height(0),
+                 m_sum(NULL), m_weight(NULL), m_capacity(0), m_pFilter(NULL) { }
+
+    void reserve(MemoryArena& arena, size_t capacity)
+    {
+        m_sum = arena.allocArray<Color>(capacity);
+        m_weight = arena.allocArray<float>(capacity);
+        m_capacity = capacity;
+    }
+
+    // Clears the buffer for pixels [x0, x1) x [y0, y1) and their border
+    // under filter; the buffer must have room for them
+    void setRect(const Filter& filter, size_t x0, size_t y0, size_t x1, size_t y1,
+                 size_t tile = kNoTile)
+    {
+        size_t padding = filter.padding();
+        m_pFilter = &filter;
+        m_tile = tile;
+        m_x0 = int(x0) - int(padding);
+        m_y0 = int(y0) - int(padding);
+        m_width = x1 - x0 + 2 * padding;
+        m_height = y1 - y0 + 2 * padding;
+        for (size_t i = 0; i < size(); ++i)
+        {
+            m_sum[i] = Color();
+            m_weight[i] = 0.0f;
+        }
+    }
+
+    size_t size() const { return m_width * m_height; }
+
+    // Splats color at offset (dx, dy) within pixel (x, y), which must be
+    // inside the unpadded rectangle
+    void addSample(size_t x, size_t y, float dx, float dy, const Color& color)
+    {
+        float wx[kMaxFilterFootprint], wy[kMaxFilterFootprint];
+        int fx, fy;
+        size_t nx = m_pFilter->footprint(dx, fx, wx);
+        size_t ny = m_pFilter->footprint(dy, fy, wy);
+        size_t base = size_t(int(y) + fy - m_y0) * m_width + size_t(int(x) + fx - m_x0);
+        for (size_t j = 0; j < ny; ++j)
+        {
+            for (size_t i = 0; i < nx; ++i)
+            {
+                float w = wx[i] * wy[j];
+                m_sum[base + j * m_width + i] += color * w;
+                m_weight[base + j * m_width + i] += w;
+            }
+        }
+    }
+};
+
+
+class Film
+{
+public:
+    Film(size_t width = 0, size_t height = 0, size_t tileSize = 32, const Filter& filter = Filter())
+    {
+        reset(width, height, tileSize, filter);
+    }
+
+    void reset(size_t width, size_t height, size_t tileSize, const Filter& filter)
+    {
+        m_width = width;
+        m_height = height;
+        m_tileSize = tileSize;
+        m_filter = filter;
+        m_padding = filter.padding();
+        m_tileStride = tileSize + 2 * m_padding;
+        m_tilesX = (width + tileSize - 1) / tileSize;
+        m_tilesY = (height + tileSize - 1) / tileSize;
+        m_sum.assign(numTiles() * tileArea(), Color());
+        m_weight.assign(numTiles() * tileArea(), 0.0f);
+    }
+
+    size_t width() const { return m_width; }
+    size_t height() const { return m_height; }
+    size_t tileSize() const { return m_tileSize; }
+    size_t tilesX() const { return m_tilesX; }
+    size_t tilesY() const { return m_tilesY; }
+    size_t numTiles() const { return m_tilesX * m_tilesY; }
+    const Filter& filter() const { return m_filter; }
+
+    // Elements of a FilmTile big enough for any tile
+    size_t tileArea() const { return m_tileStride * m_tileStride; }
+
+    // Pixels [x0, x1) x [y0, y1) of tile
+    void tileBounds(size_t tile, size_t& x0, size_t& y0, size_t& x1, size_t& y1) const
+    {
+        x0 = (tile % m_tilesX) * m_tileSize;
+        y0 = (tile / m_tilesX) * m_tileSize;
+        x1 = std::min(x0 + m_tileSize, m_width);
+        y1 = std::min(y0 + m_tileSize, m_height);
+    }
+
+    // Index of the tile whose pixels are exactly [x0, x1) x [y0, y1), or
+    // kNoTile
+    size_t tileAt(size_t x0, size_t y0, size_t x1, size_t y1) const
+    {
+        if (x0 % m_tileSize != 0 || y0 % m_tileSize != 0 || x0 >= m_width || y0 >= m_height)
+        {
+            return kNoTile;
+        }
+        size_t tile = (y0 / m_tileSize) * m_tilesX + x0 / m_tileSize;
+        size_t tx0, ty0, tx1, ty1;
+        tileBounds(tile, tx0, ty0, tx1, ty1);
+        return (tx1 == x1 && ty1 == y1) ? tile : kNoTile;
+    }
+
+    // Adds buffer to the film. A buffer holding one of the film's tiles
+    // only touches that tile's storage, so different tiles can be merged
+    // concurrently; any other buffer must be merged by one thread at a time.
+    void mergeTile(const FilmTile& buffer)
+    {
+        if (buffer.m_tile != kNoTile)
+        {
+            Color* sum = &m_sum[buffer.m_tile * tileArea()];
+            float* weight = &m_weight[buffer.m_tile * tileArea()];
+            for (size_t j = 0; j < buffer.m_height; ++j)
+            {
+                for (size_t i = 0; i < buffer.m_width; ++i)
+                {
+                    sum[j * m_tileStride + i] += buffer.m_sum[j * buffer.m_width + i];
+                    weight[j * m_tileStride + i] += buffer.m_weight[j * buffer.m_width + i];
+                }
+            }
+            return;
+        }
+
+        for (size_t j = 0; j < buffer.m_height; ++j)
+        {
+            int y = buffer.m_y0 + int(j);
+            for (size_t i = 0; i < buffer.m_width; ++i)
+            {
+                int x = buffer.m_x0 + int(i);
+                if (x >= 0 && y >= 0 && size_t(x) < m_width && size_t(y) < m_height)
+                {
+                    size_t k = pixelSlot(size_t(x), size_t(y));
+                    m_sum[k] += buffer.m_sum[j * buffer.m_width + i];
+                    m_weight[k] += buffer.m_weight[j * buffer.m_width + i];
+                }
+            }
+        }
+    }
+
+    // Splats color at offset (dx, dy) within pixel (x, y) straight into
+    // the film; concurrent calls must have footprints that do not overlap
+    void addSample(size_t x, size_t y, float dx, float dy, const Color& color)
+    {
+        float wx[kMaxFilterFootprint], wy[kMaxFilterFootprint];
+        int fx, fy;
+        size_t nx = m_filter.footprint(dx, fx, wx);
+        size_t ny = m_filter.footprint(dy, fy, wy);
+        for (size_t j = 0; j < ny; ++j)
+        {
+            int qy = int(y) + fy + int(j);
+            if (qy < 0 || size_t(qy) >= m_height)
+            {
+                continue;
+            }
+            for (size_t i = 0; i < nx; ++i)
+            {
+                int qx = int(x) + fx + int(i);
+                if (qx >= 0 && size_t(qx) < m_width)
+                {
+                    float w = wx[i] * wy[j];
+                    size_t k = pixelSlot(size_t(qx), size_t(qy));
+                    m_sum[k] += color * w;
+                    m_weight[k] += w;
+                }
+            }
+        }
+    }
+
+    // Filtered value of each pixel (black where nothing landed yet)
+    void resolve(std::vector<Color>& image) const
+    {
+        image.resize(m_width * m_height);
+        const int padding = int(m_padding);
+        const int tileSize = int(m_tileSize);
+
+        #pragma omp parallel for schedule(dynamic, 4)
+        for (size_t y = 0; y < m_height; ++y)
+        {
+            // Tile rows whose padded rows include y
+            size_t ty0 = size_t(std::max(int(y) - padding, 0) / tileSize);
+            size_t ty1 = std::min(size_t((int(y) + padding) / tileSize), m_tilesY - 1);
+            for (size_t x = 0; x < m_width; ++x)
+            {
+                size_t tx0 = size_t(std::max(int(x) - padding, 0) / tileSize);
+                size_t tx1 = std::min(size_t((int(x) + padding) / tileSize), m_tilesX - 1);
+                Color sum;
+                float weight = 0.0f;
+                for (size_t ty = ty0; ty <= ty1; ++ty)
+                {
+                    size_t ly = y + m_padding - ty * m_tileSize;
+                    for (size_t tx = tx0; tx <= tx1; ++tx)
+                    {
+                        size_t lx = x + m_padding - tx * m_tileSize;
+                        size_t k = (ty * m_tilesX + tx) * tileArea() + ly * m_tileStride + lx;
+                        sum += m_sum[k];
+                        weight += m_weight[k];
+                    }
+                }
+                image[y * m_width + x] = weight > 0.0f ? sum / weight : Color();
+            }
+        }
+    }
+
+    // Moves the storage of tiles [first, end) to a NUMA node (pages
+    // straddling a neighbouring tile range stay where they are)
+    void bindTiles(size_t first, size_t end, int node)
+    {
+        if (end > first)
+        {
+            bindMemoryToNode(&m_sum[first * tileArea()], (end - first) * tileArea() * sizeof(Color), node);
+            bindMemoryToNode(&m_weight[first * tileArea()], (end - first) * tileArea() * sizeof(float), node);
+        }
+    }
+
+protected:
+    // Where an in-image pixel is kept in its own tile
+    size_t pixelSlot(size_t x, size_t y) const
+    {
+        size_t tile = (y / m_tileSize) * m_tilesX + x / m_tileSize;
+        return tile * tileArea() + (y % m_tileSize + m_padding) * m_tileStride +
+               x % m_tileSize + m_padding;
+    }
+
+    size_t m_width, m_height;
+    size_t m_tileSize;
+    Filter m_filter;
+    size_t m_padding;
+    // Row length of a tile's storage: the tile plus its border
+    size_t m_tileStride;
+    size_t m_tilesX, m_tilesY;
+    std::vector<Color> m_sum;
+    std::vector<float> m_weight;
+};
+
+}//namespace Tracer
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef __IMAGE_IO_H__
+#define __IMAGE_IO_H__
+
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "util.h"
+
+namespace Tracer
+{
+
+// Writes a row-major width x height image of 0..1 colors as 8-bit RGB
+inline bool writeImage(const std::string& path,
+                       const std::vector<Color>& pixels,
+                       size_t width,
+                       size_t height)
+{
+    cv::Mat resMat(height, width, CV_8UC3, cv::Scalar(0, 0, 0));
+    for (size_t y = 0; y < height; ++y)
+    {
+        for (size_t x = 0; x < width; ++x)
+        {
+            Color c = pixels[y * width + x];
+            c.clamp();
+            resMat.at<cv::Vec3b>(y,x)[0] = (unsigned char)(c.m_b * 255.0f);
+            resMat.at<cv::Vec3b>(y,x)[1] = (unsigned char)(c.m_g * 255.0f);
+            resMat.at<cv::Vec3b>(y,x)[2] = (unsigned char)(c.m_r * 255.0f);
+        }
+    }
+    return imwrite(path, resMat);
+}
+
+
+// Reads an image as row-major linear colors: float formats (Radiance .hdr,
+// OpenEXR, PFM) as stored, 8 and 16-bit ones scaled to 0..1
+inline bool readImage(const std::string& path,
+                      std::vector<Color>& pixels,
+                      size_t& width,
+                      size_t& height)
+{
+    cv::Mat mat = cv::imread(path, cv::IMREAD_COLOR | cv::IMREAD_ANYDEPTH);
+    if (mat.empty())
+    {
+        return false;
+    }
+    double scale = mat.depth() == CV_8U ? 1.0 / 255.0 :
+                   mat.depth() == CV_16U ? 1.0 / 65535.0 : 1.0;
+    cv::Mat rgb;
+    mat.convertTo(rgb, CV_32FC3, scale);
+    width = (size_t)rgb.cols;
+    height = (size_t)rgb.rows;
+    pixels.resize(width * height);
+    for (size_t y = 0; y < height; ++y)
+    {
+        for (size_t x = 0; x < width; ++x)
+        {
+            const cv::Vec3f& c = rgb.at<cv::Vec3f>(y, x);
+            pixels[y * width + x] = Color(c[2], c[1], c[0]);
+        }
+    }
+    return true;
+}
+
+}//namespace Tracer
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef __INSTANCE_H__
+#define __INSTANCE_H__
+
+#include "util.h"
+#include "ray.h"
+#include "shape.h"
+#include "transform.h"
+
+namespace Tracer
+{
+
+//
+// Reference to a shared prototype shape (usually a Bvh over a sub-scene)
+// placed in the world by an affine transform.
+//
+// Rays are taken into the prototype's space for intersection; t is the
+// same in both spaces for an affine map, so only the normal has to be
+// brought back. Only the world-to-object transform is stored, so an
+// instance costs a pointer and twelve floats over the Shape base whatever
+// the size of its prototype; the prototype is not owned.
+//
+class Instance : public Shape
+{
+public:
+    Instance(Shape* pPrototype, const Transform& toWorld = Transform())
+        : m_pPrototype(pPrototype)
+    {
+        m_shapeType = "Instance";
+        setTransform(toWorld);
+    }
+
+    virtual ~Instance() { }
+
+    void setTransform(const Transform& toWorld) { m_toObject = toWorld.inverse(); }
+
+    Transform transform() const { return m_toObject.inverse(); }
+
+    Shape* prototype() const { return m_pPrototype; }
+
+    const Transform& worldToObject() const { return m_toObject; }
+
+    virtual bool intersect(Intersection& intersection)
+    {
+        Ray worldRay = intersection.m_ray;
+        intersection.m_ray = Ray(m_toObject.transformPoint(worldRay.m_origin),
+                                 m_toObject.transformVector(worldRay.m_direction),
+                                 worldRay.m_tMax);
+        bool intersected = m_pPrototype->intersect(intersection);
+        if (intersected)
+        {
+            intersection.m_normal = m_toObject.transformTransposed(intersection.m_normal).normalized();
+            // uv density per object unit to per world unit
+            intersection.m_uvDensity *= intersection.m_ray.m_direction.length() / worldRay.m_direction.length();
+        }
+        intersection.m_ray = worldRay;
+        return intersected;
+    }
+
+    virtual bool bounds(BoundingBox& box) const
+    {
+        BoundingBox prototypeBox;
+        if (!m_pPrototype->bounds(prototypeBox))
+        {
+            return false;
+        }
+        box = transform().transformBox(prototypeBox);
+        return true;
+    }
+
+protected:
+    Shape* m_pPrototype;
+    Transform m_toObject;
+};
+
+}//namespace Tracer
+
+#endif
@@ -0,0 +1,703 @@
+#ifndef __INTEGRATOR_H__
+#define __INTEGRATOR_H__
+
+#include <vector>
+#include "util.h"
+#include "ray.h"
+#include "shape.h"
+#include "material.h"
+#include "light_source.h"
+#include "texture.h"
+#include "irradiance_cache.h"
+#include "path_guide.h"
+
+namespace Tracer
+{
+
+// Mirror direction of d about the unit normal n
+inline Vector reflect(const Vector& d, const Vector& n)
+{
+    return d - 2.0f * dot(d, n) * n;
+}
+
+
+// Refract the unit direction d through the unit normal n (pointing against d)
+// with eta = n_incident / n_transmitted. Returns false on total internal
+// reflection.
+inline bool refract(const Vector& d, const Vector& n, float eta, Vector& refracted)
+{
+    float cosI = -dot(d, n);
+    float sin2T = eta * eta * (1.0f - cosI * cosI);
+    if (sin2T >= 1.0f)
+    {
+        return false;
+    }
+    float cosT = std::sqrt(1.0f - sin2T);
+    refracted = eta * d + (eta * cosI - cosT) * n;
+    refracted.normalize();
+    return true;
+}
+
+
+// Unpolarized Fresnel reflectance of a smooth dielectric interface.
+// cosI is the cosine on the incident side, eta = n_incident / n_transmitted.
+inline float fresnelDielectric(float cosI, float eta)
+{
+    float sin2T = eta * eta * (1.0f - cosI * cosI);
+    if (sin2T >= 1.0f)
+    {
+        // Total internal reflection
+        return 1.0f;
+    }
+    float cosT = std::sqrt(1.0f - sin2T);
+    float rParallel = (cosI - eta * cosT) / (cosI + eta * cosT);
+    float rPerpendicular = (eta * cosI - cosT) / (eta * cosI + cosT);
+    return 0.5f * (rParallel * rParallel + rPerpendicular * rPerpendicular);
+}
+
+
+// Radiance picked up by a ray that leaves the scene in direction: the sum
+// over the lights, of which only environment lights contribute
+inline Color escapedRadiance(const std::vector<Light*>& lights, const Vector& direction)
+{
+    Color radiance;
+    for (size_t i = 0; i < lights.size(); ++i)
+    {
+        radiance += lights[i]->radiance(direction);
+    }
+    return radiance;
+}
+
+
+// Texture color of the hit's material at the hit, white if it has none.
+// The ray reaching the hit is taken as a cone coneWidth across there (in
+// world units), which stretches by 1 / cos on the surface; that width in
+// uv units picks the mip level.
+inline Color surfaceTexture(const Intersection& intersection, float coneWidth)
+{
+    const Material* pMaterial = intersection.m_pMaterial;
+    if (!pMaterial->m_pTexture)
+    {
+        return Color(1.0f, 1.0f, 1.0f);
+    }
+    float cosI = std::fabs(dot(intersection.m_ray.m_direction, intersection.m_normal));
+    float footprint = coneWidth * intersection.m_uvDensity * pMaterial->m_uvScale / std::max(cosI, 0.2f);
+    return pMaterial->m_pTexture->sample(intersection.m_u * pMaterial->m_uvScale,
+                                         intersection.m_v * pMaterial->m_uvScale,
+                                         footprint);
+}
+
+
+// Light samples taken by the direct lighting and the shadow rays traced
+// for them; the difference is what culling saved
+struct ShadowStats
+{
+    ShadowStats() : m_numSamples(0), m_numTraced(0) { }
+
+    void add(const ShadowStats& other)
+    {
+        m_numSamples += other.m_numSamples;
+        m_numTraced += other.m_numTraced;
+    }
+
+    size_t m_numSamples;
+    size_t m_numTraced;
+};
+
+
+// Whether a light sample needs its shadow ray, from what it would add to
+// the pixel if nothing were in the way. Samples adding nothing (the light
+// is behind the surface, outside the lobe or the material only scatters
+// specularly) never do. Below threshold (in luminance) a sample survives
+// with probability contribution / threshold and its weight is scaled up
+// by the inverse, so culling stays unbiased; threshold 0 turns that off.
+inline bool keepShadowRay(const Color& contribution, float threshold, Rng& rng, float& weight)
+{
+    weight = 1.0f;
+    float y = luminance(contribution);
+    if (!(y > 0.0f))
+    {
+        return false;
+    }
+    if (y >= threshold)
+    {
+        return true;
+    }
+    float p = y / threshold;
+    if (rng.nextFloat() >= p)
+    {
+        return false;
+    }
+    weight = 1.0f / p;
+    return true;
+}
+
+
+// Shades the light samples of batch at intersection as if their lights
+// were visible, a batch at a time, then traces the shadow rays of those
+// keepShadowRay() keeps (pLights[i] was sampled distances[i] away) and adds
+// what gets through to direct. Empties the batch.
+inline void shadeLightBatch(LightSampleBatch& batch,
+                            Light* const* pLights,
+                            const float* distances,
+                            const Intersection& intersection,
+                            const Point& position,
+                            ShapeSet& masterSet,
+                            Rng& rng,
+                            const Color& pixelShare,
+                            float cullThreshold,
+                            Color& direct,
+                            ShadowStats& stats)
+{
+    intersection.m_pMaterial->getColorBatch(position,
+                                            intersection.m_normal,
+                                            intersection.m_ray.m_direction,
+                                            batch);
+    for (size_t i = 0; i < batch.m_count; ++i)
+    {
+        Color color = batch.color(i);
+        float weight;
+        if (!keepShadowRay(pixelShare * color, cullThreshold, rng, weight))
+        {
+            continue;
+        }
+
+        // Fire a shadow ray to make sure we can actually see
+        // that light position
+        ++stats.m_numTraced;
+        Ray shadowRay(position, batch.direction(i), distances[i]);
+        Intersection shadowIntersection(shadowRay);
+        bool intersected = masterSet.intersect(shadowIntersection);
+
+        if (!intersected || shadowIntersection.m_pShape == pLights[i])
+        {
+            direct += weight * color;
+        }
+    }
+    batch.clear();
+}
+
+
+// Terms of shadeDirect() besides the light samples
+enum ShadeTerms
+{
+    kShadeAmbient = 1 << 0,
+    kShadeEmission = 1 << 1,
+    kShadeAll = kShadeAmbient | kShadeEmission
+};
+
+
+// Ambient + direct lighting at a hit, averaged over numLightSamples samples
+// per light (none for 0), plus the hit's own emission if it is a light;
+// terms leaves out the ambient or emission. coneWidth is
+// the width of the ray's footprint at the hit, for texture filtering, and
+// throughput the path's weight up to the hit, which with the texture and
+// the sample count turns a light sample into its share of the pixel for
+// keepShadowRay(). Light samples are counted into pStats if given.
+inline Color shadeDirect(const Intersection& intersection,
+                         ShapeSet& masterSet,
+                         const std::vector<Light*>& lights,
+                         Rng& rng,
+                         size_t numLightSamples,
+                         float coneWidth = 0.0f,
+                         const Color& throughput = Color(1.0f, 1.0f, 1.0f),
+                         float cullThreshold = 0.0f,
+                         ShadowStats* pStats = NULL,
+                         unsigned int terms = kShadeAll)
+{
+    const Material* pMaterial = intersection.m_pMaterial;
+    Point position = intersection.position();
+    Color texture = surfaceTexture(intersection, coneWidth);
+    float sampleScale = 1.0f / float(std::max(numLightSamples, size_t(1)));
+    Color pixelShare = throughput * texture * sampleScale;
+    Color direct;
+    ShadowStats stats;
+
+    // Light samples are gathered and shaded a batch at a time, with the
+    // light and distance of each for its shadow ray
+    LightSampleBatch batch;
+    Light* batchLights[kShadingBatchSize];
+    float batchDistances[kShadingBatchSize];
+
+    for (size_t s_l = 0; s_l < numLightSamples; ++s_l)
+    {
+        for (std::vector<Light*>::const_iterator iter = lights.begin();
+             iter != lights.end();
+             ++iter)
+        {
+            // Ask the light for a random position/normal we can use
+            // for lighting
+            Point lightPoint;
+            Vector lightNormal;
+            Light *pLightShape = *iter;
+            ++stats.m_numSamples;
+            if (!pLightShape->samplePoint(rng,
+                                          position,
+                                          lightPoint,
+                                          lightNormal))
+            {
+                continue;
+            }
+
+            // Shade the sample as if the light were visible, and only
+            // pay for the shadow ray if that could matter
+            Vector toLight = lightPoint - position;
+            batchLights[batch.m_count] = pLightShape;
+            batchDistances[batch.m_count] = toLight.normalize();
+            batch.add(toLight, pLightShape->sampledPower(position, lightPoint));
+            if (batch.full())
+            {
+                shadeLightBatch(batch, batchLights, batchDistances, intersection, position,
+                                masterSet, rng, pixelShare, cullThreshold, direct, stats);
+            }
+        } //for light
+    } //for s_l
+    shadeLightBatch(batch, batchLights, batchDistances, intersection, position,
+                    masterSet, rng, pixelShare, cullThreshold, direct, stats);
+    if (pStats)
+    {
+        pStats->add(stats);
+    }
+
+    Color ambient = (terms & kShadeAmbient) ? pMaterial->m_kAmbient * pMaterial->m_color : Color();
+    Color pixelColor = (ambient + direct * sampleScale) * texture;
+    if ((terms & kShadeEmission) &&
+        intersection.m_pShape->getShapeType().find("Light") != std::string::npos)
+    {
+        pixelColor += intersection.m_emitted;
+    }
+    return pixelColor;
+}
+
+
+// Whether a material's diffuse lobe takes indirect light from an
+// irradiance cache
+inline bool takesIrradiance(const Material& material)
+{
+    return (material.m_type == kBsdfLambert || material.m_type == kBsdfPhong) &&
+           material.m_kDiffuse > 0.0f;
+}
+
+
+// Gathers an irradiance cache record at position, on the side of the
+// surface normal points to, from numRays rays cosine-distributed over
+// stratified cells: numTheta rings of numPhi cells, numTheta about
+// sqrt(numRays / pi) so the cells are roughly square. A ray that hits
+// brings back the surface's direct lighting and ambient (fewer light
+// samples, kIrradianceLightSamples, are enough with this many rays); one
+// that misses brings nothing, since the lights, the environment included,
+// are already counted by the direct lighting. The gradients are those of
+// Ward and Heckbert for this stratification. The radius is the harmonic
+// mean hit distance, limited by how fast the irradiance changes and
+// clamped so a * radius spans kIrradianceMinSpacing to
+// kIrradianceMaxSpacing times the footprint coneWidth.
+const size_t kIrradianceLightSamples = 4;
+const float kIrradianceMinSpacing = 1.5f;
+const float kIrradianceMaxSpacing = 30.0f;
+
+inline IrradianceRecord gatherIrradiance(const Point& position,
+                                         const Vector& normal,
+                                         float accuracy,
+                                         size_t numRays,
+                                         float coneWidth,
+                                         ShapeSet& masterSet,
+                                         const std::vector<Light*>& lights,
+                                         Rng& rng)
+{
+    const size_t numTheta = std::max<size_t>(1, size_t(std::sqrt(float(numRays) / float(M_PI)) + 0.5f));
+    const size_t numPhi = std::max<size_t>(1, numRays / numTheta);
+    const size_t count = numTheta * numPhi;
+    // Each ray stands for a cone of about 2 pi / count steradians
+    const float raySpread = std::sqrt(2.0f * float(M_PI) / float(count));
+    Vector u, v;
+    makeBasis(normal, u, v);
+
+    std::vector<Color> radiance(count);
+    std::vector<float> distance(count);
+    Color sum;
+    float inverseDistanceSum = 0.0f;
+    Vector rotation[3];
+    for (size_t k = 0; k < numPhi; ++k)
+    {
+        for (size_t j = 0; j < numTheta; ++j)
+        {
+            float sin2Theta = (float(j) + rng.nextFloat()) / float(numTheta);
+            float sinTheta = std::sqrt(sin2Theta);
+            float cosTheta = std::sqrt(std::max(0.0f, 1.0f - sin2Theta));
+            float phi = 2.0f * float(M_PI) * (float(k) + rng.nextFloat()) / float(numPhi);
+            Vector direction = (std::cos(phi) * sinTheta) * u + (std::sin(phi) * sinTheta) * v +
+                               cosTheta * normal;
+
+            Intersection hit(Ray(position, direction));
+            Color L;
+            float r = kRayTMax;
+            if (masterSet.intersect(hit))
+            {
+                r = hit.m_t;
+                L = shadeDirect(hit, masterSet, lights, rng, kIrradianceLightSamples,
+                                coneWidth + raySpread * r, Color(1.0f, 1.0f, 1.0f), 0.0f, NULL,
+                                kShadeAmbient);
+                inverseDistanceSum += 1.0f / std::max(r, 1.0e-4f);
+            }
+            radiance[k * numTheta + j] = L;
+            distance[k * numTheta + j] = r;
+            sum += L;
+
+            // Rotational gradient: -tan(theta) L along the tangent
+            // perpendicular to phi
+            Vector tangent = std::cos(phi) * v - std::sin(phi) * u;
+            float tanTheta = sinTheta / std::max(cosTheta, 0.01f);
+            rotation[0] -= (tanTheta * L.m_r) * tangent;
+            rotation[1] -= (tanTheta * L.m_g) * tangent;
+            rotation[2] -= (tanTheta * L.m_b) * tangent;
+        }
+    }
+
+    IrradianceRecord record;
+    record.m_position = position;
+    record.m_normal = normal;
+    record.m_irradiance = (float(M_PI) / float(count)) * sum;
+    for (size_t c = 0; c < 3; ++c)
+    {
+        record.m_rotation[c] = (float(M_PI) / float(count)) * rotation[c];
+        record.m_translation[c] = Vector();
+    }
+
+    // Translational gradient: changes across the ring boundaries (theta)
+    // and the wedge boundaries (phi), each weighted by the nearer hit
+    for (size_t k = 0; k < numPhi; ++k)
+    {
+        float phiCenter = 2.0f * float(M_PI) * (float(k) + 0.5f) / float(numPhi);
+        float phiEdge = 2.0f * float(M_PI) * float(k) / float(numPhi);
+        Vector radial = std::cos(phiCenter) * u + std::sin(phiCenter) * v;
+        Vector edgeTangent = std::cos(phiEdge) * v - std::sin(phiEdge) * u;
+        size_t kPrev = (k + numPhi - 1) % numPhi;
+        for (size_t j = 0; j < numTheta; ++j)
+        {
+            const Color& L = radiance[k * numTheta + j];
+            float sinMinus = std::sqrt(float(j) / float(numTheta));
+            float sinPlus = std::sqrt(float(j + 1) / float(numTheta));
+            if (j > 0)
+            {
+                const Color& below = radiance[k * numTheta + j - 1];
+                float w = 2.0f * float(M_PI) / float(numPhi) * sinMinus * (1.0f - sinMinus * sinMinus) /
+                          std::min(distance[k * numTheta + j], distance[k * numTheta + j - 1]);
+                record.m_translation[0] += (w * (L.m_r - below.m_r)) * radial;
+                record.m_translation[1] += (w * (L.m_g - below.m_g)) * radial;
+                record.m_translation[2] += (w * (L.m_b - below.m_b)) * radial;
+            }
+            if (numPhi > 1)
+            {
+                const Color& before = radiance[kPrev * numTheta + j];
+                float w = (sinPlus - sinMinus) /
+                          std::min(distance[k * numTheta + j], distance[kPrev * numTheta + j]);
+                record.m_translation[0] += (w * (L.m_r - before.m_r)) * edgeTangent;
+                record.m_translation[1] += (w * (L.m_g - before.m_g)) * edgeTangent;
+                record.m_translation[2] += (w * (L.m_b - before.m_b)) * edgeTangent;
+            }
+        }
+    }
+
+    float radius = inverseDistanceSum > 0.0f ? float(count) / inverseDistanceSum : kRayTMax;
+    Vector gradient = 0.2126f * record.m_translation[0] + 0.7152f * record.m_translation[1] +
+                      0.0722f * record.m_translation[2];
+    float gradientLength = gradient.length();
+    if (gradientLength > 0.0f)
+    {
+        radius = std::min(radius, luminance(record.m_irradiance) / gradientLength);
+    }
+    if (coneWidth > 0.0f)
+    {
+        radius = std::min(std::max(radius, kIrradianceMinSpacing * coneWidth / accuracy),
+                          kIrradianceMaxSpacing * coneWidth / accuracy);
+    }
+    record.m_radius = std::max(radius, 1.0e-6f);
+
+    // Near contacts and corners the nearest hits are very close and the
+    // translational gradient explodes; once the radius is clamped up it
+    // could extrapolate far past the record's own value, so limit each
+    // channel's change across the radius to that value
+    const Color& e = record.m_irradiance;
+    const float limits[3] = { e.m_r, e.m_g, e.m_b };
+    for (size_t c = 0; c < 3; ++c)
+    {
+        float change = record.m_translation[c].length() * record.m_radius;
+        float limit = limits[c];
+        if (change > limit)
+        {
+            record.m_translation[c] *= limit / change;
+        }
+    }
+    return record;
+}
+
+
+// Diffuse indirect light leaving a hit whose material takesIrradiance(),
+// interpolated from cache or, where it has no usable record, from a new
+// record gathered on the spot. coneWidth is the ray's footprint at the
+// hit. The irradiance E is turned into outgoing light as kDiffuse * color
+// * E / pi, the convention the lights follow (see EnvironmentLight).
+inline Color diffuseIndirect(IrradianceCache& cache,
+                             size_t numRays,
+                             const Intersection& intersection,
+                             ShapeSet& masterSet,
+                             const std::vector<Light*>& lights,
+                             Rng& rng,
+                             float coneWidth)
+{
+    const Material* pMaterial = intersection.m_pMaterial;
+    Point position = intersection.position();
+    Vector normal = intersection.m_normal;
+    if (dot(normal, intersection.m_ray.m_direction) > 0.0f)
+    {
+        normal *= -1.0f;
+    }
+
+    Color irradiance;
+    if (!cache.interpolate(position, normal, irradiance))
+    {
+        IrradianceRecord record = gatherIrradiance(position, normal, cache.accuracy(), numRays,
+                                                   coneWidth, masterSet, lights, rng);
+        cache.insert(record);
+        irradiance = record.m_irradiance;
+    }
+    return (pMaterial->m_kDiffuse / float(M_PI)) * irradiance * pMaterial->m_color *
+           surfaceTexture(intersection, coneWidth);
+}
+
+
+// Share of guided indirect rays drawn from the cosine lobe instead of the
+// guide, so directions the guide has not learned yet are still sampled
+const float kGuideCosineFraction = 0.5f;
+
+// Diffuse indirect light leaving a hit whose material takesIrradiance(),
+// estimated from a single ray. The ray is drawn from a one-sample mixture
+// of the cosine lobe and guide's learned distribution at the hit (just
+// the cosine lobe where the guide knows nothing yet) and brings back what
+// a gather ray of gatherIrradiance() would; what it brought back is
+// recorded into guide. The result follows the convention of
+// diffuseIndirect().
+inline Color guidedIndirect(PathGuide& guide,
+                            const Intersection& intersection,
+                            ShapeSet& masterSet,
+                            const std::vector<Light*>& lights,
+                            Rng& rng,
+                            float coneWidth)
+{
+    const Material* pMaterial = intersection.m_pMaterial;
+    Point position = intersection.position();
+    Vector normal = intersection.m_normal;
+    if (dot(normal, intersection.m_ray.m_direction) > 0.0f)
+    {
+        normal *= -1.0f;
+    }
+
+    const DTree* pDistribution = guide.distribution(position);
+    float cosineFraction = pDistribution ? kGuideCosineFraction : 1.0f;
+    Vector direction;
+    if (rng.nextFloat() < cosineFraction)
+    {
+        Vector u, v;
+        makeBasis(normal, u, v);
+        float sin2Theta = rng.nextFloat();
+        float sinTheta = std::sqrt(sin2Theta);
+        float phi = 2.0f * float(M_PI) * rng.nextFloat();
+        direction = (std::cos(phi) * sinTheta) * u + (std::sin(phi) * sinTheta) * v +
+                    std::sqrt(std::max(0.0f, 1.0f - sin2Theta)) * normal;
+    }
+    else
+    {
+        pDistribution->sample(rng, direction);
+    }
+    float cosTheta = dot(direction, normal);
+    float pdf = cosineFraction * std::max(cosTheta, 0.0f) / float(M_PI);
+    if (pDistribution)
+    {
+        pdf += (1.0f - cosineFraction) * pDistribution->pdf(direction);
+    }
+    if (cosTheta <= 0.0f || !(pdf > 0.0f))
+    {
+        // Below the surface: nothing arrives, but the sample still counts
+        guide.record(position, direction, 0.0f);
+        return Color();
+    }
+
+    // The ray stands for the solid angle 1 / pdf around it, as a gather
+    // ray for 2 pi / count
+    const float raySpread = std::sqrt(1.0f / pdf);
+    Color radiance;
+    Intersection hit(Ray(position, direction));
+    if (masterSet.intersect(hit))
+    {
+        radiance = shadeDirect(hit, masterSet, lights, rng, kIrradianceLightSamples,
+                               coneWidth + raySpread * hit.m_t, Color(1.0f, 1.0f, 1.0f), 0.0f, NULL,
+                               kShadeAmbient);
+    }
+    guide.record(position, direction, luminance(radiance) / pdf);
+    Color irradiance = (cosTheta / pdf) * radiance;
+    return (pMaterial->m_kDiffuse / float(M_PI)) * irradiance * pMaterial->m_color *
+           surfaceTexture(intersection, coneWidth);
+}
+
+
+// Pick one scattering lobe at a hit and set up the continuation ray.
+// Exactly one ray is spawned per path vertex: the lobe is chosen at random
+// in proportion to its weight and the throughput is divided by that
+// probability, so the estimate stays unbiased without two-way branching.
+// Returns false if the path ends here.
+inline bool sampleScatter(const Intersection& intersection,
+                          Rng& rng,
+                          Ray& ray,
+                          Color& throughput)
+{
+    const Material& material = *intersection.m_pMaterial;
+    const Vector& direction = intersection.m_ray.m_direction;
+    Point position = intersection.position();
+
+    // Orient the normal against the incoming ray, remembering which side
+    // of the surface we came from
+    Vector normal = intersection.m_normal;
+    float cosI = -dot(direction, normal);
+    bool entering = cosI > 0.0f;
+    if (!entering)
+    {
+        normal *= -1.0f;
+        cosI = -cosI;
+    }
+
+    if (material.m_type == kBsdfDielectric)
+    {
+        float eta = entering ? 1.0f / material.m_ior : material.m_ior;
+        float fresnel = fresnelDielectric(cosI, eta);
+        Vector refracted;
+        if (rng.nextFloat() < fresnel || !refract(direction, normal, eta, refracted))
+        {
+            // Reflection, picked with probability F (always under TIR)
+            ray = Ray(position, reflect(direction, normal));
+        }
+        else
+        {
+            // Transmission, picked with probability 1 - F
+            ray = Ray(position, refracted);
+            throughput *= material.m_color;
+        }
+        return true;
+    }
+
+    // Everything else may carry a mirror lobe (m_rReflect) and a smooth
+    // transmission lobe (m_rRefract)
+    float lobeSum = material.m_rReflect + material.m_rRefract;
+    if (lobeSum <= 0.0f)
+    {
+        return false;
+    }
+    throughput *= lobeSum;
+
+    Vector refracted;
+    float eta = entering ? 1.0f / material.m_ior : material.m_ior;
+    if (rng.nextFloat() * lobeSum < material.m_rReflect ||
+        !refract(direction, normal, eta, refracted))
+    {
+        ray = Ray(position, reflect(direction, normal));
+    }
+    else
+    {
+        ray = Ray(position, refracted);
+    }
+    return true;
+}
+
+
+// Iterative path integrator: direct lighting at every vertex, continued
+// along one sampled lobe until the path misses (picking up the
+// environment), is absorbed or has bounced maxBounce times. pixelSpread is
+// the angle a pixel subtends (Camera::pixelSpread()); the ray's footprint
+// grows by it per unit of distance travelled, through every bounce, since
+// all the lobes are smooth. cullThreshold and pStats go to shadeDirect().
+// With pIrradiance, diffuse surfaces take indirect light from that cache,
+// gathered with numIrradianceRays rays per record, in place of their
+// ambient term; without a cache but with pGuide, they take it from a
+// guided ray per hit instead (see guidedIndirect()).
+//
+// The path starts at first, the camera ray's hit (hit is false for a
+// miss), which gets firstLightSamples light samples per light; callers
+// that light it themselves pass 0. traceRay() finds that hit.
+inline Color continuePath(const Intersection& first,
+                          bool hit,
+                          size_t firstLightSamples,
+                          ShapeSet& masterSet,
+                          const std::vector<Light*>& lights,
+                          Rng& rng,
+                          size_t maxBounce,
+                          size_t numLightSamples,
+                          float pixelSpread = 0.0f,
+                          float cullThreshold = 0.0f,
+                          ShadowStats* pStats = NULL,
+                          IrradianceCache* pIrradiance = NULL,
+                          size_t numIrradianceRays = 0,
+                          PathGuide* pGuide = NULL)
+{
+    Color pixelColor(0.0f, 0.0f, 0.0f);
+    Color throughput(1.0f, 1.0f, 1.0f);
+    Ray ray = first.m_ray;
+    float coneWidth = 0.0f;
+
+    for (size_t nBounce = 0; ; ++nBounce)
+    {
+        Intersection intersection = nBounce == 0 ? first : Intersection(ray);
+        if (nBounce == 0 ? !hit : !masterSet.intersect(intersection))
+        {
+            pixelColor += throughput * escapedRadiance(lights, ray.m_direction);
+            break;
+        }
+
+        coneWidth += pixelSpread * intersection.m_t;
+        bool indirect = (pIrradiance || pGuide) && takesIrradiance(*intersection.m_pMaterial);
+        pixelColor += throughput * shadeDirect(intersection, masterSet, lights, rng,
+                                               nBounce == 0 ? firstLightSamples : numLightSamples,
+                                               coneWidth, throughput, cullThreshold, pStats,
+                                               indirect ? kShadeEmission : kShadeAll);
+        if (indirect && pIrradiance)
+        {
+            pixelColor += throughput * diffuseIndirect(*pIrradiance, numIrradianceRays, intersection,
+                                                       masterSet, lights, rng, coneWidth);
+        }
+        else if (indirect)
+        {
+            pixelColor += throughput * guidedIndirect(*pGuide, intersection, masterSet, lights, rng,
+                                                      coneWidth);
+        }
+
+        if (nBounce >= maxBounce || !sampleScatter(intersection, rng, ray, throughput))
+        {
+            break;
+        }
+    }
+    return pixelColor;
+}
+
+
+// Radiance arriving along cameraRay; see continuePath()
+inline Color traceRay(const Ray& cameraRay,
+                      ShapeSet& masterSet,
+                      const std::vector<Light*>& lights,
+                      Rng& rng,
+                      size_t maxBounce,
+                      size_t numLightSamples,
+                      float pixelSpread = 0.0f,
+                      float cullThreshold = 0.0f,
+                      ShadowStats* pStats = NULL,
+                      IrradianceCache* pIrradiance = NULL,
+                      size_t numIrradianceRays = 0,
+                      PathGuide* pGuide = NULL)
+{
+    Intersection first(cameraRay);
+    bool hit = masterSet.intersect(first);
+    return continuePath(first, hit, numLightSamples, masterSet, lights, rng, maxBounce,
+                        numLightSamples, pixelSpread, cullThreshold, pStats, pIrradiance,
+                        numIrradianceRays, pGuide);
+}
+
+}//namespace Tracer
+
+#endif
@@ -7,11 +7,36 @@
 #include <list>
 #include <algorithm>
 #include "util.h"
+#include "arena.h"
+#include "numa.h"
 #include <opencv2/opencv.hpp>
 #include "shape.h"
 #include "ray.h"
 #include "light_source.h"
+#include "environment.h"
+#include "texture.h"
 #include "material.h"
+#include "irradiance_cache.h"
+#include "path_guide.h"
+#include "integrator.h"
+#include "camera.h"
+#include "film.h"
+#include "transform.h"
+#include "bvh.h"
+#include "instance.h"
+#include "animation.h"
+#include "wavefront.h"
+#include "denoise.h"
+#include "settings.h"
+#include "image_io.h"
+#include "primary_hits.h"
+#include "progressive.h"
+#include "restir.h"
+#include "distributed.h"
+#include "scene.h"
+#include "binary_scene.h"
+#include "renderer.h"
+#include "server.h"
 #ifndef M_PI
 
     #define M_PI 3.14159265358979
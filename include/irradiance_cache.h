@@ -0,0 +1,279 @@
+#ifndef __IRRADIANCE_CACHE_H__
+#define __IRRADIANCE_CACHE_H__
+
+#include <atomic>
+#include <cmath>
+#include <vector>
+#include "util.h"
+
+namespace Tracer
+{
+
+//
+// Irradiance cache for diffuse indirect light (Ward et al. 1988, with the
+// gradients of Ward and Heckbert 1992).
+//
+// Indirect irradiance varies slowly over diffuse surfaces, so it is only
+// gathered, with a hemisphere of rays, at scattered records and
+// interpolated in between. A record at P_i with normal N_i, whose gather
+// rays hit at a harmonic mean distance R_i, serves a point P with normal N
+// while its error
+//
+//     e_i = |P - P_i| / R_i + sqrt(1 - N . N_i)
+//
+// is below the accuracy a, with weight 1 / e_i; no point farther than
+// a * R_i uses it. Each record first extrapolates its irradiance to P and
+// N along its rotational and translational gradients.
+//
+// The records sit in a hash grid of cubic cells with one level per
+// power-of-two cell size. A record is filed on the smallest level whose
+// cells are as wide as its sphere of radius a * R_i, in the (at most
+// eight) cells the sphere touches, so a lookup only visits the cell holding P on each level in
+// use. Cells are lock-free lists: a record never changes once it is
+// published, inserts push it with a compare-and-swap and lookups just
+// follow the pointers, so rendering threads fill and read the cache
+// without locks. Records are created as rendering needs them, so with
+// several threads which records exist depends on the timing; two threads
+// may also gather a record for the same spot, and both are kept.
+//
+
+// Hash buckets of the grid
+const size_t kIrradianceBuckets = 1 << 16;
+// Range of the grid levels; level L has cells 2^L across
+const int kIrradianceMinLevel = -32;
+const int kIrradianceMaxLevel = 31;
+// A record is not used by points more than this fraction of its radius
+// in front of it (Ward's test against records from around a corner)
+const float kIrradianceInFront = 0.05f;
+
+
+struct IrradianceRecord
+{
+    Point m_position;
+    // Unit normal, on the side the gather rays left from
+    Vector m_normal;
+    Color m_irradiance;
+    // Harmonic mean distance of the gather rays, after clamping
+    float m_radius;
+    // Gradients of the red, green and blue irradiance for a rotation of
+    // the normal and a move of the position
+    Vector m_rotation[3];
+    Vector m_translation[3];
+
+    // Irradiance extrapolated to a nearby position and normal
+    Color extrapolate(const Point& position, const Vector& normal) const
+    {
+        Vector axis = cross(m_normal, normal);
+        Vector offset = position - m_position;
+        Color change(dot(axis, m_rotation[0]) + dot(offset, m_translation[0]),
+                     dot(axis, m_rotation[1]) + dot(offset, m_translation[1]),
+                     dot(axis, m_rotation[2]) + dot(offset, m_translation[2]));
+        Color irradiance = m_irradiance + change;
+        return Color(std::max(irradiance.m_r, 0.0f),
+                     std::max(irradiance.m_g, 0.0f),
+                     std::max(irradiance.m_b, 0.0f));
+    }
+};
+
+
+class IrradianceCache
+{
+public:
+    // accuracy: the a above, typically 0.1 to 0.3
+    explicit IrradianceCache(float accuracy, size_t numBuckets = kIrradianceBuckets)
+        : m_accuracy(accuracy),
+          m_buckets(numBuckets),
+          m_levels(0),
+          m_pRecords(NULL),
+          m_numRecords(0)
+    {
+        for (size_t i = 0; i < m_buckets.size(); ++i)
+        {
+            m_buckets[i].store(NULL, std::memory_order_relaxed);
+        }
+    }
+
+    ~IrradianceCache()
+    {
+        clear();
+    }
+
+    float accuracy() const { return m_accuracy; }
+
+    size_t numRecords() const { return m_numRecords.load(std::memory_order_relaxed); }
+
+    // Weighted average of the records usable at position and unit normal;
+    // false if there are none
+    bool interpolate(const Point& position, const Vector& normal, Color& irradiance) const
+    {
+        unsigned long long levels = m_levels.load(std::memory_order_acquire);
+        Color sum;
+        float weightSum = 0.0f;
+        for (int level = kIrradianceMinLevel; levels; ++level, levels >>= 1)
+        {
+            if (!(levels & 1ull))
+            {
+                continue;
+            }
+            float inverseSize = std::ldexp(1.0f, -level);
+            int x = cell(position.m_x, inverseSize);
+            int y = cell(position.m_y, inverseSize);
+            int z = cell(position.m_z, inverseSize);
+            for (const Node* pNode = m_buckets[bucket(level, x, y, z)].load(std::memory_order_acquire);
+                 pNode;
+                 pNode = pNode->m_pNext)
+            {
+                if (pNode->m_level != level || pNode->m_x != x || pNode->m_y != y || pNode->m_z != z)
+                {
+                    continue;
+                }
+                const IrradianceRecord& record = pNode->m_pStored->m_record;
+                Vector offset = position - record.m_position;
+                float error = offset.length() / record.m_radius +
+                              std::sqrt(std::max(0.0f, 1.0f - dot(normal, record.m_normal)));
+                if (error >= m_accuracy ||
+                    dot(offset, normal + record.m_normal) < -2.0f * kIrradianceInFront * record.m_radius)
+                {
+                    continue;
+                }
+                float weight = 1.0f / std::max(error, 1.0e-6f);
+                sum += weight * record.extrapolate(position, normal);
+                weightSum += weight;
+            }
+        }
+        if (weightSum <= 0.0f)
+        {
+            return false;
+        }
+        irradiance = sum / weightSum;
+        return true;
+    }
+
+    // Publishes a record; safe to call while other threads interpolate or
+    // insert
+    void insert(const IrradianceRecord& record)
+    {
+        StoredRecord* pStored = new StoredRecord;
+        pStored->m_record = record;
+
+        float reach = m_accuracy * record.m_radius;
+        int level = std::min(std::max(int(std::ceil(std::log2(2.0f * reach))), kIrradianceMinLevel),
+                             kIrradianceMaxLevel);
+        float inverseSize = std::ldexp(1.0f, -level);
+        const Point& p = record.m_position;
+        int x0 = cell(p.m_x - reach, inverseSize), x1 = cell(p.m_x + reach, inverseSize);
+        int y0 = cell(p.m_y - reach, inverseSize), y1 = cell(p.m_y + reach, inverseSize);
+        int z0 = cell(p.m_z - reach, inverseSize), z1 = cell(p.m_z + reach, inverseSize);
+        // The sphere is no wider than a cell, so it spans one or two cells
+        // per axis (rounding aside)
+        x1 = std::min(x1, x0 + 1);
+        y1 = std::min(y1, y0 + 1);
+        z1 = std::min(z1, z0 + 1);
+
+        size_t numNodes = 0;
+        for (int z = z0; z <= z1; ++z)
+        {
+            for (int y = y0; y <= y1; ++y)
+            {
+                for (int x = x0; x <= x1; ++x)
+                {
+                    Node& node = pStored->m_nodes[numNodes++];
+                    node.m_level = level;
+                    node.m_x = x;
+                    node.m_y = y;
+                    node.m_z = z;
+                    node.m_pStored = pStored;
+                }
+            }
+        }
+
+        // Keep the record for clear(), then make it visible cell by cell
+        pStored->m_pNextStored = m_pRecords.load(std::memory_order_relaxed);
+        while (!m_pRecords.compare_exchange_weak(pStored->m_pNextStored, pStored,
+                                                 std::memory_order_relaxed))
+        {
+        }
+        for (size_t i = 0; i < numNodes; ++i)
+        {
+            Node& node = pStored->m_nodes[i];
+            std::atomic<Node*>& head = m_buckets[bucket(level, node.m_x, node.m_y, node.m_z)];
+            node.m_pNext = head.load(std::memory_order_relaxed);
+            while (!head.compare_exchange_weak(node.m_pNext, &node,
+                                               std::memory_order_release,
+                                               std::memory_order_relaxed))
+            {
+            }
+        }
+        m_levels.fetch_or(1ull << (level - kIrradianceMinLevel), std::memory_order_release);
+        m_numRecords.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Drops every record; no other thread may use the cache meanwhile
+    void clear()
+    {
+        StoredRecord* pStored = m_pRecords.exchange(NULL);
+        while (pStored)
+        {
+            StoredRecord* pNext = pStored->m_pNextStored;
+            delete pStored;
+            pStored = pNext;
+        }
+        for (size_t i = 0; i < m_buckets.size(); ++i)
+        {
+            m_buckets[i].store(NULL, std::memory_order_relaxed);
+        }
+        m_levels.store(0);
+        m_numRecords.store(0);
+    }
+
+protected:
+    struct StoredRecord;
+
+    // A record's entry in one cell's list
+    struct Node
+    {
+        int m_level, m_x, m_y, m_z;
+        const StoredRecord* m_pStored;
+        Node* m_pNext;
+    };
+
+    struct StoredRecord
+    {
+        IrradianceRecord m_record;
+        Node m_nodes[8];
+        // Next in the list of every record
+        StoredRecord* m_pNextStored;
+    };
+
+    // Cell index of a coordinate, clamped so far away points on fine
+    // levels stay representable
+    static int cell(float coordinate, float inverseSize)
+    {
+        float c = std::floor(coordinate * inverseSize);
+        return int(std::min(std::max(c, -1.0e9f), 1.0e9f));
+    }
+
+    size_t bucket(int level, int x, int y, int z) const
+    {
+        unsigned int h = hashUInt32((unsigned int)level);
+        h = hashUInt32(h ^ (unsigned int)x);
+        h = hashUInt32(h ^ (unsigned int)y);
+        h = hashUInt32(h ^ (unsigned int)z);
+        return h % m_buckets.size();
+    }
+
+    float m_accuracy;
+    std::vector<std::atomic<Node*> > m_buckets;
+    // Bit L - kIrradianceMinLevel is set once level L holds a record
+    std::atomic<unsigned long long> m_levels;
+    std::atomic<StoredRecord*> m_pRecords;
+    std::atomic<size_t> m_numRecords;
+
+private:
+    IrradianceCache(const IrradianceCache&);
+    IrradianceCache& operator =(const IrradianceCache&);
+};
+
+}//namespace Tracer
+
+#endif
@@ -6,6 +6,27 @@
 
 namespace Tracer
 {
+
+// Unit vectors u and v completing the unit vector w to an orthonormal basis
+inline void makeBasis(const Vector& w, Vector& u, Vector& v)
+{
+	Vector axis = std::fabs(w.m_y) < 0.9f ? Vector(0.0f, 1.0f, 0.0f) : Vector(1.0f, 0.0f, 0.0f);
+	u = cross(axis, w).normalized();
+	v = cross(w, u);
+}
+
+
+//
+// A light source. Direct lighting asks it for a point to fire a shadow ray
+// at (samplePoint()) and for the power arriving from there
+// (sampledPower()), which Material::getColor() scales by the BSDF.
+//
+// Rectangle lights hand out their full power whatever the geometry. The
+// other lights are physically based: point and spot lights have an
+// intensity that falls off with the squared distance, sphere and disk
+// lights a radiance, sampled by solid angle, which sampledPower() turns
+// into L / (pi * pdf) as the environment does.
+//
 class Light : public virtual Shape
 {
 public:
@@ -15,10 +36,27 @@ public:
 	}	
 	virtual ~Light() {}
 	virtual Color emitted() const {return m_color * m_power; }
-	virtual bool samplePoint(Rng rng,
-							 Point& position,
-							 Point& lightPostion,
-							 Vector& lightNormal) {}
+	float power() const { return m_power; }
+	// Picks a point on the light to light position from, drawing from
+	// rng; returns false if no part of the light reaches position, so no
+	// shadow ray has to be traced
+	virtual bool samplePoint(Rng& rng,
+							 const Point& position,
+							 Point& lightPosition,
+							 Vector& lightNormal) { return false; }
+	// Power reaching position from a point picked by samplePoint(), as
+	// handed to Material::getColor(); lights that emit the same everywhere
+	// just return emitted()
+	virtual Color sampledPower(const Point& position, const Point& lightPosition) const { return emitted(); }
+	// Density with which samplePoint() from position picks lightPosition,
+	// per unit area of the light (per unit solid angle for environments,
+	// 1 for lights that are a single point); 0 if it never would. Times
+	// sampledPower(), it gives the unweighted power, which lets a sample
+	// picked from one position be reused at another.
+	virtual float sampleDensity(const Point& position, const Point& lightPosition) const { return 1.0f; }
+	// Radiance carried by a ray that leaves the scene in direction; only
+	// environment lights have any
+	virtual Color radiance(const Vector& direction) const { return Color(); }
 protected:
 	Color m_color;
 	float m_power;
@@ -50,8 +88,8 @@ public:
         }
 		return true;
 	}
-	virtual  bool samplePoint(Rng rng,
-							  Point& position,
+	virtual  bool samplePoint(Rng& rng,
+							  const Point& position,
 							  Point& lightPosition,
 							  Vector& lightNormal)	
 	{
@@ -66,12 +104,284 @@ public:
         }
         return true;
 	}
+	virtual float sampleDensity(const Point&, const Point&) const
+	{
+		return 1.0f / cross(m_side1, m_side2).length();
+	}
+	const Material* material() const { return m_pMaterial; }
 protected:
 	const Material* m_pMaterial;
 };
 
 
+// Light from a single point, the same in every direction; never hit by rays
+class PointLight : public Light
+{
+public:
+	PointLight(const Point& position, const Material* pMaterial, float power)
+		: Light(pMaterial->m_color, power), m_position(position), m_pMaterial(pMaterial)
+	{
+		m_shapeType = "PointLight";
+	}
+	virtual ~PointLight() {}
+	virtual bool intersect(Intersection&) { return false; }
+	virtual bool bounds(BoundingBox& box) const
+	{
+		box = BoundingBox(m_position, m_position);
+		return true;
+	}
+	virtual bool samplePoint(Rng&,
+							 const Point& position,
+							 Point& lightPosition,
+							 Vector& lightNormal)
+	{
+		lightPosition = m_position;
+		lightNormal = (position - m_position).normalized();
+		return true;
+	}
+	virtual Color sampledPower(const Point& position, const Point& lightPosition) const
+	{
+		return emitted() / (position - lightPosition).length2();
+	}
+	const Point& position() const { return m_position; }
+	const Material* material() const { return m_pMaterial; }
+protected:
+	Point m_position;
+	const Material* m_pMaterial;
+};
+
 
+// Point light shining into a cone: full intensity up to angle - falloff
+// from the axis, fading smoothly to nothing at angle (degrees)
+class SpotLight : public PointLight
+{
+public:
+	SpotLight(const Point& position,
+			  const Vector& direction,
+			  float angle,
+			  float falloff,
+			  const Material* pMaterial,
+			  float power)
+		: PointLight(position, pMaterial, power),
+		  m_direction(direction.normalized()),
+		  m_angle(angle),
+		  m_falloff(falloff),
+		  m_cosOuter(std::cos(angle * float(M_PI) / 180.0f)),
+		  m_cosInner(std::cos(std::max(angle - falloff, 0.0f) * float(M_PI) / 180.0f))
+	{
+		m_shapeType = "SpotLight";
+	}
+	virtual ~SpotLight() {}
+	// Points outside the cone get no sample at all
+	virtual bool samplePoint(Rng& rng,
+							 const Point& position,
+							 Point& lightPosition,
+							 Vector& lightNormal)
+	{
+		PointLight::samplePoint(rng, position, lightPosition, lightNormal);
+		return dot(lightNormal, m_direction) > m_cosOuter;
+	}
+	virtual Color sampledPower(const Point& position, const Point& lightPosition) const
+	{
+		Vector toPosition = position - lightPosition;
+		float d2 = toPosition.length2();
+		float cosAxis = dot(toPosition, m_direction) / std::sqrt(d2);
+		if (cosAxis <= m_cosOuter)
+		{
+			return Color();
+		}
+		float t = cosAxis >= m_cosInner ? 1.0f : (cosAxis - m_cosOuter) / (m_cosInner - m_cosOuter);
+		return emitted() * (t * t * (3.0f - 2.0f * t) / d2);
+	}
+	const Vector& direction() const { return m_direction; }
+	float angle() const { return m_angle; }
+	float falloff() const { return m_falloff; }
+protected:
+	Vector m_direction;
+	float m_angle, m_falloff;
+	float m_cosOuter, m_cosInner;
+};
+
+
+// Sphere of uniform radiance. Samples are spread evenly over the cone the
+// sphere subtends, so each lands on the visible cap.
+class SphereLight : public Light
+{
+public:
+	SphereLight(const Point& center, float radius, const Material* pMaterial, float power)
+		: Light(pMaterial->m_color, power), m_center(center), m_radius(radius), m_pMaterial(pMaterial)
+	{
+		m_shapeType = "SphereLight";
+	}
+	virtual ~SphereLight() {}
+	virtual bool intersect(Intersection& intersection)
+	{
+		if (!Sphere::intersectSphere(m_center, m_radius, intersection))
+		{
+			return false;
+		}
+		intersection.m_pShape = this;
+		intersection.m_pMaterial = m_pMaterial;
+		intersection.m_emitted = emitted();
+		return true;
+	}
+	virtual bool bounds(BoundingBox& box) const
+	{
+		box = BoundingBox(m_center - Vector(m_radius), m_center + Vector(m_radius));
+		return true;
+	}
+	virtual bool samplePoint(Rng& rng,
+							 const Point& position,
+							 Point& lightPosition,
+							 Vector& lightNormal)
+	{
+		Vector toCenter = m_center - position;
+		float d2 = toCenter.length2();
+		float oneMinusCosMax = coneSize(d2);
+		if (oneMinusCosMax <= 0.0f)
+		{
+			return false;
+		}
+		float d = std::sqrt(d2);
+		Vector w = toCenter * (1.0f / d);
+		Vector u, v;
+		makeBasis(w, u, v);
+		float cosTheta = 1.0f - rng.nextFloat() * oneMinusCosMax;
+		float sinTheta = std::sqrt(std::max(0.0f, 1.0f - cosTheta * cosTheta));
+		float phi = 2.0f * float(M_PI) * rng.nextFloat();
+		Vector direction = (u * std::cos(phi) + v * std::sin(phi)) * sinTheta + w * cosTheta;
+		// Nearer of the two points the direction crosses the sphere at
+		float t = d * cosTheta - std::sqrt(std::max(0.0f, m_radius * m_radius - d2 * sinTheta * sinTheta));
+		lightPosition = position + direction * t;
+		lightNormal = (lightPosition - m_center).normalized();
+		return true;
+	}
+	// The cone's solid angle is 2 pi (1 - cos theta_max)
+	virtual Color sampledPower(const Point& position, const Point&) const
+	{
+		return emitted() * (2.0f * coneSize((m_center - position).length2()));
+	}
+	// Even over the cone, so per unit area cos / (d^2 * solid angle) on
+	// the visible cap and nothing behind it
+	virtual float sampleDensity(const Point& position, const Point& lightPosition) const
+	{
+		float oneMinusCosMax = coneSize((m_center - position).length2());
+		Vector toPosition = position - lightPosition;
+		float d2 = toPosition.length2();
+		float cosLight = dot(toPosition, lightPosition - m_center) / (m_radius * std::sqrt(d2));
+		if (oneMinusCosMax <= 0.0f || !(cosLight > 0.0f))
+		{
+			return 0.0f;
+		}
+		return cosLight / (d2 * 2.0f * float(M_PI) * oneMinusCosMax);
+	}
+	const Point& center() const { return m_center; }
+	float radius() const { return m_radius; }
+	const Material* material() const { return m_pMaterial; }
+protected:
+	// 1 - cos of the half-angle of the cone seen from squared distance d2,
+	// written to stay accurate for small cones; 0 from inside
+	float coneSize(float d2) const
+	{
+		float sin2Max = m_radius * m_radius / d2;
+		return sin2Max < 1.0f ? sin2Max / (1.0f + std::sqrt(1.0f - sin2Max)) : 0.0f;
+	}
+
+	Point m_center;
+	float m_radius;
+	const Material* m_pMaterial;
+};
+
+
+// Disk of uniform radiance, emitting from the side its normal points to.
+// Points behind it get no sample; the others sample its area evenly,
+// converted to solid angle.
+class DiskLight : public Light
+{
+public:
+	DiskLight(const Point& center, const Vector& normal, float radius, const Material* pMaterial, float power)
+		: Light(pMaterial->m_color, power),
+		  m_center(center),
+		  m_normal(normal.normalized()),
+		  m_radius(radius),
+		  m_pMaterial(pMaterial)
+	{
+		m_shapeType = "DiskLight";
+		makeBasis(m_normal, m_u, m_v);
+	}
+	virtual ~DiskLight() {}
+	virtual bool intersect(Intersection& intersection)
+	{
+		const Ray& ray = intersection.m_ray;
+		float nDotD = dot(m_normal, ray.m_direction);
+		if (nDotD < EPSL && -nDotD < EPSL)
+		{
+			return false;
+		}
+		float t = dot(m_center - ray.m_origin, m_normal) / nDotD;
+		if (t >= intersection.m_t || t < kRayTMin ||
+			(ray.calculate(t) - m_center).length2() > m_radius * m_radius)
+		{
+			return false;
+		}
+		intersection.m_t = t;
+		intersection.m_pShape = this;
+		intersection.m_pMaterial = m_pMaterial;
+		intersection.m_emitted = nDotD < 0.0f ? emitted() : Color();
+		intersection.m_normal = nDotD < 0.0f ? m_normal : m_normal * -1.0f;
+		return true;
+	}
+	virtual bool bounds(BoundingBox& box) const
+	{
+		// Extent of the rim along each axis
+		Vector extent(m_radius * std::sqrt(std::max(0.0f, 1.0f - m_normal.m_x * m_normal.m_x)),
+					  m_radius * std::sqrt(std::max(0.0f, 1.0f - m_normal.m_y * m_normal.m_y)),
+					  m_radius * std::sqrt(std::max(0.0f, 1.0f - m_normal.m_z * m_normal.m_z)));
+		box = BoundingBox(m_center - extent, m_center + extent);
+		return true;
+	}
+	virtual bool samplePoint(Rng& rng,
+							 const Point& position,
+							 Point& lightPosition,
+							 Vector& lightNormal)
+	{
+		if (dot(position - m_center, m_normal) <= 0.0f)
+		{
+			return false;
+		}
+		float r = m_radius * std::sqrt(rng.nextFloat());
+		float phi = 2.0f * float(M_PI) * rng.nextFloat();
+		lightPosition = m_center + (m_u * std::cos(phi) + m_v * std::sin(phi)) * r;
+		lightNormal = m_normal;
+		return true;
+	}
+	// An area sample's density per unit solid angle is d^2 / (A cos)
+	virtual Color sampledPower(const Point& position, const Point& lightPosition) const
+	{
+		Vector toPosition = position - lightPosition;
+		float d2 = toPosition.length2();
+		float cosLight = dot(toPosition, m_normal) / std::sqrt(d2);
+		if (cosLight <= 0.0f)
+		{
+			return Color();
+		}
+		return emitted() * (m_radius * m_radius * cosLight / d2);
+	}
+	virtual float sampleDensity(const Point& position, const Point&) const
+	{
+		return dot(position - m_center, m_normal) > 0.0f ? 1.0f / (float(M_PI) * m_radius * m_radius) : 0.0f;
+	}
+	const Point& center() const { return m_center; }
+	const Vector& normal() const { return m_normal; }
+	float radius() const { return m_radius; }
+	const Material* material() const { return m_pMaterial; }
+protected:
+	Point m_center;
+	Vector m_normal;
+	Vector m_u, m_v;
+	float m_radius;
+	const Material* m_pMaterial;
+};
 
 
 }// namespace Tracer
@@ -1,75 +1,341 @@
 #ifndef __MATERIAL_H__
 #define __MATERIAL_H__
 
+#include <vector>
 #include "util.h"
 #include "ray.h"
+#include "arena.h"
+#include "shading_kernel.h"
 
 namespace Tracer
 {
 
+// The closed set of scattering models a material can use. Shading switches
+// on this instead of going through a virtual call per light sample, so hits
+// can also be sorted and shaded in batches of one type.
+enum BsdfType
+{
+    kBsdfLambert,
+    kBsdfPhong,
+    kBsdfMirror,
+    kBsdfDielectric,
+    kNumBsdfTypes
+};
+
+const unsigned int kInvalidMaterialId = ~0u;
+
+class Texture;
+
 
 class Material
 {
 public:
-	virtual ~Material() { }
-    
-    
-    virtual Color getColor(const Point& position,
-                           const Vector& normal,
-                           const Vector& incomingRayDirection,
-                           const Vector& lightDirection,
-						   const Color& incomingPower) const = 0; 
-    Color m_color;	
+    Material()
+        : m_type(kBsdfLambert),
+          m_id(kInvalidMaterialId),
+          m_color(),
+          m_kAmbient(0.0f),
+          m_rReflect(0.0f),
+          m_rRefract(0.0f),
+          m_kDiffuse(1.0f),
+          m_kSpecular(0.0f),
+          m_exponent(1.0f),
+          m_ior(1.0f),
+          m_pow(1.0f),
+          m_pTexture(NULL),
+          m_uvScale(1.0f)
+    {
+
+    }
+
+    // Direct lighting from one light sample; normal and lightDirection must
+    // be unit length.
+    inline Color getColor(const Point& position,
+                          const Vector& normal,
+                          const Vector& incomingRayDirection,
+                          const Vector& lightDirection,
+                          const Color& incomingPower) const;
+
+    // getColor() of every light sample of batch, into the batch's colors
+    inline void getColorBatch(const Point& position,
+                              const Vector& normal,
+                              const Vector& incomingRayDirection,
+                              LightSampleBatch& batch) const;
+
+    BsdfType m_type;
+    // Index into the MaterialTable this material lives in
+    unsigned int m_id;
+    Color m_color;
 	float m_kAmbient;
 	float m_rReflect;
 	float m_rRefract;
+    float m_kDiffuse;
+    float m_kSpecular;
+    float m_exponent;
+    // Index of refraction, used by dielectrics
+    float m_ior;
+    // Specular exponentiation, specialized for m_exponent at construction
+    PowKernel m_pow;
+    // Image multiplying m_color across the surface, or NULL; owned by the
+    // TextureCache. m_uvScale repeats it that many times per uv unit.
+    const Texture* m_pTexture;
+    float m_uvScale;
+};
+
+
+//
+// Per-type shading kernels. Each specialization evaluates one light sample
+// and a batch of light samples for its BSDF type.
+//
+
+template <BsdfType kType>
+struct BsdfKernel;
+
+
+template <>
+struct BsdfKernel<kBsdfLambert>
+{
+    static Color eval(const Material& m,
+                      const Vector& normal,
+                      const Vector& incomingRayDirection,
+                      const Vector& lightDirection,
+                      const Color& incomingPower)
+    {
+        return m.m_kDiffuse * std::max(0.0f, dot(lightDirection, normal)) * incomingPower * m.m_color;
+    }
+
+    static void evalBatch(const Material& m,
+                          const Vector& normal,
+                          const Vector& incomingRayDirection,
+                          LightSampleBatch& batch)
+    {
+        const float nx = normal.m_x, ny = normal.m_y, nz = normal.m_z;
+        const float kr = m.m_kDiffuse * m.m_color.m_r;
+        const float kg = m.m_kDiffuse * m.m_color.m_g;
+        const float kb = m.m_kDiffuse * m.m_color.m_b;
+
+        #pragma omp simd
+        for (size_t i = 0; i < batch.m_count; ++i)
+        {
+            float nDotL = batch.m_dirX[i] * nx + batch.m_dirY[i] * ny + batch.m_dirZ[i] * nz;
+            nDotL = nDotL > 0.0f ? nDotL : 0.0f;
+            batch.m_colorR[i] = nDotL * batch.m_powerR[i] * kr;
+            batch.m_colorG[i] = nDotL * batch.m_powerG[i] * kg;
+            batch.m_colorB[i] = nDotL * batch.m_powerB[i] * kb;
+        }
+    }
+};
+
+
+template <>
+struct BsdfKernel<kBsdfPhong>
+{
+    static Color eval(const Material& m,
+                      const Vector& normal,
+                      const Vector& incomingRayDirection,
+                      const Vector& lightDirection,
+                      const Color& incomingPower)
+    {
+        // Neither lobe sees light from below the surface
+        float nDotL = dot(lightDirection, normal);
+        if (nDotL <= 0.0f)
+        {
+            return Color();
+        }
+		Vector H = (lightDirection - incomingRayDirection).normalized();
+        return m.m_kSpecular * m.m_pow(std::max(0.0f, dot(H, normal))) * incomingPower * m.m_color +
+               m.m_kDiffuse * nDotL * incomingPower * m.m_color;
+    }
+
+    static void evalBatch(const Material& m,
+                          const Vector& normal,
+                          const Vector& incomingRayDirection,
+                          LightSampleBatch& batch)
+    {
+        shadeBlinnPhongBatch(batch, normal, incomingRayDirection,
+                             m.m_kDiffuse, m.m_kSpecular, m.m_pow, m.m_color);
+    }
+};
+
+
+// Black for every sample of batch, for the BSDFs lit only through their
+// scattered rays
+inline void clearBatchColors(LightSampleBatch& batch)
+{
+    for (size_t i = 0; i < batch.m_count; ++i)
+    {
+        batch.m_colorR[i] = batch.m_colorG[i] = batch.m_colorB[i] = 0.0f;
+    }
+}
+
+
+// Perfect specular surfaces only see lights through the reflected ray
+template <>
+struct BsdfKernel<kBsdfMirror>
+{
+    static Color eval(const Material&, const Vector&, const Vector&, const Vector&, const Color&)
+    {
+        return Color();
+    }
+
+    static void evalBatch(const Material&, const Vector&, const Vector&, LightSampleBatch& batch)
+    {
+        clearBatchColors(batch);
+    }
+};
+
+
+// Smooth dielectrics are lit through their reflected/transmitted rays only
+template <>
+struct BsdfKernel<kBsdfDielectric>
+{
+    static Color eval(const Material&, const Vector&, const Vector&, const Vector&, const Color&)
+    {
+        return Color();
+    }
+
+    static void evalBatch(const Material&, const Vector&, const Vector&, LightSampleBatch& batch)
+    {
+        clearBatchColors(batch);
+    }
+};
+
+
+inline Color Material::getColor(const Point& position,
+                                const Vector& normal,
+                                const Vector& incomingRayDirection,
+                                const Vector& lightDirection,
+                                const Color& incomingPower) const
+{
+    switch (m_type)
+    {
+        case kBsdfLambert:
+            return BsdfKernel<kBsdfLambert>::eval(*this, normal, incomingRayDirection, lightDirection, incomingPower);
+        case kBsdfPhong:
+            return BsdfKernel<kBsdfPhong>::eval(*this, normal, incomingRayDirection, lightDirection, incomingPower);
+        case kBsdfMirror:
+            return BsdfKernel<kBsdfMirror>::eval(*this, normal, incomingRayDirection, lightDirection, incomingPower);
+        case kBsdfDielectric:
+            return BsdfKernel<kBsdfDielectric>::eval(*this, normal, incomingRayDirection, lightDirection, incomingPower);
+        default:
+            return Color();
+    }
+}
+
+
+inline void Material::getColorBatch(const Point& position,
+                                    const Vector& normal,
+                                    const Vector& incomingRayDirection,
+                                    LightSampleBatch& batch) const
+{
+    switch (m_type)
+    {
+        case kBsdfLambert:
+            BsdfKernel<kBsdfLambert>::evalBatch(*this, normal, incomingRayDirection, batch);
+            break;
+        case kBsdfPhong:
+            BsdfKernel<kBsdfPhong>::evalBatch(*this, normal, incomingRayDirection, batch);
+            break;
+        case kBsdfMirror:
+            BsdfKernel<kBsdfMirror>::evalBatch(*this, normal, incomingRayDirection, batch);
+            break;
+        case kBsdfDielectric:
+            BsdfKernel<kBsdfDielectric>::evalBatch(*this, normal, incomingRayDirection, batch);
+            break;
+        default:
+            clearBatchColors(batch);
+            break;
+    }
+}
+
+
+//
+// Convenience constructors for each BSDF type. They only fill in the
+// Material fields, so they can be copied into a MaterialTable by value.
+//
+
+class LambertMaterial : public Material
+{
+public:
+    LambertMaterial(const Color& color, float kDiffuse = 1.0f, float kAmbient = 0.0f, float rReflect = 0.0f)
+    {
+        m_type = kBsdfLambert;
+        m_color = color;
+        m_kDiffuse = kDiffuse;
+        m_kAmbient = kAmbient;
+        m_rReflect = rReflect;
+    }
 };
 
 
 class PhongMaterial : public Material
 {
 public:
-	PhongMaterial(const Color& color, float exponent,float k1, float k2, float k3,float rReflect = 0.0f, float rRefract = 0.0f) : 
-					m_exponent(exponent), 
-					m_kReflect(k2),
-					m_kDiffuse(k1)
-					
-					{
-						m_color = color;
-						m_kAmbient = k3;
-						m_rReflect = rReflect;
-						m_rRefract = rRefract;
-					}
-    
-    virtual ~PhongMaterial() { }
-    
-    virtual Color getColor(const Point& position,
-                           const Vector& normal,
-                           const Vector& incomingRayDirection,
-                           const Vector& lightDirectionNorm,
-						   const Color& incomingPower) const 
-    {
-        //Vector reflect = 2*dot(lightDirectionNorm,normal)*normal + lightDirectionNorm;
-		//reflect.normalize();
-		//std::cout<<"3";
-
-		Vector H =  (lightDirectionNorm - incomingRayDirection ).normalized();
-		normal.normalize();
-        Color res = 
-			   //(m_kReflect * std::pow(std::max(0.0f, -dot(reflect, incomingRayDirection)), m_exponent)* incomingPower + 
-				m_kReflect * std::pow(std::max(0.0f,dot(H,normal)),m_exponent)* incomingPower * m_color +
-			    m_kDiffuse * std::max(0.0f,dot(lightDirectionNorm, normal))* incomingPower * m_color;
-		//std::cout<<std::pow(std::max(0.0f, -dot(reflect, incomingRayDirection)),m_exponent)<<reflect<<incomingRayDirection<<std::endl;
-		//std::cout<<"4";
-		return res;
+	PhongMaterial(const Color& color, float exponent,float k1, float k2, float k3,float rReflect = 0.0f, float rRefract = 0.0f)
+	{
+		m_type = kBsdfPhong;
+		m_color = color;
+		m_exponent = exponent;
+		m_pow = PowKernel(exponent);
+		m_kDiffuse = k1;
+		m_kSpecular = k2;
+		m_kAmbient = k3;
+		m_rReflect = rReflect;
+		m_rRefract = rRefract;
 	}
-    
+};
+
+
+class MirrorMaterial : public Material
+{
+public:
+    explicit MirrorMaterial(const Color& color = Color(1.0f, 1.0f, 1.0f))
+    {
+        m_type = kBsdfMirror;
+        m_color = color;
+        m_kDiffuse = 0.0f;
+        m_rReflect = 1.0f;
+    }
+};
+
+
+// Smooth glass-like interface; m_color tints the transmitted light
+class DielectricMaterial : public Material
+{
+public:
+    DielectricMaterial(const Color& color, float ior = 1.5f)
+    {
+        m_type = kBsdfDielectric;
+        m_color = color;
+        m_kDiffuse = 0.0f;
+        m_rRefract = 1.0f;
+        m_ior = ior;
+    }
+};
+
+
+//
+// All materials in a scene, indexed by material ID. Entries never move, so
+// shapes may point at a material as soon as it has been added.
+//
+class MaterialTable
+{
+public:
+    unsigned int addMaterial(const Material& material)
+    {
+        unsigned int id = (unsigned int)m_materials.size();
+        m_materials.create(material)->m_id = id;
+        return id;
+    }
+
+    const Material& operator [](unsigned int id) const { return m_materials[id]; }
+    const Material* get(unsigned int id) const { return &m_materials[id]; }
+
+    size_t size() const { return m_materials.size(); }
+    void clear() { m_materials.clear(); }
+
 protected:
-    //Color m_color;
-	float m_exponent;
-	float m_kDiffuse;
-	float m_kReflect;
-	
+    ObjectPool<Material> m_materials;
 };
 
 
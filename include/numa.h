@@ -0,0 +1,246 @@
+#ifndef __NUMA_H__
+#define __NUMA_H__
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "omp.h"
+#include "util.h"
+#include "shape.h"
+#include "light_source.h"
+
+namespace Tracer
+{
+
+//
+// NUMA support without libnuma: the topology comes from sysfs, threads are
+// pinned with pthread_setaffinity_np and memory placement goes through the
+// mbind and set_mempolicy system calls. On a machine with one node (or
+// without sysfs) all of it degrades to plain, unpinned rendering.
+//
+
+// "0-3,8,10-11" -> 0 1 2 3 8 10 11
+inline bool parseCpuList(const std::string& text, std::vector<int>& cpus)
+{
+    std::istringstream in(text);
+    std::string range;
+    while (std::getline(in, range, ','))
+    {
+        int first, last;
+        char dash;
+        std::istringstream r(range);
+        if (!(r >> first))
+        {
+            return false;
+        }
+        last = first;
+        if (r >> dash && (dash != '-' || !(r >> last)))
+        {
+            return false;
+        }
+        for (int cpu = first; cpu <= last; ++cpu)
+        {
+            cpus.push_back(cpu);
+        }
+    }
+    return true;
+}
+
+
+class NumaTopology
+{
+public:
+    // Reads the nodes that have CPUs from /sys/devices/system/node. Without
+    // it the machine is taken as one node with the CPUs the process may run
+    // on, and false is returned.
+    bool detect()
+    {
+        m_nodes.clear();
+        DIR* dir = opendir("/sys/devices/system/node");
+        if (dir)
+        {
+            while (dirent* entry = readdir(dir))
+            {
+                std::string name = entry->d_name;
+                if (name.compare(0, 4, "node") != 0 || name.size() == 4 ||
+                    name.find_first_not_of("0123456789", 4) != std::string::npos)
+                {
+                    continue;
+                }
+                std::ifstream in(("/sys/devices/system/node/" + name + "/cpulist").c_str());
+                std::string list;
+                std::vector<int> cpus;
+                if (std::getline(in, list) && parseCpuList(list, cpus) && !cpus.empty())
+                {
+                    addNode(atoi(name.c_str() + 4), cpus);
+                }
+            }
+            closedir(dir);
+        }
+        if (m_nodes.empty())
+        {
+            std::vector<int> cpus;
+            cpu_set_t set;
+            if (sched_getaffinity(0, sizeof(set), &set) == 0)
+            {
+                for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+                {
+                    if (CPU_ISSET(cpu, &set))
+                    {
+                        cpus.push_back(cpu);
+                    }
+                }
+            }
+            addNode(0, cpus.empty() ? std::vector<int>(1, 0) : cpus);
+            return false;
+        }
+        return true;
+    }
+
+    // Nodes are kept sorted by their OS number
+    void addNode(int id, const std::vector<int>& cpus)
+    {
+        Node node;
+        node.m_id = id;
+        node.m_cpus = cpus;
+        std::vector<Node>::iterator pos = m_nodes.begin();
+        while (pos != m_nodes.end() && pos->m_id < id)
+        {
+            ++pos;
+        }
+        m_nodes.insert(pos, node);
+    }
+
+    size_t numNodes() const { return m_nodes.size(); }
+    // OS number of the i-th node
+    int nodeId(size_t i) const { return m_nodes[i].m_id; }
+    const std::vector<int>& cpus(size_t i) const { return m_nodes[i].m_cpus; }
+
+protected:
+    struct Node
+    {
+        int m_id;
+        std::vector<int> m_cpus;
+    };
+
+    std::vector<Node> m_nodes;
+};
+
+
+// Restricts the calling thread to the given CPUs
+inline bool pinCurrentThread(const std::vector<int>& cpus)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i = 0; i < cpus.size(); ++i)
+    {
+        CPU_SET(cpus[i], &set);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+
+// Memory policy of the calling thread for pages it touches from now on:
+// MPOL_DEFAULT (node-local), MPOL_PREFERRED or MPOL_INTERLEAVE over nodes
+inline bool setMemoryPolicy(int mode, const std::vector<int>& nodes = std::vector<int>())
+{
+    unsigned long mask[16] = { 0 };
+    const unsigned long bitsPerWord = 8 * sizeof(unsigned long);
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        if (nodes[i] >= 0 && size_t(nodes[i]) < 16 * bitsPerWord)
+        {
+            mask[nodes[i] / bitsPerWord] |= 1ul << (nodes[i] % bitsPerWord);
+        }
+    }
+    return syscall(SYS_set_mempolicy, mode, nodes.empty() ? NULL : mask,
+                   nodes.empty() ? 0 : 16 * bitsPerWord + 1) == 0;
+}
+
+
+// Moves the whole pages inside [p, p + size) to node and keeps them there
+inline bool bindMemoryToNode(const void* p, size_t size, int node)
+{
+    const unsigned long bitsPerWord = 8 * sizeof(unsigned long);
+    if (node < 0 || size_t(node) >= 16 * bitsPerWord)
+    {
+        return false;
+    }
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t begin = ((size_t)p + pageSize - 1) & ~(pageSize - 1);
+    size_t end = ((size_t)p + size) & ~(pageSize - 1);
+    if (end <= begin)
+    {
+        return true;
+    }
+    unsigned long mask[16] = { 0 };
+    mask[node / bitsPerWord] = 1ul << (node % bitsPerWord);
+    return syscall(SYS_mbind, begin, end - begin, MPOL_BIND, mask,
+                   16 * bitsPerWord + 1, MPOL_MF_MOVE) == 0;
+}
+
+
+//
+// How a render is spread over the nodes: the node each OpenMP thread is
+// pinned to and, per node, the copy of the scene its threads trace
+// against (the same one everywhere unless the scene is replicated).
+// Nodes are indices into the topology; m_nodeIds has their OS numbers.
+//
+struct NumaPlacement
+{
+    std::vector<size_t> m_threadNode;
+    std::vector<int> m_nodeIds;
+    std::vector<ShapeSet*> m_masterSets;
+    std::vector<const std::vector<Light*>*> m_lights;
+
+    size_t numNodes() const { return m_nodeIds.size(); }
+
+    size_t threadNode(size_t thread) const
+    {
+        return thread < m_threadNode.size() ? m_threadNode[thread] : 0;
+    }
+
+    // Pins the OpenMP threads round-robin over the nodes, one CPU each, so
+    // any thread count spreads evenly; returns false if pinning failed
+    bool pinThreads(const NumaTopology& topology)
+    {
+        size_t numNodes = topology.numNodes();
+        m_nodeIds.resize(numNodes);
+        for (size_t n = 0; n < numNodes; ++n)
+        {
+            m_nodeIds[n] = topology.nodeId(n);
+        }
+        m_threadNode.assign(std::max(omp_get_max_threads(), 1), 0);
+        bool pinned = true;
+        #pragma omp parallel
+        {
+            size_t t = (size_t)omp_get_thread_num();
+            size_t node = t % numNodes;
+            const std::vector<int>& cpus = topology.cpus(node);
+            std::vector<int> cpu(1, cpus[(t / numNodes) % cpus.size()]);
+            if (t < m_threadNode.size())
+            {
+                m_threadNode[t] = node;
+            }
+            if (!pinCurrentThread(cpu))
+            {
+                #pragma omp atomic write
+                pinned = false;
+            }
+        }
+        return pinned;
+    }
+};
+
+}//namespace Tracer
+
+#endif
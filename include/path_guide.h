@@ -0,0 +1,501 @@
+#ifndef __PATH_GUIDE_H__
+#define __PATH_GUIDE_H__
+
+#include <atomic>
+#include <cmath>
+#include <vector>
+#include "util.h"
+
+namespace Tracer
+{
+
+//
+// Path guiding with an SD-tree (Mueller et al., "Practical Path Guiding
+// for Efficient Light-Transport Simulation", 2017).
+//
+// The guide learns where indirect light comes from: a binary tree over
+// space (the S-tree) whose leaves each hold a quadtree over directions
+// (a D-tree) of the radiance arriving there. Rendering samples directions
+// from the D-tree of the leaf holding the shading point and records what
+// each sampled ray brought back into a second, training D-tree.
+//
+// Learning runs in iterations, one per progressive pass. During a pass the
+// trees keep their shape: recording only adds to the sums of existing
+// nodes with atomic operations, and sampling only reads the distribution
+// of the previous iteration, so worker threads share the guide without
+// locks. Between passes refine() makes the training D-trees the new
+// sampling ones, subdivides their busiest directions into fresh training
+// trees, and splits the spatial leaves that received many samples. The
+// first pass only measures where the shading points lie, to size the
+// S-tree's box.
+//
+// Directions are mapped to the unit square by (cos theta, phi) around z,
+// which preserves area, so a density on the square is 4 pi times the
+// density per steradian.
+//
+
+// A D-tree node's quadrant is subdivided once it holds this fraction of
+// the tree's energy
+const float kGuideSubdivide = 0.01f;
+const size_t kGuideMaxDepth = 20;
+// A spatial leaf is split once it saw this many samples times the square
+// root of 2^iteration in the last pass
+const size_t kGuideSplitSamples = 4000;
+
+
+// Float addition on an atomic float
+inline void atomicAdd(std::atomic<float>& target, float value)
+{
+    float current = target.load(std::memory_order_relaxed);
+    while (!target.compare_exchange_weak(current, current + value, std::memory_order_relaxed))
+    {
+    }
+}
+
+
+//
+// Quadtree over the square of directions. Each node stores the energy of
+// its four quadrants and the children subdividing them (0 for none).
+//
+class DTree
+{
+public:
+    DTree() : m_nodes(1) { }
+
+    static void toSquare(const Vector& direction, float& x, float& y)
+    {
+        x = std::min(std::max(0.5f * (direction.m_z + 1.0f), 0.0f), 1.0f);
+        float phi = std::atan2(direction.m_y, direction.m_x);
+        y = phi / (2.0f * float(M_PI));
+        y -= std::floor(y);
+    }
+
+    static Vector fromSquare(float x, float y)
+    {
+        float cosTheta = 2.0f * x - 1.0f;
+        float sinTheta = std::sqrt(std::max(0.0f, 1.0f - cosTheta * cosTheta));
+        float phi = 2.0f * float(M_PI) * y;
+        return Vector(sinTheta * std::cos(phi), sinTheta * std::sin(phi), cosTheta);
+    }
+
+    float energy() const
+    {
+        const Node& root = m_nodes[0];
+        return root.sum(0) + root.sum(1) + root.sum(2) + root.sum(3);
+    }
+
+    size_t numNodes() const { return m_nodes.size(); }
+
+    // Adds value to every node on the way to the direction's leaf; safe
+    // to call from several threads at once
+    void record(const Vector& direction, float value)
+    {
+        float x, y;
+        toSquare(direction, x, y);
+        for (size_t node = 0; ; )
+        {
+            size_t q = quadrant(x, y);
+            atomicAdd(m_nodes[node].m_sum[q], value);
+            if (!m_nodes[node].m_child[q])
+            {
+                return;
+            }
+            node = m_nodes[node].m_child[q];
+        }
+    }
+
+    // Direction drawn in proportion to the energy, and its density per
+    // steradian; the tree must have energy
+    float sample(Rng& rng, Vector& direction) const
+    {
+        float x0 = 0.0f, y0 = 0.0f, size = 1.0f;
+        float pdf = 1.0f;
+        for (size_t node = 0; ; )
+        {
+            const Node& n = m_nodes[node];
+            float sums[4] = { n.sum(0), n.sum(1), n.sum(2), n.sum(3) };
+            float total = sums[0] + sums[1] + sums[2] + sums[3];
+            if (!(total > 0.0f))
+            {
+                break;
+            }
+            float u = rng.nextFloat() * total;
+            size_t q = 0;
+            while (q < 3 && u >= sums[q])
+            {
+                u -= sums[q++];
+            }
+            if (sums[q] <= 0.0f)
+            {
+                // Rounding picked an empty quadrant; take the last one with energy
+                for (q = 3; sums[q] <= 0.0f; --q)
+                {
+                }
+            }
+            pdf *= 4.0f * sums[q] / total;
+            size *= 0.5f;
+            x0 += (q & 1) ? size : 0.0f;
+            y0 += (q & 2) ? size : 0.0f;
+            if (!n.m_child[q])
+            {
+                break;
+            }
+            node = n.m_child[q];
+        }
+        direction = fromSquare(x0 + rng.nextFloat() * size, y0 + rng.nextFloat() * size);
+        return pdf / (4.0f * float(M_PI));
+    }
+
+    // Density of sample() for direction, per steradian
+    float pdf(const Vector& direction) const
+    {
+        float x, y;
+        toSquare(direction, x, y);
+        float pdf = 1.0f;
+        for (size_t node = 0; ; )
+        {
+            const Node& n = m_nodes[node];
+            float total = n.sum(0) + n.sum(1) + n.sum(2) + n.sum(3);
+            if (!(total > 0.0f))
+            {
+                break;
+            }
+            size_t q = quadrant(x, y);
+            pdf *= 4.0f * n.sum(q) / total;
+            if (!n.m_child[q] || pdf <= 0.0f)
+            {
+                break;
+            }
+            node = n.m_child[q];
+        }
+        return pdf / (4.0f * float(M_PI));
+    }
+
+    // Empty tree shaped after this one's energy: a quadrant holding more
+    // than kGuideSubdivide of the total keeps its children, or gets them
+    // if it had none, so the tree deepens by up to a level per iteration;
+    // the other quadrants stay (or become) leaves
+    DTree refined() const
+    {
+        DTree tree;
+        float total = energy();
+        if (!(total > 0.0f))
+        {
+            tree.m_nodes = m_nodes;
+            tree.clearSums();
+            return tree;
+        }
+        // Pairs of (node here, node in tree) still to visit, with depth
+        std::vector<size_t> stack(1, 0);
+        std::vector<size_t> targets(1, 0);
+        std::vector<size_t> depths(1, 1);
+        while (!stack.empty())
+        {
+            size_t node = stack.back(), target = targets.back(), depth = depths.back();
+            stack.pop_back();
+            targets.pop_back();
+            depths.pop_back();
+            for (size_t q = 0; q < 4; ++q)
+            {
+                if (depth >= kGuideMaxDepth || m_nodes[node].sum(q) <= kGuideSubdivide * total)
+                {
+                    continue;
+                }
+                size_t child = tree.m_nodes.size();
+                tree.m_nodes.push_back(Node());
+                tree.m_nodes[target].m_child[q] = (unsigned int)child;
+                if (m_nodes[node].m_child[q])
+                {
+                    stack.push_back(m_nodes[node].m_child[q]);
+                    targets.push_back(child);
+                    depths.push_back(depth + 1);
+                }
+            }
+        }
+        return tree;
+    }
+
+protected:
+    struct Node
+    {
+        std::atomic<float> m_sum[4];
+        unsigned int m_child[4];
+
+        Node()
+        {
+            for (size_t q = 0; q < 4; ++q)
+            {
+                m_sum[q].store(0.0f, std::memory_order_relaxed);
+                m_child[q] = 0;
+            }
+        }
+
+        Node(const Node& other) { *this = other; }
+
+        Node& operator =(const Node& other)
+        {
+            for (size_t q = 0; q < 4; ++q)
+            {
+                m_sum[q].store(other.sum(q), std::memory_order_relaxed);
+                m_child[q] = other.m_child[q];
+            }
+            return *this;
+        }
+
+        float sum(size_t q) const { return m_sum[q].load(std::memory_order_relaxed); }
+    };
+
+    // Quadrant of (x, y), which is then rescaled to the quadrant
+    static size_t quadrant(float& x, float& y)
+    {
+        size_t q = 0;
+        x *= 2.0f;
+        y *= 2.0f;
+        if (x >= 1.0f)
+        {
+            q |= 1;
+            x -= 1.0f;
+        }
+        if (y >= 1.0f)
+        {
+            q |= 2;
+            y -= 1.0f;
+        }
+        return q;
+    }
+
+    void clearSums()
+    {
+        for (size_t i = 0; i < m_nodes.size(); ++i)
+        {
+            for (size_t q = 0; q < 4; ++q)
+            {
+                m_nodes[i].m_sum[q].store(0.0f, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    std::vector<Node> m_nodes;
+};
+
+
+class PathGuide
+{
+public:
+    PathGuide()
+        : m_iteration(0)
+    {
+        for (size_t i = 0; i < 3; ++i)
+        {
+            m_seenMin[i].store(kRayTMax, std::memory_order_relaxed);
+            m_seenMax[i].store(-kRayTMax, std::memory_order_relaxed);
+        }
+    }
+
+    // Distribution to sample at position, or NULL while there is nothing
+    // learned there yet
+    const DTree* distribution(const Point& position) const
+    {
+        if (m_nodes.empty())
+        {
+            return NULL;
+        }
+        const Leaf& leaf = m_leaves[findLeaf(position)];
+        return leaf.m_sampling.energy() > 0.0f ? &leaf.m_sampling : NULL;
+    }
+
+    // Records that a ray from position in direction brought back radiance,
+    // already divided by the density the direction was drawn with. Safe
+    // to call from several threads at once.
+    void record(const Point& position, const Vector& direction, float radiance)
+    {
+        if (m_nodes.empty())
+        {
+            const float p[3] = { position.m_x, position.m_y, position.m_z };
+            for (size_t i = 0; i < 3; ++i)
+            {
+                atomicMin(m_seenMin[i], p[i]);
+                atomicMax(m_seenMax[i], p[i]);
+            }
+            return;
+        }
+        if (!(radiance >= 0.0f) || radiance >= kRayTMax)
+        {
+            return;
+        }
+        Leaf& leaf = m_leaves[findLeaf(position)];
+        leaf.m_training.record(direction, radiance);
+        leaf.m_numSamples.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Ends a learning iteration; no other thread may use the guide meanwhile
+    void refine()
+    {
+        if (m_nodes.empty())
+        {
+            buildRoot();
+            return;
+        }
+        ++m_iteration;
+        size_t threshold = size_t(float(kGuideSplitSamples) * std::sqrt(std::ldexp(1.0f, int(m_iteration))));
+        size_t numLeaves = m_leaves.size();
+        for (size_t i = 0; i < numLeaves; ++i)
+        {
+            Leaf& leaf = m_leaves[i];
+            leaf.m_sampling = leaf.m_training;
+            leaf.m_training = leaf.m_sampling.refined();
+        }
+        size_t numNodes = m_nodes.size();
+        for (size_t i = 0; i < numNodes; ++i)
+        {
+            if (m_nodes[i].m_child[0] == 0)
+            {
+                split(i, m_leaves[m_nodes[i].m_leaf].m_numSamples.load(), threshold);
+            }
+        }
+        for (size_t i = 0; i < m_leaves.size(); ++i)
+        {
+            m_leaves[i].m_numSamples.store(0);
+        }
+    }
+
+    size_t numLeaves() const { return m_leaves.size(); }
+
+    size_t numDirectionalNodes() const
+    {
+        size_t count = 0;
+        for (size_t i = 0; i < m_leaves.size(); ++i)
+        {
+            count += m_leaves[i].m_sampling.numNodes();
+        }
+        return count;
+    }
+
+protected:
+    // Learned and training distributions of a spatial leaf
+    struct Leaf
+    {
+        DTree m_sampling;
+        DTree m_training;
+        std::atomic<size_t> m_numSamples;
+
+        Leaf() { m_numSamples.store(0, std::memory_order_relaxed); }
+        Leaf(const Leaf& other) { *this = other; }
+
+        Leaf& operator =(const Leaf& other)
+        {
+            m_sampling = other.m_sampling;
+            m_training = other.m_training;
+            m_numSamples.store(other.m_numSamples.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            return *this;
+        }
+    };
+
+    // Splits along axis depth % 3 at the middle of the node's box; a
+    // leaf has no children and refers to its Leaf
+    struct SNode
+    {
+        unsigned int m_child[2];
+        unsigned int m_leaf;
+    };
+
+    static void atomicMin(std::atomic<float>& target, float value)
+    {
+        float current = target.load(std::memory_order_relaxed);
+        while (value < current &&
+               !target.compare_exchange_weak(current, value, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    static void atomicMax(std::atomic<float>& target, float value)
+    {
+        float current = target.load(std::memory_order_relaxed);
+        while (value > current &&
+               !target.compare_exchange_weak(current, value, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    void buildRoot()
+    {
+        for (size_t i = 0; i < 3; ++i)
+        {
+            float lo = m_seenMin[i].load(), hi = m_seenMax[i].load();
+            if (!(lo <= hi))
+            {
+                // Nothing was recorded; try again after the next pass
+                return;
+            }
+            // A little margin so the box's faces hold no points
+            float margin = 0.01f * (hi - lo) + 1.0e-3f;
+            m_min[i] = lo - margin;
+            m_max[i] = hi + margin;
+        }
+        SNode root = { { 0, 0 }, 0 };
+        m_nodes.push_back(root);
+        m_leaves.push_back(Leaf());
+    }
+
+    size_t findLeaf(const Point& position) const
+    {
+        const float p[3] = { position.m_x, position.m_y, position.m_z };
+        float lo[3] = { m_min[0], m_min[1], m_min[2] };
+        float hi[3] = { m_max[0], m_max[1], m_max[2] };
+        size_t node = 0;
+        for (size_t depth = 0; m_nodes[node].m_child[0]; ++depth)
+        {
+            size_t axis = depth % 3;
+            float middle = 0.5f * (lo[axis] + hi[axis]);
+            if (p[axis] < middle)
+            {
+                hi[axis] = middle;
+                node = m_nodes[node].m_child[0];
+            }
+            else
+            {
+                lo[axis] = middle;
+                node = m_nodes[node].m_child[1];
+            }
+        }
+        return m_nodes[node].m_leaf;
+    }
+
+    // Splits a leaf that saw numSamples samples while that is above
+    // threshold, assuming the samples fall evenly into the halves. The
+    // halves start from copies of the leaf's distributions.
+    void split(size_t node, size_t numSamples, size_t threshold)
+    {
+        if (numSamples <= threshold)
+        {
+            return;
+        }
+        unsigned int leaf = m_nodes[node].m_leaf;
+        unsigned int second = (unsigned int)m_leaves.size();
+        Leaf copy = m_leaves[leaf];
+        m_leaves.push_back(copy);
+        for (size_t c = 0; c < 2; ++c)
+        {
+            SNode child = { { 0, 0 }, c == 0 ? leaf : second };
+            m_nodes[node].m_child[c] = (unsigned int)m_nodes.size();
+            m_nodes.push_back(child);
+        }
+        split(m_nodes[node].m_child[0], numSamples / 2, threshold);
+        split(m_nodes[node].m_child[1], numSamples / 2, threshold);
+    }
+
+    std::vector<SNode> m_nodes;
+    std::vector<Leaf> m_leaves;
+    float m_min[3], m_max[3];
+    // Bounds of the points recorded before the S-tree exists
+    std::atomic<float> m_seenMin[3], m_seenMax[3];
+    size_t m_iteration;
+
+private:
+    PathGuide(const PathGuide&);
+    PathGuide& operator =(const PathGuide&);
+};
+
+}//namespace Tracer
+
+#endif
@@ -0,0 +1,261 @@
+#ifndef __PRIMARY_HITS_H__
+#define __PRIMARY_HITS_H__
+
+#include <vector>
+#include "util.h"
+#include "ray.h"
+#include "shape.h"
+#include "material.h"
+#include "light_source.h"
+#include "camera.h"
+#include "film.h"
+#include "settings.h"
+
+namespace Tracer
+{
+
+//
+// Camera hits of every pixel sample of a frame, kept so that a later
+// render of the same geometry through the same camera (typically a
+// lookdev iteration that only changed lights or materials) can skip the
+// primary intersections and go straight to shading.
+//
+// A render either records the hits or, if the last complete render was
+// recorded with the same layout (geometry hash, camera, image and tile
+// size, samples per pixel and seed), replays them. A replayed sample is
+// shot through the recorded offset within its pixel, so it lands where
+// the recorded hit is, whatever the random stream draws now.
+//
+// Lights are shapes too but are meant to change between renders, so the
+// geometry hash leaves them out and every replayed sample is tested
+// against the lights again: a light moved in front of a recorded hit
+// still hides it. A sample whose camera ray hit a light is recorded as
+// such and traced in full every time, as what lies behind the light is
+// not known.
+//
+// Hits are kept in tile order, like the film, so a tile's samples are
+// contiguous.
+//
+
+// PrimaryHit::m_material of a sample that saw a light; a sample that saw
+// nothing has kInvalidMaterialId
+const unsigned int kPrimaryHitLight = kInvalidMaterialId - 1;
+
+
+// Camera hit of one pixel sample (40 bytes); its position is m_t along
+// the camera ray through (m_dx, m_dy)
+struct PrimaryHit
+{
+    float m_dx, m_dy;
+    float m_t;
+    float m_normal[3];
+    float m_u, m_v, m_uvDensity;
+    // Id in the scene's MaterialTable, kPrimaryHitLight or
+    // kInvalidMaterialId
+    unsigned int m_material;
+};
+
+
+class PrimaryHitCache
+{
+public:
+    PrimaryHitCache()
+        : m_pMaterials(NULL),
+          m_replaying(false),
+          m_recording(false),
+          m_complete(false)
+    {
+
+    }
+
+    // Gets ready to render film (already sized, with the settings' tile
+    // size) of the scene with geometryHash and materials through camera:
+    // replays the last complete recording if its layout matches, else
+    // records a new one unless it would take more than maxBytes. Returns
+    // whether the render replays.
+    bool begin(unsigned long long geometryHash,
+               const MaterialTable& materials,
+               const Camera& camera,
+               const Film& film,
+               const RenderSettings& settings,
+               size_t maxBytes)
+    {
+        Layout layout;
+        layout.m_geometryHash = geometryHash;
+        layout.m_camera = camera;
+        layout.m_width = film.width();
+        layout.m_height = film.height();
+        layout.m_tileSize = film.tileSize();
+        layout.m_tilesX = film.tilesX();
+        layout.m_samplesPerPixel = settings.m_numPixelSamples;
+        layout.m_seed = settings.m_seed;
+
+        m_pMaterials = &materials;
+        m_replaying = m_complete && layout == m_layout;
+        m_recording = false;
+        if (m_replaying)
+        {
+            return true;
+        }
+
+        m_layout = layout;
+        m_complete = false;
+        size_t size = film.numTiles() * film.tileArea() * settings.m_numPixelSamples;
+        if (size * sizeof(PrimaryHit) > maxBytes)
+        {
+            m_hits.clear();
+            return false;
+        }
+        m_hits.resize(size);
+        m_recording = true;
+        return false;
+    }
+
+    // Ends the render begun last, which must have drawn every sample
+    void end()
+    {
+        m_complete = m_replaying || m_recording;
+        m_replaying = m_recording = false;
+    }
+
+    // Whether the current render replays or records hits; with neither
+    // it has no use for the cache
+    bool replaying() const { return m_replaying; }
+    bool active() const { return m_replaying || m_recording; }
+
+    // Offset (dx, dy) of hit's sample within its pixel: the recorded one
+    // when replaying; when recording, the one drawn, which is kept
+    void offset(PrimaryHit& hit, float& dx, float& dy) const
+    {
+        if (m_replaying)
+        {
+            dx = hit.m_dx;
+            dy = hit.m_dy;
+        }
+        else
+        {
+            hit.m_dx = dx;
+            hit.m_dy = dy;
+        }
+    }
+
+    // Hits of pixel (x, y)'s samples, in the order the samples are drawn
+    PrimaryHit* pixel(size_t x, size_t y)
+    {
+        size_t tileSize = m_layout.m_tileSize;
+        size_t tile = (y / tileSize) * m_layout.m_tilesX + x / tileSize;
+        size_t i = (tile * tileSize + y % tileSize) * tileSize + x % tileSize;
+        return &m_hits[i * m_layout.m_samplesPerPixel];
+    }
+
+    // Finds where intersection's ray (shot through the offset()) hits
+    // first, like masterSet.intersect(): when recording, by tracing
+    // it and keeping the result in hit; when replaying, from hit and the
+    // lights
+    bool intersect(PrimaryHit& hit,
+                   ShapeSet& masterSet,
+                   const std::vector<Light*>& lights,
+                   Intersection& intersection) const
+    {
+        if (m_recording)
+        {
+            bool found = masterSet.intersect(intersection);
+            hit.m_t = intersection.m_t;
+            hit.m_normal[0] = intersection.m_normal.m_x;
+            hit.m_normal[1] = intersection.m_normal.m_y;
+            hit.m_normal[2] = intersection.m_normal.m_z;
+            hit.m_u = intersection.m_u;
+            hit.m_v = intersection.m_v;
+            hit.m_uvDensity = intersection.m_uvDensity;
+            hit.m_material = !found ? kInvalidMaterialId
+                             : intersection.m_pShape->getShapeType().find("Light") != std::string::npos
+                               ? kPrimaryHitLight
+                               : intersection.m_pMaterial->m_id;
+            return found;
+        }
+        if (hit.m_material == kPrimaryHitLight)
+        {
+            return masterSet.intersect(intersection);
+        }
+
+        bool found = hit.m_material != kInvalidMaterialId;
+        if (found)
+        {
+            intersection.m_t = hit.m_t;
+            // The hit shape is not kept, only that it was no light
+            intersection.m_pShape = &masterSet;
+            intersection.m_pMaterial = m_pMaterials->get(hit.m_material);
+            intersection.m_normal = Vector(hit.m_normal[0], hit.m_normal[1], hit.m_normal[2]);
+            intersection.m_u = hit.m_u;
+            intersection.m_v = hit.m_v;
+            intersection.m_uvDensity = hit.m_uvDensity;
+        }
+        for (size_t l = 0; l < lights.size(); ++l)
+        {
+            if (lights[l]->intersect(intersection))
+            {
+                found = true;
+            }
+        }
+        return found;
+    }
+
+    // Memory the hits take
+    size_t bytes() const { return m_hits.size() * sizeof(PrimaryHit); }
+
+protected:
+    // What a recording can only be replayed for
+    struct Layout
+    {
+        Layout()
+            : m_geometryHash(0),
+              m_width(0),
+              m_height(0),
+              m_tileSize(0),
+              m_tilesX(0),
+              m_samplesPerPixel(0),
+              m_seed(0)
+        {
+
+        }
+
+        bool operator ==(const Layout& other) const
+        {
+            return m_geometryHash == other.m_geometryHash &&
+                   m_camera.m_fieldOfView == other.m_camera.m_fieldOfView &&
+                   same(m_camera.m_origin, other.m_camera.m_origin) &&
+                   same(m_camera.m_target, other.m_camera.m_target) &&
+                   same(m_camera.m_up, other.m_camera.m_up) &&
+                   m_width == other.m_width && m_height == other.m_height &&
+                   m_tileSize == other.m_tileSize &&
+                   m_samplesPerPixel == other.m_samplesPerPixel &&
+                   m_seed == other.m_seed;
+        }
+
+        static bool same(const Vector& a, const Vector& b)
+        {
+            return a.m_x == b.m_x && a.m_y == b.m_y && a.m_z == b.m_z;
+        }
+
+        unsigned long long m_geometryHash;
+        Camera m_camera;
+        size_t m_width, m_height, m_tileSize, m_tilesX;
+        size_t m_samplesPerPixel;
+        unsigned int m_seed;
+    };
+
+    std::vector<PrimaryHit> m_hits;
+    Layout m_layout;
+    const MaterialTable* m_pMaterials;
+    bool m_replaying, m_recording;
+    // Whether m_hits holds a complete recording for m_layout
+    bool m_complete;
+
+private:
+    PrimaryHitCache(const PrimaryHitCache&);
+    PrimaryHitCache& operator =(const PrimaryHitCache&);
+};
+
+}//namespace Tracer
+
+#endif
@@ -0,0 +1,352 @@
+#ifndef __PROGRESSIVE_H__
+#define __PROGRESSIVE_H__
+
+#include <iostream>
+#include <vector>
+#include "omp.h"
+#include "util.h"
+#include "arena.h"
+#include "numa.h"
+#include "shape.h"
+#include "light_source.h"
+#include "camera.h"
+#include "film.h"
+#include "integrator.h"
+#include "primary_hits.h"
+#include "settings.h"
+
+namespace Tracer
+{
+
+//
+// Tiled depth-first renderer working in progressive passes.
+//
+// Without a time budget it renders all m_numPixelSamples in a single pass.
+// With one it renders a 1 spp pass, estimates the cost of a sample from it
+// and keeps scheduling passes (at most doubling the sample count each time,
+// so the estimate is refreshed) as long as they are predicted to end before
+// the deadline. The 1 spp pass always covers every pixel, so no pixel is
+// left black however short the budget; in later passes a tile stops at
+// the first pixel it reaches after the hard deadline, keeping the samples
+// it has, so the frame can be resolved and written in time.
+//
+// Each thread splats its tile's samples into a FilmTile from its own frame
+// arena and merges it into the film when the tile is done. Tiles are the
+// film's own, so merging needs no synchronization. The shadow ray counts
+// are kept per tile too and summed once the tile is done.
+//
+
+// Fraction of the budget kept back for resolving and writing the image
+const double kDeadlineReserve = 0.05;
+
+
+class ProgressiveRenderer
+{
+public:
+    ProgressiveRenderer(ShapeSet& masterSet,
+                        const std::vector<Light*>& lights,
+                        const Camera& camera,
+                        const RenderSettings& settings)
+        : m_masterSet(masterSet),
+          m_lights(lights),
+          m_camera(camera),
+          m_settings(settings),
+          m_pArenas(&m_ownArenas),
+          m_pNuma(NULL),
+          m_pIrradiance(NULL),
+          m_pGuide(NULL),
+          m_pHits(NULL)
+    {
+
+    }
+
+    // Arenas for the per-thread tile buffers, kept by the caller so that
+    // they can be reused by the next renderer; by default the renderer has
+    // its own
+    void setFrameArenas(FrameArenas* pArenas) { m_pArenas = pArenas ? pArenas : &m_ownArenas; }
+
+    // Spreads the render over NUMA nodes as placed (by the caller, who keeps
+    // it alive): each node takes tiles from its own band of rows, traces
+    // against its own copy of the scene and keeps the band's part of the
+    // film in its memory. Threads move on to other bands
+    // once their own is done.
+    void setNumaPlacement(const NumaPlacement* pNuma) { m_pNuma = pNuma; }
+
+    // Irradiance cache (kept by the caller) for diffuse indirect light, or
+    // NULL for the ambient term. Every NUMA node shares it.
+    void setIrradianceCache(IrradianceCache* pCache) { m_pIrradiance = pCache; }
+
+    // Path guide (kept by the caller) that takes diffuse indirect light
+    // from guided rays when there is no irradiance cache, or NULL. The
+    // guide learns between passes, so without a time budget the frame is
+    // rendered in passes of 1, 2, 4, ... samples per pixel.
+    void setPathGuide(PathGuide* pGuide) { m_pGuide = pGuide; }
+
+    // Primary hit cache (kept by the caller, who begins and ends it around
+    // the frame) that records the camera hits or replays those of an
+    // earlier frame, or NULL. Only for renders without a time budget,
+    // whose samples are the same every time.
+    void setPrimaryHits(PrimaryHitCache* pHits) { m_pHits = pHits && pHits->active() ? pHits : NULL; }
+
+    // Adds samplesPerPass samples, following firstSample earlier ones, to
+    // every pixel reached before deadline (an omp_get_wtime() time, 0 for
+    // none). Returns false if pixels were left out.
+    bool renderPass(Film& film,
+                    size_t passIndex,
+                    size_t firstSample,
+                    size_t samplesPerPass,
+                    double deadline = 0.0)
+    {
+        size_t tilesX = film.tilesX();
+        size_t tilesY = film.tilesY();
+        size_t numTiles = film.numTiles();
+        unsigned int passSeed = m_settings.m_seed ^ hashUInt32((unsigned int)passIndex);
+        bool complete = true;
+
+        m_pArenas->ensure(size_t(omp_get_max_threads()));
+        m_pArenas->reset();
+        if (!m_pNuma)
+        {
+            #pragma omp parallel
+            {
+                FilmTile buffer;
+                buffer.reserve(m_pArenas->local(), film.tileArea());
+
+                #pragma omp for schedule(dynamic, 1)
+                for (size_t tile = 0; tile < numTiles; ++tile)
+                {
+                    if (!renderTile(film, tile, passSeed, firstSample, samplesPerPass, deadline,
+                                    m_masterSet, m_lights, buffer))
+                    {
+                        #pragma omp atomic write
+                        complete = false;
+                    }
+                }
+            }
+            return complete;
+        }
+
+        // Next unclaimed tile of every band
+        size_t numNodes = m_pNuma->numNodes();
+        std::vector<size_t> next(numNodes);
+        for (size_t n = 0; n < numNodes; ++n)
+        {
+            next[n] = bandBegin(n, tilesX, tilesY);
+        }
+        #pragma omp parallel
+        {
+            FilmTile buffer;
+            buffer.reserve(m_pArenas->local(), film.tileArea());
+            size_t home = m_pNuma->threadNode((size_t)omp_get_thread_num());
+            ShapeSet& masterSet = *m_pNuma->m_masterSets[home];
+            const std::vector<Light*>& lights = *m_pNuma->m_lights[home];
+
+            for (size_t k = 0; k < numNodes; ++k)
+            {
+                size_t band = (home + k) % numNodes;
+                size_t bandEnd = bandBegin(band + 1, tilesX, tilesY);
+                for (;;)
+                {
+                    size_t tile;
+                    #pragma omp atomic capture
+                    tile = next[band]++;
+                    if (tile >= bandEnd)
+                    {
+                        break;
+                    }
+                    if (!renderTile(film, tile, passSeed, firstSample, samplesPerPass, deadline,
+                                    masterSet, lights, buffer))
+                    {
+                        #pragma omp atomic write
+                        complete = false;
+                    }
+                }
+            }
+        }
+        return complete;
+    }
+
+    // Light samples and shadow rays of every pass rendered so far
+    const ShadowStats& shadowStats() const { return m_shadowStats; }
+
+    // Renders the frame into film (already sized, with the settings' tile
+    // size); returns the number of samples per pixel of the last complete
+    // pass
+    size_t render(Film& film)
+    {
+        const size_t maxSamples = m_settings.m_numPixelSamples;
+        const double budget = m_settings.m_timeBudget;
+
+        if (m_pNuma)
+        {
+            placeBands(film);
+        }
+        if (budget <= 0.0 && !m_pGuide)
+        {
+            renderPass(film, 0, 0, maxSamples);
+            return maxSamples;
+        }
+        if (budget <= 0.0)
+        {
+            size_t done = 0;
+            for (size_t pass = 0; done < maxSamples; ++pass)
+            {
+                size_t spp = std::min(size_t(1) << std::min(pass, size_t(30)), maxSamples - done);
+                renderPass(film, pass, done, spp);
+                m_pGuide->refine();
+                done += spp;
+            }
+            return maxSamples;
+        }
+
+        double start = omp_get_wtime();
+        double deadline = start + budget * (1.0 - kDeadlineReserve);
+        size_t done = 0;
+
+        for (size_t pass = 0; done < maxSamples; ++pass)
+        {
+            size_t spp = 1;
+            if (done > 0)
+            {
+                // Predict from everything rendered so far
+                double secondsPerSample = (omp_get_wtime() - start) / double(done);
+                double remaining = deadline - omp_get_wtime();
+                if (remaining < secondsPerSample)
+                {
+                    break;
+                }
+                spp = std::min(size_t(remaining / secondsPerSample), done);
+                spp = std::min(spp, maxSamples - done);
+            }
+
+            // The first pass is finished whatever the time, as skipped
+            // pixels would have no sample at all
+            double passStart = omp_get_wtime();
+            bool complete = renderPass(film, pass, done, spp, done > 0 ? deadline : 0.0);
+            if (m_settings.m_verbose)
+            {
+                std::cerr << "pass " << pass << ": " << spp << " spp in "
+                          << omp_get_wtime() - passStart << " s"
+                          << (complete ? "" : " (cut short by the deadline)") << std::endl;
+            }
+            if (!complete)
+            {
+                break;
+            }
+            if (m_pGuide)
+            {
+                m_pGuide->refine();
+            }
+            done += spp;
+        }
+        return done;
+    }
+
+protected:
+    // Samples one tile into buffer, then merges it into film; returns
+    // false if the deadline passed first and pixels were left out
+    bool renderTile(Film& film,
+                    size_t tile,
+                    unsigned int passSeed,
+                    size_t firstSample,
+                    size_t samplesPerPass,
+                    double deadline,
+                    ShapeSet& masterSet,
+                    const std::vector<Light*>& lights,
+                    FilmTile& buffer)
+    {
+        const size_t width = film.width();
+        const size_t height = film.height();
+        const float pixelSpread = m_camera.pixelSpread(width, height);
+        const float cullThreshold = float(m_settings.m_shadowCullThreshold);
+        ShadowStats stats;
+
+        // Random generator, one stream per tile and pass so threads never
+        // share state
+        Rng rng = Rng::forStream(passSeed, (unsigned int)tile);
+        size_t x0, y0, x1, y1;
+        film.tileBounds(tile, x0, y0, x1, y1);
+        buffer.setRect(film.filter(), x0, y0, x1, y1, tile);
+
+        bool complete = true;
+        for (size_t y = y0; y < y1 && complete; ++y)
+        {
+            for (size_t x = x0; x < x1; ++x)
+            {
+                // Pixels finished so far are kept; each has its samples
+                // weighted on its own, so the rest merely stay noisier
+                if (deadline > 0.0 && omp_get_wtime() > deadline)
+                {
+                    complete = false;
+                    break;
+                }
+                PrimaryHit* pHits = m_pHits ? m_pHits->pixel(x, y) + firstSample : NULL;
+                for (size_t s_i = 0; s_i < samplesPerPass; ++s_i)
+                {
+                    float dy = rng.nextFloat();
+                    float dx = rng.nextFloat();
+                    if (pHits)
+                    {
+                        m_pHits->offset(pHits[s_i], dx, dy);
+                    }
+                    float yu = 1.0f - (y + dy) / float(height - 1);
+                    float xu = (x + dx) / float(width - 1);
+
+                    // Find where this pixel sample hits in the scene
+                    Intersection first(m_camera.makeRay(xu, yu));
+                    bool hit = pHits ? m_pHits->intersect(pHits[s_i], masterSet, lights, first)
+                                     : masterSet.intersect(first);
+                    Color pixelColor = continuePath(first, hit, m_settings.m_numLightSamples,
+                                                    masterSet, lights, rng,
+                                                    m_settings.m_maxBounce,
+                                                    m_settings.m_numLightSamples,
+                                                    pixelSpread, cullThreshold, &stats,
+                                                    m_pIrradiance, m_settings.m_numIrradianceRays,
+                                                    m_pGuide);
+
+                    // We're writing LDR pixel values, so clamp to 0..1 range first
+                    pixelColor.clamp();
+                    buffer.addSample(x, y, dx, dy, pixelColor);
+                }
+            }
+        }
+        film.mergeTile(buffer);
+        #pragma omp critical(shadowStats)
+        m_shadowStats.add(stats);
+        return complete;
+    }
+
+    // First tile of a node's band; bands are runs of whole tile rows split
+    // as evenly as the rows allow
+    size_t bandBegin(size_t node, size_t tilesX, size_t tilesY) const
+    {
+        return (tilesY * node / m_pNuma->numNodes()) * tilesX;
+    }
+
+    // Moves each band's tiles of the film to its node
+    void placeBands(Film& film) const
+    {
+        for (size_t n = 0; n < m_pNuma->numNodes(); ++n)
+        {
+            film.bindTiles(bandBegin(n, film.tilesX(), film.tilesY()),
+                           bandBegin(n + 1, film.tilesX(), film.tilesY()),
+                           m_pNuma->m_nodeIds[n]);
+        }
+    }
+
+    ShapeSet& m_masterSet;
+    const std::vector<Light*>& m_lights;
+    Camera m_camera;
+    const RenderSettings& m_settings;
+    FrameArenas m_ownArenas;
+    FrameArenas* m_pArenas;
+    const NumaPlacement* m_pNuma;
+    IrradianceCache* m_pIrradiance;
+    PathGuide* m_pGuide;
+    PrimaryHitCache* m_pHits;
+    ShadowStats m_shadowStats;
+};
+
+}//namespace Tracer
+
+#endif
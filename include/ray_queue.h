@@ -0,0 +1,142 @@
+#ifndef __RAY_QUEUE_H__
+#define __RAY_QUEUE_H__
+
+#include "util.h"
+#include "arena.h"
+#include "ray.h"
+#include "shape.h"
+#include "material.h"
+#include "light_source.h"
+
+namespace Tracer
+{
+
+//
+// SoA queues used by the stream renderers. They are transient, so their
+// arrays come from a MemoryArena and live until it is reset.
+//
+
+// Queue of path segments still to be traced
+struct RayQueue
+{
+    float *m_originX, *m_originY, *m_originZ;
+    float *m_dirX, *m_dirY, *m_dirZ;
+    // Throughput of the path up to this segment
+    float *m_throughputR, *m_throughputG, *m_throughputB;
+    // Index of the owning path in the wave
+    unsigned int* m_path;
+    size_t m_count;
+    size_t m_capacity;
+
+    RayQueue() : m_count(0), m_capacity(0) { }
+
+    void allocate(MemoryArena& arena, size_t n)
+    {
+        m_originX = arena.allocArray<float>(n);
+        m_originY = arena.allocArray<float>(n);
+        m_originZ = arena.allocArray<float>(n);
+        m_dirX = arena.allocArray<float>(n);
+        m_dirY = arena.allocArray<float>(n);
+        m_dirZ = arena.allocArray<float>(n);
+        m_throughputR = arena.allocArray<float>(n);
+        m_throughputG = arena.allocArray<float>(n);
+        m_throughputB = arena.allocArray<float>(n);
+        m_path = arena.allocArray<unsigned int>(n);
+        m_count = 0;
+        m_capacity = n;
+    }
+
+    Ray ray(size_t i) const
+    {
+        return Ray(Point(m_originX[i], m_originY[i], m_originZ[i]),
+                   Vector(m_dirX[i], m_dirY[i], m_dirZ[i]));
+    }
+
+    void set(size_t i, const Ray& ray, const Color& throughput, unsigned int path)
+    {
+        m_originX[i] = ray.m_origin.m_x;
+        m_originY[i] = ray.m_origin.m_y;
+        m_originZ[i] = ray.m_origin.m_z;
+        m_dirX[i] = ray.m_direction.m_x;
+        m_dirY[i] = ray.m_direction.m_y;
+        m_dirZ[i] = ray.m_direction.m_z;
+        m_throughputR[i] = throughput.m_r;
+        m_throughputG[i] = throughput.m_g;
+        m_throughputB[i] = throughput.m_b;
+        m_path[i] = path;
+    }
+};
+
+
+// Closest hits of a RayQueue, one entry per ray
+struct HitQueue
+{
+    float* m_t;
+    Shape** m_pShape;
+    const Material** m_pMaterial;
+    float *m_normalX, *m_normalY, *m_normalZ;
+    float *m_emittedR, *m_emittedG, *m_emittedB;
+    float *m_u, *m_v, *m_uvDensity;
+
+    void allocate(MemoryArena& arena, size_t n)
+    {
+        m_t = arena.allocArray<float>(n);
+        m_pShape = arena.allocArray<Shape*>(n);
+        m_pMaterial = arena.allocArray<const Material*>(n);
+        m_normalX = arena.allocArray<float>(n);
+        m_normalY = arena.allocArray<float>(n);
+        m_normalZ = arena.allocArray<float>(n);
+        m_emittedR = arena.allocArray<float>(n);
+        m_emittedG = arena.allocArray<float>(n);
+        m_emittedB = arena.allocArray<float>(n);
+        m_u = arena.allocArray<float>(n);
+        m_v = arena.allocArray<float>(n);
+        m_uvDensity = arena.allocArray<float>(n);
+    }
+
+    Intersection intersection(size_t i, const Ray& ray) const
+    {
+        Intersection isect(ray);
+        isect.m_t = m_t[i];
+        isect.m_pShape = m_pShape[i];
+        isect.m_pMaterial = m_pMaterial[i];
+        isect.m_normal = Vector(m_normalX[i], m_normalY[i], m_normalZ[i]);
+        isect.m_emitted = Color(m_emittedR[i], m_emittedG[i], m_emittedB[i]);
+        isect.m_u = m_u[i];
+        isect.m_v = m_v[i];
+        isect.m_uvDensity = m_uvDensity[i];
+        return isect;
+    }
+};
+
+
+// Shadow rays with the radiance they deliver if unoccluded. Each shaded hit
+// owns a fixed block of slots so shading can run in parallel; unused slots
+// have a NULL light.
+struct ShadowQueue
+{
+    float *m_originX, *m_originY, *m_originZ;
+    float *m_dirX, *m_dirY, *m_dirZ;
+    float* m_tMax;
+    Light** m_pLight;
+    float *m_contribR, *m_contribG, *m_contribB;
+
+    void allocate(MemoryArena& arena, size_t n)
+    {
+        m_originX = arena.allocArray<float>(n);
+        m_originY = arena.allocArray<float>(n);
+        m_originZ = arena.allocArray<float>(n);
+        m_dirX = arena.allocArray<float>(n);
+        m_dirY = arena.allocArray<float>(n);
+        m_dirZ = arena.allocArray<float>(n);
+        m_tMax = arena.allocArray<float>(n);
+        m_pLight = arena.allocArray<Light*>(n);
+        m_contribR = arena.allocArray<float>(n);
+        m_contribG = arena.allocArray<float>(n);
+        m_contribB = arena.allocArray<float>(n);
+    }
+};
+
+}//namespace Tracer
+
+#endif
@@ -0,0 +1,158 @@
+#ifndef __RAY_SORT_H__
+#define __RAY_SORT_H__
+
+#include <vector>
+#include "util.h"
+#include "ray_queue.h"
+
+namespace Tracer
+{
+
+//
+// Reordering of secondary rays for coherence.
+//
+// Each ray gets a 33-bit key: its direction octant in the top 3 bits, then
+// the 30-bit Morton code of its origin quantized to a 1024^3 grid over the
+// queue's bounding box. Sorting by that key puts rays that start close
+// together and travel the same general way next to each other, so they
+// walk the same shapes back to back.
+//
+
+// Spread the low 10 bits of v out to every third bit
+inline unsigned int expandBits10(unsigned int v)
+{
+    v &= 0x3ffu;
+    v = (v | (v << 16)) & 0x030000ffu;
+    v = (v | (v << 8))  & 0x0300f00fu;
+    v = (v | (v << 4))  & 0x030c30c3u;
+    v = (v | (v << 2))  & 0x09249249u;
+    return v;
+}
+
+
+inline unsigned int morton3D(unsigned int x, unsigned int y, unsigned int z)
+{
+    return (expandBits10(x) << 2) | (expandBits10(y) << 1) | expandBits10(z);
+}
+
+
+class RaySorter
+{
+public:
+    // Scratch space for sorting queues of up to capacity rays, valid until
+    // arena is reset
+    void reserve(MemoryArena& arena, size_t capacity)
+    {
+        m_scratch.allocate(arena, capacity);
+    }
+
+    // Sorts rays[0, rays.m_count) by origin cell and direction octant; the
+    // queue must fit the space reserved
+    void sort(RayQueue& rays)
+    {
+        size_t n = rays.m_count;
+        if (n < 2)
+        {
+            return;
+        }
+        computeKeys(rays);
+        radixSort(n);
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            size_t src = m_order[i];
+            m_scratch.m_originX[i] = rays.m_originX[src];
+            m_scratch.m_originY[i] = rays.m_originY[src];
+            m_scratch.m_originZ[i] = rays.m_originZ[src];
+            m_scratch.m_dirX[i] = rays.m_dirX[src];
+            m_scratch.m_dirY[i] = rays.m_dirY[src];
+            m_scratch.m_dirZ[i] = rays.m_dirZ[src];
+            m_scratch.m_throughputR[i] = rays.m_throughputR[src];
+            m_scratch.m_throughputG[i] = rays.m_throughputG[src];
+            m_scratch.m_throughputB[i] = rays.m_throughputB[src];
+            m_scratch.m_path[i] = rays.m_path[src];
+        }
+        m_scratch.m_count = n;
+        std::swap(rays, m_scratch);
+    }
+
+    // Keys of the last sort, in the original queue order
+    const std::vector<unsigned long long>& keys() const { return m_keys; }
+
+protected:
+    void computeKeys(const RayQueue& rays)
+    {
+        size_t n = rays.m_count;
+        float minX = rays.m_originX[0], maxX = minX;
+        float minY = rays.m_originY[0], maxY = minY;
+        float minZ = rays.m_originZ[0], maxZ = minZ;
+        for (size_t i = 1; i < n; ++i)
+        {
+            minX = std::min(minX, rays.m_originX[i]); maxX = std::max(maxX, rays.m_originX[i]);
+            minY = std::min(minY, rays.m_originY[i]); maxY = std::max(maxY, rays.m_originY[i]);
+            minZ = std::min(minZ, rays.m_originZ[i]); maxZ = std::max(maxZ, rays.m_originZ[i]);
+        }
+        float scaleX = 1023.0f / std::max(maxX - minX, 1e-6f);
+        float scaleY = 1023.0f / std::max(maxY - minY, 1e-6f);
+        float scaleZ = 1023.0f / std::max(maxZ - minZ, 1e-6f);
+
+        m_keys.resize(n);
+        #pragma omp parallel for
+        for (size_t i = 0; i < n; ++i)
+        {
+            unsigned int cx = (unsigned int)((rays.m_originX[i] - minX) * scaleX);
+            unsigned int cy = (unsigned int)((rays.m_originY[i] - minY) * scaleY);
+            unsigned int cz = (unsigned int)((rays.m_originZ[i] - minZ) * scaleZ);
+            unsigned int octant = (rays.m_dirX[i] < 0.0f ? 4u : 0u) |
+                                  (rays.m_dirY[i] < 0.0f ? 2u : 0u) |
+                                  (rays.m_dirZ[i] < 0.0f ? 1u : 0u);
+            m_keys[i] = ((unsigned long long)octant << 30) | morton3D(cx, cy, cz);
+        }
+    }
+
+    // LSD radix sort of the indices by key, 11 bits per pass
+    void radixSort(size_t n)
+    {
+        const unsigned int kRadixBits = 11;
+        const unsigned int kRadix = 1u << kRadixBits;
+
+        m_order.resize(n);
+        m_orderTmp.resize(n);
+        for (size_t i = 0; i < n; ++i)
+        {
+            m_order[i] = (unsigned int)i;
+        }
+
+        std::vector<size_t> counts(kRadix);
+        for (unsigned int shift = 0; shift < 33; shift += kRadixBits)
+        {
+            std::fill(counts.begin(), counts.end(), 0);
+            for (size_t i = 0; i < n; ++i)
+            {
+                ++counts[(m_keys[m_order[i]] >> shift) & (kRadix - 1)];
+            }
+            size_t sum = 0;
+            for (unsigned int d = 0; d < kRadix; ++d)
+            {
+                size_t c = counts[d];
+                counts[d] = sum;
+                sum += c;
+            }
+            for (size_t i = 0; i < n; ++i)
+            {
+                unsigned int index = m_order[i];
+                m_orderTmp[counts[(m_keys[index] >> shift) & (kRadix - 1)]++] = index;
+            }
+            std::swap(m_order, m_orderTmp);
+        }
+    }
+
+    std::vector<unsigned long long> m_keys;
+    std::vector<unsigned int> m_order;
+    std::vector<unsigned int> m_orderTmp;
+    RayQueue m_scratch;
+};
+
+}//namespace Tracer
+
+#endif
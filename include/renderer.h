@@ -0,0 +1,357 @@
+#ifndef __RENDERER_H__
+#define __RENDERER_H__
+
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "omp.h"
+#include "util.h"
+#include "camera.h"
+#include "scene.h"
+#include "settings.h"
+#include "arena.h"
+#include "numa.h"
+#include "film.h"
+#include "texture.h"
+#include "progressive.h"
+#include "restir.h"
+#include "wavefront.h"
+#include "denoise.h"
+#include "image_io.h"
+
+namespace Tracer
+{
+
+//
+// NUMA setup for --numa renders. The OpenMP threads are pinned round-robin
+// over the nodes. With "replicate" every node but the first also gets a
+// copy of the scene, loaded by a thread pinned to that node so the copy's
+// pages are local to it; a binary scene's mapped data is shared by all
+// copies through the page cache. With "interleave" there is one copy,
+// whose pages were spread over the nodes while it was loaded (see
+// interleaveMemory()).
+//
+class NumaScenes
+{
+public:
+    NumaScenes() { }
+
+    ~NumaScenes()
+    {
+        for (size_t i = 0; i < m_replicas.size(); ++i)
+        {
+            delete m_replicas[i];
+        }
+    }
+
+    // Makes the memory the calling thread touches from now on (or until
+    // the next call with on = false) interleave over every node
+    static void interleaveMemory(const NumaTopology& topology, bool on)
+    {
+        std::vector<int> nodes;
+        for (size_t n = 0; n < topology.numNodes(); ++n)
+        {
+            nodes.push_back(topology.nodeId(n));
+        }
+        setMemoryPolicy(on ? MPOL_INTERLEAVE : MPOL_DEFAULT, on ? nodes : std::vector<int>());
+    }
+
+    // Pins the threads and, when replicating, loads the copies of scene
+    // (built from settings.m_scenePath) for the other nodes
+    bool setup(Scene& scene, const NumaTopology& topology,
+               const RenderSettings& settings, std::string& error)
+    {
+        if (!m_placement.pinThreads(topology) && settings.m_verbose)
+        {
+            std::cerr << "could not pin every thread to its NUMA node" << std::endl;
+        }
+        size_t numNodes = topology.numNodes();
+        bool replicate = settings.m_numa == "replicate" && numNodes > 1;
+        m_replicas.assign(replicate ? numNodes - 1 : 0, NULL);
+        std::vector<std::string> errors(m_replicas.size());
+        std::vector<std::thread> loaders;
+        for (size_t i = 0; i < m_replicas.size(); ++i)
+        {
+            m_replicas[i] = new Scene;
+            loaders.push_back(std::thread([this, i, &topology, &settings, &errors]()
+            {
+                size_t node = i + 1;
+                pinCurrentThread(topology.cpus(node));
+                setMemoryPolicy(MPOL_PREFERRED, std::vector<int>(1, topology.nodeId(node)));
+                loadScene(settings.m_scenePath, *m_replicas[i], errors[i]);
+            }));
+        }
+        for (size_t i = 0; i < loaders.size(); ++i)
+        {
+            loaders[i].join();
+            if (!errors[i].empty())
+            {
+                error = errors[i];
+                return false;
+            }
+        }
+
+        m_placement.m_masterSets.assign(numNodes, &scene.m_masterSet);
+        m_placement.m_lights.assign(numNodes, &scene.m_lights);
+        for (size_t i = 0; i < m_replicas.size(); ++i)
+        {
+            m_placement.m_masterSets[i + 1] = &m_replicas[i]->m_masterSet;
+            m_placement.m_lights[i + 1] = &m_replicas[i]->m_lights;
+        }
+        if (settings.m_verbose)
+        {
+            std::cerr << "numa: " << numNodes << " node(s), " << m_placement.m_threadNode.size()
+                      << " thread(s), " << m_replicas.size() + 1 << " scene cop"
+                      << (m_replicas.empty() ? "y" : "ies") << std::endl;
+        }
+        return true;
+    }
+
+    const NumaPlacement& placement() const { return m_placement; }
+
+    // Moves the copies of the scene to time, as Scene::setTime() does the
+    // original
+    void setTime(float time)
+    {
+        for (size_t i = 0; i < m_replicas.size(); ++i)
+        {
+            m_replicas[i]->setTime(time);
+        }
+    }
+
+protected:
+    NumaPlacement m_placement;
+    // Copies for nodes 1 and up; node 0 uses the original
+    std::vector<Scene*> m_replicas;
+
+private:
+    NumaScenes(const NumaScenes&);
+    NumaScenes& operator =(const NumaScenes&);
+};
+
+
+// Post-process stage of a frame: the feature pass, if the features are
+// wanted for denoising or for writing out (into pFeatures when given), and
+// the denoiser
+inline void finishFrame(ShapeSet& masterSet,
+                        const Camera& camera,
+                        const RenderSettings& settings,
+                        std::vector<Color>& image,
+                        FeatureBuffers* pFeatures = NULL)
+{
+    if (!settings.m_denoise && !settings.m_writeFeatures)
+    {
+        return;
+    }
+    double start = omp_get_wtime();
+    FeatureBuffers localFeatures;
+    FeatureBuffers& features = pFeatures ? *pFeatures : localFeatures;
+    renderFeatures(masterSet, camera, settings.m_width, settings.m_height, settings.m_seed, features);
+    if (settings.m_denoise)
+    {
+        denoiseImage(image, features);
+    }
+    if (settings.m_verbose)
+    {
+        std::cerr << (settings.m_denoise ? "features and denoising: " : "features: ")
+                  << omp_get_wtime() - start << " s" << std::endl;
+    }
+}
+
+
+// Renders one frame of scene through camera with the in-process renderer
+// picked by settings; image is row-major, m_width x m_height. Callers that
+// render many frames pass the same pArenas each time so the transient
+// buffers are allocated once. With pNuma the progressive renderer spreads
+// the frame over the NUMA nodes; the wavefront renderer only benefits from
+// the pinning and memory placement. With --restir, callers pass the same
+// pReservoirs each frame so that the next frame resamples this one's
+// reservoirs. With --relight-cache, callers pass the same pHits each time
+// so that the progressive renderer replays the camera hits of the last
+// frame if the geometry and view did not change. The frame then goes
+// through finishFrame().
+inline void renderFrame(Scene& scene,
+                        const Camera& camera,
+                        const RenderSettings& settings,
+                        std::vector<Color>& image,
+                        FrameArenas* pArenas = NULL,
+                        const NumaPlacement* pNuma = NULL,
+                        FeatureBuffers* pFeatures = NULL,
+                        ReservoirBuffers* pReservoirs = NULL,
+                        PrimaryHitCache* pHits = NULL)
+{
+    Film film(settings.m_width, settings.m_height, settings.m_tileSize, makeFilter(settings));
+    ShadowStats shadows;
+    IrradianceCache irradiance(float(settings.m_irradianceAccuracy));
+    IrradianceCache* pIrradiance = settings.m_irradianceAccuracy > 0.0 ? &irradiance : NULL;
+    PathGuide guide;
+    PathGuide* pGuide = settings.m_pathGuiding && !pIrradiance ? &guide : NULL;
+    if (settings.m_pathGuiding && pIrradiance)
+    {
+        std::cerr << "--guiding is ignored with --irradiance-cache" << std::endl;
+    }
+    bool relight = pHits && settings.m_relightCacheSize > 0;
+    if (relight && (settings.m_restir || settings.m_wavefront || settings.m_timeBudget > 0.0))
+    {
+        std::cerr << "--relight-cache is ignored with --restir, --wavefront and --time-budget" << std::endl;
+        relight = false;
+    }
+    if (settings.m_restir)
+    {
+        if (settings.m_wavefront || settings.m_timeBudget > 0.0)
+        {
+            std::cerr << "--wavefront and --time-budget are ignored with --restir" << std::endl;
+        }
+        ReservoirRenderer renderer(scene.m_masterSet, scene.m_lights, camera, settings);
+        renderer.setFrameArenas(pArenas);
+        renderer.setReservoirBuffers(pReservoirs);
+        renderer.setIrradianceCache(pIrradiance);
+        renderer.setPathGuide(pGuide);
+        renderer.render(film);
+        shadows = renderer.shadowStats();
+    }
+    else if (settings.m_wavefront)
+    {
+        if (settings.m_timeBudget > 0.0)
+        {
+            std::cerr << "--time-budget is ignored by the wavefront renderer" << std::endl;
+        }
+        WavefrontRenderer renderer(scene.m_masterSet, scene.m_lights, scene.m_materials, camera);
+        renderer.setSortSecondaryRays(settings.m_sortSecondaryRays);
+        renderer.setFrameArenas(pArenas);
+        renderer.setSeed(settings.m_seed);
+        renderer.setShadowCullThreshold(float(settings.m_shadowCullThreshold));
+        renderer.setIrradianceCache(pIrradiance, settings.m_numIrradianceRays);
+        renderer.setPathGuide(pGuide);
+        renderer.render(settings.m_numPixelSamples, settings.m_numLightSamples,
+                        settings.m_maxBounce, film);
+        shadows = renderer.shadowStats();
+    }
+    else
+    {
+        ProgressiveRenderer renderer(scene.m_masterSet, scene.m_lights, camera, settings);
+        renderer.setFrameArenas(pArenas);
+        renderer.setNumaPlacement(pNuma);
+        renderer.setIrradianceCache(pIrradiance);
+        renderer.setPathGuide(pGuide);
+        bool replay = relight && pHits->begin(scene.m_geometryHash, scene.m_materials, camera, film,
+                                              settings, settings.m_relightCacheSize << 20);
+        renderer.setPrimaryHits(relight ? pHits : NULL);
+        size_t spp = renderer.render(film);
+        if (settings.m_verbose)
+        {
+            std::cerr << "rendered " << spp << " samples per pixel" << std::endl;
+        }
+        if (settings.m_verbose && relight)
+        {
+            std::cerr << "camera hits: " << (replay ? "replayed" : pHits->active() ? "recorded" : "too many to keep")
+                      << " (" << (pHits->bytes() >> 20) << " MB)" << std::endl;
+        }
+        if (relight)
+        {
+            pHits->end();
+        }
+        shadows = renderer.shadowStats();
+    }
+    if (settings.m_verbose && shadows.m_numSamples)
+    {
+        size_t saved = shadows.m_numSamples - shadows.m_numTraced;
+        std::cerr << "shadow rays: " << shadows.m_numTraced << " of " << shadows.m_numSamples
+                  << " light samples traced, " << saved << " ("
+                  << 100.0 * double(saved) / double(shadows.m_numSamples) << "%) culled" << std::endl;
+    }
+    if (settings.m_verbose && pIrradiance)
+    {
+        std::cerr << "irradiance cache: " << irradiance.numRecords() << " records" << std::endl;
+    }
+    if (settings.m_verbose && pGuide)
+    {
+        std::cerr << "path guide: " << guide.numLeaves() << " spatial leaves, "
+                  << guide.numDirectionalNodes() << " directional nodes" << std::endl;
+    }
+    const TextureCache& textures = TextureCache::global();
+    if (settings.m_verbose && textures.numTextures())
+    {
+        std::cerr << "textures: " << textures.numTextures() << ", " << textures.misses()
+                  << " tile reads into " << textures.numSlots() << " cache slots" << std::endl;
+    }
+    film.resolve(image);
+    finishFrame(scene.m_masterSet, camera, settings, image, pFeatures);
+}
+
+
+//
+// Renders settings.m_numFrames frames of an animated scene, starting at
+// frame m_firstFrame, to the files named by settings.frameFile().
+//
+// The scene is loaded once; for each frame the scene graph is moved to the
+// frame's time, which only refits the BVH (or leaves it alone when nothing
+// moved). Frame N is encoded and written on a separate thread while frame
+// N + 1 renders, so the two image buffers swap roles every frame.
+//
+inline bool renderAnimation(Scene& scene, const RenderSettings& settings, NumaScenes* pNuma = NULL)
+{
+    std::vector<Color> images[2];
+    FeatureBuffers features[2];
+    FrameArenas arenas;
+    ReservoirBuffers reservoirs;
+    std::thread writer;
+    bool writeOk = true;
+    std::string writeFile;
+
+    for (size_t i = 0; i < settings.m_numFrames; ++i)
+    {
+        size_t frame = settings.m_firstFrame + i;
+        float time = float(frame / settings.m_fps);
+        double start = omp_get_wtime();
+        SceneUpdate update = scene.setTime(time);
+        if (pNuma)
+        {
+            pNuma->setTime(time);
+        }
+        std::vector<Color>& image = images[i & 1];
+        renderFrame(scene, scene.cameraAt(time), settings, image, &arenas,
+                    pNuma ? &pNuma->placement() : NULL, &features[i & 1], &reservoirs);
+
+        // The previous frame must be out before its buffer is reused
+        if (writer.joinable())
+        {
+            writer.join();
+            if (!writeOk)
+            {
+                std::cerr << "failed to write " << writeFile << std::endl;
+                return false;
+            }
+        }
+        if (settings.m_verbose)
+        {
+            const char* updates[] = { "static", "refit", "rebuilt" };
+            std::cerr << "frame " << frame << " (t = " << time << " s, bvh "
+                      << updates[update] << "): " << omp_get_wtime() - start << " s" << std::endl;
+        }
+        writeFile = settings.frameFile(frame);
+        const std::vector<Color>* pImage = &image;
+        const FeatureBuffers* pFeatures = &features[i & 1];
+        writer = std::thread([pImage, pFeatures, &writeOk, &writeFile, &settings]()
+        {
+            writeOk = writeImage(writeFile, *pImage, settings.m_width, settings.m_height) &&
+                      (!settings.m_writeFeatures || writeFeatureImages(*pFeatures, writeFile));
+        });
+    }
+
+    if (writer.joinable())
+    {
+        writer.join();
+        if (!writeOk)
+        {
+            std::cerr << "failed to write " << writeFile << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+}//namespace Tracer
+
+#endif
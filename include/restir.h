@@ -0,0 +1,642 @@
+#ifndef __RESTIR_H__
+#define __RESTIR_H__
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "omp.h"
+#include "util.h"
+#include "arena.h"
+#include "shape.h"
+#include "light_source.h"
+#include "camera.h"
+#include "film.h"
+#include "integrator.h"
+#include "settings.h"
+
+namespace Tracer
+{
+
+//
+// Direct lighting by reservoir resampling (ReSTIR: Bitterli et al.,
+// "Spatiotemporal Reservoir Resampling for Real-Time Ray Tracing with
+// Dynamic Direct Lighting", 2020).
+//
+// Each pass renders one sample per pixel. The camera hit of every pixel
+// draws candidate light samples (a random light, then a point on it) and
+// keeps one of them in a reservoir by resampled importance sampling, in
+// proportion to the light it would bring if nothing were in the way. On
+// the first pass of a frame the reservoir is merged with the one its
+// surface had at the end of the previous frame (found by reprojecting
+// through the previous camera); then, over a few rounds, with those of
+// random neighbouring pixels on similar surfaces. A pixel thus picks from
+// the candidates of many pixels and pays a single shadow ray, for the
+// sample it ends up with. The rest of the path is traced by
+// continuePath() as usual.
+//
+// Merging weights each reservoir's sample by the balance heuristic over
+// the pixels that could have drawn it, so it stays unbiased even where
+// neighbours see the lights very differently (the edge of a spot's cone,
+// say). Nothing is dropped for being occluded before merging: that would
+// darken pixels near shadows. The passes of one frame don't share
+// reservoirs either, since the film averages them and correlated passes
+// converge more slowly than independent ones.
+//
+// Reservoirs and pixel data are kept in tile order, so a tile's pixels
+// are contiguous and every stage runs over tiles in parallel. Merging
+// reads one set of reservoirs and writes the other, and the two swap; the
+// last pass's reservoirs stay behind as the history of the next frame.
+//
+
+// Spatial merging rounds per pass, neighbours per pixel and round, and
+// how far away they are picked, in pixels
+const size_t kRestirSpatialRounds = 2;
+const size_t kRestirNeighbours = 5;
+const float kRestirRadius = 30.0f;
+// A previous frame's reservoir counts for at most this many times the
+// candidates of a fresh one, so old samples make way for new ones
+const float kRestirHistoryCap = 20.0f;
+// Pixels share reservoirs if their normals are within about 25 degrees
+// and each hit lies within this fraction of its distance to the camera
+// of the other's tangent plane
+const float kRestirNormalCos = 0.9f;
+const float kRestirPlaneDistance = 0.1f;
+
+const unsigned int kNoReservoirLight = ~0u;
+
+
+// Light sample a pixel keeps, and what resampling needs to know about it
+struct Reservoir
+{
+    float m_point[3];
+    // Index of the sample's light, or kNoReservoirLight
+    unsigned int m_light;
+    // Sum of the resampling weights of the candidates seen
+    float m_weightSum;
+    // Candidates seen (M)
+    float m_count;
+    // Target density of the sample at the reservoir's pixel
+    float m_target;
+    // Weight turning the sample's light into an estimate of the pixel's
+    // direct light (W)
+    float m_weight;
+
+    Reservoir()
+        : m_light(kNoReservoirLight),
+          m_weightSum(0.0f),
+          m_count(0.0f),
+          m_target(0.0f),
+          m_weight(0.0f)
+    {
+        m_point[0] = m_point[1] = m_point[2] = 0.0f;
+    }
+
+    Point point() const { return Point(m_point[0], m_point[1], m_point[2]); }
+
+    // Streams in a candidate with resampling weight w, keeping it with
+    // probability w over the weights seen so far; xi is uniform in [0, 1)
+    void update(unsigned int light, const Point& point, float target, float w, float xi)
+    {
+        m_weightSum += w;
+        if (w > 0.0f && xi * m_weightSum < w)
+        {
+            m_light = light;
+            m_point[0] = point.m_x;
+            m_point[1] = point.m_y;
+            m_point[2] = point.m_z;
+            m_target = target;
+        }
+    }
+};
+
+
+// A pixel's camera hit, as far as resampling needs it
+struct ReservoirPixel
+{
+    float m_position[3];
+    float m_normal[3];
+    float m_texture[3];
+    // NULL if the camera ray missed
+    const Material* m_pMaterial;
+    // Offset of the camera sample within the pixel
+    float m_dx, m_dy;
+
+    Point position() const { return Point(m_position[0], m_position[1], m_position[2]); }
+    Vector normal() const { return Vector(m_normal[0], m_normal[1], m_normal[2]); }
+    Color texture() const { return Color(m_texture[0], m_texture[1], m_texture[2]); }
+};
+
+
+//
+// Reservoirs and pixel data of a frame, kept by the caller so that the
+// next frame can resample this one's reservoirs.
+//
+class ReservoirBuffers
+{
+public:
+    ReservoirBuffers()
+        : m_width(0),
+          m_height(0),
+          m_tileSize(0),
+          m_tilesX(0),
+          m_current(0),
+          m_hasHistory(false),
+          m_numPasses(0)
+    {
+
+    }
+
+    // Lays the buffers out for film's pixels and tiles; the history only
+    // survives if the layout is unchanged
+    void reset(const Film& film)
+    {
+        if (film.width() == m_width && film.height() == m_height && film.tileSize() == m_tileSize)
+        {
+            return;
+        }
+        m_width = film.width();
+        m_height = film.height();
+        m_tileSize = film.tileSize();
+        m_tilesX = film.tilesX();
+        size_t size = film.numTiles() * m_tileSize * m_tileSize;
+        for (size_t i = 0; i < 2; ++i)
+        {
+            m_reservoirs[i].assign(size, Reservoir());
+        }
+        m_pixels.assign(size, ReservoirPixel());
+        m_previousPixels.assign(size, ReservoirPixel());
+        m_hasHistory = false;
+    }
+
+    // Element of pixel (x, y) in every buffer
+    size_t index(size_t x, size_t y) const
+    {
+        size_t tile = (y / m_tileSize) * m_tilesX + x / m_tileSize;
+        return (tile * m_tileSize + y % m_tileSize) * m_tileSize + x % m_tileSize;
+    }
+
+    size_t m_width, m_height, m_tileSize, m_tilesX;
+    // Merging reads m_reservoirs[m_current] and writes the other set
+    std::vector<Reservoir> m_reservoirs[2];
+    size_t m_current;
+    // Camera hits of this pass and of the last pass of the previous frame,
+    // seen from m_previousCamera
+    std::vector<ReservoirPixel> m_pixels;
+    std::vector<ReservoirPixel> m_previousPixels;
+    Camera m_previousCamera;
+    bool m_hasHistory;
+    // Passes rendered so far, which seed the next
+    unsigned int m_numPasses;
+
+private:
+    ReservoirBuffers(const ReservoirBuffers&);
+    ReservoirBuffers& operator =(const ReservoirBuffers&);
+};
+
+
+class ReservoirRenderer
+{
+public:
+    ReservoirRenderer(ShapeSet& masterSet,
+                      const std::vector<Light*>& lights,
+                      const Camera& camera,
+                      const RenderSettings& settings)
+        : m_masterSet(masterSet),
+          m_lights(lights),
+          m_camera(camera),
+          m_settings(settings),
+          m_pArenas(&m_ownArenas),
+          m_pBuffers(&m_ownBuffers),
+          m_pIrradiance(NULL),
+          m_pGuide(NULL),
+          m_pixelSpread(0.0f)
+    {
+
+    }
+
+    // Arenas for the per-thread tile buffers, kept by the caller so that
+    // they can be reused by the next renderer; by default the renderer has
+    // its own
+    void setFrameArenas(FrameArenas* pArenas) { m_pArenas = pArenas ? pArenas : &m_ownArenas; }
+
+    // Reservoirs, kept by the caller so that the next frame's renderer
+    // resamples this one's; by default the renderer has its own
+    void setReservoirBuffers(ReservoirBuffers* pBuffers) { m_pBuffers = pBuffers ? pBuffers : &m_ownBuffers; }
+
+    // As for ProgressiveRenderer; the guide learns after 1, 2, 4, ...
+    // passes
+    void setIrradianceCache(IrradianceCache* pCache) { m_pIrradiance = pCache; }
+    void setPathGuide(PathGuide* pGuide) { m_pGuide = pGuide; }
+
+    // Light samples and shadow rays of every pass rendered so far
+    const ShadowStats& shadowStats() const { return m_shadowStats; }
+
+    // Renders the frame into film (already sized, with the settings' tile
+    // size), one pass per sample per pixel; returns the samples per pixel
+    size_t render(Film& film)
+    {
+        ReservoirBuffers& buffers = *m_pBuffers;
+        buffers.reset(film);
+        m_pixelSpread = m_camera.pixelSpread(film.width(), film.height());
+
+        for (size_t pass = 0; pass < m_settings.m_numPixelSamples; ++pass)
+        {
+            unsigned int seed = m_settings.m_seed ^ hashUInt32(buffers.m_numPasses++);
+            sampleCandidates(film, seed, pass == 0 && buffers.m_hasHistory);
+            for (size_t round = 0; round < kRestirSpatialRounds; ++round)
+            {
+                reuseNeighbours(film, seed + (unsigned int)(round + 1) * 0x9e3779b9u);
+            }
+            shade(film, seed + (unsigned int)(kRestirSpatialRounds + 1) * 0x9e3779b9u);
+
+            if (m_pGuide && ((pass + 2) & (pass + 1)) == 0)
+            {
+                m_pGuide->refine();
+            }
+        }
+        if (m_settings.m_numPixelSamples > 0)
+        {
+            buffers.m_pixels.swap(buffers.m_previousPixels);
+            buffers.m_previousCamera = m_camera;
+            buffers.m_hasHistory = true;
+        }
+        return m_settings.m_numPixelSamples;
+    }
+
+protected:
+    // Stage 1: camera hit and candidates for every pixel, merged with the
+    // previous frame's reservoirs if temporal
+    void sampleCandidates(const Film& film, unsigned int seed, bool temporal)
+    {
+        ReservoirBuffers& buffers = *m_pBuffers;
+        const std::vector<Reservoir>& history = buffers.m_reservoirs[buffers.m_current];
+        std::vector<Reservoir>& reservoirs = buffers.m_reservoirs[1 - buffers.m_current];
+        const size_t width = film.width();
+        const size_t height = film.height();
+        const size_t numCandidates = m_settings.m_numRestirCandidates;
+        const size_t numLights = m_lights.size();
+        const float historyCap = kRestirHistoryCap * float(numCandidates);
+        size_t numSamples = 0;
+
+        #pragma omp parallel for schedule(dynamic, 1) reduction(+:numSamples)
+        for (size_t tile = 0; tile < film.numTiles(); ++tile)
+        {
+            Rng rng = Rng::forStream(seed, (unsigned int)tile);
+            size_t x0, y0, x1, y1;
+            film.tileBounds(tile, x0, y0, x1, y1);
+            for (size_t y = y0; y < y1; ++y)
+            {
+                for (size_t x = x0; x < x1; ++x)
+                {
+                    size_t i = buffers.index(x, y);
+                    ReservoirPixel& pixel = buffers.m_pixels[i];
+                    Reservoir& reservoir = reservoirs[i];
+                    reservoir = Reservoir();
+
+                    float xu, yu;
+                    pixel.m_dy = rng.nextFloat();
+                    pixel.m_dx = rng.nextFloat();
+                    Camera::screenPosition(x, y, pixel.m_dx, pixel.m_dy, width, height, xu, yu);
+                    Intersection isect(m_camera.makeRay(xu, yu));
+                    if (!m_masterSet.intersect(isect))
+                    {
+                        pixel.m_pMaterial = NULL;
+                        continue;
+                    }
+                    setPixel(pixel, isect);
+                    if (numLights == 0)
+                    {
+                        continue;
+                    }
+
+                    Point position = isect.position();
+                    for (size_t c = 0; c < numCandidates; ++c)
+                    {
+                        ++numSamples;
+                        size_t l = std::min(size_t(rng.nextFloat() * float(numLights)), numLights - 1);
+                        Point lightPoint;
+                        Vector lightNormal;
+                        if (!m_lights[l]->samplePoint(rng, position, lightPoint, lightNormal))
+                        {
+                            continue;
+                        }
+                        float density = m_lights[l]->sampleDensity(position, lightPoint);
+                        float value = density > 0.0f
+                                      ? luminance(unshadowed(pixel, m_camera.m_origin, *m_lights[l], lightPoint))
+                                      : 0.0f;
+                        reservoir.update((unsigned int)l, lightPoint, value * density,
+                                         value * float(numLights), rng.nextFloat());
+                    }
+                    reservoir.m_count = float(numCandidates);
+                    if (reservoir.m_target > 0.0f)
+                    {
+                        reservoir.m_weight = reservoir.m_weightSum / (reservoir.m_count * reservoir.m_target);
+                    }
+
+                    // Merge with the reservoir this surface had last frame
+                    size_t j;
+                    if (!temporal || !previousIndex(position, width, height, j) ||
+                        !similar(pixel, buffers.m_previousPixels[j], m_camera.m_origin))
+                    {
+                        continue;
+                    }
+                    Reservoir previous = history[j];
+                    previous.m_count = std::min(previous.m_count, historyCap);
+                    const Reservoir* inputs[2] = { &reservoir, &previous };
+                    const ReservoirPixel* pixels[2] = { &pixel, &buffers.m_previousPixels[j] };
+                    Point eyes[2] = { m_camera.m_origin, buffers.m_previousCamera.m_origin };
+                    reservoir = merge(inputs, pixels, eyes, 2, rng);
+                }
+            }
+        }
+        buffers.m_current = 1 - buffers.m_current;
+        m_shadowStats.m_numSamples += numSamples;
+    }
+
+    // Stage 2, run kRestirSpatialRounds times: every pixel's reservoir
+    // merged with those of random neighbours on similar surfaces
+    void reuseNeighbours(const Film& film, unsigned int seed)
+    {
+        ReservoirBuffers& buffers = *m_pBuffers;
+        const std::vector<Reservoir>& in = buffers.m_reservoirs[buffers.m_current];
+        std::vector<Reservoir>& out = buffers.m_reservoirs[1 - buffers.m_current];
+        const int width = int(film.width());
+        const int height = int(film.height());
+
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (size_t tile = 0; tile < film.numTiles(); ++tile)
+        {
+            Rng rng = Rng::forStream(seed, (unsigned int)tile);
+            const Reservoir* inputs[kRestirNeighbours + 1];
+            const ReservoirPixel* pixels[kRestirNeighbours + 1];
+            Point eyes[kRestirNeighbours + 1];
+            size_t x0, y0, x1, y1;
+            film.tileBounds(tile, x0, y0, x1, y1);
+            for (size_t y = y0; y < y1; ++y)
+            {
+                for (size_t x = x0; x < x1; ++x)
+                {
+                    size_t i = buffers.index(x, y);
+                    const ReservoirPixel& pixel = buffers.m_pixels[i];
+                    if (!pixel.m_pMaterial)
+                    {
+                        out[i] = in[i];
+                        continue;
+                    }
+                    inputs[0] = &in[i];
+                    pixels[0] = &pixel;
+                    eyes[0] = m_camera.m_origin;
+                    size_t n = 1;
+                    for (size_t k = 0; k < kRestirNeighbours; ++k)
+                    {
+                        float r = kRestirRadius * std::sqrt(rng.nextFloat());
+                        float phi = 2.0f * float(M_PI) * rng.nextFloat();
+                        int nx = int(x) + int(std::floor(r * std::cos(phi) + 0.5f));
+                        int ny = int(y) + int(std::floor(r * std::sin(phi) + 0.5f));
+                        if (nx < 0 || ny < 0 || nx >= width || ny >= height ||
+                            (size_t(nx) == x && size_t(ny) == y))
+                        {
+                            continue;
+                        }
+                        size_t j = buffers.index(size_t(nx), size_t(ny));
+                        if (!similar(pixel, buffers.m_pixels[j], m_camera.m_origin))
+                        {
+                            continue;
+                        }
+                        inputs[n] = &in[j];
+                        pixels[n] = &buffers.m_pixels[j];
+                        eyes[n] = m_camera.m_origin;
+                        ++n;
+                    }
+                    out[i] = merge(inputs, pixels, eyes, n, rng);
+                }
+            }
+        }
+        buffers.m_current = 1 - buffers.m_current;
+    }
+
+    // Stage 3: one shadow ray per pixel for its reservoir's sample, the
+    // rest of the path, and the sample into film
+    void shade(Film& film, unsigned int seed)
+    {
+        ReservoirBuffers& buffers = *m_pBuffers;
+        const std::vector<Reservoir>& reservoirs = buffers.m_reservoirs[buffers.m_current];
+        const size_t width = film.width();
+        const size_t height = film.height();
+        const float cullThreshold = float(m_settings.m_shadowCullThreshold);
+
+        m_pArenas->ensure(size_t(omp_get_max_threads()));
+        m_pArenas->reset();
+        #pragma omp parallel
+        {
+            FilmTile buffer;
+            buffer.reserve(m_pArenas->local(), film.tileArea());
+
+            #pragma omp for schedule(dynamic, 1)
+            for (size_t tile = 0; tile < film.numTiles(); ++tile)
+            {
+                Rng rng = Rng::forStream(seed, (unsigned int)tile);
+                ShadowStats stats;
+                size_t x0, y0, x1, y1;
+                film.tileBounds(tile, x0, y0, x1, y1);
+                buffer.setRect(film.filter(), x0, y0, x1, y1, tile);
+                for (size_t y = y0; y < y1; ++y)
+                {
+                    for (size_t x = x0; x < x1; ++x)
+                    {
+                        size_t i = buffers.index(x, y);
+                        const ReservoirPixel& pixel = buffers.m_pixels[i];
+                        const Reservoir& reservoir = reservoirs[i];
+
+                        // Trace the camera ray again rather than keep every hit
+                        float xu, yu;
+                        Camera::screenPosition(x, y, pixel.m_dx, pixel.m_dy, width, height, xu, yu);
+                        Intersection first(m_camera.makeRay(xu, yu));
+                        bool hit = m_masterSet.intersect(first);
+
+                        Color pixelColor;
+                        if (hit && reservoir.m_light != kNoReservoirLight && reservoir.m_weight > 0.0f)
+                        {
+                            const Light& light = *m_lights[reservoir.m_light];
+                            Point position = pixel.position();
+                            Point lightPoint = reservoir.point();
+                            Color direct = unshadowed(pixel, m_camera.m_origin, light, lightPoint) *
+                                           (light.sampleDensity(position, lightPoint) * reservoir.m_weight);
+                            if (luminance(direct) > 0.0f)
+                            {
+                                ++stats.m_numTraced;
+                                if (visible(position, light, lightPoint))
+                                {
+                                    pixelColor += direct;
+                                }
+                            }
+                        }
+                        pixelColor += continuePath(first, hit, 0, m_masterSet, m_lights, rng,
+                                                   m_settings.m_maxBounce, m_settings.m_numLightSamples,
+                                                   m_pixelSpread, cullThreshold, &stats,
+                                                   m_pIrradiance, m_settings.m_numIrradianceRays,
+                                                   m_pGuide);
+
+                        // We're writing LDR pixel values, so clamp to 0..1 range first
+                        pixelColor.clamp();
+                        buffer.addSample(x, y, pixel.m_dx, pixel.m_dy, pixelColor);
+                    }
+                }
+                film.mergeTile(buffer);
+                #pragma omp critical(shadowStats)
+                m_shadowStats.add(stats);
+            }
+        }
+    }
+
+    void setPixel(ReservoirPixel& pixel, const Intersection& isect) const
+    {
+        Point position = isect.position();
+        Color texture = surfaceTexture(isect, m_pixelSpread * isect.m_t);
+        pixel.m_position[0] = position.m_x;
+        pixel.m_position[1] = position.m_y;
+        pixel.m_position[2] = position.m_z;
+        pixel.m_normal[0] = isect.m_normal.m_x;
+        pixel.m_normal[1] = isect.m_normal.m_y;
+        pixel.m_normal[2] = isect.m_normal.m_z;
+        pixel.m_texture[0] = texture.m_r;
+        pixel.m_texture[1] = texture.m_g;
+        pixel.m_texture[2] = texture.m_b;
+        pixel.m_pMaterial = isect.m_pMaterial;
+    }
+
+    // Light a sample at lightPoint brings to the pixel seen from eye if
+    // nothing is in the way, weighted as one of shadeDirect()'s samples
+    static Color unshadowed(const ReservoirPixel& pixel,
+                            const Point& eye,
+                            const Light& light,
+                            const Point& lightPoint)
+    {
+        Point position = pixel.position();
+        Vector toLight = lightPoint - position;
+        toLight.normalize();
+        return pixel.m_pMaterial->getColor(position,
+                                           pixel.normal(),
+                                           (position - eye).normalized(),
+                                           toLight,
+                                           light.sampledPower(position, lightPoint)) * pixel.texture();
+    }
+
+    // Target density of a sample at the pixel seen from eye: the luminance
+    // of its unshadowed light, per unit of the light's own measure
+    float target(const ReservoirPixel& pixel, const Point& eye, unsigned int light, const Point& lightPoint) const
+    {
+        if (!pixel.m_pMaterial)
+        {
+            return 0.0f;
+        }
+        const Light& l = *m_lights[light];
+        float density = l.sampleDensity(pixel.position(), lightPoint);
+        return density > 0.0f ? luminance(unshadowed(pixel, eye, l, lightPoint)) * density : 0.0f;
+    }
+
+    // Merges n reservoirs, the k-th kept by pixels[k] as seen from
+    // eyes[k], into one for pixels[0]
+    Reservoir merge(const Reservoir* const* inputs,
+                    const ReservoirPixel* const* pixels,
+                    const Point* eyes,
+                    size_t n,
+                    Rng& rng) const
+    {
+        Reservoir merged;
+        float count = 0.0f;
+        for (size_t k = 0; k < n; ++k)
+        {
+            const Reservoir& in = *inputs[k];
+            count += in.m_count;
+            if (in.m_light == kNoReservoirLight || !(in.m_weight > 0.0f))
+            {
+                continue;
+            }
+            Point lightPoint = in.point();
+            float t = k == 0 ? in.m_target : target(*pixels[0], eyes[0], in.m_light, lightPoint);
+            if (!(t > 0.0f))
+            {
+                continue;
+            }
+
+            // Balance heuristic: the share of the sample's candidates that
+            // came from pixel k, had every pixel drawn it
+            float candidates = 0.0f;
+            for (size_t j = 0; j < n; ++j)
+            {
+                float tj = j == k ? in.m_target
+                                  : j == 0 ? t : target(*pixels[j], eyes[j], in.m_light, lightPoint);
+                candidates += inputs[j]->m_count * tj;
+            }
+            float mis = in.m_count * in.m_target / candidates;
+            merged.update(in.m_light, lightPoint, t, mis * t * in.m_weight, rng.nextFloat());
+        }
+        merged.m_count = count;
+        if (merged.m_target > 0.0f)
+        {
+            merged.m_weight = merged.m_weightSum / merged.m_target;
+        }
+        return merged;
+    }
+
+    // Whether pixels a and b are on similar enough surfaces to share
+    // reservoirs; a is seen from eye
+    static bool similar(const ReservoirPixel& a, const ReservoirPixel& b, const Point& eye)
+    {
+        if (!b.m_pMaterial)
+        {
+            return false;
+        }
+        Vector normal = a.normal();
+        Point position = a.position();
+        return dot(normal, b.normal()) >= kRestirNormalCos &&
+               std::fabs(dot(b.position() - position, normal)) <=
+               kRestirPlaneDistance * (position - eye).length();
+    }
+
+    // Element of the pixel the previous camera saw position in, inverting
+    // Camera::screenPosition() (width and height are at least 2)
+    bool previousIndex(const Point& position, size_t width, size_t height, size_t& index) const
+    {
+        float xu, yu;
+        if (!m_pBuffers->m_previousCamera.project(position, xu, yu))
+        {
+            return false;
+        }
+        float x = std::floor(xu * float(width - 1));
+        float y = std::floor((1.0f - yu) * float(height - 1));
+        if (!(x >= 0.0f && y >= 0.0f && x < float(width) && y < float(height)))
+        {
+            return false;
+        }
+        index = m_pBuffers->index(size_t(x), size_t(y));
+        return true;
+    }
+
+    bool visible(const Point& position, const Light& light, const Point& lightPoint) const
+    {
+        Vector toLight = lightPoint - position;
+        float lightDistance = toLight.normalize();
+        Intersection shadowIntersection(Ray(position, toLight, lightDistance));
+        return !m_masterSet.intersect(shadowIntersection) ||
+               shadowIntersection.m_pShape == static_cast<const Shape*>(&light);
+    }
+
+    ShapeSet& m_masterSet;
+    const std::vector<Light*>& m_lights;
+    Camera m_camera;
+    const RenderSettings& m_settings;
+    FrameArenas m_ownArenas;
+    FrameArenas* m_pArenas;
+    ReservoirBuffers m_ownBuffers;
+    ReservoirBuffers* m_pBuffers;
+    IrradianceCache* m_pIrradiance;
+    PathGuide* m_pGuide;
+    float m_pixelSpread;
+    ShadowStats m_shadowStats;
+};
+
+}//namespace Tracer
+
+#endif
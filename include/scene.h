@@ -0,0 +1,869 @@
+#ifndef __SCENE_H__
+#define __SCENE_H__
+
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include "util.h"
+#include "arena.h"
+#include "shape.h"
+#include "material.h"
+#include "light_source.h"
+#include "environment.h"
+#include "image_io.h"
+#include "texture.h"
+#include "camera.h"
+#include "bvh.h"
+#include "animation.h"
+#include "instance.h"
+#include "transform.h"
+
+namespace Tracer
+{
+
+// What setTime() had to do to the acceleration structure
+enum SceneUpdate
+{
+    kSceneStatic,
+    kSceneRefit,
+    kSceneRebuilt
+};
+
+
+//
+// Everything needed to render a frame: materials, shapes, lights and a
+// default camera, plus the scene graph and camera track that animate them.
+// The scene owns its shapes, lights and prototypes.
+//
+// Shapes are allocated by create(), which keeps each type in a pool of its
+// own: the spheres of a scene sit next to each other in memory rather than
+// wherever the heap put them, and stay put for the scene's lifetime.
+//
+// Acceleration is two-level: each prototype (a sub-scene shared by any
+// number of instances) has its own bottom-level BVH, and the top-level BVH
+// holds the bounded top-level shapes and instances. The master set holds
+// the unbounded shapes (planes) and the top-level BVH, once finalize() has
+// been called.
+//
+class Scene
+{
+public:
+    Scene() : m_hash(0), m_geometryHash(0) { }
+
+    ~Scene() { clear(); }
+
+    void clear()
+    {
+        m_masterSet.clearShapes();
+        m_lights.clear();
+        for (size_t i = 0; i < m_ownedShapes.size(); ++i)
+        {
+            delete m_ownedShapes[i];
+        }
+        m_ownedShapes.clear();
+        m_topLevelShapes.clear();
+        m_graph.clear();
+        m_cameraTrack.clear();
+        m_bvh.build(m_topLevelShapes);
+        // No shape touches another on destruction, so the order is free
+        m_instances.clear();
+        m_prototypes.clear();
+        m_planes.clear();
+        m_spheres.clear();
+        m_rectangles.clear();
+        m_rectangleLights.clear();
+        m_pointLights.clear();
+        m_spotLights.clear();
+        m_sphereLights.clear();
+        m_diskLights.clear();
+        m_materials.clear();
+        m_hash = 0;
+        m_geometryHash = 0;
+    }
+
+    // Constructs a Plane, Sphere, Rectangle, Instance, Bvh or a light other
+    // than the environment in the scene's pool for its type. The scene owns the result, which is
+    // not in the world until passed to addShape() or addLight().
+    template <class T, class... Args>
+    T* create(Args&&... args)
+    {
+        return pool(static_cast<T*>(NULL)).create(std::forward<Args>(args)...);
+    }
+
+    // Takes ownership of a heap-allocated shape of a type create() does not
+    // know, without placing it in the world
+    void adoptShape(Shape* pShape) { m_ownedShapes.push_back(pShape); }
+
+    // Places pShape, which the scene must own; with a scene graph node it
+    // follows that node's transform, otherwise it stays where it was built
+    void addShape(Shape* pShape, int node = -1)
+    {
+        if (node >= 0)
+        {
+            addInstance(pShape, Transform(), node);
+        }
+        else
+        {
+            m_topLevelShapes.push_back(pShape);
+        }
+    }
+
+    // Returns a prototype over the (bounded, scene-owned) shapes for
+    // addInstance(); the shapes themselves are not rendered
+    Shape* addPrototype(const std::vector<Shape*>& shapes)
+    {
+        Bvh* pPrototype = create<Bvh>();
+        pPrototype->build(shapes);
+        return pPrototype;
+    }
+
+    // Places pPrototype (owned elsewhere, typically by addPrototype) in the
+    // world; with a scene graph node, toWorld is relative to the node
+    void addInstance(Shape* pPrototype, const Transform& toWorld, int node = -1)
+    {
+        Instance* pInstance = create<Instance>(pPrototype, toWorld);
+        if (node >= 0)
+        {
+            m_graph.attach(node, pInstance, toWorld);
+        }
+        m_topLevelShapes.push_back(pInstance);
+    }
+
+    // Places pLight, which the scene must own; it is both a shape and a
+    // light source
+    template <class LightType>
+    void addLight(LightType* pLight)
+    {
+        addShape(pLight);
+        m_lights.push_back(pLight);
+    }
+
+    // Makes pLight, which the scene must own (see adoptShape()), light the
+    // scene from infinitely far away; it is a light source but no shape in
+    // the world
+    void addEnvironment(Light* pLight)
+    {
+        m_lights.push_back(pLight);
+    }
+
+    // Places the shapes at time 0 and builds the BVH and master set; call
+    // once every shape has been added
+    void finalize()
+    {
+        m_graph.update(0.0f);
+        std::vector<Shape*> bounded;
+        m_masterSet.clearShapes();
+        for (size_t i = 0; i < m_topLevelShapes.size(); ++i)
+        {
+            BoundingBox box;
+            if (m_topLevelShapes[i]->bounds(box))
+            {
+                bounded.push_back(m_topLevelShapes[i]);
+            }
+            else
+            {
+                m_masterSet.addShape(m_topLevelShapes[i]);
+            }
+        }
+        m_bvh.build(bounded);
+        if (m_bvh.numShapes())
+        {
+            m_masterSet.addShape(&m_bvh);
+        }
+    }
+
+    // Moves the animated shapes to time, refitting the BVH if anything moved
+    SceneUpdate setTime(float time)
+    {
+        if (!m_graph.update(time))
+        {
+            return kSceneStatic;
+        }
+        return m_bvh.refit() ? kSceneRebuilt : kSceneRefit;
+    }
+
+    Camera cameraAt(float time) const { return m_cameraTrack.evaluate(time, m_camera); }
+
+    bool animated() const { return !m_cameraTrack.empty() || m_graph.size() > 0; }
+
+    // Shapes as placed in the world and the top-level BVH over the bounded
+    // ones, for converters
+    const std::vector<Shape*>& topLevelShapes() const { return m_topLevelShapes; }
+    const Bvh& bvh() const { return m_bvh; }
+
+    MaterialTable m_materials;
+    ShapeSet m_masterSet;
+    std::vector<Light*> m_lights;
+    Camera m_camera;
+    SceneGraph m_graph;
+    CameraTrack m_cameraTrack;
+    // Content hash of the description the scene was built from, and of the
+    // part of it that decides what the camera sees: everything but the
+    // lights, the environment, the camera and the materials' parameters
+    unsigned long long m_hash;
+    unsigned long long m_geometryHash;
+
+protected:
+    ObjectPool<Plane>& pool(Plane*) { return m_planes; }
+    ObjectPool<Sphere>& pool(Sphere*) { return m_spheres; }
+    ObjectPool<Rectangle>& pool(Rectangle*) { return m_rectangles; }
+    ObjectPool<RectangleLight>& pool(RectangleLight*) { return m_rectangleLights; }
+    ObjectPool<PointLight>& pool(PointLight*) { return m_pointLights; }
+    ObjectPool<SpotLight>& pool(SpotLight*) { return m_spotLights; }
+    ObjectPool<SphereLight>& pool(SphereLight*) { return m_sphereLights; }
+    ObjectPool<DiskLight>& pool(DiskLight*) { return m_diskLights; }
+    ObjectPool<Instance>& pool(Instance*) { return m_instances; }
+    ObjectPool<Bvh>& pool(Bvh*) { return m_prototypes; }
+
+    ObjectPool<Plane> m_planes;
+    ObjectPool<Sphere> m_spheres;
+    ObjectPool<Rectangle> m_rectangles;
+    ObjectPool<RectangleLight> m_rectangleLights;
+    ObjectPool<PointLight> m_pointLights;
+    ObjectPool<SpotLight> m_spotLights;
+    ObjectPool<SphereLight> m_sphereLights;
+    ObjectPool<DiskLight> m_diskLights;
+    ObjectPool<Instance> m_instances;
+    ObjectPool<Bvh> m_prototypes;
+    // Shapes of other types, from adoptShape()
+    std::vector<Shape*> m_ownedShapes;
+    // Shapes as placed in the world: plain shapes and instances
+    std::vector<Shape*> m_topLevelShapes;
+    Bvh m_bvh;
+
+private:
+    Scene(const Scene&);
+    Scene& operator =(const Scene&);
+};
+
+
+// The original homework scene: a box with colored walls, a blue sphere and
+// an area light in the ceiling
+inline void buildDefaultScene(Scene& scene)
+{
+    scene.clear();
+
+	MaterialTable& materials = scene.m_materials;
+	unsigned int ph1Id = materials.addMaterial(PhongMaterial(Color(0.5f,0.5f,0.5f),1,0.5f,0.8f,0.2f));
+	unsigned int ph2Id = materials.addMaterial(PhongMaterial(Color(0.0f,0.5f,0.0f),1,0.5f,0.8f,0.2f));
+	unsigned int ph3Id = materials.addMaterial(PhongMaterial(Color(0.5f,0.0f,0.0f),1,0.5f,0.8f,0.2f));
+	unsigned int ph4Id = materials.addMaterial(PhongMaterial(Color(0.0f,0.0f,0.5f),20,0.5f,5.0f,0.5f,0.5f));
+	unsigned int ph5Id = materials.addMaterial(PhongMaterial(Color(1.0f,1.0f,1.0f),1,0.5f,0.3f,0.3f));
+
+    scene.addShape(scene.create<Plane>(Point(0.0f, -2.0f, 0.0f), Vector(0.0f, 1.0f, 0.0f), materials.get(ph1Id)));
+    scene.addShape(scene.create<Plane>(Point(0.0f, 12.0f, 0.0f), Vector(0.0f, -1.0f, 0.0f), materials.get(ph1Id)));
+    scene.addShape(scene.create<Plane>(Point(7.0f, 0.0f, 0.0f), Vector(-1.0f, 0.0f, 0.0f), materials.get(ph2Id)));
+    scene.addShape(scene.create<Plane>(Point(-7.0f, 0.0f, 0.0f), Vector(1.0f, 0.0f, 0.0f), materials.get(ph3Id)));
+    scene.addShape(scene.create<Plane>(Point(0.0f, 0.0f, -5.0f), Vector(0.0f, 0.0f, 1.0f), materials.get(ph1Id)));
+
+	// Add a sphere
+    scene.addShape(scene.create<Sphere>(Point(2.0f, 1.0f, 0.0f), 3.0f, materials.get(ph4Id)));
+
+	// Add an area light
+    scene.addLight(scene.create<RectangleLight>(Point(-2.0f, 11.99f, -2.5f),
+                                                Vector(4.0f, 0.0f, 0.0f),
+                                                Vector(0.0f, 0.0f, 4.0f),
+                                                materials.get(ph5Id),
+                                                1.0f));
+
+    scene.m_camera = Camera(60.0f,
+                            Point(0.0f, 5.0f, 15.0f),
+                            Point(0.0f, 5.0f, 0.0f),
+                            Point(0.0f, 1.0f, 0.0f));
+    scene.finalize();
+}
+
+
+inline bool isLightKeyword(const std::string& keyword)
+{
+    return keyword == "rectlight" || keyword == "pointlight" || keyword == "spotlight" ||
+           keyword == "spherelight" || keyword == "disklight";
+}
+
+
+//
+// Text scene description, one statement per line ('#' starts a comment):
+//
+//   material NAME phong R G B EXPONENT KDIFFUSE KSPECULAR KAMBIENT [RREFLECT [RREFRACT]]
+//   material NAME lambert R G B [KDIFFUSE [KAMBIENT [RREFLECT]]]
+//   material NAME mirror R G B
+//   material NAME dielectric R G B [IOR]
+//     (any material may end in texture=PATH and uvscale=S)
+//   plane PX PY PZ NX NY NZ MATERIAL
+//   sphere CX CY CZ RADIUS MATERIAL
+//   rectangle PX PY PZ S1X S1Y S1Z S2X S2Y S2Z MATERIAL
+//   rectlight PX PY PZ S1X S1Y S1Z S2X S2Y S2Z MATERIAL POWER
+//   pointlight PX PY PZ MATERIAL POWER
+//   spotlight PX PY PZ DX DY DZ ANGLE FALLOFF MATERIAL POWER
+//   spherelight CX CY CZ RADIUS MATERIAL POWER
+//   disklight CX CY CZ NX NY NZ RADIUS MATERIAL POWER
+//   camera FOV OX OY OZ TX TY TZ [UX UY UZ]
+//   node NAME [PARENT]
+//   key NODE TIME TX TY TZ RX RY RZ SCALE
+//   camerakey TIME FOV OX OY OZ TX TY TZ [UX UY UZ]
+//   prototype NAME
+//     ...spheres, rectangles and instances...
+//   end
+//   instance PROTOTYPE TX TY TZ RX RY RZ SCALE
+//   environment constant R G B [POWER]
+//   environment sky ZR ZG ZB HR HG HB GR GG GB [POWER [SX SY SZ SR SG SB ANGLE]]
+//   environment image PATH [POWER [ROTATION]]
+//
+// A textured material multiplies its color by the image in PATH (any
+// format readImage() takes, or a tiled texture) at the hit's surface
+// coordinates, repeated S times across them. Rectangles span the image
+// once, spheres wrap it around the y axis and planes repeat it every
+// world unit.
+//
+// A light takes its color from its material. A spot light shines along D
+// with full power up to ANGLE - FALLOFF degrees off the axis, fading out
+// at ANGLE; a disk light emits on the side N points to.
+//
+// Materials may be declared anywhere; shapes refer to them by name. Any
+// shape but a light may end in "node=NAME" to follow that scene graph
+// node, whose transform is keyframed by 'key' lines (rotations in degrees,
+// times in seconds). A node's parent must be declared before it.
+//
+// Shapes between 'prototype' and 'end' are not rendered themselves but
+// make up a sub-scene that 'instance' places any number of times, sharing
+// the geometry. A prototype may instance earlier prototypes but must not
+// contain planes or lights; an instance may be attached to a node too.
+//
+// At most one 'environment' lights the scene from afar: a constant color,
+// a sky (zenith, horizon and ground colors, optionally a sun towards S
+// with radiance SR SG SB and an angular radius in degrees) or a lat-long
+// image (PATH relative to the working directory, ROTATION in degrees
+// about the y axis).
+//
+inline bool parseScene(const std::string& text, Scene& scene, std::string& error)
+{
+    scene.clear();
+
+    struct Statement
+    {
+        size_t m_line;
+        std::string m_keyword;
+        std::vector<std::string> m_args;
+    };
+    std::vector<Statement> shapes;
+    std::map<std::string, unsigned int> materialIds;
+    std::string geometry;
+    std::string openPrototype;
+    bool hasEnvironment = false;
+
+    std::istringstream in(text);
+    std::string line;
+    size_t lineNumber = 0;
+    while (std::getline(in, line))
+    {
+        ++lineNumber;
+        std::string::size_type hash = line.find('#');
+        if (hash != std::string::npos)
+        {
+            line.erase(hash);
+        }
+        Statement st;
+        st.m_line = lineNumber;
+        std::istringstream words(line);
+        if (!(words >> st.m_keyword))
+        {
+            continue;
+        }
+        std::string word;
+        while (words >> word)
+        {
+            st.m_args.push_back(word);
+        }
+        // Trailing key=value options of a material
+        std::vector<std::string> options;
+        while (st.m_keyword == "material" && !st.m_args.empty() &&
+               st.m_args.back().find('=') != std::string::npos)
+        {
+            options.insert(options.begin(), st.m_args.back());
+            st.m_args.pop_back();
+        }
+
+        // A material only counts by its name (which fixes its id) and
+        // whether it is textured (which decides if hits get uv coordinates)
+        if (st.m_keyword == "material")
+        {
+            geometry += "material";
+            geometry += st.m_args.empty() ? std::string() : " " + st.m_args[0];
+            for (size_t i = 0; i < options.size(); ++i)
+            {
+                geometry += options[i].compare(0, 8, "texture=") == 0 ? " textured" : "";
+            }
+            geometry += "\n";
+        }
+        else if (!isLightKeyword(st.m_keyword) && st.m_keyword != "environment" &&
+                 st.m_keyword != "camera" && st.m_keyword != "camerakey")
+        {
+            geometry += st.m_keyword;
+            for (size_t i = 0; i < st.m_args.size(); ++i)
+            {
+                geometry += " " + st.m_args[i];
+            }
+            geometry += "\n";
+        }
+
+        std::vector<float> f;
+        bool numeric = true;
+        size_t first = (st.m_keyword == "material") ? 2 :
+                       (st.m_keyword == "key") ? 1 :
+                       (st.m_keyword == "environment") ?
+                           (!st.m_args.empty() && st.m_args[0] == "image" ? 2 : 1) : 0;
+        for (size_t i = first; i < st.m_args.size(); ++i)
+        {
+            std::istringstream number(st.m_args[i]);
+            float v;
+            if (number >> v && number.eof())
+            {
+                f.push_back(v);
+            }
+            else
+            {
+                numeric = false;
+            }
+        }
+
+        std::ostringstream where;
+        where << "line " << lineNumber << ": ";
+
+        if (st.m_keyword == "material")
+        {
+            if (st.m_args.size() < 2 || !numeric || f.size() < 3)
+            {
+                error = where.str() + "expected 'material NAME TYPE R G B ...'";
+                return false;
+            }
+            const std::string& type = st.m_args[1];
+            Color color(f[0], f[1], f[2]);
+            Material m;
+            if (type == "phong" && f.size() >= 7 && f.size() <= 9)
+            {
+                m = PhongMaterial(color, f[3], f[4], f[5], f[6],
+                                  f.size() > 7 ? f[7] : 0.0f,
+                                  f.size() > 8 ? f[8] : 0.0f);
+            }
+            else if (type == "lambert" && f.size() <= 6)
+            {
+                m = LambertMaterial(color,
+                                    f.size() > 3 ? f[3] : 1.0f,
+                                    f.size() > 4 ? f[4] : 0.0f,
+                                    f.size() > 5 ? f[5] : 0.0f);
+            }
+            else if (type == "mirror" && f.size() == 3)
+            {
+                m = MirrorMaterial(color);
+            }
+            else if (type == "dielectric" && f.size() <= 4)
+            {
+                m = DielectricMaterial(color, f.size() > 3 ? f[3] : 1.5f);
+            }
+            else
+            {
+                error = where.str() + "bad material '" + type + "' or wrong number of parameters";
+                return false;
+            }
+            for (size_t i = 0; i < options.size(); ++i)
+            {
+                std::string::size_type eq = options[i].find('=');
+                std::string key = options[i].substr(0, eq);
+                std::string value = options[i].substr(eq + 1);
+                std::istringstream number(value);
+                if (key == "texture")
+                {
+                    std::string textureError;
+                    if (!(m.m_pTexture = TextureCache::global().load(value, textureError)))
+                    {
+                        error = where.str() + textureError;
+                        return false;
+                    }
+                }
+                else if (key != "uvscale" || !(number >> m.m_uvScale) || !number.eof() || m.m_uvScale <= 0.0f)
+                {
+                    error = where.str() + "bad material option '" + options[i] + "'";
+                    return false;
+                }
+            }
+            if (materialIds.count(st.m_args[0]))
+            {
+                error = where.str() + "material '" + st.m_args[0] + "' defined twice";
+                return false;
+            }
+            materialIds[st.m_args[0]] = scene.m_materials.addMaterial(m);
+        }
+        else if (st.m_keyword == "camera")
+        {
+            if (!numeric || (f.size() != 7 && f.size() != 10))
+            {
+                error = where.str() + "expected 'camera FOV OX OY OZ TX TY TZ [UX UY UZ]'";
+                return false;
+            }
+            Vector up = f.size() == 10 ? Vector(f[7], f[8], f[9]) : Vector(0.0f, 1.0f, 0.0f);
+            scene.m_camera = Camera(f[0], Point(f[1], f[2], f[3]), Point(f[4], f[5], f[6]), up);
+        }
+        else if (st.m_keyword == "camerakey")
+        {
+            if (!numeric || (f.size() != 8 && f.size() != 11))
+            {
+                error = where.str() + "expected 'camerakey TIME FOV OX OY OZ TX TY TZ [UX UY UZ]'";
+                return false;
+            }
+            Vector up = f.size() == 11 ? Vector(f[8], f[9], f[10]) : Vector(0.0f, 1.0f, 0.0f);
+            scene.m_cameraTrack.addKey(f[0], Camera(f[1], Point(f[2], f[3], f[4]), Point(f[5], f[6], f[7]), up));
+        }
+        else if (st.m_keyword == "node")
+        {
+            if (st.m_args.empty() || st.m_args.size() > 2)
+            {
+                error = where.str() + "expected 'node NAME [PARENT]'";
+                return false;
+            }
+            if (scene.m_graph.find(st.m_args[0]) >= 0)
+            {
+                error = where.str() + "node '" + st.m_args[0] + "' defined twice";
+                return false;
+            }
+            int parent = -1;
+            if (st.m_args.size() == 2 && (parent = scene.m_graph.find(st.m_args[1])) < 0)
+            {
+                error = where.str() + "unknown parent node '" + st.m_args[1] + "'";
+                return false;
+            }
+            scene.m_graph.addNode(st.m_args[0], parent);
+        }
+        else if (st.m_keyword == "key")
+        {
+            if (st.m_args.size() != 9 || !numeric)
+            {
+                error = where.str() + "expected 'key NODE TIME TX TY TZ RX RY RZ SCALE'";
+                return false;
+            }
+            int node = scene.m_graph.find(st.m_args[0]);
+            if (node < 0)
+            {
+                error = where.str() + "unknown node '" + st.m_args[0] + "'";
+                return false;
+            }
+            scene.m_graph.animation(node).addKey(TransformKey(f[0], Vector(f[1], f[2], f[3]),
+                                                              Vector(f[4], f[5], f[6]), f[7]));
+        }
+        else if (st.m_keyword == "environment")
+        {
+            if (hasEnvironment)
+            {
+                error = where.str() + "only one environment is allowed";
+                return false;
+            }
+            if (st.m_args.empty() || !numeric)
+            {
+                error = where.str() + "expected 'environment TYPE ...'";
+                return false;
+            }
+            const std::string& type = st.m_args[0];
+            Light* pLight;
+            if (type == "constant" && (f.size() == 3 || f.size() == 4))
+            {
+                pLight = new EnvironmentLight(Color(f[0], f[1], f[2]), f.size() > 3 ? f[3] : 1.0f);
+            }
+            else if (type == "sky" && (f.size() == 9 || f.size() == 10 || f.size() == 17))
+            {
+                SkyModel sky;
+                sky.m_zenith = Color(f[0], f[1], f[2]);
+                sky.m_horizon = Color(f[3], f[4], f[5]);
+                sky.m_ground = Color(f[6], f[7], f[8]);
+                if (f.size() == 17)
+                {
+                    sky.m_sunDirection = Vector(f[10], f[11], f[12]).normalized();
+                    sky.m_sun = Color(f[13], f[14], f[15]);
+                    sky.m_sunAngle = f[16];
+                }
+                pLight = new EnvironmentLight(sky, f.size() > 9 ? f[9] : 1.0f);
+            }
+            else if (type == "image" && st.m_args.size() >= 2 && f.size() <= 2)
+            {
+                std::vector<Color> texels;
+                size_t width, height;
+                if (!readImage(st.m_args[1], texels, width, height) || width == 0 || height == 0)
+                {
+                    error = where.str() + "cannot read environment image '" + st.m_args[1] + "'";
+                    return false;
+                }
+                pLight = new EnvironmentLight(texels, width, height,
+                                              f.size() > 0 ? f[0] : 1.0f,
+                                              f.size() > 1 ? f[1] : 0.0f);
+            }
+            else
+            {
+                error = where.str() + "bad environment '" + type + "' or wrong number of parameters";
+                return false;
+            }
+            scene.adoptShape(pLight);
+            scene.addEnvironment(pLight);
+            hasEnvironment = true;
+        }
+        else if (st.m_keyword == "plane" || st.m_keyword == "sphere" ||
+                 st.m_keyword == "rectangle" || st.m_keyword == "instance" ||
+                 isLightKeyword(st.m_keyword))
+        {
+            // Built once every material is known
+            shapes.push_back(st);
+        }
+        else if (st.m_keyword == "prototype")
+        {
+            if (st.m_args.size() != 1)
+            {
+                error = where.str() + "expected 'prototype NAME'";
+                return false;
+            }
+            if (!openPrototype.empty())
+            {
+                error = where.str() + "prototype '" + openPrototype + "' is not closed";
+                return false;
+            }
+            openPrototype = st.m_args[0];
+            shapes.push_back(st);
+        }
+        else if (st.m_keyword == "end")
+        {
+            if (openPrototype.empty() || !st.m_args.empty())
+            {
+                error = where.str() + "'end' without 'prototype'";
+                return false;
+            }
+            openPrototype.clear();
+            shapes.push_back(st);
+        }
+        else
+        {
+            error = where.str() + "unknown statement '" + st.m_keyword + "'";
+            return false;
+        }
+    }
+    if (!openPrototype.empty())
+    {
+        error = "prototype '" + openPrototype + "' is not closed";
+        return false;
+    }
+
+    // Shapes of the prototype being read; the name is empty at the top level
+    std::vector<Shape*> prototypeShapes;
+    std::string prototypeName;
+    std::map<std::string, Shape*> prototypes;
+    for (size_t i = 0; i < shapes.size(); ++i)
+    {
+        const Statement& st = shapes[i];
+        std::ostringstream where;
+        where << "line " << st.m_line << ": ";
+
+        if (st.m_keyword == "prototype")
+        {
+            if (prototypes.count(st.m_args[0]))
+            {
+                error = where.str() + "prototype '" + st.m_args[0] + "' defined twice";
+                return false;
+            }
+            prototypeName = st.m_args[0];
+            prototypeShapes.clear();
+            continue;
+        }
+        if (st.m_keyword == "end")
+        {
+            prototypes[prototypeName] = scene.addPrototype(prototypeShapes);
+            prototypeName.clear();
+            continue;
+        }
+        bool inPrototype = !prototypeName.empty();
+
+        bool isLight = isLightKeyword(st.m_keyword);
+        bool isInstance = st.m_keyword == "instance";
+        if (inPrototype && (isLight || st.m_keyword == "plane"))
+        {
+            error = where.str() + "prototypes cannot contain planes or lights";
+            return false;
+        }
+        size_t numFloats = st.m_keyword == "plane" ? 6 :
+                           st.m_keyword == "sphere" || st.m_keyword == "spherelight" ? 4 :
+                           st.m_keyword == "pointlight" ? 3 :
+                           st.m_keyword == "disklight" || isInstance ? 7 :
+                           st.m_keyword == "spotlight" ? 8 : 9;
+        size_t numArgs = st.m_args.size();
+        int node = -1;
+        if (numArgs > 0 && st.m_args[numArgs - 1].compare(0, 5, "node=") == 0)
+        {
+            std::string name = st.m_args[--numArgs].substr(5);
+            if (isLight || inPrototype)
+            {
+                error = where.str() + "lights and prototype contents cannot be attached to a node";
+                return false;
+            }
+            if ((node = scene.m_graph.find(name)) < 0)
+            {
+                error = where.str() + "unknown node '" + name + "'";
+                return false;
+            }
+        }
+        if (numArgs != numFloats + 1 + (isLight ? 1 : 0))
+        {
+            error = where.str() + "wrong number of parameters for '" + st.m_keyword + "'";
+            return false;
+        }
+        // The instance's prototype comes first, a shape's material last
+        size_t nameArg = isInstance ? 0 : numFloats;
+        std::vector<float> f;
+        for (size_t k = 0; k < numArgs; ++k)
+        {
+            if (k == nameArg)
+            {
+                continue;
+            }
+            std::istringstream number(st.m_args[k]);
+            float v;
+            if (!(number >> v) || !number.eof())
+            {
+                error = where.str() + "bad number '" + st.m_args[k] + "'";
+                return false;
+            }
+            f.push_back(v);
+        }
+        if (isInstance)
+        {
+            std::map<std::string, Shape*>::const_iterator p = prototypes.find(st.m_args[0]);
+            if (p == prototypes.end())
+            {
+                error = where.str() + "unknown prototype '" + st.m_args[0] + "'";
+                return false;
+            }
+            Transform toWorld = TransformKey(0.0f, Vector(f[0], f[1], f[2]),
+                                             Vector(f[3], f[4], f[5]), f[6]).toTransform();
+            if (inPrototype)
+            {
+                prototypeShapes.push_back(scene.create<Instance>(p->second, toWorld));
+            }
+            else
+            {
+                scene.addInstance(p->second, toWorld, node);
+            }
+            continue;
+        }
+
+        std::map<std::string, unsigned int>::const_iterator m = materialIds.find(st.m_args[numFloats]);
+        if (m == materialIds.end())
+        {
+            error = where.str() + "unknown material '" + st.m_args[numFloats] + "'";
+            return false;
+        }
+        const Material* pMaterial = scene.m_materials.get(m->second);
+
+        if (isLight)
+        {
+            float power = f[numFloats];
+            if (st.m_keyword == "rectlight")
+            {
+                scene.addLight(scene.create<RectangleLight>(Point(f[0], f[1], f[2]), Vector(f[3], f[4], f[5]),
+                                                            Vector(f[6], f[7], f[8]), pMaterial, power));
+            }
+            else if (st.m_keyword == "pointlight")
+            {
+                scene.addLight(scene.create<PointLight>(Point(f[0], f[1], f[2]), pMaterial, power));
+            }
+            else if (st.m_keyword == "spotlight")
+            {
+                scene.addLight(scene.create<SpotLight>(Point(f[0], f[1], f[2]), Vector(f[3], f[4], f[5]),
+                                                       f[6], f[7], pMaterial, power));
+            }
+            else if (st.m_keyword == "spherelight")
+            {
+                scene.addLight(scene.create<SphereLight>(Point(f[0], f[1], f[2]), f[3], pMaterial, power));
+            }
+            else
+            {
+                scene.addLight(scene.create<DiskLight>(Point(f[0], f[1], f[2]), Vector(f[3], f[4], f[5]),
+                                                       f[6], pMaterial, power));
+            }
+            continue;
+        }
+        Shape* pShape;
+        if (st.m_keyword == "plane")
+        {
+            pShape = scene.create<Plane>(Point(f[0], f[1], f[2]), Vector(f[3], f[4], f[5]), pMaterial);
+        }
+        else if (st.m_keyword == "sphere")
+        {
+            pShape = scene.create<Sphere>(Point(f[0], f[1], f[2]), f[3], pMaterial);
+        }
+        else
+        {
+            pShape = scene.create<Rectangle>(Point(f[0], f[1], f[2]), Vector(f[3], f[4], f[5]),
+                                             Vector(f[6], f[7], f[8]), pMaterial);
+        }
+        if (inPrototype)
+        {
+            prototypeShapes.push_back(pShape);
+        }
+        else
+        {
+            scene.addShape(pShape, node);
+        }
+    }
+
+    scene.finalize();
+    scene.m_hash = hashBytes(text.data(), text.size());
+    scene.m_geometryHash = hashBytes(geometry.data(), geometry.size());
+    return true;
+}
+
+
+inline bool readFile(const std::string& path, std::string& contents)
+{
+    std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+    if (!in)
+    {
+        return false;
+    }
+    std::ostringstream buffer;
+    buffer << in.rdbuf();
+    contents = buffer.str();
+    return true;
+}
+
+
+// Defined in binary_scene.h
+inline bool isBinarySceneFile(const std::string& path);
+inline bool loadBinaryScene(const std::string& path, Scene& scene, std::string& error);
+
+
+// Builds the scene described in a file (text or binary), or the default
+// scene for an empty path or "builtin"
+inline bool loadScene(const std::string& path, Scene& scene, std::string& error)
+{
+    if (path.empty() || path == "builtin")
+    {
+        buildDefaultScene(scene);
+        return true;
+    }
+    if (isBinarySceneFile(path))
+    {
+        return loadBinaryScene(path, scene, error);
+    }
+    std::string text;
+    if (!readFile(path, text))
+    {
+        error = "cannot read scene file '" + path + "'";
+        return false;
+    }
+    if (!parseScene(text, scene, error))
+    {
+        error = path + ": " + error;
+        return false;
+    }
+    return true;
+}
+
+}//namespace Tracer
+
+#endif
@@ -0,0 +1,333 @@
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "omp.h"
+#include "util.h"
+#include "camera.h"
+#include "scene.h"
+#include "binary_scene.h"
+#include "settings.h"
+#include "renderer.h"
+#include "image_io.h"
+
+namespace Tracer
+{
+
+//
+// LRU cache of built scenes keyed by the hash of their description, so a
+// scene file that did not change is parsed and built only once however many
+// frames are rendered from it.
+//
+class SceneCache
+{
+public:
+    explicit SceneCache(size_t capacity) : m_capacity(capacity), m_hits(0), m_misses(0) { }
+
+    // The scene for path ("builtin" or empty for the default scene); hit
+    // reports whether it came from the cache. Returns NULL on error.
+    std::shared_ptr<Scene> get(const std::string& path, bool& hit, std::string& error)
+    {
+        bool builtin = path.empty() || path == "builtin";
+        // Binary scenes are keyed by the source hash in their header, so
+        // they are never read in full
+        bool binary = !builtin && isBinarySceneFile(path);
+        std::string text = "builtin";
+        unsigned long long key;
+        if (binary)
+        {
+            if (!readBinarySceneHash(path, key))
+            {
+                error = "cannot read scene file '" + path + "'";
+                return std::shared_ptr<Scene>();
+            }
+            key ^= 2ULL;
+        }
+        else if (!builtin && !readFile(path, text))
+        {
+            error = "cannot read scene file '" + path + "'";
+            return std::shared_ptr<Scene>();
+        }
+        else
+        {
+            key = hashBytes(text.data(), text.size()) ^ (builtin ? 1ULL : 0ULL);
+        }
+
+        std::map<unsigned long long, Entries::iterator>::iterator found = m_index.find(key);
+        if (found != m_index.end())
+        {
+            // Move to the front of the LRU list
+            m_entries.splice(m_entries.begin(), m_entries, found->second);
+            hit = true;
+            ++m_hits;
+            return m_entries.front().second;
+        }
+
+        std::shared_ptr<Scene> scene(new Scene);
+        if (builtin)
+        {
+            buildDefaultScene(*scene);
+        }
+        else if (binary)
+        {
+            if (!loadBinaryScene(path, *scene, error))
+            {
+                return std::shared_ptr<Scene>();
+            }
+        }
+        else if (!parseScene(text, *scene, error))
+        {
+            error = path + ": " + error;
+            return std::shared_ptr<Scene>();
+        }
+        hit = false;
+        ++m_misses;
+        m_entries.push_front(std::make_pair(key, scene));
+        m_index[key] = m_entries.begin();
+        while (m_entries.size() > m_capacity)
+        {
+            m_index.erase(m_entries.back().first);
+            m_entries.pop_back();
+        }
+        return scene;
+    }
+
+    size_t size() const { return m_entries.size(); }
+    size_t hits() const { return m_hits; }
+    size_t misses() const { return m_misses; }
+
+protected:
+    typedef std::list<std::pair<unsigned long long, std::shared_ptr<Scene> > > Entries;
+
+    size_t m_capacity;
+    Entries m_entries;
+    std::map<unsigned long long, Entries::iterator> m_index;
+    size_t m_hits, m_misses;
+};
+
+
+//
+// Long-running render server speaking a line protocol (one request per
+// line on the input stream, one reply per line on the output stream):
+//
+//   render [scene=PATH] [camera=FOV,OX,OY,OZ,TX,TY,TZ[,UX,UY,UZ]] [KEY=VALUE ...]
+//       renders a frame; KEY is any render setting (output, width, spp,
+//       threads...) and overrides the server's defaults for this request
+//       only. Settings of the server as a whole (see isServerOption())
+//       are refused.
+//       Replies "ok OUTPUT seconds=S scene=hit|miss" or "error MESSAGE".
+//   stats
+//       replies "ok scenes=N hits=H misses=M"
+//   quit
+//       replies "ok bye" and stops the server
+//
+// Requests run one after another, each on the whole OpenMP worker pool,
+// which stays alive between requests.
+//
+// With --relight-cache the server keeps the camera hits of the last
+// render. A request that only changes lights, materials or shading
+// settings (an edited scene file is rebuilt, but keeps its geometry hash)
+// replays them instead of tracing the camera rays again.
+//
+class RenderServer
+{
+public:
+    RenderServer(const RenderSettings& defaults,
+                 size_t sceneCacheSize,
+                 std::istream& in,
+                 std::ostream& out)
+        : m_defaults(defaults),
+          m_cache(sceneCacheSize),
+          m_numThreads(omp_get_max_threads()),
+          m_in(in),
+          m_out(out)
+    {
+
+    }
+
+    int run()
+    {
+        std::string line;
+        while (std::getline(m_in, line))
+        {
+            std::istringstream words(line);
+            std::string command;
+            if (!(words >> command) || command[0] == '#')
+            {
+                continue;
+            }
+            if (command == "quit")
+            {
+                m_out << "ok bye" << std::endl;
+                return 0;
+            }
+            else if (command == "stats")
+            {
+                m_out << "ok scenes=" << m_cache.size()
+                      << " hits=" << m_cache.hits()
+                      << " misses=" << m_cache.misses() << std::endl;
+            }
+            else if (command == "render")
+            {
+                std::vector<std::string> args;
+                std::string arg;
+                while (words >> arg)
+                {
+                    args.push_back(arg);
+                }
+                handleRender(args);
+            }
+            else
+            {
+                m_out << "error unknown command '" << command << "'" << std::endl;
+            }
+        }
+        return 0;
+    }
+
+protected:
+    void handleRender(const std::vector<std::string>& args)
+    {
+        double start = omp_get_wtime();
+        RenderSettings settings = m_defaults;
+        std::string scenePath = m_defaults.m_scenePath;
+        std::string cameraSpec;
+        std::string error;
+        int numThreads = m_numThreads;
+
+        for (size_t i = 0; i < args.size(); ++i)
+        {
+            std::string::size_type eq = args[i].find('=');
+            if (eq == std::string::npos)
+            {
+                m_out << "error expected KEY=VALUE, got '" << args[i] << "'" << std::endl;
+                return;
+            }
+            std::string key = args[i].substr(0, eq);
+            std::string value = args[i].substr(eq + 1);
+            if (key == "scene")
+            {
+                scenePath = value;
+            }
+            else if (key == "camera")
+            {
+                cameraSpec = value;
+            }
+            else if (isServerOption(key))
+            {
+                m_out << "error option '" << key << "' is not allowed in a request" << std::endl;
+                return;
+            }
+            else if (!settings.set(key, value, error))
+            {
+                m_out << "error " << error << std::endl;
+                return;
+            }
+            else if (key == "threads")
+            {
+                numThreads = settings.m_numThreads > 0 ? int(settings.m_numThreads) : omp_get_num_procs();
+            }
+        }
+        // The reused arenas were sized for the team the server started
+        // with; a request may ask for a larger one
+        omp_set_num_threads(numThreads);
+        m_frameArenas.ensure(size_t(numThreads));
+
+        bool hit = false;
+        std::shared_ptr<Scene> scene = m_cache.get(scenePath, hit, error);
+        if (!scene)
+        {
+            m_out << "error " << error << std::endl;
+            return;
+        }
+
+        Camera camera = scene->m_camera;
+        if (!cameraSpec.empty() && !parseCamera(cameraSpec, camera))
+        {
+            m_out << "error bad camera '" << cameraSpec << "'" << std::endl;
+            return;
+        }
+
+        std::vector<Color> image;
+        FeatureBuffers features;
+        renderFrame(*scene, camera, settings, image, &m_frameArenas, NULL, &features, NULL,
+                    &m_primaryHits);
+        std::string outputFile = settings.outputFile();
+        if (!writeImage(outputFile, image, settings.m_width, settings.m_height) ||
+            (settings.m_writeFeatures && !writeFeatureImages(features, outputFile)))
+        {
+            m_out << "error failed to write " << outputFile << std::endl;
+            return;
+        }
+        m_out << "ok " << outputFile
+              << " seconds=" << omp_get_wtime() - start
+              << " scene=" << (hit ? "hit" : "miss") << std::endl;
+    }
+
+    // Whether key is an option the server only takes at startup, or that
+    // does nothing for a single in-process frame, so a request must not
+    // look as if it had set it
+    static bool isServerOption(const std::string& key)
+    {
+        static const char* const kServerOptions[] =
+        {
+            "config", "serve", "scene-cache", "texture-cache", "texture-dir", "numa",
+            "write-scene", "frames", "first-frame", "fps",
+            "workers", "remote-workers", "worker-timeout", "partition", "connect", "listen"
+        };
+        for (size_t i = 0; i < sizeof(kServerOptions) / sizeof(kServerOptions[0]); ++i)
+        {
+            if (key == kServerOptions[i])
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // "FOV,OX,OY,OZ,TX,TY,TZ[,UX,UY,UZ]"
+    static bool parseCamera(const std::string& spec, Camera& camera)
+    {
+        std::vector<float> f;
+        std::istringstream in(spec);
+        std::string item;
+        while (std::getline(in, item, ','))
+        {
+            std::istringstream number(item);
+            float v;
+            if (!(number >> v) || !number.eof())
+            {
+                return false;
+            }
+            f.push_back(v);
+        }
+        if (f.size() != 7 && f.size() != 10)
+        {
+            return false;
+        }
+        Vector up = f.size() == 10 ? Vector(f[7], f[8], f[9]) : Vector(0.0f, 1.0f, 0.0f);
+        camera = Camera(f[0], Point(f[1], f[2], f[3]), Point(f[4], f[5], f[6]), up);
+        return true;
+    }
+
+    RenderSettings m_defaults;
+    SceneCache m_cache;
+    // OpenMP threads of a request that does not set threads
+    int m_numThreads;
+    // Transient render buffers, reused from one request to the next
+    FrameArenas m_frameArenas;
+    // Camera hits of the last render, for the next to replay
+    PrimaryHitCache m_primaryHits;
+    std::istream& m_in;
+    std::ostream& m_out;
+};
+
+}//namespace Tracer
+
+#endif
@@ -0,0 +1,482 @@
+#ifndef __SETTINGS_H__
+#define __SETTINGS_H__
+
+#include <climits>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+namespace Tracer
+{
+
+//
+// Render settings, read from (in increasing priority) the built-in
+// defaults, an optional config file and the command line.
+//
+// Config files hold one "key = value" per line; '#' starts a comment.
+// On the command line the same keys are given as "--key value" or
+// "--key=value", and "--config file" loads a config file in place.
+//
+struct RenderSettings
+{
+    size_t m_width;
+    size_t m_height;
+    size_t m_numPixelSamples;
+    size_t m_numLightSamples;
+    size_t m_maxBounce;
+    // 0 lets OpenMP decide
+    size_t m_numThreads;
+    size_t m_tileSize;
+    unsigned int m_seed;
+    // Pixel reconstruction filter: "box", "tent", "gaussian" or "mitchell",
+    // and its radius in pixels (0 for the filter's default)
+    std::string m_filter;
+    double m_filterRadius;
+    std::string m_outputPath;
+    // Image format (file extension) overriding the one of m_outputPath
+    std::string m_outputFormat;
+    // Wall-clock budget in seconds, 0 for none
+    double m_timeBudget;
+    bool m_wavefront;
+    bool m_sortSecondaryRays;
+    bool m_verbose;
+    // Denoise the frame, guided by a feature pass
+    bool m_denoise;
+    // Also write the albedo, normal and depth images of the feature pass
+    bool m_writeFeatures;
+    // Distributed rendering: local worker processes to fork, extra remote
+    // workers to wait for and how many seconds for, how the frame is
+    // split, where the coordinator listens, and (for a worker) which
+    // coordinator to connect to
+    size_t m_numWorkers;
+    size_t m_numRemoteWorkers;
+    double m_workerTimeout;
+    std::string m_partition;
+    std::string m_listenAddress;
+    std::string m_connectAddress;
+    // Scene file, empty for the built-in scene
+    std::string m_scenePath;
+    // Write the loaded scene here as a binary scene instead of rendering
+    std::string m_binaryScenePath;
+    // Serve render requests from stdin instead of rendering one frame
+    bool m_serve;
+    size_t m_sceneCacheSize;
+    // Memory for the camera hits the server keeps between requests, in MB,
+    // so that relighting the same view skips the primary intersections; 0
+    // for none
+    size_t m_relightCacheSize;
+    // Animation: frames to render (0 renders a single still at time 0),
+    // index of the first one and frames per second
+    size_t m_numFrames;
+    size_t m_firstFrame;
+    double m_fps;
+    // NUMA mode: "off", "interleave" (spread the scene's pages over the
+    // nodes) or "replicate" (a copy of the scene per node)
+    std::string m_numa;
+    // Memory for cached texture tiles, in MB, and the directory images are
+    // converted to tiled textures in (empty for $TMPDIR/tracer-textures)
+    size_t m_textureCacheSize;
+    std::string m_textureDirectory;
+    // Light samples adding less than this (in luminance) to a pixel only
+    // get a shadow ray by Russian roulette; 0 culls just those adding
+    // nothing
+    double m_shadowCullThreshold;
+    // Irradiance cache accuracy for diffuse indirect light, 0 for none
+    // (the ambient term stands in), and gather rays per cache record
+    double m_irradianceAccuracy;
+    size_t m_numIrradianceRays;
+    // Diffuse indirect light from rays guided by a learned path guide,
+    // when there is no irradiance cache
+    bool m_pathGuiding;
+    // Direct light at camera hits by reservoir resampling, from this many
+    // light candidates per pixel and pass
+    bool m_restir;
+    size_t m_numRestirCandidates;
+
+    RenderSettings()
+        : m_width(1920),
+          m_height(1080),
+          m_numPixelSamples(64),
+          m_numLightSamples(32),
+          m_maxBounce(1),
+          m_numThreads(0),
+          m_tileSize(32),
+          m_seed(0),
+          m_filter("box"),
+          m_filterRadius(0.0),
+          m_outputPath("out.jpg"),
+          m_outputFormat(),
+          m_timeBudget(0.0),
+          m_wavefront(false),
+          m_sortSecondaryRays(true),
+          m_verbose(false),
+          m_denoise(false),
+          m_writeFeatures(false),
+          m_numWorkers(0),
+          m_numRemoteWorkers(0),
+          m_workerTimeout(60.0),
+          m_partition("tiles"),
+          m_listenAddress("127.0.0.1:0"),
+          m_connectAddress(),
+          m_scenePath(),
+          m_binaryScenePath(),
+          m_serve(false),
+          m_sceneCacheSize(4),
+          m_relightCacheSize(0),
+          m_numFrames(0),
+          m_firstFrame(0),
+          m_fps(24.0),
+          m_numa("off"),
+          m_textureCacheSize(256),
+          m_textureDirectory(),
+          m_shadowCullThreshold(0.0),
+          m_irradianceAccuracy(0.0),
+          m_numIrradianceRays(256),
+          m_pathGuiding(false),
+          m_restir(false),
+          m_numRestirCandidates(32)
+    {
+
+    }
+
+    // Output path with m_outputFormat applied
+    std::string outputFile() const
+    {
+        if (m_outputFormat.empty())
+        {
+            return m_outputPath;
+        }
+        std::string::size_type dot = m_outputPath.find_last_of('.');
+        std::string::size_type slash = m_outputPath.find_last_of('/');
+        std::string stem = m_outputPath;
+        if (dot != std::string::npos && (slash == std::string::npos || dot > slash))
+        {
+            stem = m_outputPath.substr(0, dot);
+        }
+        return stem + "." + m_outputFormat;
+    }
+
+    // Output file of an animation frame: a run of '#' in the path is
+    // replaced by the zero-padded frame number, otherwise "_NNNN" is
+    // inserted before the extension
+    std::string frameFile(size_t frame) const
+    {
+        std::string path = outputFile();
+        std::string::size_type begin = path.find('#');
+        std::string::size_type slash = path.find_last_of('/');
+        std::ostringstream number;
+        if (begin != std::string::npos && (slash == std::string::npos || begin > slash))
+        {
+            std::string::size_type end = path.find_first_not_of('#', begin);
+            if (end == std::string::npos)
+            {
+                end = path.size();
+            }
+            number.width(end - begin);
+            number.fill('0');
+            number << frame;
+            return path.substr(0, begin) + number.str() + path.substr(end);
+        }
+        number.width(4);
+        number.fill('0');
+        number << frame;
+        std::string::size_type dot = path.find_last_of('.');
+        if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        {
+            dot = path.size();
+        }
+        return path.substr(0, dot) + "_" + number.str() + path.substr(dot);
+    }
+
+    // Sets one option; returns false (with a message in error) if the key
+    // is unknown or the value does not parse
+    bool set(const std::string& key, const std::string& value, std::string& error)
+    {
+        bool ok = true;
+        if      (key == "width")            ok = parseSize(value, m_width, 2);
+        else if (key == "height")           ok = parseSize(value, m_height, 2);
+        else if (key == "spp")              ok = parseSize(value, m_numPixelSamples, 1);
+        else if (key == "light-samples")    ok = parseSize(value, m_numLightSamples, 1);
+        else if (key == "bounces")          ok = parseSize(value, m_maxBounce, 0);
+        else if (key == "threads")          ok = parseSize(value, m_numThreads, 0);
+        else if (key == "tile-size")        ok = parseSize(value, m_tileSize, 1);
+        else if (key == "seed")             { size_t seed = 0; ok = parseSize(value, seed, 0) && seed <= UINT_MAX; m_seed = (unsigned int)seed; }
+        else if (key == "filter")           { m_filter = value; ok = (value == "box" || value == "tent" || value == "gaussian" || value == "mitchell"); }
+        else if (key == "filter-radius")    ok = parseDouble(value, m_filterRadius) && m_filterRadius <= 4.0;
+        else if (key == "output")           m_outputPath = value;
+        else if (key == "format")           m_outputFormat = value;
+        else if (key == "time-budget")      ok = parseDouble(value, m_timeBudget);
+        else if (key == "wavefront")        ok = parseBool(value, m_wavefront);
+        else if (key == "sort-rays")        ok = parseBool(value, m_sortSecondaryRays);
+        else if (key == "verbose")          ok = parseBool(value, m_verbose);
+        else if (key == "denoise")          ok = parseBool(value, m_denoise);
+        else if (key == "aux")              ok = parseBool(value, m_writeFeatures);
+        else if (key == "workers")          ok = parseSize(value, m_numWorkers, 0);
+        else if (key == "remote-workers")   ok = parseSize(value, m_numRemoteWorkers, 0);
+        else if (key == "worker-timeout")   ok = parseDouble(value, m_workerTimeout) && m_workerTimeout > 0.0;
+        else if (key == "partition")        { m_partition = value; ok = (value == "tiles" || value == "samples"); }
+        else if (key == "listen")           m_listenAddress = value;
+        else if (key == "connect")          m_connectAddress = value;
+        else if (key == "scene")            m_scenePath = value;
+        else if (key == "write-scene")      m_binaryScenePath = value;
+        else if (key == "serve")            ok = parseBool(value, m_serve);
+        else if (key == "scene-cache")      ok = parseSize(value, m_sceneCacheSize, 1);
+        else if (key == "relight-cache")    ok = parseSize(value, m_relightCacheSize, 0);
+        else if (key == "frames")           ok = parseSize(value, m_numFrames, 0);
+        else if (key == "first-frame")      ok = parseSize(value, m_firstFrame, 0);
+        else if (key == "fps")              ok = parseDouble(value, m_fps) && m_fps > 0.0;
+        else if (key == "numa")             { m_numa = value; ok = (value == "off" || value == "interleave" || value == "replicate"); }
+        else if (key == "texture-cache")    ok = parseSize(value, m_textureCacheSize, 1);
+        else if (key == "texture-dir")      m_textureDirectory = value;
+        else if (key == "shadow-cull")      ok = parseDouble(value, m_shadowCullThreshold) && m_shadowCullThreshold >= 0.0;
+        else if (key == "irradiance-cache") ok = parseDouble(value, m_irradianceAccuracy) && m_irradianceAccuracy >= 0.0;
+        else if (key == "irradiance-rays")  ok = parseSize(value, m_numIrradianceRays, 1);
+        else if (key == "guiding")          ok = parseBool(value, m_pathGuiding);
+        else if (key == "restir")           ok = parseBool(value, m_restir);
+        else if (key == "restir-candidates") ok = parseSize(value, m_numRestirCandidates, 1);
+        else
+        {
+            error = "unknown option '" + key + "'";
+            return false;
+        }
+        if (!ok)
+        {
+            error = "bad value '" + value + "' for option '" + key + "'";
+        }
+        return ok;
+    }
+
+    bool loadConfigFile(const std::string& path, std::string& error)
+    {
+        std::ifstream in(path.c_str());
+        if (!in)
+        {
+            error = "cannot open config file '" + path + "'";
+            return false;
+        }
+        std::string line;
+        size_t lineNumber = 0;
+        while (std::getline(in, line))
+        {
+            ++lineNumber;
+            std::string::size_type hash = line.find('#');
+            if (hash != std::string::npos)
+            {
+                line.erase(hash);
+            }
+            line = trim(line);
+            if (line.empty())
+            {
+                continue;
+            }
+            std::string::size_type eq = line.find('=');
+            if (eq == std::string::npos)
+            {
+                std::ostringstream msg;
+                msg << path << ":" << lineNumber << ": expected 'key = value'";
+                error = msg.str();
+                return false;
+            }
+            std::string key = trim(line.substr(0, eq));
+            if (key == "config")
+            {
+                error = path + ": config files cannot include other config files";
+                return false;
+            }
+            if (!set(key, trim(line.substr(eq + 1)), error))
+            {
+                std::ostringstream msg;
+                msg << path << ":" << lineNumber << ": " << error;
+                error = msg.str();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Parses argv; returns false on error or --help, after printing why
+    bool parseCommandLine(int argc, char **argv)
+    {
+        std::string error;
+        for (int i = 1; i < argc; ++i)
+        {
+            std::string arg = argv[i];
+            if (arg == "-h" || arg == "--help")
+            {
+                printUsage(argv[0]);
+                return false;
+            }
+            if (arg.compare(0, 2, "--") != 0)
+            {
+                std::cerr << "unexpected argument '" << arg << "'" << std::endl;
+                printUsage(argv[0]);
+                return false;
+            }
+
+            std::string key = arg.substr(2);
+            std::string value;
+            std::string::size_type eq = key.find('=');
+            if (eq != std::string::npos)
+            {
+                value = key.substr(eq + 1);
+                key.erase(eq);
+            }
+            else if (isFlag(key) && (i + 1 >= argc || std::string(argv[i + 1]).compare(0, 2, "--") == 0))
+            {
+                // Boolean options may be given without a value
+                value = "true";
+            }
+            else if (i + 1 < argc)
+            {
+                value = argv[++i];
+            }
+            else
+            {
+                std::cerr << "missing value for option '" << key << "'" << std::endl;
+                return false;
+            }
+
+            bool ok = (key == "config") ? loadConfigFile(value, error) : set(key, value, error);
+            if (!ok)
+            {
+                std::cerr << error << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static void printUsage(const char* program)
+    {
+        std::cerr << "usage: " << program << " [options]\n"
+                  << "  --config FILE         read 'key = value' options from FILE\n"
+                  << "  --width N             image width, at least 2 (1920)\n"
+                  << "  --height N            image height, at least 2 (1080)\n"
+                  << "  --spp N               samples per pixel (64)\n"
+                  << "  --light-samples N     light samples per hit (32)\n"
+                  << "  --bounces N           maximum bounce depth (1)\n"
+                  << "  --threads N           worker threads, 0 = all cores (0)\n"
+                  << "  --tile-size N         tile edge in pixels (32)\n"
+                  << "  --seed N              random seed (0)\n"
+                  << "  --filter NAME         pixel filter: box, tent, gaussian or mitchell (box)\n"
+                  << "  --filter-radius R     filter radius in pixels, at most 4; 0 = the filter's\n"
+                  << "                        default of 0.5, 1, 1.5 or 2 (0)\n"
+                  << "  --output PATH         output image (out.jpg)\n"
+                  << "  --format EXT          output format, replaces the extension of PATH\n"
+                  << "  --time-budget SEC     render progressive passes for at most SEC seconds,\n"
+                  << "                        up to --spp samples per pixel; 0 = no budget (0)\n"
+                  << "  --wavefront [BOOL]    use the wavefront renderer (false)\n"
+                  << "  --sort-rays BOOL      sort secondary rays in the wavefront renderer (true)\n"
+                  << "  --verbose [BOOL]      report render progress on stderr (false)\n"
+                  << "  --denoise [BOOL]      denoise the image guided by albedo, normals and depth\n"
+                  << "                        (false)\n"
+                  << "  --aux [BOOL]          also write those as PATH_albedo, PATH_normal and\n"
+                  << "                        PATH_depth images (false)\n"
+                  << "  --workers N           render in N forked worker processes (0)\n"
+                  << "  --remote-workers N    also wait for N workers started with --connect (0)\n"
+                  << "  --worker-timeout SECS start with the workers connected by then (60)\n"
+                  << "  --partition MODE      split the frame by 'tiles' or 'samples' (tiles)\n"
+                  << "  --listen HOST:PORT    coordinator address, port 0 = any (127.0.0.1:0)\n"
+                  << "  --connect HOST:PORT   run as a worker for the coordinator at HOST:PORT\n"
+                  << "  --scene FILE          scene description or binary scene, 'builtin' = default\n"
+                  << "                        scene (builtin)\n"
+                  << "  --write-scene FILE    convert the scene to a binary scene in FILE and exit\n"
+                  << "  --serve [BOOL]        serve render requests read from stdin (false)\n"
+                  << "  --scene-cache N       scenes kept in memory by the server (4)\n"
+                  << "  --relight-cache MB    memory for the camera hits of the last render the\n"
+                  << "                        server keeps, so that a request with the same\n"
+                  << "                        geometry, camera, size, spp and seed only redoes the\n"
+                  << "                        shading; 0 = off (0)\n"
+                  << "  --frames N            render N animation frames, 0 = one still (0);\n"
+                  << "                        a run of '#' in --output is the frame number\n"
+                  << "  --first-frame N       number of the first animation frame (0)\n"
+                  << "  --fps F               animation frames per second (24)\n"
+                  << "  --numa MODE           pin threads to NUMA nodes, render each node's band of\n"
+                  << "                        rows locally, and 'interleave' the scene over the nodes\n"
+                  << "                        or 'replicate' it per node; 'off' = no NUMA (off)\n"
+                  << "  --texture-cache MB    memory for texture tiles (256)\n"
+                  << "  --texture-dir DIR     where images are converted to tiled textures\n"
+                  << "                        ($TMPDIR/tracer-textures)\n"
+                  << "  --shadow-cull T       trace the shadow ray of a light sample adding less\n"
+                  << "                        than T to its pixel only with probability\n"
+                  << "                        contribution / T, weighted to stay unbiased; 0 =\n"
+                  << "                        skip only samples adding nothing (0)\n"
+                  << "  --irradiance-cache A  diffuse indirect light from an irradiance cache of\n"
+                  << "                        accuracy A, e.g. 0.2, instead of the ambient term;\n"
+                  << "                        0 = off (0)\n"
+                  << "  --irradiance-rays N   gather rays per irradiance cache record (256)\n"
+                  << "  --guiding [BOOL]      diffuse indirect light from one ray per hit, guided\n"
+                  << "                        by where light was found in earlier passes, instead\n"
+                  << "                        of the ambient term (false)\n"
+                  << "  --restir [BOOL]       light camera hits by reservoir resampling: candidates\n"
+                  << "                        are shared with neighbouring pixels and the previous\n"
+                  << "                        frame, and one shadow ray is traced per pixel for\n"
+                  << "                        the chosen sample; one pass per sample (false)\n"
+                  << "  --restir-candidates N light candidates per pixel and pass (32)\n";
+    }
+
+protected:
+    static bool isFlag(const std::string& key)
+    {
+        return key == "wavefront" || key == "sort-rays" || key == "verbose" || key == "serve" ||
+               key == "denoise" || key == "aux" || key == "guiding" ||
+               key == "restir";
+    }
+
+    static std::string trim(const std::string& s)
+    {
+        const char* ws = " \t\r\n";
+        std::string::size_type b = s.find_first_not_of(ws);
+        if (b == std::string::npos)
+        {
+            return std::string();
+        }
+        std::string::size_type e = s.find_last_not_of(ws);
+        return s.substr(b, e - b + 1);
+    }
+
+    static bool parseSize(const std::string& s, size_t& out, size_t minValue)
+    {
+        char* end = NULL;
+        unsigned long long v = std::strtoull(s.c_str(), &end, 10);
+        if (s.empty() || *end != '\0' || s[0] == '-' || v < minValue)
+        {
+            return false;
+        }
+        out = (size_t)v;
+        return true;
+    }
+
+    static bool parseDouble(const std::string& s, double& out)
+    {
+        char* end = NULL;
+        double v = std::strtod(s.c_str(), &end);
+        if (s.empty() || *end != '\0' || v < 0.0)
+        {
+            return false;
+        }
+        out = v;
+        return true;
+    }
+
+    static bool parseBool(const std::string& s, bool& out)
+    {
+        if (s == "1" || s == "true" || s == "yes" || s == "on")
+        {
+            out = true;
+            return true;
+        }
+        if (s == "0" || s == "false" || s == "no" || s == "off")
+        {
+            out = false;
+            return true;
+        }
+        return false;
+    }
+};
+
+}//namespace Tracer
+
+#endif
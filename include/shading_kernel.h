@@ -0,0 +1,245 @@
+#ifndef __SHADING_KERNEL_H__
+#define __SHADING_KERNEL_H__
+
+#include <cstring>
+#include "util.h"
+
+namespace Tracer
+{
+
+//
+// Low level shading kernels used by the materials.
+//
+// The specular lobe is evaluated kNumLightSamples times per hit, so the
+// exponentiation is picked once when the material is built instead of calling
+// std::pow with an arbitrary float exponent for every sample.
+//
+
+// Largest exponent we still evaluate by repeated squaring
+const unsigned int kMaxIntegerExponent = 1024;
+
+// Number of light samples shaded by one batched kernel call
+const size_t kShadingBatchSize = 64;
+
+
+// x^n for an integer n by repeated squaring
+inline float powInt(float x, unsigned int n)
+{
+    float result = 1.0f;
+    while (n)
+    {
+        if (n & 1u)
+        {
+            result *= x;
+        }
+        x *= x;
+        n >>= 1;
+    }
+    return result;
+}
+
+
+// Approximate x^y for x in (0, 1] via log2/exp2 on the float bit pattern.
+// Relative error is a few percent, which is invisible on a highlight.
+inline float fastPow(float x, float y)
+{
+    if (x <= 0.0f)
+    {
+        return 0.0f;
+    }
+    int bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    // log2(x) from the exponent and a quadratic fit of the mantissa (the fit
+    // returns log2(m) + 1, hence the extra bias)
+    float e = float((bits >> 23) & 255) - 128.0f;
+    bits = (bits & ~(255 << 23)) | (127 << 23);
+    float m;
+    std::memcpy(&m, &bits, sizeof(m));
+    float log2x = e + (-0.34484843f * m + 2.02466578f) * m - 0.67487759f;
+
+    // 2^p back from the split integer/fractional parts
+    float p = y * log2x;
+    if (p < -126.0f)
+    {
+        return 0.0f;
+    }
+    float fi = std::floor(p);
+    float f = p - fi;
+    int result = int((fi + 127.0f)) << 23;
+    float r;
+    std::memcpy(&r, &result, sizeof(r));
+    return r * (1.0f + f * (0.6960656421f + f * 0.224494337f + f * f * 0.0792043502f));
+}
+
+
+enum PowKernelType
+{
+    kPowGeneric,   // std::pow, any exponent
+    kPowInteger,   // repeated squaring, small non-negative integer exponents
+    kPowFast       // fastPow approximation (TRACER_FAST_MATH builds only)
+};
+
+
+// Exponentiation kernel bound to one exponent
+struct PowKernel
+{
+    PowKernelType m_type;
+    float m_exponent;
+    unsigned int m_intExponent;
+
+    explicit PowKernel(float exponent = 1.0f)
+        : m_type(kPowGeneric),
+          m_exponent(exponent),
+          m_intExponent(0)
+    {
+        float rounded = std::floor(exponent + 0.5f);
+        if (exponent >= 0.0f &&
+            rounded == exponent &&
+            exponent <= float(kMaxIntegerExponent))
+        {
+            m_type = kPowInteger;
+            m_intExponent = (unsigned int)rounded;
+        }
+#ifdef TRACER_FAST_MATH
+        else
+        {
+            m_type = kPowFast;
+        }
+#endif
+    }
+
+    float operator ()(float x) const
+    {
+        switch (m_type)
+        {
+            case kPowInteger: return powInt(x, m_intExponent);
+            case kPowFast:    return fastPow(x, m_exponent);
+            default:          return std::pow(x, m_exponent);
+        }
+    }
+};
+
+
+//
+// A batch of light samples in SoA layout: normalized direction towards the
+// light and the power arriving from it, and once shaded, the light each
+// sample reflects towards the viewer.
+//
+struct LightSampleBatch
+{
+    float m_dirX[kShadingBatchSize];
+    float m_dirY[kShadingBatchSize];
+    float m_dirZ[kShadingBatchSize];
+    float m_powerR[kShadingBatchSize];
+    float m_powerG[kShadingBatchSize];
+    float m_powerB[kShadingBatchSize];
+    float m_colorR[kShadingBatchSize];
+    float m_colorG[kShadingBatchSize];
+    float m_colorB[kShadingBatchSize];
+    size_t m_count;
+
+    LightSampleBatch() : m_count(0) { }
+
+    bool full() const { return m_count == kShadingBatchSize; }
+    void clear() { m_count = 0; }
+
+    Vector direction(size_t i) const { return Vector(m_dirX[i], m_dirY[i], m_dirZ[i]); }
+    Color color(size_t i) const { return Color(m_colorR[i], m_colorG[i], m_colorB[i]); }
+
+    void add(const Vector& direction, const Color& power)
+    {
+        m_dirX[m_count] = direction.m_x;
+        m_dirY[m_count] = direction.m_y;
+        m_dirZ[m_count] = direction.m_z;
+        m_powerR[m_count] = power.m_r;
+        m_powerG[m_count] = power.m_g;
+        m_powerB[m_count] = power.m_b;
+        ++m_count;
+    }
+};
+
+
+// Blinn-Phong for a whole batch of light samples; sets each sample's color
+// to (kSpecular * max(0, N.H)^e + kDiffuse * N.L) * power * color, or
+// black for N.L <= 0.
+// The loop is written per kernel type so the exponent branch is hoisted out
+// and each variant vectorizes on its own.
+template <PowKernelType kType>
+inline void shadeBlinnPhongBatch(LightSampleBatch& batch,
+                                 const Vector& normal,
+                                 const Vector& incomingRayDirection,
+                                 float kDiffuse,
+                                 float kSpecular,
+                                 const PowKernel& pow,
+                                 const Color& color)
+{
+    const float nx = normal.m_x, ny = normal.m_y, nz = normal.m_z;
+    const float vx = incomingRayDirection.m_x;
+    const float vy = incomingRayDirection.m_y;
+    const float vz = incomingRayDirection.m_z;
+    const float cr = color.m_r, cg = color.m_g, cb = color.m_b;
+    const unsigned int intExponent = pow.m_intExponent;
+    const float exponent = pow.m_exponent;
+
+    #pragma omp simd
+    for (size_t i = 0; i < batch.m_count; ++i)
+    {
+        float lx = batch.m_dirX[i], ly = batch.m_dirY[i], lz = batch.m_dirZ[i];
+        float hx = lx - vx, hy = ly - vy, hz = lz - vz;
+        float hLen2 = hx * hx + hy * hy + hz * hz;
+        float nDotH = (hx * nx + hy * ny + hz * nz) / std::sqrt(hLen2);
+        float nDotL = lx * nx + ly * ny + lz * nz;
+        // Light from below the surface reaches neither lobe
+        nDotH = nDotH > 0.0f && nDotL > 0.0f ? nDotH : 0.0f;
+        nDotL = nDotL > 0.0f ? nDotL : 0.0f;
+
+        float spec;
+        if (kType == kPowInteger)
+        {
+            spec = powInt(nDotH, intExponent);
+        }
+        else if (kType == kPowFast)
+        {
+            spec = fastPow(nDotH, exponent);
+        }
+        else
+        {
+            spec = std::pow(nDotH, exponent);
+        }
+
+        float w = kSpecular * spec + kDiffuse * nDotL;
+        batch.m_colorR[i] = w * batch.m_powerR[i] * cr;
+        batch.m_colorG[i] = w * batch.m_powerG[i] * cg;
+        batch.m_colorB[i] = w * batch.m_powerB[i] * cb;
+    }
+}
+
+
+inline void shadeBlinnPhongBatch(LightSampleBatch& batch,
+                                 const Vector& normal,
+                                 const Vector& incomingRayDirection,
+                                 float kDiffuse,
+                                 float kSpecular,
+                                 const PowKernel& pow,
+                                 const Color& color)
+{
+    switch (pow.m_type)
+    {
+        case kPowInteger:
+            shadeBlinnPhongBatch<kPowInteger>(batch, normal, incomingRayDirection,
+                                              kDiffuse, kSpecular, pow, color);
+            break;
+        case kPowFast:
+            shadeBlinnPhongBatch<kPowFast>(batch, normal, incomingRayDirection,
+                                           kDiffuse, kSpecular, pow, color);
+            break;
+        default:
+            shadeBlinnPhongBatch<kPowGeneric>(batch, normal, incomingRayDirection,
+                                              kDiffuse, kSpecular, pow, color);
+            break;
+    }
+}
+
+}//namespace Tracer
+
+#endif
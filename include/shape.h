@@ -1,6 +1,7 @@
 #ifndef __SHAPE_H__
 #define __SHAPE_H__
 
+#include <vector>
 #include "util.h"
 #include "ray.h"
 #include "material.h"
@@ -8,6 +9,7 @@
 namespace Tracer
 {
 class Shape;
+class Rectangle;
 
 struct Intersection
 {
@@ -17,6 +19,11 @@ struct Intersection
     const Material *m_pMaterial;
     Color m_emitted;
     Vector m_normal;
+    // Surface coordinates of the hit, and how fast they change: uv units
+    // per world unit along the surface. Set by rectangles always, by
+    // spheres and planes only if their material is textured.
+    float m_u, m_v;
+    float m_uvDensity;
     
     
     Intersection()
@@ -25,7 +32,10 @@ struct Intersection
           m_pShape(NULL),
           m_pMaterial(NULL),
           m_emitted(),
-          m_normal()
+          m_normal(),
+          m_u(0.0f),
+          m_v(0.0f),
+          m_uvDensity(0.0f)
     {
         
     }
@@ -36,7 +46,10 @@ struct Intersection
           m_pShape(i.m_pShape),
           m_pMaterial(i.m_pMaterial),
           m_emitted(i.m_emitted),
-          m_normal(i.m_normal)
+          m_normal(i.m_normal),
+          m_u(i.m_u),
+          m_v(i.m_v),
+          m_uvDensity(i.m_uvDensity)
     {
         
     }
@@ -47,7 +60,10 @@ struct Intersection
            m_pShape(NULL),
            m_pMaterial(NULL),
            m_emitted(),
-           m_normal()
+           m_normal(),
+           m_u(0.0f),
+           m_v(0.0f),
+           m_uvDensity(0.0f)
     {
         
     }
@@ -60,6 +76,9 @@ struct Intersection
         m_pMaterial = i.m_pMaterial;
         m_emitted = i.m_emitted;
         m_normal = i.m_normal;
+        m_u = i.m_u;
+        m_v = i.m_v;
+        m_uvDensity = i.m_uvDensity;
         return *this;
     }
     
@@ -69,6 +88,77 @@ struct Intersection
 };
 
 
+// Axis-aligned bounding box; empty (min > max) when default constructed
+struct BoundingBox
+{
+    Point m_min, m_max;
+
+    BoundingBox()
+        : m_min(kRayTMax, kRayTMax, kRayTMax),
+          m_max(-kRayTMax, -kRayTMax, -kRayTMax)
+    {
+
+    }
+
+    BoundingBox(const Point& min, const Point& max) : m_min(min), m_max(max) { }
+
+    bool empty() const { return m_min.m_x > m_max.m_x; }
+
+    void expand(const Point& p)
+    {
+        m_min = Point(std::min(m_min.m_x, p.m_x), std::min(m_min.m_y, p.m_y), std::min(m_min.m_z, p.m_z));
+        m_max = Point(std::max(m_max.m_x, p.m_x), std::max(m_max.m_y, p.m_y), std::max(m_max.m_z, p.m_z));
+    }
+
+    void expand(const BoundingBox& b)
+    {
+        if (!b.empty())
+        {
+            expand(b.m_min);
+            expand(b.m_max);
+        }
+    }
+
+    Point center() const { return 0.5f * (m_min + m_max); }
+
+    Point corner(int i) const
+    {
+        return Point((i & 1) ? m_max.m_x : m_min.m_x,
+                     (i & 2) ? m_max.m_y : m_min.m_y,
+                     (i & 4) ? m_max.m_z : m_min.m_z);
+    }
+
+    float surfaceArea() const
+    {
+        if (empty())
+        {
+            return 0.0f;
+        }
+        Vector d = m_max - m_min;
+        return 2.0f * (d.m_x * d.m_y + d.m_y * d.m_z + d.m_z * d.m_x);
+    }
+
+    // Slab test against the ray segment [tMin, tMax], given the reciprocal
+    // of the ray direction
+    bool intersect(const Point& origin, const Vector& invDirection, float tMin, float tMax) const
+    {
+        float t0 = (m_min.m_x - origin.m_x) * invDirection.m_x;
+        float t1 = (m_max.m_x - origin.m_x) * invDirection.m_x;
+        tMin = std::max(tMin, std::min(t0, t1));
+        tMax = std::min(tMax, std::max(t0, t1));
+        t0 = (m_min.m_y - origin.m_y) * invDirection.m_y;
+        t1 = (m_max.m_y - origin.m_y) * invDirection.m_y;
+        tMin = std::max(tMin, std::min(t0, t1));
+        tMax = std::min(tMax, std::max(t0, t1));
+        t0 = (m_min.m_z - origin.m_z) * invDirection.m_z;
+        t1 = (m_max.m_z - origin.m_z) * invDirection.m_z;
+        tMin = std::max(tMin, std::min(t0, t1));
+        tMax = std::min(tMax, std::max(t0, t1));
+        return tMin <= tMax;
+    }
+};
+
+
 class Shape
 {
 public:
@@ -76,7 +166,12 @@ public:
     
     // Subclasses must implement this; this is the meat of ray tracing
     virtual bool intersect(Intersection& intersection) = 0;
-	std::string getShapeType(){return m_shapeType;}
+    // World-space bounds; returns false for unbounded shapes (planes)
+    virtual bool bounds(BoundingBox& box) const { return false; }
+    // Rectangle derives virtually from Shape, so without RTTI this is the
+    // only way back to it from a Shape pointer
+    virtual const Rectangle* asRectangle() const { return NULL; }
+	std::string getShapeType() const {return m_shapeType;}
 protected:
 	std::string m_shapeType;
 };
@@ -91,7 +186,7 @@ public:
     virtual bool intersect(Intersection& intersection)
     {
         bool intersectedAny = false;
-        for (std::list<Shape*>::iterator iter = m_shapes.begin();
+        for (std::vector<Shape*>::iterator iter = m_shapes.begin();
              iter != m_shapes.end();
              ++iter)
         {
@@ -105,12 +200,29 @@ public:
         return intersectedAny;
     }
     
+    virtual bool bounds(BoundingBox& box) const
+    {
+        box = BoundingBox();
+        for (std::vector<Shape*>::const_iterator iter = m_shapes.begin();
+             iter != m_shapes.end();
+             ++iter)
+        {
+            BoundingBox b;
+            if (!(*iter)->bounds(b))
+            {
+                return false;
+            }
+            box.expand(b);
+        }
+        return true;
+    }
+    
     void addShape(Shape *pShape) { m_shapes.push_back(pShape); }
     
     void clearShapes() { m_shapes.clear(); }
     
 protected:
-    std::list<Shape*> m_shapes;
+    std::vector<Shape*> m_shapes;
 };
 
 
@@ -123,7 +235,10 @@ public:
 		  m_pMaterial(pMaterial)
     {
 		m_shapeType="Plane";
-        
+        // Texture axes in the plane
+        Vector axis = std::fabs(m_normal.m_y) < 0.9f ? Vector(0.0f, 1.0f, 0.0f) : Vector(1.0f, 0.0f, 0.0f);
+        m_tangent = cross(axis, m_normal).normalized();
+        m_bitangent = cross(m_normal, m_tangent);
     }
     
     virtual ~Plane() { }
@@ -161,15 +276,25 @@ public:
         intersection.m_pShape = this;
         intersection.m_pMaterial = m_pMaterial;
         intersection.m_normal = m_normal;
-       
-
-	 
+        if (m_pMaterial && m_pMaterial->m_pTexture)
+        {
+            // One texture repeat per world unit
+            Vector offset = intersection.m_ray.calculate(t) - m_position;
+            intersection.m_u = dot(offset, m_tangent);
+            intersection.m_v = dot(offset, m_bitangent);
+            intersection.m_uvDensity = 1.0f;
+        }
         return true;
     }
 
+    const Point& position() const { return m_position; }
+    const Vector& normal() const { return m_normal; }
+    const Material* material() const { return m_pMaterial; }
+
 protected:
     Point m_position;
     Vector m_normal;
+    Vector m_tangent, m_bitangent;
     Color m_color;
 	const Material* m_pMaterial;
 };
@@ -196,16 +321,34 @@ public:
         m_shapeType="Rectangle";
     }
     virtual bool intersect(Intersection& intersection)
+    {
+        if (!intersectRectangle(m_position, m_side1, m_side2, intersection))
+        {
+            return false;
+        }
+        intersection.m_pShape = this;
+        intersection.m_pMaterial = m_pMaterial;
+        return true;
+    }
+
+    // Ray-rectangle test on its own, for callers that keep rectangles in
+    // other forms; on a hit closer than intersection.m_t it sets m_t,
+    // m_normal, m_emitted and the uv coordinates, which span the rectangle
+    // from 0 to 1 along each side
+    static bool intersectRectangle(const Point& position,
+                                   const Vector& side1,
+                                   const Vector& side2,
+                                   Intersection& intersection)
     {
         
-        Vector normal = cross(m_side1, m_side2).normalized();
+        Vector normal = cross(side1, side2).normalized();
         float nDotD = dot(normal, intersection.m_ray.m_direction);
         if (nDotD < EPSL && -nDotD <EPSL)
         {
             return false;
         }
         
-        float t = (dot(m_position, normal) - dot(intersection.m_ray.m_origin, normal)) /
+        float t = (dot(position, normal) - dot(intersection.m_ray.m_origin, normal)) /
                   dot(intersection.m_ray.m_direction, normal);
         
         if (t >= intersection.m_t || t < kRayTMin)
@@ -213,13 +356,13 @@ public:
             return false;
         }
         
-        Vector side1Norm = m_side1;
-        Vector side2Norm = m_side2;
+        Vector side1Norm = side1;
+        Vector side2Norm = side2;
         float side1Length = side1Norm.normalize();
         float side2Length = side2Norm.normalize();
         
         Point worldPoint = intersection.m_ray.calculate(t);
-        Point worldRelativePoint = worldPoint - m_position;
+        Point worldRelativePoint = worldPoint - position;
         Point localPoint = Point(dot(worldRelativePoint, side1Norm),
                                  dot(worldRelativePoint, side2Norm),
                                  0.0f);
@@ -231,14 +374,32 @@ public:
         }
         
         intersection.m_t = t;
-        intersection.m_pShape = this;
         intersection.m_emitted = Color();
         intersection.m_normal = normal;
-        intersection.m_pMaterial = m_pMaterial;
+        intersection.m_u = localPoint.m_x / side1Length;
+        intersection.m_v = localPoint.m_y / side2Length;
+        intersection.m_uvDensity = 1.0f / std::min(side1Length, side2Length);
         return true;
     }
     
     
+    virtual bool bounds(BoundingBox& box) const
+    {
+        box = BoundingBox();
+        box.expand(m_position);
+        box.expand(m_position + m_side1);
+        box.expand(m_position + m_side2);
+        box.expand(m_position + m_side1 + m_side2);
+        return true;
+    }
+    
+    virtual const Rectangle* asRectangle() const { return this; }
+
+    const Point& position() const { return m_position; }
+    const Vector& side1() const { return m_side1; }
+    const Vector& side2() const { return m_side2; }
+    const Material* material() const { return m_pMaterial; }
+
 protected:
     Point m_position;
     Vector m_side1, m_side2; 
@@ -254,15 +415,43 @@ public:
           m_radius(radius),
           m_pMaterial(pMaterial)
     {
-        
+        m_shapeType = "Sphere";
     }
     
     virtual ~Sphere() { }
     
     virtual bool intersect(Intersection& intersection)
+    {
+        if (!intersectSphere(m_position, m_radius, intersection))
+        {
+            return false;
+        }
+        intersection.m_pShape = this;
+        intersection.m_pMaterial = m_pMaterial;
+        if (m_pMaterial->m_pTexture)
+        {
+            surfaceUV(m_radius, intersection);
+        }
+        return true;
+    }
+
+    // Lat-long uv coordinates of a hit on a sphere of the given radius,
+    // from its normal: u around the y axis, v from the top (0) to the
+    // bottom (1)
+    static void surfaceUV(float radius, Intersection& intersection)
+    {
+        const Vector& n = intersection.m_normal;
+        intersection.m_u = 0.5f + std::atan2(n.m_z, n.m_x) / (2.0f * float(M_PI));
+        intersection.m_v = std::acos(std::max(-1.0f, std::min(1.0f, n.m_y))) / float(M_PI);
+        intersection.m_uvDensity = 1.0f / (float(M_PI) * radius);
+    }
+
+    // Ray-sphere test on its own, for callers that keep spheres in other
+    // forms; on a hit closer than intersection.m_t it sets m_t and m_normal
+    static bool intersectSphere(const Point& position, float radius, Intersection& intersection)
     {
         Ray localRay = intersection.m_ray;
-        localRay.m_origin -= m_position;
+        localRay.m_origin -= position;
         
         // Ray-sphere intersection can result in either zero, one or two points
         // of intersection.  It turns into a quadratic equation, so we just find
@@ -273,7 +462,7 @@ public:
         // Calculate quadratic coeffs
         float a = localRay.m_direction.length2();
         float b = 2.0f * dot(localRay.m_direction, localRay.m_origin);
-        float c = localRay.m_origin.length2() - m_radius * m_radius;
+        float c = localRay.m_origin.length2() - radius * radius;
         
         float t0, t1, discriminant;
         discriminant = b * b - 4.0f * a * c;
@@ -343,8 +532,6 @@ public:
         // Final Norm : wordNorm + m_position
 		//-----------------------------------
 
-        intersection.m_pShape = this;
-        intersection.m_pMaterial = m_pMaterial;
 		//std::cout<<"--------"<<m_color<<"---------"<<std::endl;
 		intersection.m_normal = worldNorm;
         //intersection.m_colorModifier = Color(1.0f, 1.0f, 1.0f);
@@ -353,6 +540,16 @@ public:
     }
     
 
+    virtual bool bounds(BoundingBox& box) const
+    {
+        box = BoundingBox(m_position - Vector(m_radius), m_position + Vector(m_radius));
+        return true;
+    }
+
+    const Point& position() const { return m_position; }
+    float radius() const { return m_radius; }
+    const Material* material() const { return m_pMaterial; }
+    
 protected:
     Point m_position;
     float m_radius;
@@ -0,0 +1,166 @@
+#ifndef __SIMD_H__
+#define __SIMD_H__
+
+#include <cmath>
+
+//
+// Four-wide float math behind Vector and Color.
+//
+// Float4 wraps an SSE register on x86-64, a NEON register on AArch64 and a
+// plain array anywhere else (or when TRACER_NO_SIMD is defined). Only the
+// handful of operations the vector classes need is here. Lane 3 is padding
+// for three-component values: it is carried through the arithmetic but
+// never read back, so what ends up in it does not matter.
+//
+// Fused multiply-add is used when the target has it (x86 built with -mfma
+// or -march=native, and AArch64); it rounds once instead of twice, so such
+// builds differ from others in the last bits.
+//
+
+#if !defined(TRACER_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64))
+    #define TRACER_SIMD_SSE
+    #include <emmintrin.h>
+    #ifdef __FMA__
+        #include <immintrin.h>
+    #endif
+#elif !defined(TRACER_NO_SIMD) && defined(__ARM_NEON) && defined(__aarch64__)
+    #define TRACER_SIMD_NEON
+    #include <arm_neon.h>
+#endif
+
+namespace Tracer
+{
+
+#if defined(TRACER_SIMD_SSE)
+
+struct Float4
+{
+    __m128 m_v;
+};
+
+// p must be 16-byte aligned
+inline Float4 load4(const float* p) { Float4 r = { _mm_load_ps(p) }; return r; }
+inline void store4(float* p, Float4 a) { _mm_store_ps(p, a.m_v); }
+inline Float4 set4(float x, float y, float z, float w) { Float4 r = { _mm_setr_ps(x, y, z, w) }; return r; }
+inline Float4 splat4(float f) { Float4 r = { _mm_set1_ps(f) }; return r; }
+
+inline Float4 add4(Float4 a, Float4 b) { Float4 r = { _mm_add_ps(a.m_v, b.m_v) }; return r; }
+inline Float4 sub4(Float4 a, Float4 b) { Float4 r = { _mm_sub_ps(a.m_v, b.m_v) }; return r; }
+inline Float4 mul4(Float4 a, Float4 b) { Float4 r = { _mm_mul_ps(a.m_v, b.m_v) }; return r; }
+inline Float4 div4(Float4 a, Float4 b) { Float4 r = { _mm_div_ps(a.m_v, b.m_v) }; return r; }
+// a < b ? a : b and a > b ? a : b, lane by lane
+inline Float4 min4(Float4 a, Float4 b) { Float4 r = { _mm_min_ps(a.m_v, b.m_v) }; return r; }
+inline Float4 max4(Float4 a, Float4 b) { Float4 r = { _mm_max_ps(a.m_v, b.m_v) }; return r; }
+
+// a * b - c
+#ifdef __FMA__
+inline Float4 msub4(Float4 a, Float4 b, Float4 c) { Float4 r = { _mm_fmsub_ps(a.m_v, b.m_v, c.m_v) }; return r; }
+#else
+inline Float4 msub4(Float4 a, Float4 b, Float4 c) { return sub4(mul4(a, b), c); }
+#endif
+
+// (y, z, x, w)
+inline Float4 shuffleYZX(Float4 a) { Float4 r = { _mm_shuffle_ps(a.m_v, a.m_v, _MM_SHUFFLE(3, 0, 2, 1)) }; return r; }
+
+// x + y + z, added in that order
+inline float hsum3(Float4 a)
+{
+    __m128 y = _mm_shuffle_ps(a.m_v, a.m_v, _MM_SHUFFLE(1, 1, 1, 1));
+    __m128 z = _mm_movehl_ps(a.m_v, a.m_v);
+    return _mm_cvtss_f32(_mm_add_ss(_mm_add_ss(a.m_v, y), z));
+}
+
+// Reciprocal square root from the hardware estimate plus one Newton step
+// (about 22 bits)
+inline float rsqrtFast(float x)
+{
+    float e = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+    return e * (1.5f - 0.5f * x * e * e);
+}
+
+#elif defined(TRACER_SIMD_NEON)
+
+struct Float4
+{
+    float32x4_t m_v;
+};
+
+inline Float4 load4(const float* p) { Float4 r = { vld1q_f32(p) }; return r; }
+inline void store4(float* p, Float4 a) { vst1q_f32(p, a.m_v); }
+inline Float4 set4(float x, float y, float z, float w)
+{
+    const float lanes[4] __attribute__((aligned(16))) = { x, y, z, w };
+    return load4(lanes);
+}
+inline Float4 splat4(float f) { Float4 r = { vdupq_n_f32(f) }; return r; }
+
+inline Float4 add4(Float4 a, Float4 b) { Float4 r = { vaddq_f32(a.m_v, b.m_v) }; return r; }
+inline Float4 sub4(Float4 a, Float4 b) { Float4 r = { vsubq_f32(a.m_v, b.m_v) }; return r; }
+inline Float4 mul4(Float4 a, Float4 b) { Float4 r = { vmulq_f32(a.m_v, b.m_v) }; return r; }
+inline Float4 div4(Float4 a, Float4 b) { Float4 r = { vdivq_f32(a.m_v, b.m_v) }; return r; }
+inline Float4 min4(Float4 a, Float4 b) { Float4 r = { vbslq_f32(vcltq_f32(a.m_v, b.m_v), a.m_v, b.m_v) }; return r; }
+inline Float4 max4(Float4 a, Float4 b) { Float4 r = { vbslq_f32(vcgtq_f32(a.m_v, b.m_v), a.m_v, b.m_v) }; return r; }
+
+inline Float4 msub4(Float4 a, Float4 b, Float4 c) { Float4 r = { vnegq_f32(vfmsq_f32(c.m_v, a.m_v, b.m_v)) }; return r; }
+
+inline Float4 shuffleYZX(Float4 a)
+{
+    Float4 r = { vsetq_lane_f32(vgetq_lane_f32(a.m_v, 0), vextq_f32(a.m_v, a.m_v, 1), 2) };
+    return r;
+}
+
+inline float hsum3(Float4 a)
+{
+    return (vgetq_lane_f32(a.m_v, 0) + vgetq_lane_f32(a.m_v, 1)) + vgetq_lane_f32(a.m_v, 2);
+}
+
+inline float rsqrtFast(float x)
+{
+    float e = vrsqrtes_f32(x);
+    return e * vrsqrtss_f32(x * e, e);
+}
+
+#else
+
+struct Float4
+{
+    float m_v[4];
+};
+
+inline Float4 load4(const float* p) { Float4 r = { { p[0], p[1], p[2], p[3] } }; return r; }
+inline void store4(float* p, Float4 a) { p[0] = a.m_v[0]; p[1] = a.m_v[1]; p[2] = a.m_v[2]; p[3] = a.m_v[3]; }
+inline Float4 set4(float x, float y, float z, float w) { Float4 r = { { x, y, z, w } }; return r; }
+inline Float4 splat4(float f) { Float4 r = { { f, f, f, f } }; return r; }
+
+// Lane by lane, written out so the compiler sees four independent scalars
+#define TRACER_FLOAT4_LANEWISE(name, x, y, expr)                                   \
+    inline Float4 name(Float4 a, Float4 b)                                         \
+    {                                                                              \
+        Float4 r = { { 0.0f, 0.0f, 0.0f, 0.0f } };                                 \
+        { float x = a.m_v[0], y = b.m_v[0]; r.m_v[0] = (expr); }                   \
+        { float x = a.m_v[1], y = b.m_v[1]; r.m_v[1] = (expr); }                   \
+        { float x = a.m_v[2], y = b.m_v[2]; r.m_v[2] = (expr); }                   \
+        { float x = a.m_v[3], y = b.m_v[3]; r.m_v[3] = (expr); }                   \
+        return r;                                                                  \
+    }
+TRACER_FLOAT4_LANEWISE(add4, x, y, x + y)
+TRACER_FLOAT4_LANEWISE(sub4, x, y, x - y)
+TRACER_FLOAT4_LANEWISE(mul4, x, y, x * y)
+TRACER_FLOAT4_LANEWISE(div4, x, y, x / y)
+TRACER_FLOAT4_LANEWISE(min4, x, y, x < y ? x : y)
+TRACER_FLOAT4_LANEWISE(max4, x, y, x > y ? x : y)
+#undef TRACER_FLOAT4_LANEWISE
+
+inline Float4 msub4(Float4 a, Float4 b, Float4 c) { return sub4(mul4(a, b), c); }
+
+inline Float4 shuffleYZX(Float4 a) { return set4(a.m_v[1], a.m_v[2], a.m_v[0], a.m_v[3]); }
+
+inline float hsum3(Float4 a) { return (a.m_v[0] + a.m_v[1]) + a.m_v[2]; }
+
+inline float rsqrtFast(float x) { return 1.0f / std::sqrt(x); }
+
+#endif
+
+}//namespace Tracer
+
+#endif
@@ -0,0 +1,678 @@
+#ifndef __TEXTURE_H__
+#define __TEXTURE_H__
+
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "util.h"
+#include "image_io.h"
+
+namespace Tracer
+{
+
+//
+// Image textures, read through a fixed-size cache of tiles.
+//
+// A texture lives on disk as a tiled file: every mip level, from the full
+// image down to 1x1, cut into square tiles of float RGB texels stored one
+// after another, so any tile of any level is one pread() away. Images in
+// other formats are converted on first use into a cache directory and the
+// converted file is reused as long as the source keeps its size and
+// modification time.
+//
+// Nothing of a texture is in memory but its header until a lookup needs
+// one of its tiles. The TextureCache holds the tiles of all textures in a
+// pool of slots sized by a memory budget, so scenes may reference far more
+// texture data than fits: tiles nobody has used for a while are evicted
+// (CLOCK, per set of slots) and read again if needed.
+//
+// Lookups are lock free. Each slot carries a sequence number that is odd
+// while the slot is being refilled; a reader copies the texels it wants
+// and keeps them only if the sequence number was even and unchanged around
+// the copy. Only a miss takes a lock, that of the set the tile maps to.
+// Each thread also remembers the last slots it hit, so the common case of
+// consecutive lookups in the same tile goes straight to it.
+//
+
+// Texels per tile edge
+const size_t kTextureTileSize = 32;
+const size_t kTextureTileTexels = kTextureTileSize * kTextureTileSize;
+const size_t kTextureTileBytes = kTextureTileTexels * 3 * sizeof(float);
+// Slots per cache set
+const size_t kTextureCacheWays = 8;
+// Recently hit slots each thread remembers
+const size_t kTextureRecentSlots = 64;
+// Textures a cache can hold; ids are 16 bits of a tile key
+const size_t kMaxTextures = 1 << 16;
+
+const char kTextureMagic[8] = { 'T', 'R', 'T', 'E', 'X', 'T', 'R', '\0' };
+const unsigned int kTextureVersion = 1;
+const unsigned int kTextureByteOrder = 0x01020304;
+
+
+struct TextureFileHeader
+{
+    char m_magic[8];
+    unsigned int m_version;
+    unsigned int m_byteOrder;
+    unsigned int m_width;
+    unsigned int m_height;
+    unsigned int m_tileSize;
+    unsigned int m_numLevels;
+};
+
+
+// One mip level; its tiles start at tile m_firstTile of the file
+struct TextureLevel
+{
+    unsigned int m_width;
+    unsigned int m_height;
+    unsigned int m_tilesX;
+    unsigned int m_tilesY;
+    unsigned long long m_firstTile;
+};
+
+
+// Writes a row-major width x height image and its mip chain (2x2 box
+// filtered) as a tiled texture. Edge tiles are padded by repeating the
+// last row and column. Writes to a temporary file renamed into place, so
+// concurrent renders never read a half-written texture.
+inline bool writeTiledTexture(const std::string& path,
+                              const std::vector<Color>& pixels,
+                              size_t width,
+                              size_t height)
+{
+    std::vector<TextureLevel> levels;
+    std::vector<std::vector<Color> > images(1, pixels);
+    unsigned long long numTiles = 0;
+    for (size_t w = width, h = height; ; w = std::max(w / 2, size_t(1)), h = std::max(h / 2, size_t(1)))
+    {
+        TextureLevel level;
+        level.m_width = (unsigned int)w;
+        level.m_height = (unsigned int)h;
+        level.m_tilesX = (unsigned int)((w + kTextureTileSize - 1) / kTextureTileSize);
+        level.m_tilesY = (unsigned int)((h + kTextureTileSize - 1) / kTextureTileSize);
+        level.m_firstTile = numTiles;
+        numTiles += (unsigned long long)level.m_tilesX * level.m_tilesY;
+        levels.push_back(level);
+        if (w == 1 && h == 1)
+        {
+            break;
+        }
+
+        const std::vector<Color>& src = images.back();
+        size_t nw = std::max(w / 2, size_t(1));
+        size_t nh = std::max(h / 2, size_t(1));
+        std::vector<Color> dst(nw * nh);
+        for (size_t y = 0; y < nh; ++y)
+        {
+            size_t y0 = std::min(2 * y, h - 1), y1 = std::min(2 * y + 1, h - 1);
+            for (size_t x = 0; x < nw; ++x)
+            {
+                size_t x0 = std::min(2 * x, w - 1), x1 = std::min(2 * x + 1, w - 1);
+                dst[y * nw + x] = 0.25f * (src[y0 * w + x0] + src[y0 * w + x1] +
+                                           src[y1 * w + x0] + src[y1 * w + x1]);
+            }
+        }
+        images.push_back(dst);
+    }
+
+    TextureFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.m_magic, kTextureMagic, sizeof(header.m_magic));
+    header.m_version = kTextureVersion;
+    header.m_byteOrder = kTextureByteOrder;
+    header.m_width = (unsigned int)width;
+    header.m_height = (unsigned int)height;
+    header.m_tileSize = (unsigned int)kTextureTileSize;
+    header.m_numLevels = (unsigned int)levels.size();
+
+    std::ostringstream temporary;
+    temporary << path << "." << getpid() << ".tmp";
+    FILE* out = std::fopen(temporary.str().c_str(), "wb");
+    if (!out)
+    {
+        return false;
+    }
+    bool ok = std::fwrite(&header, sizeof(header), 1, out) == 1 &&
+              std::fwrite(&levels[0], sizeof(TextureLevel), levels.size(), out) == levels.size();
+    std::vector<float> tile(kTextureTileTexels * 3);
+    for (size_t l = 0; l < levels.size() && ok; ++l)
+    {
+        const TextureLevel& level = levels[l];
+        const std::vector<Color>& image = images[l];
+        for (size_t ty = 0; ty < level.m_tilesY && ok; ++ty)
+        {
+            for (size_t tx = 0; tx < level.m_tilesX && ok; ++tx)
+            {
+                for (size_t j = 0; j < kTextureTileSize; ++j)
+                {
+                    size_t y = std::min(ty * kTextureTileSize + j, size_t(level.m_height - 1));
+                    for (size_t i = 0; i < kTextureTileSize; ++i)
+                    {
+                        size_t x = std::min(tx * kTextureTileSize + i, size_t(level.m_width - 1));
+                        const Color& c = image[y * level.m_width + x];
+                        float* texel = &tile[(j * kTextureTileSize + i) * 3];
+                        texel[0] = c.m_r;
+                        texel[1] = c.m_g;
+                        texel[2] = c.m_b;
+                    }
+                }
+                ok = std::fwrite(&tile[0], sizeof(float), tile.size(), out) == tile.size();
+            }
+        }
+    }
+    ok = std::fclose(out) == 0 && ok;
+    if (!ok || std::rename(temporary.str().c_str(), path.c_str()) != 0)
+    {
+        std::remove(temporary.str().c_str());
+        return false;
+    }
+    return true;
+}
+
+
+class TextureCache;
+
+
+//
+// An open tiled texture. Sampling goes through the cache that loaded it.
+//
+class Texture
+{
+public:
+    // Trilinearly filtered color at (u, v), with wrap-around addressing;
+    // footprint is the size of the area to filter over in uv units, which
+    // picks the mip level
+    inline Color sample(float u, float v, float footprint) const;
+
+    const std::string& path() const { return m_path; }
+    unsigned int id() const { return m_id; }
+    size_t width() const { return m_levels[0].m_width; }
+    size_t height() const { return m_levels[0].m_height; }
+    size_t numLevels() const { return m_levels.size(); }
+
+protected:
+    friend class TextureCache;
+
+    Texture(TextureCache* pCache, unsigned int id, const std::string& path, int fd,
+            const std::vector<TextureLevel>& levels, size_t dataOffset)
+        : m_pCache(pCache), m_id(id), m_path(path), m_fd(fd), m_levels(levels), m_dataOffset(dataOffset)
+    {
+
+    }
+
+    ~Texture() { close(m_fd); }
+
+    // Reads tile (tx, ty) of a level from the file; a short read leaves
+    // the rest black
+    void readTile(unsigned int level, unsigned int tx, unsigned int ty, float* texels) const
+    {
+        const TextureLevel& l = m_levels[level];
+        off_t offset = off_t(m_dataOffset + (l.m_firstTile + (unsigned long long)ty * l.m_tilesX + tx) * kTextureTileBytes);
+        size_t done = 0;
+        char* dst = reinterpret_cast<char*>(texels);
+        while (done < kTextureTileBytes)
+        {
+            ssize_t n = pread(m_fd, dst + done, kTextureTileBytes - done, offset + off_t(done));
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                std::memset(dst + done, 0, kTextureTileBytes - done);
+                break;
+            }
+            done += size_t(n);
+        }
+    }
+
+    // Bilinearly filtered color of one level at (u, v) in [0, 1)
+    inline Color bilinear(unsigned int level, float u, float v) const;
+
+    TextureCache* m_pCache;
+    unsigned int m_id;
+    std::string m_path;
+    int m_fd;
+    std::vector<TextureLevel> m_levels;
+    // Where the first tile starts in the file
+    size_t m_dataOffset;
+
+private:
+    Texture(const Texture&);
+    Texture& operator =(const Texture&);
+};
+
+
+class TextureCache
+{
+public:
+    TextureCache()
+        : m_budget(size_t(256) << 20),
+          m_directory(defaultDirectory()),
+          m_pSlots(NULL),
+          m_pTexels(NULL),
+          m_pSets(NULL),
+          m_numSets(0),
+          m_misses(0)
+    {
+
+    }
+
+    ~TextureCache()
+    {
+        for (size_t i = 0; i < m_textures.size(); ++i)
+        {
+            delete m_textures[i];
+        }
+        delete[] m_pSlots;
+        delete[] m_pTexels;
+        delete[] m_pSets;
+    }
+
+    // The cache every scene loads its textures through
+    static TextureCache& global()
+    {
+        static TextureCache cache;
+        return cache;
+    }
+
+    // Bytes of tiles to keep in memory, and where converted textures go.
+    // The budget only counts until the first texture is loaded.
+    void configure(size_t budget, const std::string& directory)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_budget = budget;
+        if (!directory.empty())
+        {
+            m_directory = directory;
+        }
+    }
+
+    // The texture in path, opened (and converted if it is not a tiled
+    // texture) the first time it is asked for; NULL with a message in
+    // error if it cannot be read. Safe to call from several threads.
+    const Texture* load(const std::string& path, std::string& error)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::map<std::string, Texture*>::const_iterator found = m_byPath.find(path);
+        if (found != m_byPath.end())
+        {
+            return found->second;
+        }
+        if (m_textures.size() >= kMaxTextures)
+        {
+            error = "too many textures";
+            return NULL;
+        }
+
+        std::string tiledPath;
+        if (!isTiledTexture(path))
+        {
+            if (!convert(path, tiledPath, error))
+            {
+                return NULL;
+            }
+        }
+        else
+        {
+            tiledPath = path;
+        }
+        int fd = open(tiledPath.c_str(), O_RDONLY);
+        TextureFileHeader header;
+        std::vector<TextureLevel> levels;
+        if (fd < 0 || !readHeader(fd, header, levels))
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            error = "cannot read texture '" + path + "'";
+            return NULL;
+        }
+
+        allocateSlots();
+        Texture* pTexture = new Texture(this, (unsigned int)m_textures.size(), path, fd, levels,
+                                        sizeof(header) + levels.size() * sizeof(TextureLevel));
+        m_textures.push_back(pTexture);
+        m_byPath[path] = pTexture;
+        return pTexture;
+    }
+
+    // Copies texels (indices within the tile) of tile (tx, ty) of a level
+    // into out, three floats each, reading the tile in if it is not cached
+    void fetch(const Texture& texture, unsigned int level, unsigned int tx, unsigned int ty,
+               const unsigned int* texels, size_t count, float* out)
+    {
+        unsigned long long key = tileKey(texture.m_id, level, tx, ty);
+        size_t set = setOf(key);
+
+        // Slot this thread last found the tile in, if any (slot + 1, 0 for
+        // none), then the set
+        static thread_local unsigned int recent[kTextureRecentSlots];
+        unsigned int& hint = recent[(key ^ (key >> 21) ^ (key >> 42)) % kTextureRecentSlots];
+        if (hint && hint <= m_numSets * kTextureCacheWays && tryRead(hint - 1, key, texels, count, out))
+        {
+            return;
+        }
+        for (size_t way = 0; way < kTextureCacheWays; ++way)
+        {
+            unsigned int slot = (unsigned int)(set * kTextureCacheWays + way);
+            if (tryRead(slot, key, texels, count, out))
+            {
+                hint = slot + 1;
+                return;
+            }
+        }
+        hint = miss(texture, key, level, tx, ty, texels, count, out) + 1;
+    }
+
+    size_t numTextures() const { return m_textures.size(); }
+    // Tiles read from disk so far
+    size_t misses() const { return m_misses.load(std::memory_order_relaxed); }
+    // Tiles the cache can hold (0 before the first texture)
+    size_t numSlots() const { return m_numSets * kTextureCacheWays; }
+
+protected:
+    static const unsigned long long kEmptyKey = ~0ULL;
+
+    struct Slot
+    {
+        std::atomic<unsigned long long> m_key;
+        // Odd while the slot is being refilled
+        std::atomic<unsigned int> m_sequence;
+        // Set by every hit, cleared as the CLOCK hand passes
+        std::atomic<unsigned char> m_referenced;
+
+        Slot() : m_key(kEmptyKey), m_sequence(0), m_referenced(0) { }
+    };
+
+    struct Set
+    {
+        std::mutex m_mutex;
+        size_t m_hand;
+
+        Set() : m_hand(0) { }
+    };
+
+    static unsigned long long tileKey(unsigned int id, unsigned int level, unsigned int tx, unsigned int ty)
+    {
+        return ((unsigned long long)id << 48) | ((unsigned long long)level << 42) |
+               ((unsigned long long)ty << 21) | (unsigned long long)tx;
+    }
+
+    size_t setOf(unsigned long long key) const
+    {
+        return size_t((key ^ (key >> 29)) * 0x9e3779b97f4a7c15ULL >> 32) % m_numSets;
+    }
+
+    // Copies the texels from slot if it holds key and was not refilled
+    // meanwhile
+    bool tryRead(unsigned int slot, unsigned long long key,
+                 const unsigned int* texels, size_t count, float* out)
+    {
+        Slot& s = m_pSlots[slot];
+        unsigned int sequence = s.m_sequence.load(std::memory_order_acquire);
+        if ((sequence & 1) || s.m_key.load(std::memory_order_relaxed) != key)
+        {
+            return false;
+        }
+        copyTexels(slot, texels, count, out);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (s.m_sequence.load(std::memory_order_relaxed) != sequence)
+        {
+            return false;
+        }
+        if (!s.m_referenced.load(std::memory_order_relaxed))
+        {
+            s.m_referenced.store(1, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    // Under the set's lock: finds the tile or reads it into the slot the
+    // CLOCK hand picks, and copies the texels from it
+    unsigned int miss(const Texture& texture, unsigned long long key,
+                      unsigned int level, unsigned int tx, unsigned int ty,
+                      const unsigned int* texels, size_t count, float* out)
+    {
+        size_t set = setOf(key);
+        Set& s = m_pSets[set];
+        std::lock_guard<std::mutex> lock(s.m_mutex);
+        size_t first = set * kTextureCacheWays;
+        for (size_t way = 0; way < kTextureCacheWays; ++way)
+        {
+            if (m_pSlots[first + way].m_key.load(std::memory_order_relaxed) == key)
+            {
+                // Another thread read it in first
+                copyTexels(first + way, texels, count, out);
+                return (unsigned int)(first + way);
+            }
+        }
+
+        size_t victim = first + s.m_hand;
+        for (size_t step = 0; step < 2 * kTextureCacheWays; ++step)
+        {
+            victim = first + s.m_hand;
+            s.m_hand = (s.m_hand + 1) % kTextureCacheWays;
+            Slot& candidate = m_pSlots[victim];
+            if (candidate.m_key.load(std::memory_order_relaxed) == kEmptyKey ||
+                !candidate.m_referenced.exchange(0, std::memory_order_relaxed))
+            {
+                break;
+            }
+        }
+
+        Slot& slot = m_pSlots[victim];
+        unsigned int sequence = slot.m_sequence.load(std::memory_order_relaxed);
+        slot.m_sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.m_key.store(key, std::memory_order_relaxed);
+        texture.readTile(level, tx, ty, m_pTexels + victim * kTextureTileTexels * 3);
+        slot.m_referenced.store(1, std::memory_order_relaxed);
+        slot.m_sequence.store(sequence + 2, std::memory_order_release);
+        m_misses.fetch_add(1, std::memory_order_relaxed);
+
+        copyTexels(victim, texels, count, out);
+        return (unsigned int)victim;
+    }
+
+    void copyTexels(size_t slot, const unsigned int* texels, size_t count, float* out) const
+    {
+        const float* tile = m_pTexels + slot * kTextureTileTexels * 3;
+        for (size_t i = 0; i < count; ++i)
+        {
+            const float* texel = tile + texels[i] * 3;
+            out[i * 3 + 0] = texel[0];
+            out[i * 3 + 1] = texel[1];
+            out[i * 3 + 2] = texel[2];
+        }
+    }
+
+    // Sizes the slot pool by the budget, once; the tile memory is only
+    // touched as tiles are read in
+    void allocateSlots()
+    {
+        if (m_pSlots)
+        {
+            return;
+        }
+        m_numSets = std::max(m_budget / (kTextureTileBytes * kTextureCacheWays), size_t(1));
+        size_t numSlots = m_numSets * kTextureCacheWays;
+        m_pSlots = new Slot[numSlots];
+        m_pSets = new Set[m_numSets];
+        m_pTexels = new float[numSlots * kTextureTileTexels * 3];
+    }
+
+    static bool isTiledTexture(const std::string& path)
+    {
+        char magic[sizeof(kTextureMagic)];
+        FILE* in = std::fopen(path.c_str(), "rb");
+        if (!in)
+        {
+            return false;
+        }
+        bool tiled = std::fread(magic, sizeof(magic), 1, in) == 1 &&
+                     std::memcmp(magic, kTextureMagic, sizeof(magic)) == 0;
+        std::fclose(in);
+        return tiled;
+    }
+
+    static bool readHeader(int fd, TextureFileHeader& header, std::vector<TextureLevel>& levels)
+    {
+        if (pread(fd, &header, sizeof(header), 0) != ssize_t(sizeof(header)) ||
+            std::memcmp(header.m_magic, kTextureMagic, sizeof(header.m_magic)) != 0 ||
+            header.m_version != kTextureVersion ||
+            header.m_byteOrder != kTextureByteOrder ||
+            header.m_tileSize != kTextureTileSize ||
+            header.m_numLevels == 0 || header.m_numLevels > 32)
+        {
+            return false;
+        }
+        levels.resize(header.m_numLevels);
+        size_t bytes = levels.size() * sizeof(TextureLevel);
+        return pread(fd, &levels[0], bytes, sizeof(header)) == ssize_t(bytes) &&
+               levels[0].m_width == header.m_width && levels[0].m_height == header.m_height &&
+               levels[0].m_width > 0 && levels[0].m_height > 0;
+    }
+
+    // Tiled copy of the image in path in the cache directory, written
+    // unless an up-to-date one is there already
+    bool convert(const std::string& path, std::string& tiledPath, std::string& error)
+    {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0)
+        {
+            error = "cannot read texture '" + path + "'";
+            return false;
+        }
+        unsigned long long h = hashBytes(path.data(), path.size());
+        h = hashBytes(reinterpret_cast<const char*>(&st.st_size), sizeof(st.st_size), h);
+        h = hashBytes(reinterpret_cast<const char*>(&st.st_mtime), sizeof(st.st_mtime), h);
+        std::ostringstream name;
+        name << m_directory << "/" << std::hex << h << ".tiles";
+        tiledPath = name.str();
+        if (isTiledTexture(tiledPath))
+        {
+            return true;
+        }
+
+        std::vector<Color> pixels;
+        size_t width, height;
+        if (!readImage(path, pixels, width, height) || width == 0 || height == 0)
+        {
+            error = "cannot read texture '" + path + "'";
+            return false;
+        }
+        if (mkdir(m_directory.c_str(), 0777) != 0 && errno != EEXIST)
+        {
+            error = "cannot create texture directory '" + m_directory + "'";
+            return false;
+        }
+        if (!writeTiledTexture(tiledPath, pixels, width, height))
+        {
+            error = "cannot write tiled texture '" + tiledPath + "'";
+            return false;
+        }
+        return true;
+    }
+
+    static std::string defaultDirectory()
+    {
+        const char* tmp = std::getenv("TMPDIR");
+        return std::string(tmp && *tmp ? tmp : "/tmp") + "/tracer-textures";
+    }
+
+    std::mutex m_mutex;
+    size_t m_budget;
+    std::string m_directory;
+    std::vector<Texture*> m_textures;
+    std::map<std::string, Texture*> m_byPath;
+
+    // m_numSets * kTextureCacheWays slots, and their tiles
+    Slot* m_pSlots;
+    float* m_pTexels;
+    Set* m_pSets;
+    size_t m_numSets;
+    std::atomic<size_t> m_misses;
+
+private:
+    TextureCache(const TextureCache&);
+    TextureCache& operator =(const TextureCache&);
+};
+
+
+inline Color Texture::sample(float u, float v, float footprint) const
+{
+    u -= std::floor(u);
+    v -= std::floor(v);
+    float size = float(std::max(m_levels[0].m_width, m_levels[0].m_height));
+    float lod = footprint * size > 1.0f ? std::log2(footprint * size) : 0.0f;
+    float maxLevel = float(m_levels.size() - 1);
+    if (lod >= maxLevel)
+    {
+        return bilinear((unsigned int)maxLevel, u, v);
+    }
+    unsigned int level = (unsigned int)lod;
+    float t = lod - float(level);
+    Color c = bilinear(level, u, v);
+    return t > 0.0f ? (1.0f - t) * c + t * bilinear(level + 1, u, v) : c;
+}
+
+
+inline Color Texture::bilinear(unsigned int level, float u, float v) const
+{
+    const TextureLevel& l = m_levels[level];
+    float x = u * float(l.m_width) - 0.5f;
+    float y = v * float(l.m_height) - 0.5f;
+    float fx = std::floor(x);
+    float fy = std::floor(y);
+    float dx = x - fx;
+    float dy = y - fy;
+    // Wrap around; u and v are in [0, 1), so x and y are at least -0.5
+    unsigned int x0 = fx < 0.0f ? l.m_width - 1 : std::min((unsigned int)fx, l.m_width - 1);
+    unsigned int y0 = fy < 0.0f ? l.m_height - 1 : std::min((unsigned int)fy, l.m_height - 1);
+    unsigned int x1 = x0 + 1 < l.m_width ? x0 + 1 : 0;
+    unsigned int y1 = y0 + 1 < l.m_height ? y0 + 1 : 0;
+
+    const unsigned int ts = (unsigned int)kTextureTileSize;
+    float texels[4 * 3];
+    if (x0 / ts == x1 / ts && y0 / ts == y1 / ts)
+    {
+        // The whole 2x2 footprint is in one tile
+        unsigned int indices[4] = { (y0 % ts) * ts + x0 % ts, (y0 % ts) * ts + x1 % ts,
+                                    (y1 % ts) * ts + x0 % ts, (y1 % ts) * ts + x1 % ts };
+        m_pCache->fetch(*this, level, x0 / ts, y0 / ts, indices, 4, texels);
+    }
+    else
+    {
+        unsigned int xs[4] = { x0, x1, x0, x1 };
+        unsigned int ys[4] = { y0, y0, y1, y1 };
+        for (size_t i = 0; i < 4; ++i)
+        {
+            unsigned int index = (ys[i] % ts) * ts + xs[i] % ts;
+            m_pCache->fetch(*this, level, xs[i] / ts, ys[i] / ts, &index, 1, texels + i * 3);
+        }
+    }
+    Color c00(texels[0], texels[1], texels[2]);
+    Color c10(texels[3], texels[4], texels[5]);
+    Color c01(texels[6], texels[7], texels[8]);
+    Color c11(texels[9], texels[10], texels[11]);
+    return (1.0f - dy) * ((1.0f - dx) * c00 + dx * c10) + dy * ((1.0f - dx) * c01 + dx * c11);
+}
+
+}//namespace Tracer
+
+#endif
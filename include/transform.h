@@ -0,0 +1,162 @@
+#ifndef __TRANSFORM_H__
+#define __TRANSFORM_H__
+
+#include <cmath>
+#include "util.h"
+#include "shape.h"
+
+namespace Tracer
+{
+
+//
+// Affine transform stored as the top three rows of a 4x4 matrix.
+//
+// Operators supported:
+//     transform * transform (apply the right one first)
+//
+
+struct Transform
+{
+    float m[3][4];
+
+    // Identity
+    Transform()
+    {
+        for (int r = 0; r < 3; ++r)
+        {
+            for (int c = 0; c < 4; ++c)
+            {
+                m[r][c] = (r == c) ? 1.0f : 0.0f;
+            }
+        }
+    }
+
+    static Transform translate(const Vector& v)
+    {
+        Transform t;
+        t.m[0][3] = v.m_x;
+        t.m[1][3] = v.m_y;
+        t.m[2][3] = v.m_z;
+        return t;
+    }
+
+    static Transform scale(const Vector& s)
+    {
+        Transform t;
+        t.m[0][0] = s.m_x;
+        t.m[1][1] = s.m_y;
+        t.m[2][2] = s.m_z;
+        return t;
+    }
+
+    // Rotation by angleInDegrees about the x (axis 0), y (1) or z (2) axis
+    static Transform rotate(int axis, float angleInDegrees)
+    {
+        float a = angleInDegrees * float(M_PI) / 180.0f;
+        float c = std::cos(a), s = std::sin(a);
+        int i = (axis + 1) % 3, j = (axis + 2) % 3;
+        Transform t;
+        t.m[i][i] = c;
+        t.m[i][j] = -s;
+        t.m[j][i] = s;
+        t.m[j][j] = c;
+        return t;
+    }
+
+    Point transformPoint(const Point& p) const
+    {
+        return Point(m[0][0] * p.m_x + m[0][1] * p.m_y + m[0][2] * p.m_z + m[0][3],
+                     m[1][0] * p.m_x + m[1][1] * p.m_y + m[1][2] * p.m_z + m[1][3],
+                     m[2][0] * p.m_x + m[2][1] * p.m_y + m[2][2] * p.m_z + m[2][3]);
+    }
+
+    Vector transformVector(const Vector& v) const
+    {
+        return Vector(m[0][0] * v.m_x + m[0][1] * v.m_y + m[0][2] * v.m_z,
+                      m[1][0] * v.m_x + m[1][1] * v.m_y + m[1][2] * v.m_z,
+                      m[2][0] * v.m_x + m[2][1] * v.m_y + m[2][2] * v.m_z);
+    }
+
+    // Multiplies by the transpose of the linear part; applied by the
+    // inverse of a transform this maps normals the way the transform does
+    Vector transformTransposed(const Vector& v) const
+    {
+        return Vector(m[0][0] * v.m_x + m[1][0] * v.m_y + m[2][0] * v.m_z,
+                      m[0][1] * v.m_x + m[1][1] * v.m_y + m[2][1] * v.m_z,
+                      m[0][2] * v.m_x + m[1][2] * v.m_y + m[2][2] * v.m_z);
+    }
+
+    // Bounds of the transformed box
+    BoundingBox transformBox(const BoundingBox& box) const
+    {
+        BoundingBox result;
+        if (!box.empty())
+        {
+            for (int i = 0; i < 8; ++i)
+            {
+                result.expand(transformPoint(box.corner(i)));
+            }
+        }
+        return result;
+    }
+
+    Transform inverse() const
+    {
+        // Inverse of the linear part by cofactors, then the translation
+        float det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+                    m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+                    m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+        float invDet = (det != 0.0f) ? 1.0f / det : 0.0f;
+        Transform r;
+        r.m[0][0] =  (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * invDet;
+        r.m[0][1] = -(m[0][1] * m[2][2] - m[0][2] * m[2][1]) * invDet;
+        r.m[0][2] =  (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * invDet;
+        r.m[1][0] = -(m[1][0] * m[2][2] - m[1][2] * m[2][0]) * invDet;
+        r.m[1][1] =  (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * invDet;
+        r.m[1][2] = -(m[0][0] * m[1][2] - m[0][2] * m[1][0]) * invDet;
+        r.m[2][0] =  (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * invDet;
+        r.m[2][1] = -(m[0][0] * m[2][1] - m[0][1] * m[2][0]) * invDet;
+        r.m[2][2] =  (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * invDet;
+        Vector t = r.transformVector(Vector(m[0][3], m[1][3], m[2][3]));
+        r.m[0][3] = -t.m_x;
+        r.m[1][3] = -t.m_y;
+        r.m[2][3] = -t.m_z;
+        return r;
+    }
+
+    bool operator ==(const Transform& t) const
+    {
+        for (int r = 0; r < 3; ++r)
+        {
+            for (int c = 0; c < 4; ++c)
+            {
+                if (m[r][c] != t.m[r][c])
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    bool operator !=(const Transform& t) const { return !(*this == t); }
+};
+
+
+inline Transform operator *(const Transform& a, const Transform& b)
+{
+    Transform r;
+    for (int i = 0; i < 3; ++i)
+    {
+        for (int j = 0; j < 4; ++j)
+        {
+            r.m[i][j] = a.m[i][0] * b.m[0][j] + a.m[i][1] * b.m[1][j] + a.m[i][2] * b.m[2][j] +
+                        (j == 3 ? a.m[i][3] : 0.0f);
+        }
+    }
+    return r;
+}
+
+}//namespace Tracer
+
+#endif
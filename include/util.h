@@ -6,6 +6,8 @@
 #include <list>
 #include <algorithm>
 #include <string>
+#include <ostream>
+#include "simd.h"
 
 #ifndef M_PI
     #define M_PI 3.14159265358979
@@ -25,137 +27,51 @@ namespace Tracer
 //     color * color, color *= color, float * color, color * float, color *= float
 //     color / color, color /= color, color / float
 //
+// Colors and vectors are 16-byte aligned with a padding lane, so every
+// operator is one Float4 operation (see simd.h), and trivially copyable, so
+// they travel in registers.
+//
 
-class Color
-{
-    public:
-	float m_r, m_g, m_b;
-    
-    	Color()                          : m_r(0.0f), m_g(0.0f), m_b(0.0f)    { }
-    	Color(const Color& c)            : m_r(c.m_r), m_g(c.m_g), m_b(c.m_b) { }
-    	Color(float r, float g, float b) : m_r(r), m_g(g), m_b(b)             { }
-    	explicit Color(float f)          : m_r(f), m_g(f), m_b(f)             { }
-    
-    
-    	void clamp(float min = 0.0f, float max = 1.0f)
-    	{
-        	m_r = std::max(min, std::min(max, m_r));
-        	m_g = std::max(min, std::min(max, m_g));
-        	m_b = std::max(min, std::min(max, m_b));
-    	}
-    
-    
-    	Color& operator =(const Color& c)
-    	{
-        	m_r = c.m_r;
-      	  	m_g = c.m_g;
-        	m_b = c.m_b;
-    	return *this;
-    	}
-    
-    	Color& operator +=(const Color& c)
-    	{
-        	m_r += c.m_r;
-        	m_g += c.m_g;
-        	m_b += c.m_b;
-        	return *this;
-    	}
-    
-   	 Color& operator -=(const Color& c)
-   	 {
-   	     m_r -= c.m_r;
-   	     m_g -= c.m_g;
-   	     m_b -= c.m_b;
-   	     return *this;
-   	 }
-   	 
-   	 Color& operator *=(const Color& c)
-   	 {
-   	     m_r *= c.m_r;
-   	     m_g *= c.m_g;
-   	     m_b *= c.m_b;
-   	     return *this;
-   	 }
-   	 
-   	 Color& operator /=(const Color& c)
-   	 {
-   	     m_r /= c.m_r;
-   	     m_g /= c.m_g;
-   	     m_b /= c.m_b;
-   	     return *this;
-   	 }
-   	 
-   	 Color& operator *=(float f)
-   	 {
-   	     m_r *= f;
-   	     m_g *= f;
-   	     m_b *= f;
-   	     return *this;
-   	 }
-   	 
-   	 Color& operator /=(float f)
-   	 {
-   	     m_r /= f;
-   	     m_g /= f;
-   	     m_b /= f;
-   	     return *this;
-   	 }
-};
-
-
-inline Color operator +(const Color& c1, const Color& c2)
-{
-    return Color(c1.m_r + c2.m_r,
-                 c1.m_g + c2.m_g,
-                 c1.m_b + c2.m_b);
-}
-
-
-inline Color operator -(const Color& c1, const Color& c2)
+struct alignas(16) Color
 {
-    return Color(c1.m_r - c2.m_r,
-                 c1.m_g - c2.m_g,
-                 c1.m_b - c2.m_b);
-}
+    float m_r, m_g, m_b;
+    // Padding lane for the 4-wide operations; not part of the value
+    float m_a;
 
+    Color()                          : m_r(0.0f), m_g(0.0f), m_b(0.0f), m_a(0.0f) { }
+    Color(float r, float g, float b) : m_r(r), m_g(g), m_b(b), m_a(0.0f)          { }
+    explicit Color(float f)          : m_r(f), m_g(f), m_b(f), m_a(0.0f)          { }
+    explicit Color(Float4 v)                                                      { store4(&m_r, v); }
 
-inline Color operator *(const Color& c1, const Color& c2)
-{
-    return Color(c1.m_r * c2.m_r,
-                 c1.m_g * c2.m_g,
-                 c1.m_b * c2.m_b);
-}
-
-
-inline Color operator /(const Color& c1, const Color& c2)
-{
-    return Color(c1.m_r / c2.m_r,
-                 c1.m_g / c2.m_g,
-                 c1.m_b / c2.m_b);
-}
+    Float4 simd() const { return load4(&m_r); }
 
+    void clamp(float min = 0.0f, float max = 1.0f)
+    {
+        *this = Color(max4(min4(simd(), splat4(max)), splat4(min)));
+    }
 
-inline Color operator *(const Color& c, float f)
-{
-    return Color(f * c.m_r,
-                 f * c.m_g,
-                 f * c.m_b);
-}
+    Color& operator +=(const Color& c) { return *this = Color(add4(simd(), c.simd())); }
+    Color& operator -=(const Color& c) { return *this = Color(sub4(simd(), c.simd())); }
+    Color& operator *=(const Color& c) { return *this = Color(mul4(simd(), c.simd())); }
+    Color& operator /=(const Color& c) { return *this = Color(div4(simd(), c.simd())); }
+    Color& operator *=(float f)        { return *this = Color(mul4(simd(), splat4(f))); }
+    Color& operator /=(float f)        { return *this = Color(div4(simd(), splat4(f))); }
+};
 
 
-inline Color operator *(float f, const Color& c)
-{
-    return Color(f * c.m_r,
-                 f * c.m_g,
-                 f * c.m_b);
-}
+inline Color operator +(const Color& c1, const Color& c2) { return Color(add4(c1.simd(), c2.simd())); }
+inline Color operator -(const Color& c1, const Color& c2) { return Color(sub4(c1.simd(), c2.simd())); }
+inline Color operator *(const Color& c1, const Color& c2) { return Color(mul4(c1.simd(), c2.simd())); }
+inline Color operator /(const Color& c1, const Color& c2) { return Color(div4(c1.simd(), c2.simd())); }
+inline Color operator *(const Color& c, float f)          { return Color(mul4(splat4(f), c.simd())); }
+inline Color operator *(float f, const Color& c)          { return Color(mul4(splat4(f), c.simd())); }
+inline Color operator /(const Color& c, float f)          { return Color(div4(c.simd(), splat4(f))); }
 
 
-inline Color operator /(const Color& c, float f)
+// Relative luminance of a linear color (Rec. 709 weights)
+inline float luminance(const Color& c)
 {
-    return Color(c.m_r / f,
-                 c.m_g / f,
-                 c.m_b / f);
+    return 0.2126f * c.m_r + 0.7152f * c.m_g + 0.0722f * c.m_b;
 }
 
 
@@ -170,104 +86,51 @@ inline Color operator /(const Color& c, float f)
 //     vector / float, vector /= float
 //
 
-struct Vector
+struct alignas(16) Vector
 {
     float m_x, m_y, m_z;
-    
-    Vector()                          : m_x(0.0f), m_y(0.0f), m_z(0.0f)    { }
-    Vector(const Vector& v)           : m_x(v.m_x), m_y(v.m_y), m_z(v.m_z) { }
-    Vector(float x, float y, float z) : m_x(x), m_y(y), m_z(z)             { }
-    explicit Vector(float f)          : m_x(f), m_y(f), m_z(f)             { }
-    
-    
-    float length2() const { return m_x * m_x + m_y * m_y + m_z * m_z; }
-    float length()  const { return std::sqrt(length2()); }
-    
-    // Returns old length from before normalization (ignore the return value if you don't need it)
-    float  normalize()        { float len = length(); *this /= len; return len; }
-    // Return a vector in this same direction, but normalized
-    Vector normalized() const { Vector r(*this); r.normalize(); return r; }
-    
-    
-    Vector& operator =(const Vector& v)
-    {
-        m_x = v.m_x;
-        m_y = v.m_y;
-        m_z = v.m_z;
-        return *this;
-    }
-    
-    Vector& operator +=(const Vector& v)
-    {
-        m_x += v.m_x;
-        m_y += v.m_y;
-        m_z += v.m_z;
-        return *this;
-    }
-    
-    Vector& operator -=(const Vector& v)
-    {
-        m_x -= v.m_x;
-        m_y -= v.m_y;
-        m_z -= v.m_z;
-        return *this;
-    }
-    
-    Vector& operator *=(float f)
-    {
-        m_x *= f;
-        m_y *= f;
-        m_z *= f;
-        return *this;
-    }
-    
-    Vector& operator /=(float f)
-    {
-        m_x /= f;
-        m_y /= f;
-        m_z /= f;
-        return *this;
-    }
-};
+    // Padding lane for the 4-wide operations; not part of the value
+    float m_w;
 
+    Vector()                          : m_x(0.0f), m_y(0.0f), m_z(0.0f), m_w(0.0f) { }
+    Vector(float x, float y, float z) : m_x(x), m_y(y), m_z(z), m_w(0.0f)          { }
+    explicit Vector(float f)          : m_x(f), m_y(f), m_z(f), m_w(0.0f)          { }
+    explicit Vector(Float4 v)                                                      { store4(&m_x, v); }
 
-inline Vector operator +(const Vector& v1, const Vector& v2)
-{
-    return Vector(v1.m_x + v2.m_x,
-                  v1.m_y + v2.m_y,
-                  v1.m_z + v2.m_z);
-}
-
+    Float4 simd() const { return load4(&m_x); }
 
-inline Vector operator -(const Vector& v1, const Vector& v2)
-{
-    return Vector(v1.m_x - v2.m_x,
-                  v1.m_y - v2.m_y,
-                  v1.m_z - v2.m_z);
-}
+    float length2() const { Float4 v = simd(); return hsum3(mul4(v, v)); }
+    float length()  const { return std::sqrt(length2()); }
 
+    // Returns old length from before normalization (ignore the return value if you don't need it).
+    // TRACER_FAST_MATH builds scale by an approximate reciprocal square root
+    // instead of dividing by the exact length.
+#ifdef TRACER_FAST_MATH
+    float  normalize()        { float len2 = length2(); float inv = rsqrtFast(len2); *this *= inv; return len2 * inv; }
+#else
+    float  normalize()        { float len = length(); *this /= len; return len; }
+#endif
+    // Return a vector in this same direction, but normalized
+    Vector normalized() const { Vector r(*this); r.normalize(); return r; }
 
-inline Vector operator *(const Vector& v, float f)
-{
-    return Vector(f * v.m_x,
-                  f * v.m_y,
-                  f * v.m_z);
-}
+    Vector& operator +=(const Vector& v) { return *this = Vector(add4(simd(), v.simd())); }
+    Vector& operator -=(const Vector& v) { return *this = Vector(sub4(simd(), v.simd())); }
+    Vector& operator *=(float f)         { return *this = Vector(mul4(simd(), splat4(f))); }
+    Vector& operator /=(float f)         { return *this = Vector(div4(simd(), splat4(f))); }
+};
 
 
-inline Vector operator *(float f, const Vector& v)
-{
-    return Vector(f * v.m_x,
-                  f * v.m_y,
-                  f * v.m_z);
-}
+inline Vector operator +(const Vector& v1, const Vector& v2) { return Vector(add4(v1.simd(), v2.simd())); }
+inline Vector operator -(const Vector& v1, const Vector& v2) { return Vector(sub4(v1.simd(), v2.simd())); }
+inline Vector operator *(const Vector& v, float f)           { return Vector(mul4(splat4(f), v.simd())); }
+inline Vector operator *(float f, const Vector& v)           { return Vector(mul4(splat4(f), v.simd())); }
 
 
 // dot(v1, v2) = length(v1) * length(v2) * cos(angle between v1, v2)
 inline float dot(const Vector& v1, const Vector& v2)
 {
     // In cartesian coordinates, it simplifies to this simple calculation:
-    return v1.m_x * v2.m_x + v1.m_y * v2.m_y + v1.m_z * v2.m_z;
+    return hsum3(mul4(v1.simd(), v2.simd()));
 }
 
 
@@ -275,10 +138,12 @@ inline float dot(const Vector& v1, const Vector& v2)
 // result is perpendicular to both v1, v2.
 inline Vector cross(const Vector& v1, const Vector& v2)
 {
-    // In cartesian coordinates, it simplifies down to this calculation:
-    return Vector(v1.m_y * v2.m_z - v1.m_z * v2.m_y,
-                  v1.m_z * v2.m_x - v1.m_x * v2.m_z,
-                  v1.m_x * v2.m_y - v1.m_y * v2.m_x);
+    // In cartesian coordinates, it simplifies down to
+    // v1.yzx * v2.zxy - v1.zxy * v2.yzx, which is the same as
+    // (v1 * v2.yzx - v1.yzx * v2).yzx
+    Float4 a = v1.simd(), b = v2.simd();
+    Float4 c = msub4(a, shuffleYZX(b), mul4(shuffleYZX(a), b));
+    return Vector(shuffleYZX(c));
 }
 
 
@@ -300,12 +165,46 @@ const float kRayTMin = 0.00001f;
 // the point on the surface to the point on the light.
 const float kRayTMax = 1.0e30f;
 
+// Integer hash with good avalanche, for turning indices into seeds
+inline unsigned int hashUInt32(unsigned int x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+}
+
+// 64-bit FNV-1a, used to key scenes and textures by their content
+inline unsigned long long hashBytes(const char* data, size_t size,
+                                    unsigned long long h = 14695981039346656037ULL)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        h ^= (unsigned char)data[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+
 struct Rng
 {
     unsigned int m_z, m_w;
     
     Rng(unsigned int z = 362436069, unsigned int w = 521288629) : m_z(z), m_w(w) { }
     
+    // Generator for one independent stream (a tile, a pixel sample...) of
+    // a render with the given seed. Neither state word may be zero.
+    static Rng forStream(unsigned int seed, unsigned int stream)
+    {
+        unsigned int h = hashUInt32(seed ^ hashUInt32(stream));
+        unsigned int z = hashUInt32(h + 0x9e3779b9U);
+        unsigned int w = hashUInt32(h ^ 0x85ebca6bU);
+        return Rng(z ? z : 362436069, w ? w : 521288629);
+    }
+    
     
     // Returns a 'canonical' float from [0,1)
     float nextFloat()
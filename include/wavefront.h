@@ -0,0 +1,476 @@
+#ifndef __WAVEFRONT_H__
+#define __WAVEFRONT_H__
+
+#include <vector>
+#include "util.h"
+#include "arena.h"
+#include "ray.h"
+#include "shape.h"
+#include "material.h"
+#include "light_source.h"
+#include "camera.h"
+#include "film.h"
+#include "integrator.h"
+#include "ray_queue.h"
+#include "ray_sort.h"
+
+namespace Tracer
+{
+
+//
+// Wavefront (stream) renderer.
+//
+// Instead of following one sample depth-first through traceRay, a whole
+// wave of paths is advanced one stage at a time:
+//
+//     generate camera rays -> intersect -> sort by material -> shade
+//         -> occlusion test of the shadow rays -> accumulate
+//
+// and the intersect..accumulate stages repeat once per bounce on the
+// compacted queue of surviving paths, which is first reordered for
+// coherence by RaySorter. All queues are SoA and every stage
+// is a flat parallel loop, so each one touches only the data it needs.
+//
+// A wave holds at most one sample per pixel, which makes the per-path
+// accumulation race free without atomics; finished paths are splatted
+// into the film in rounds of rows far enough apart that their filter
+// footprints never overlap.
+//
+// The queues and per-path state are carved out of a frame arena that is
+// reset at the start of every render, so rendering frame after frame with
+// the same arenas allocates nothing once the first frame is done.
+//
+
+// Paths in flight per wave
+const size_t kWavefrontSize = 1 << 15;
+
+
+class WavefrontRenderer
+{
+public:
+    WavefrontRenderer(ShapeSet& masterSet,
+                      const std::vector<Light*>& lights,
+                      const MaterialTable& materials,
+                      const Camera& camera)
+        : m_masterSet(masterSet),
+          m_lights(lights.begin(), lights.end()),
+          m_materials(materials),
+          m_camera(camera),
+          m_sortSecondaryRays(true),
+          m_seed(0),
+          m_pArenas(&m_ownArenas),
+          m_pixelSpread(0.0f),
+          m_cullThreshold(0.0f),
+          m_pIrradiance(NULL),
+          m_numIrradianceRays(0),
+          m_pGuide(NULL)
+    {
+
+    }
+
+    // Arenas to allocate the queues from, kept by the caller so that they
+    // can be reused by the next renderer; by default the renderer has its own
+    void setFrameArenas(FrameArenas* pArenas) { m_pArenas = pArenas ? pArenas : &m_ownArenas; }
+
+    // Reorder secondary rays by origin cell and direction octant before
+    // intersecting them (on by default)
+    void setSortSecondaryRays(bool sort) { m_sortSecondaryRays = sort; }
+
+    void setSeed(unsigned int seed) { m_seed = seed; }
+
+    // See keepShadowRay(); 0 by default
+    void setShadowCullThreshold(float threshold) { m_cullThreshold = threshold; }
+
+    // Irradiance cache (kept by the caller) for diffuse indirect light,
+    // gathered with numRays rays per record, or NULL for the ambient term
+    void setIrradianceCache(IrradianceCache* pCache, size_t numRays)
+    {
+        m_pIrradiance = pCache;
+        m_numIrradianceRays = numRays;
+    }
+
+    // Path guide (kept by the caller) for diffuse indirect light from
+    // guided rays when there is no irradiance cache, or NULL. It learns
+    // after 1, 2, 4, ... samples per pixel.
+    void setPathGuide(PathGuide* pGuide) { m_pGuide = pGuide; }
+
+    // Light samples and shadow rays of the last render()
+    const ShadowStats& shadowStats() const { return m_shadowStats; }
+
+    // Splats numPixelSamples clamped samples per pixel into film (already
+    // sized), same as the depth-first renderer.
+    void render(size_t numPixelSamples,
+                size_t numLightSamples,
+                size_t maxBounce,
+                Film& film)
+    {
+        const size_t width = film.width();
+        const size_t height = film.height();
+        size_t numPixels = width * height;
+
+        size_t shadowStride = numLightSamples * m_lights.size();
+        m_pArenas->ensure(size_t(omp_get_max_threads()));
+        m_pArenas->reset();
+        MemoryArena& arena = m_pArenas->local();
+        m_rays.allocate(arena, kWavefrontSize);
+        m_nextRays.allocate(arena, kWavefrontSize);
+        m_raySorter.reserve(arena, kWavefrontSize);
+        m_hits.allocate(arena, kWavefrontSize);
+        m_order = arena.allocArray<unsigned int>(kWavefrontSize);
+        m_shadows.allocate(arena, kWavefrontSize * shadowStride);
+        m_visible = arena.allocArray<unsigned char>(kWavefrontSize * shadowStride);
+        m_pathRadiance = arena.allocArray<float>(kWavefrontSize * 3);
+        m_rngZ = arena.allocArray<unsigned int>(kWavefrontSize);
+        m_rngW = arena.allocArray<unsigned int>(kWavefrontSize);
+        m_sampleX = arena.allocArray<float>(kWavefrontSize);
+        m_sampleY = arena.allocArray<float>(kWavefrontSize);
+        m_coneWidth = arena.allocArray<float>(kWavefrontSize);
+        m_pixelSpread = m_camera.pixelSpread(width, height);
+        m_shadowStats = ShadowStats();
+
+        for (size_t s_i = 0; s_i < numPixelSamples; ++s_i)
+        {
+            for (size_t first = 0; first < numPixels; first += kWavefrontSize)
+            {
+                size_t count = std::min(kWavefrontSize, numPixels - first);
+
+                generateCameraRays(first, count, s_i, width, height);
+                for (size_t nBounce = 0; m_rays.m_count > 0; ++nBounce)
+                {
+                    if (nBounce > 0 && m_sortSecondaryRays)
+                    {
+                        m_raySorter.sort(m_rays);
+                    }
+                    intersect();
+                    sortByMaterial();
+                    shade(numLightSamples, nBounce < maxBounce);
+                    occlusionTest(m_rays.m_count * shadowStride);
+                    accumulateShadows(shadowStride);
+                    std::swap(m_rays, m_nextRays);
+                }
+                accumulatePixels(first, count, film);
+            }
+            if (m_pGuide && ((s_i + 2) & (s_i + 1)) == 0)
+            {
+                m_pGuide->refine();
+            }
+        }
+    }
+
+protected:
+    // Stage 1: one camera ray per pixel in [first, first + count)
+    void generateCameraRays(size_t first, size_t count, size_t sampleIndex,
+                            size_t width, size_t height)
+    {
+        #pragma omp parallel for
+        for (size_t i = 0; i < count; ++i)
+        {
+            size_t pixel = first + i;
+            size_t x = pixel % width;
+            size_t y = pixel / width;
+            Rng rng = Rng::forStream(m_seed + (unsigned int)sampleIndex * 0x9e3779b9u,
+                                     (unsigned int)pixel);
+
+            float xu, yu;
+            float dy = rng.nextFloat();
+            float dx = rng.nextFloat();
+            Camera::screenPosition(x, y, dx, dy, width, height, xu, yu);
+            m_sampleX[i] = dx;
+            m_sampleY[i] = dy;
+            m_rays.set(i, m_camera.makeRay(xu, yu), Color(1.0f, 1.0f, 1.0f), (unsigned int)i);
+
+            m_rngZ[i] = rng.m_z;
+            m_rngW[i] = rng.m_w;
+            m_pathRadiance[i * 3 + 0] = 0.0f;
+            m_pathRadiance[i * 3 + 1] = 0.0f;
+            m_pathRadiance[i * 3 + 2] = 0.0f;
+            m_coneWidth[i] = 0.0f;
+        }
+        m_rays.m_count = count;
+    }
+
+    // Stage 2: closest hit for every queued ray
+    void intersect()
+    {
+        #pragma omp parallel for schedule(dynamic, 256)
+        for (size_t i = 0; i < m_rays.m_count; ++i)
+        {
+            Intersection isect(m_rays.ray(i));
+            m_masterSet.intersect(isect);
+            m_hits.m_t[i] = isect.m_t;
+            m_hits.m_pShape[i] = isect.m_pShape;
+            m_hits.m_pMaterial[i] = isect.m_pMaterial;
+            m_hits.m_normalX[i] = isect.m_normal.m_x;
+            m_hits.m_normalY[i] = isect.m_normal.m_y;
+            m_hits.m_normalZ[i] = isect.m_normal.m_z;
+            m_hits.m_emittedR[i] = isect.m_emitted.m_r;
+            m_hits.m_emittedG[i] = isect.m_emitted.m_g;
+            m_hits.m_emittedB[i] = isect.m_emitted.m_b;
+            m_hits.m_u[i] = isect.m_u;
+            m_hits.m_v[i] = isect.m_v;
+            m_hits.m_uvDensity[i] = isect.m_uvDensity;
+        }
+    }
+
+    // Stage 3: counting sort of the hits by material ID (misses last), so
+    // the shading stage walks one material at a time
+    void sortByMaterial()
+    {
+        size_t numBuckets = m_materials.size() + 1;
+        m_bucketStart.assign(numBuckets + 1, 0);
+        for (size_t i = 0; i < m_rays.m_count; ++i)
+        {
+            ++m_bucketStart[materialBucket(i) + 1];
+        }
+        for (size_t b = 0; b < numBuckets; ++b)
+        {
+            m_bucketStart[b + 1] += m_bucketStart[b];
+        }
+        for (size_t i = 0; i < m_rays.m_count; ++i)
+        {
+            m_order[m_bucketStart[materialBucket(i)]++] = (unsigned int)i;
+        }
+    }
+
+    size_t materialBucket(size_t i) const
+    {
+        const Material* pMaterial = m_hits.m_pMaterial[i];
+        return (m_hits.m_pShape[i] && pMaterial && pMaterial->m_id < m_materials.size())
+               ? pMaterial->m_id
+               : m_materials.size();
+    }
+
+    // Stage 4: emission, ambient and light sampling for every hit (the
+    // environment for every miss), plus the continuation ray if the path goes on. Shadow rays for ray i go to
+    // slots [i * stride, (i + 1) * stride); those keepShadowRay() culls are
+    // left empty.
+    void shade(size_t numLightSamples, bool continuePaths)
+    {
+        size_t stride = numLightSamples * m_lights.size();
+        float invLightSamples = 1.0f / float(numLightSamples);
+        size_t numNext = 0;
+        size_t numSamples = 0, numTraced = 0;
+
+        #pragma omp parallel for schedule(dynamic, 64) reduction(+:numSamples, numTraced)
+        for (size_t k = 0; k < m_rays.m_count; ++k)
+        {
+            size_t i = m_order[k];
+            size_t shadowBase = i * stride;
+            unsigned int path = m_rays.m_path[i];
+
+            if (!m_hits.m_pShape[i])
+            {
+                // The path leaves the scene and picks up the environment
+                Color escaped = escapedRadiance(m_lights, m_rays.ray(i).m_direction);
+                m_pathRadiance[path * 3 + 0] += m_rays.m_throughputR[i] * escaped.m_r;
+                m_pathRadiance[path * 3 + 1] += m_rays.m_throughputG[i] * escaped.m_g;
+                m_pathRadiance[path * 3 + 2] += m_rays.m_throughputB[i] * escaped.m_b;
+                for (size_t s = 0; s < stride; ++s)
+                {
+                    m_shadows.m_pLight[shadowBase + s] = NULL;
+                    m_shadows.m_contribR[shadowBase + s] = 0.0f;
+                    m_shadows.m_contribG[shadowBase + s] = 0.0f;
+                    m_shadows.m_contribB[shadowBase + s] = 0.0f;
+                }
+                continue;
+            }
+
+            Ray ray = m_rays.ray(i);
+            Intersection isect = m_hits.intersection(i, ray);
+            const Material* pMaterial = isect.m_pMaterial;
+            Color throughput(m_rays.m_throughputR[i], m_rays.m_throughputG[i], m_rays.m_throughputB[i]);
+            Point position = isect.position();
+            Rng rng(m_rngZ[path], m_rngW[path]);
+            m_coneWidth[path] += m_pixelSpread * isect.m_t;
+            Color texture = surfaceTexture(isect, m_coneWidth[path]);
+
+            Color direct;
+            if (m_pIrradiance && takesIrradiance(*pMaterial))
+            {
+                direct = diffuseIndirect(*m_pIrradiance, m_numIrradianceRays, isect, m_masterSet,
+                                         m_lights, rng, m_coneWidth[path]);
+            }
+            else if (m_pGuide && takesIrradiance(*pMaterial))
+            {
+                direct = guidedIndirect(*m_pGuide, isect, m_masterSet, m_lights, rng, m_coneWidth[path]);
+            }
+            else
+            {
+                direct = pMaterial->m_kAmbient * pMaterial->m_color * texture;
+            }
+            if (isect.m_pShape->getShapeType().find("Light") != std::string::npos)
+            {
+                direct += isect.m_emitted;
+            }
+            m_pathRadiance[path * 3 + 0] += throughput.m_r * direct.m_r;
+            m_pathRadiance[path * 3 + 1] += throughput.m_g * direct.m_g;
+            m_pathRadiance[path * 3 + 2] += throughput.m_b * direct.m_b;
+
+            size_t slot = shadowBase;
+            for (size_t s_l = 0; s_l < numLightSamples; ++s_l)
+            {
+                for (size_t l = 0; l < m_lights.size(); ++l, ++slot)
+                {
+                    Light* pLight = m_lights[l];
+                    Point lightPoint;
+                    Vector lightNormal;
+                    Vector toLight;
+                    float lightDistance = 0.0f;
+                    Color contrib;
+                    float weight;
+                    ++numSamples;
+                    if (pLight->samplePoint(rng, position, lightPoint, lightNormal))
+                    {
+                        toLight = lightPoint - position;
+                        lightDistance = toLight.normalize();
+                        contrib = throughput * invLightSamples * texture *
+                                  pMaterial->getColor(position, isect.m_normal, ray.m_direction,
+                                                      toLight, pLight->sampledPower(position, lightPoint));
+                    }
+                    if (!keepShadowRay(contrib, m_cullThreshold, rng, weight))
+                    {
+                        m_shadows.m_pLight[slot] = NULL;
+                        m_shadows.m_contribR[slot] = 0.0f;
+                        m_shadows.m_contribG[slot] = 0.0f;
+                        m_shadows.m_contribB[slot] = 0.0f;
+                        continue;
+                    }
+                    ++numTraced;
+                    contrib *= weight;
+
+                    m_shadows.m_originX[slot] = position.m_x;
+                    m_shadows.m_originY[slot] = position.m_y;
+                    m_shadows.m_originZ[slot] = position.m_z;
+                    m_shadows.m_dirX[slot] = toLight.m_x;
+                    m_shadows.m_dirY[slot] = toLight.m_y;
+                    m_shadows.m_dirZ[slot] = toLight.m_z;
+                    m_shadows.m_tMax[slot] = lightDistance;
+                    m_shadows.m_pLight[slot] = pLight;
+                    m_shadows.m_contribR[slot] = contrib.m_r;
+                    m_shadows.m_contribG[slot] = contrib.m_g;
+                    m_shadows.m_contribB[slot] = contrib.m_b;
+                }
+            }
+
+            Ray nextRay;
+            if (continuePaths && sampleScatter(isect, rng, nextRay, throughput))
+            {
+                size_t next;
+                #pragma omp atomic capture
+                next = numNext++;
+                m_nextRays.set(next, nextRay, throughput, path);
+            }
+            m_rngZ[path] = rng.m_z;
+            m_rngW[path] = rng.m_w;
+        }
+        m_nextRays.m_count = numNext;
+        m_shadowStats.m_numSamples += numSamples;
+        m_shadowStats.m_numTraced += numTraced;
+    }
+
+    // Stage 5: any-hit test of every live shadow ray
+    void occlusionTest(size_t numShadows)
+    {
+        #pragma omp parallel for schedule(dynamic, 1024)
+        for (size_t s = 0; s < numShadows; ++s)
+        {
+            Light* pLight = m_shadows.m_pLight[s];
+            if (!pLight)
+            {
+                m_visible[s] = 0;
+                continue;
+            }
+            Ray shadowRay(Point(m_shadows.m_originX[s], m_shadows.m_originY[s], m_shadows.m_originZ[s]),
+                          Vector(m_shadows.m_dirX[s], m_shadows.m_dirY[s], m_shadows.m_dirZ[s]),
+                          m_shadows.m_tMax[s]);
+            Intersection shadowIntersection(shadowRay);
+            bool intersected = m_masterSet.intersect(shadowIntersection);
+            m_visible[s] = (!intersected || shadowIntersection.m_pShape == pLight) ? 1 : 0;
+        }
+    }
+
+    // Stage 6a: fold the visible shadow contributions into their paths
+    void accumulateShadows(size_t stride)
+    {
+        #pragma omp parallel for
+        for (size_t i = 0; i < m_rays.m_count; ++i)
+        {
+            size_t base = i * stride;
+            float r = 0.0f, g = 0.0f, b = 0.0f;
+            #pragma omp simd reduction(+:r, g, b)
+            for (size_t s = 0; s < stride; ++s)
+            {
+                float v = float(m_visible[base + s]);
+                r += v * m_shadows.m_contribR[base + s];
+                g += v * m_shadows.m_contribG[base + s];
+                b += v * m_shadows.m_contribB[base + s];
+            }
+            unsigned int path = m_rays.m_path[i];
+            m_pathRadiance[path * 3 + 0] += r;
+            m_pathRadiance[path * 3 + 1] += g;
+            m_pathRadiance[path * 3 + 2] += b;
+        }
+    }
+
+    // Stage 6b: clamp each finished path and splat it into the film. A
+    // splat reaches up to the filter's padding rows above and below its
+    // own, so each round takes rows 2 * padding + 1 apart.
+    void accumulatePixels(size_t first, size_t count, Film& film)
+    {
+        const size_t width = film.width();
+        const size_t rowStep = 2 * film.filter().padding() + 1;
+        const size_t firstRow = first / width;
+        const size_t endRow = (first + count - 1) / width + 1;
+        for (size_t round = 0; round < rowStep; ++round)
+        {
+            #pragma omp parallel for schedule(dynamic, 1)
+            for (size_t row = firstRow + round; row < endRow; row += rowStep)
+            {
+                size_t begin = std::max(row * width, first) - first;
+                size_t end = std::min((row + 1) * width, first + count) - first;
+                for (size_t i = begin; i < end; ++i)
+                {
+                    Color c(m_pathRadiance[i * 3 + 0], m_pathRadiance[i * 3 + 1], m_pathRadiance[i * 3 + 2]);
+                    c.clamp();
+                    film.addSample((first + i) % width, row, m_sampleX[i], m_sampleY[i], c);
+                }
+            }
+        }
+    }
+
+    ShapeSet& m_masterSet;
+    std::vector<Light*> m_lights;
+    const MaterialTable& m_materials;
+    Camera m_camera;
+    bool m_sortSecondaryRays;
+    unsigned int m_seed;
+    RaySorter m_raySorter;
+    FrameArenas m_ownArenas;
+    FrameArenas* m_pArenas;
+
+    // Valid from the start of render() until the arenas are reset
+    RayQueue m_rays;
+    RayQueue m_nextRays;
+    HitQueue m_hits;
+    ShadowQueue m_shadows;
+    unsigned char* m_visible;
+    unsigned int* m_order;
+    float* m_pathRadiance;
+    unsigned int *m_rngZ, *m_rngW;
+    // Offset of each path's camera sample within its pixel
+    float *m_sampleX, *m_sampleY;
+    // Width of each path's ray cone at its last hit, for texture filtering,
+    // and how fast cones grow with distance
+    float* m_coneWidth;
+    float m_pixelSpread;
+    float m_cullThreshold;
+    IrradianceCache* m_pIrradiance;
+    size_t m_numIrradianceRays;
+    PathGuide* m_pGuide;
+    ShadowStats m_shadowStats;
+    std::vector<size_t> m_bucketStart;
+};
+
+}//namespace Tracer
+
+#endif